@@ -4,18 +4,43 @@
 #include <fuse.h>
 #include <limits.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "blocks.h"
-
-#define MAX_FUSE_OPEN_FILES 128
+#include "handles.h"
 
 struct archivist_state {
-    char root_dir[AA_NUM_COPIES][PATH_MAX];
-    uint64_t used_entries;
-    struct file_entry entry[MAX_FUSE_OPEN_FILES];
+    char root_dir[AA_MAX_ROOTS][PATH_MAX];
+    size_t block_size;
+    int fec;
+    struct root_layout layout;
+    size_t cache_size;
+    size_t write_buffer_size;
+    const char *io_engine;
+    int read_policy;
+    int hash_type;
+    double attr_timeout;
+    int readdir_plus;
+    int lowlevel;
+    int ll_workers;
+    size_t max_io;
+    size_t scrub_rate;
+    char scrub_state[PATH_MAX];
+    char log_file[PATH_MAX];
+    int log_level;
+    size_t log_rotate;
+    struct handle_table handles;
 };
 
 #define AA_DATA ((struct archivist_state *) fuse_get_context()->private_data)
 
 extern int open_file_entry(const char* path, struct file_entry *file_entry, int flags);
+extern void close_all(struct file_entry *file_entry);
+extern off_t logical_size(off_t file_size);
+extern off_t striped_size(const int fd[], off_t primary_size);
+extern ssize_t read_data(struct file_entry *file_entry, char *buf, size_t size, off_t offset);
+extern int read_segments(struct file_entry *file_entry, size_t size, off_t offset, struct data_block **blocks, struct fuse_bufvec **bufp);
+extern int truncate_entry(struct file_entry *file_entry, off_t new_size);
+extern int stats_xattr(const char *name, char *text, size_t size);
+extern void destroy_call(void *private_data);
 
 #endif
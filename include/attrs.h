@@ -0,0 +1,32 @@
+#ifndef __ATTRS__
+#define __ATTRS__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#define AA_ATTR_SHARDS 16
+#define AA_ATTR_CACHE_ENTRIES 65536
+#define AA_ATTR_TREES 4096
+#define AA_ATTR_DEFAULT_TIMEOUT 1.0
+
+struct attr_stats {
+    size_t capacity;
+    size_t used;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+extern int init_attr_cache(double timeout);
+extern int attr_lookup(const char *path, struct stat *statbuf);
+extern uint64_t attr_epoch(const char *path);
+extern void attr_insert(const char *path, const struct stat *statbuf, uint64_t epoch);
+extern void attr_invalidate(const char *path);
+extern void attr_invalidate_tree(const char *path);
+extern void attr_get_stats(struct attr_stats *stats);
+
+#endif
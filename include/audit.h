@@ -0,0 +1,14 @@
+#ifndef __AUDIT__
+#define __AUDIT__
+
+#include <stdio.h>
+
+/* Bytes of a file checked by one job, and read from each copy at a time. */
+#define AA_AUDIT_CHUNK (16 * 1024 * 1024)
+#define AA_AUDIT_STEP (1024 * 1024)
+#define AA_AUDIT_QUEUE 256
+
+extern int verify_archive(char *const root_dir[], int roots, int threads, FILE *report);
+extern int repair_archive(char *const root_dir[], int roots, int threads, int dry_run, FILE *report);
+
+#endif
@@ -4,14 +4,31 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 #include "seed.h"
-
-#define AA_NUM_COPIES 2
+#include "geometry.h"
 
 #define AA_HASH_SIZE 20
 #define AA_HEAD_SIZE 32
-#define AA_DATA_SIZE 480
-#define AA_BLOCK_SIZE 512
+#define AA_BLOCK_SIZE archive_block_size
+/* The error correction trailer at the end of a full block, see fec.c. */
+#define AA_FEC_SIZE (archive_fec ? archive_block_size / AA_FEC_RATIO : 0)
+#define AA_DATA_SIZE (archive_block_size - AA_HEAD_SIZE - AA_FEC_SIZE)
+#define AA_MAX_DATA_SIZE (AA_MAX_BLOCK_SIZE - AA_HEAD_SIZE)
+
+/* The hash covers the seed and the data, which lie next to each other. */
+#define AA_HASHED_SIZE (AA_SEED_SIZE + AA_DATA_SIZE)
+
+#define AA_MAX_WRITE_BLOCKS 256
+#define AA_BLOCK_LOCKS 1024
+
+/* Copies of a block in a struct block_set, one unless it is mirrored. */
+#define AA_NUM_COPIES (AA_ERASURE_CODED ? 1 : AA_NUM_ROOTS)
+
+#define AA_READ_ALL 0
+#define AA_READ_PRIMARY_FIRST 1
 
 #define NTOH ntohs
 #define HTON htons
@@ -19,28 +36,91 @@
 struct data_header {
     uint16_t version;
     uint16_t length;
-    unsigned char sha1[AA_HASH_SIZE];
+    unsigned char hash[AA_HASH_SIZE];
     unsigned char seed[AA_SEED_SIZE];
 };
 
+/*
+  A single block has room for the largest geometry. Arrays of blocks are
+  packed AA_BLOCK_SIZE apart, as they are in the file, and are indexed
+  with block_at.
+*/
 struct data_block {
     struct data_header header;
-    unsigned char data[AA_DATA_SIZE];
+    unsigned char data[AA_MAX_DATA_SIZE];
 };
 
+static inline struct data_block *block_at(struct data_block *blocks, int n) {
+    return (struct data_block *)((unsigned char *)blocks + (size_t)n * AA_BLOCK_SIZE);
+}
+
+/*
+  The bytes a block takes in its file. A full block fills its place,
+  error correction trailer and all, a short one stops after its data.
+  A length past the data gives -1, which no read size matches.
+*/
+static inline int block_stored_size(const struct data_block *block) {
+    int length;
+    length = NTOH(block->header.length);
+    if (length>AA_DATA_SIZE) {
+        return -1;
+    }
+    return (length==AA_DATA_SIZE) ? AA_BLOCK_SIZE : AA_HEAD_SIZE + length;
+}
+
 struct data_entry {
     int fd;
+};
+
+struct block_copy {
     int corrupt;
+    int corrected;
     struct data_block block;
 };
 
+struct block_set {
+    struct block_copy copy[AA_MAX_COPIES];
+};
+
+struct dirty_block {
+    off_t file_block_ofs;
+    int lo;
+    int hi;
+    int loaded;
+    int slot;
+};
+
+struct write_buffer {
+    int count;
+    int capacity;
+    struct dirty_block *block;
+    struct data_block *data;
+    off_t end;
+    int pending;
+    struct file_entry *next_pending;
+};
+
 struct file_entry {
-    struct data_entry file[AA_NUM_COPIES];
+    dev_t dev;
+    ino_t ino;
+    pthread_mutex_t lock;
+    struct write_buffer dirty;
+    struct data_entry file[AA_MAX_ROOTS];
 };
 
+extern void set_read_policy(int policy);
+extern int block_lock_index(const struct file_entry *file_entry, off_t file_block_ofs);
+extern uint64_t block_generation(int lock);
+extern void lock_block(int lock);
+extern void unlock_block(int lock, int written);
+extern void cache_read_block(const struct file_entry *file_entry, off_t file_block_ofs, const struct data_block *block, int lock, uint64_t generation, uint64_t epoch);
 extern void clear_list(int list[]);
 extern int first_error(const int err_no[]);
-extern int read_block(struct file_entry *file_entry, off_t file_block_ofs);
-extern int write_block(struct file_entry *file_entry, off_t file_block_ofs);
+extern int read_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks);
+extern int scrub_block(struct file_entry *file_entry, off_t file_block_ofs, int *repaired);
+extern int scrub_blocks(struct file_entry *file_entry, off_t file_block_ofs, int count, int err_no[], int repaired[]);
+extern int read_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct data_block *blocks, int count, int *blocks_read);
+extern int write_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks);
+extern int write_blocks(struct file_entry *file_entry, struct data_block *blocks[], int count, off_t file_block_ofs);
 
 #endif
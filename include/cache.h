@@ -0,0 +1,29 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "blocks.h"
+
+#define AA_CACHE_SHARDS 16
+#define AA_CACHE_EPOCHS 1024
+#define AA_CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+struct cache_stats {
+    size_t capacity;
+    size_t used;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+extern int init_block_cache(size_t budget);
+extern int cache_lookup(dev_t dev, ino_t ino, off_t file_block_ofs, struct data_block *block);
+extern uint64_t cache_epoch(dev_t dev, ino_t ino);
+extern void cache_insert(dev_t dev, ino_t ino, off_t file_block_ofs, const struct data_block *block, uint64_t epoch);
+extern void cache_invalidate(dev_t dev, ino_t ino, off_t from_block_ofs);
+extern void cache_get_stats(struct cache_stats *stats);
+
+#endif
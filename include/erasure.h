@@ -0,0 +1,18 @@
+#ifndef __ERASURE__
+#define __ERASURE__
+
+#include <sys/types.h>
+#include "blocks.h"
+
+/* Stripes read at a time, so each data root is read with at most this many vectors. */
+#define AA_EC_READ_STRIPES 256
+
+extern int init_erasure();
+extern int ec_read_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks);
+extern int ec_read_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct data_block *blocks, int count, int *blocks_read);
+extern int ec_write_blocks(struct file_entry *file_entry, struct data_block *blocks[], int count, off_t file_block_ofs);
+extern int ec_scrub_blocks(struct file_entry *file_entry, off_t stripe_ofs, int count, int err_no[], int repaired[]);
+extern int ec_truncate(struct file_entry *file_entry, off_t new_size);
+extern off_t ec_file_size(const int fd[]);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __FEC__
+#define __FEC__
+
+#include "blocks.h"
+
+extern void fec_encode_block(struct data_block *block);
+extern int fec_correct_block(struct data_block *block);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef __GEOMETRY__
+#define __GEOMETRY__
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+  Archive geometry, the block size and the layout of the roots.
+
+  Every block of an archive is the same size, a power of
+  two from 512 bytes to 64K, with the same 32 byte header. The size is
+  kept in the high byte of each block's version as log2(size) - 9, so
+  512 byte blocks keep the plain version numbers they always had, and in
+  a geometry file at the top of each storage location.
+*/
+#define AA_MIN_BLOCK_SIZE 512
+#define AA_MAX_BLOCK_SIZE 65536
+#define AA_DEFAULT_BLOCK_SIZE 512
+#define AA_MIN_BLOCK_SHIFT 9
+
+#define AA_GEOMETRY_FILE "archivist.geometry"
+
+/*
+  An archive may keep a forward error correction trailer at the end of
+  every full block, taking 1/AA_FEC_RATIO of the block from the data. The
+  top bit of the version marks a block that has one.
+*/
+#define AA_FEC_RATIO 64
+#define AA_VERSION_FEC 0x8000
+
+/*
+  Root layouts. A mirrored archive keeps a whole copy of every file in each
+  root. An erasure coded one deals the blocks of each file out in turn to
+  its data roots and keeps Reed-Solomon parity of every stripe of blocks,
+  one block from each data root, in its parity roots.
+*/
+#define AA_LAYOUT_MIRROR 0
+#define AA_LAYOUT_ERASURE 1
+
+#define AA_MAX_ROOTS 16
+#define AA_MAX_COPIES 4
+#define AA_DEFAULT_COPIES 2
+
+struct root_layout {
+    int mode;
+    int roots;
+    int data;
+    int parity;
+};
+
+/* What a geometry file records. root is -1 when it does not say. */
+struct archive_geometry {
+    int block_size;
+    int fec;
+    struct root_layout layout;
+    int root;
+};
+
+#define AA_NUM_ROOTS archive_layout.roots
+#define AA_DATA_ROOTS archive_layout.data
+#define AA_PARITY_ROOTS archive_layout.parity
+#define AA_ERASURE_CODED (archive_layout.mode==AA_LAYOUT_ERASURE)
+
+struct data_block;
+
+extern int archive_block_size;
+extern int archive_fec;
+extern struct root_layout archive_layout;
+
+extern int block_size_valid(size_t size);
+extern void set_block_size(int size);
+extern void set_fec(int fec);
+extern uint16_t block_version(int format);
+extern int version_format(uint16_t version);
+extern int version_block_size(uint16_t version);
+extern int layout_by_name(const char *name, struct root_layout *layout);
+extern void layout_name(const struct root_layout *layout, char *name, size_t size);
+extern void set_layout(const struct root_layout *layout);
+extern int same_layout(const struct root_layout *a, const struct root_layout *b);
+extern int load_geometry(const char *root_dir, struct archive_geometry *geometry);
+extern int save_geometry(const char *root_dir, const struct archive_geometry *geometry);
+extern ssize_t read_encoded_block(int fd, struct data_block *block);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef __HANDLES__
+#define __HANDLES__
+
+#include <stdint.h>
+#include "blocks.h"
+
+#define AA_HANDLE_CHUNK_SIZE 256
+#define AA_HANDLE_MAX_CHUNKS 16384
+
+struct handle {
+    struct file_entry entry;
+    uint32_t next_free;
+};
+
+struct handle_table {
+    uint64_t free_head;
+    uint32_t num_chunks;
+    struct handle *chunk[AA_HANDLE_MAX_CHUNKS];
+};
+
+extern int allocate_handle(struct handle_table *table, uint64_t *fh);
+extern void release_handle(struct handle_table *table, uint64_t fh);
+extern struct file_entry *handle_file_entry(struct handle_table *table, uint64_t fh);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __HASH__
+#define __HASH__
+
+#include "blocks.h"
+#include "sha1.h"
+
+/*
+  Block format versions, held in the low byte of the header version.
+  Version 1 blocks hold the SHA-1 of the seed and data. Version 2 blocks
+  name their hash algorithm in the first byte of the hash field, followed
+  by the digest and zero padding.
+*/
+#define AA_VERSION_1 1
+#define AA_VERSION_2 2
+
+#define AA_HASH_TYPE_SHA1 1
+#define AA_HASH_TYPE_XXH3 2
+
+#define AA_HASH_DEFAULT_TYPE AA_HASH_TYPE_SHA1
+
+extern void set_hash_type(int type);
+extern int hash_type_by_name(const char *name);
+extern const char *hash_type_name(int type);
+extern int block_hash_type(const struct data_block *block);
+
+extern void hash_block(struct data_block *block);
+extern void hash_blocks(struct data_block *const block[], int count);
+extern ssize_t encode_blocks(const unsigned char *data, size_t length, struct data_block *out);
+extern int block_hash_valid(const struct data_block *block);
+extern void blocks_hash_valid(const struct data_block *const block[], int count, int valid[]);
+
+#endif
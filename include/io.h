@@ -0,0 +1,43 @@
+#ifndef __IO__
+#define __IO__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AA_IO_PENDING (-1000000)
+
+struct io_request {
+    int fd;
+    int write;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    struct iovec single;
+    ssize_t result;
+};
+
+struct io_batch {
+    struct io_request *request;
+    int count;
+    int submitted;
+    int completed;
+};
+
+struct io_engine {
+    const char *name;
+    int (*available)();
+    void (*submit)(struct io_batch *batch);
+    int (*complete)(struct io_batch *batch);
+};
+
+extern int init_io_engine(const char *name);
+extern const char *io_engine_name();
+extern void io_prepare(struct io_request *request, int fd, int write, void *buf, size_t len, off_t offset);
+extern void io_prepare_vector(struct io_request *request, int fd, int write, const struct iovec *iov, int iovcnt, off_t offset);
+extern void io_submit(struct io_batch *batch, struct io_request request[], int count);
+extern int io_complete(struct io_batch *batch);
+
+extern const struct io_engine pread_engine;
+extern const struct io_engine uring_engine;
+
+#endif
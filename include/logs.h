@@ -1,9 +1,41 @@
 #ifndef __LOGS__
 #define __LOGS__
 
-extern void init_logging();
-extern int log_status(const char* context, int rc, const char* format, ...);
-extern void log_info(const char* context, const char* format, ...);
+#include <stddef.h>
+
+#define AA_LOG_ERROR 0
+#define AA_LOG_STATUS 1
+#define AA_LOG_INFO 2
+
+/* Levels above this are compiled out, e.g. -DAA_LOG_MAX_LEVEL=1 drops log_info. */
+#ifndef AA_LOG_MAX_LEVEL
+#define AA_LOG_MAX_LEVEL AA_LOG_INFO
+#endif
+
+#define AA_LOG_DEFAULT_FILE "archivist.log"
+#define AA_LOG_DEFAULT_ROTATE (64 * 1024 * 1024)
+#define AA_LOG_KEEP 4
+#define AA_LOG_RING_RECORDS 1024
+#define AA_LOG_CONTEXT_SIZE 16
+#define AA_LOG_TEXT_SIZE 224
+#define AA_LOG_IDLE_MS 10
+
+extern int log_level;
+
+#define log_enabled(level) ((AA_LOG_MAX_LEVEL >= (level)) && (log_level >= (level)))
+
+static inline int log_skipped(int rc) {
+    return rc;
+}
+
+#define log_status(context, rc, ...) (log_enabled(AA_LOG_STATUS) ? log_status_write(context, rc, __VA_ARGS__) : log_skipped(rc))
+#define log_info(...) (log_enabled(AA_LOG_INFO) ? log_info_write(__VA_ARGS__) : (void)0)
+
+extern void init_logging(const char *path, int level, size_t rotate_size);
+extern void start_logging();
+extern void stop_logging();
+extern int log_status_write(const char* context, int rc, const char* format, ...);
+extern void log_info_write(const char* context, const char* format, ...);
 extern int log_error(const char* context, int err_no, const char* format, ...);
 
 #endif
@@ -0,0 +1,13 @@
+#ifndef __LOWLEVEL__
+#define __LOWLEVEL__
+
+#include "archivist.h"
+
+#define AA_LL_INODE_BUCKETS 65536
+#define AA_LL_MAX_WORKERS 64
+#define AA_LL_DEFAULT_WORKERS 4
+#define AA_LL_DEFAULT_MAX_IO (1024 * 1024)
+
+extern int lowlevel_main(int argc, char* argv[], struct archivist_state *aa_state);
+
+#endif
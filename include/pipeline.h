@@ -0,0 +1,55 @@
+#ifndef __PIPELINE__
+#define __PIPELINE__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Bytes of blocks in each batch, and the alignment of its buffers. */
+#define AA_PIPE_BATCH_BYTES (1024 * 1024)
+#define AA_PIPE_ALIGN 4096
+#define AA_PIPE_MAX_THREADS 64
+
+/*
+  A batch of input read together and the output made from it. The work
+  function fills out and out_len from in and in_len, and on failure sets
+  err_no and message, which are reported once everything before it is
+  written.
+*/
+struct pipe_batch {
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    uint64_t seq;
+    int last;
+    int state;
+    int err_no;
+    char message[256];
+};
+
+/*
+  A reader, threads workers and a writer connected by batches of in_size
+  input bytes and out_size output bytes. Input stops after limit bytes
+  unless it is negative. The first prefix_len bytes of input are taken
+  from prefix before fd_in is read.
+*/
+struct pipeline {
+    int fd_in;
+    int fd_out;
+    size_t in_size;
+    size_t out_size;
+    int threads;
+    off_t limit;
+    const unsigned char *prefix;
+    size_t prefix_len;
+    int (*work)(struct pipe_batch *batch, void *arg);
+    void *arg;
+};
+
+extern int pipe_threads(const char *value);
+extern int skip_input(int fd, off_t bytes);
+extern ssize_t read_input(int fd, unsigned char *buf, size_t size);
+extern int write_output(int fd, const unsigned char *buf, size_t size);
+extern int run_pipeline(const struct pipeline *pipe, const char *fpath_in, const char *fpath_out);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef __RS__
+#define __RS__
+
+#include <stddef.h>
+#include "geometry.h"
+
+/*
+  Reed-Solomon erasure code over GF(2^8). A stripe of data shards is
+  extended with parity shards so that any data-many of the shards are
+  enough to recover all of them.
+*/
+struct rs_code {
+    int data;
+    int parity;
+    unsigned char matrix[AA_MAX_ROOTS][AA_MAX_ROOTS];
+};
+
+/* Codewords of the interleaved error correcting code, one per 128 bytes of the largest block. */
+#define AA_RS_MAX_WAYS 512
+
+extern int rs_init(struct rs_code *code, int data, int parity);
+extern const char *rs_engine_name();
+extern void rs_encode(const struct rs_code *code, const unsigned char *const data[], unsigned char *const parity[], size_t len);
+extern int rs_reconstruct(const struct rs_code *code, unsigned char *const shard[], const int present[], size_t len);
+extern void rs_check_interleaved(const unsigned char *data, int ways, int rows, unsigned char *check);
+extern int rs_correct_interleaved(unsigned char *data, int ways, int rows, unsigned char *check);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef __SCRUB__
+#define __SCRUB__
+
+#include <limits.h>
+#include <stdint.h>
+#include "blocks.h"
+#include "sha1.h"
+
+#define AA_SCRUB_STATE_FILE "archivist.scrub"
+#define AA_SCRUB_SAVE_SECONDS 10
+#define AA_SCRUB_IDLE_MS 20
+#define AA_SCRUB_SPAN AA_HASH_LANES
+
+struct scrub_stats {
+    uint64_t passes;
+    uint64_t files;
+    uint64_t blocks_scanned;
+    uint64_t blocks_repaired;
+    uint64_t blocks_unrecoverable;
+    uint64_t files_unreadable;
+};
+
+extern int start_scrubber(char root_dir[AA_MAX_ROOTS][PATH_MAX], size_t rate, const char *state_file);
+extern void stop_scrubber();
+extern void scrub_foreground();
+extern void scrub_get_stats(struct scrub_stats *stats);
+
+#endif
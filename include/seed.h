@@ -9,5 +9,6 @@
 #define AA_SEED_SIZE 8
 
 extern int initialise_seed(unsigned char seed[]);
+extern int initialise_seeds(unsigned char seeds[], size_t count);
 
 #endif //ARCHIVIST_SEED_H
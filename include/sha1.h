@@ -1,6 +1,19 @@
 #ifndef __SHA1__
 #define __SHA1__
 
+#include <stddef.h>
+
+/* Hash kernels, the accelerated ones can be or'ed together. */
+#define AA_HASH_PORTABLE 0
+#define AA_HASH_SHANI 1
+#define AA_HASH_AVX2 2
+
+/* Without SHA-NI, SHA1_many hashes up to this many messages at once, and
+   no fewer than AA_HASH_MIN_LANES, below which the lanes cost more than
+   they save. */
+#define AA_HASH_LANES 8
+#define AA_HASH_MIN_LANES 3
+
 typedef struct SHA1Context SHA1Context;
 struct SHA1Context {
     unsigned int state[5];
@@ -8,10 +21,15 @@ struct SHA1Context {
     unsigned char buffer[64];
 };
 
+extern int hash_engine();
+extern int hash_select(int engine);
+extern const char *hash_engine_name(int engine);
+
 extern void hash_init(SHA1Context *p);
 extern void hash_step(SHA1Context *p, const unsigned char *data, unsigned int len);
 extern void hash_finish(SHA1Context *p, unsigned char *digest);
 
 extern void SHA1(const unsigned char *data, size_t count, unsigned char* md_buf);
+extern void SHA1_many(const unsigned char *const data[], size_t count, unsigned char *const md_buf[], int n);
 
 #endif
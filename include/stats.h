@@ -0,0 +1,70 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "blocks.h"
+
+#define AA_STATS_SHARDS 16
+#define AA_STATS_BUCKETS 32
+
+#define AA_STAT_BLOCKS_READ 0
+#define AA_STAT_BLOCKS_WRITTEN 1
+#define AA_STAT_BLOCKS_VERIFIED 2
+#define AA_STAT_HASH_FAILURES 3
+#define AA_STAT_REPAIRS_CORRUPT 4
+#define AA_STAT_REPAIRS_MISMATCHED 5
+#define AA_STAT_REPAIRS_MISSING 6
+#define AA_STAT_REPAIRS_FEC 7
+#define AA_STAT_NAMED 8
+#define AA_STAT_BYTES_READ(idx) (AA_STAT_NAMED + (idx))
+#define AA_STAT_BYTES_WRITTEN(idx) (AA_STAT_NAMED + AA_MAX_ROOTS + (idx))
+#define AA_STAT_COUNTERS (AA_STAT_NAMED + 2 * AA_MAX_ROOTS)
+
+#define AA_OP_LOOKUP 0
+#define AA_OP_FORGET 1
+#define AA_OP_GETATTR 2
+#define AA_OP_FGETATTR 3
+#define AA_OP_SETATTR 4
+#define AA_OP_OPEN 5
+#define AA_OP_RELEASE 6
+#define AA_OP_READ 7
+#define AA_OP_WRITE 8
+#define AA_OP_FLUSH 9
+#define AA_OP_FSYNC 10
+#define AA_OP_MKNOD 11
+#define AA_OP_MKDIR 12
+#define AA_OP_UNLINK 13
+#define AA_OP_RMDIR 14
+#define AA_OP_RENAME 15
+#define AA_OP_CHMOD 16
+#define AA_OP_CHOWN 17
+#define AA_OP_UTIME 18
+#define AA_OP_TRUNCATE 19
+#define AA_OP_FTRUNCATE 20
+#define AA_OP_OPENDIR 21
+#define AA_OP_READDIR 22
+#define AA_OP_RELEASEDIR 23
+#define AA_OP_GETXATTR 24
+#define AA_OPS 25
+
+/* Nodes of the read only statistics tree under the mount point. */
+#define AA_STATS_TOP_NAME ".archivist"
+#define AA_STATS_NONE 0
+#define AA_STATS_TOP 1
+#define AA_STATS_DIR 2
+#define AA_STATS_COUNTERS 3
+#define AA_STATS_LATENCY 4
+#define AA_STATS_NODES 5
+
+extern void stat_add(int counter, uint64_t n);
+extern uint64_t stat_clock();
+extern void stat_op(int op, uint64_t start);
+
+extern int stats_node(const char *path);
+extern int stats_child(int node, const char *name);
+extern const char *stats_entry(int node, int index);
+extern void stats_attr(int node, struct stat *statbuf);
+extern int stats_render(int node, char **text, size_t *len);
+
+#endif
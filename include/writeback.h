@@ -0,0 +1,18 @@
+#ifndef __WRITEBACK__
+#define __WRITEBACK__
+
+#include <sys/types.h>
+#include "blocks.h"
+
+#define AA_WRITE_BUFFER_DEFAULT_SIZE (1024 * 1024)
+
+extern void init_write_buffer(size_t limit);
+extern int buffer_write(struct file_entry *file_entry, const char *buf, size_t size, off_t offset);
+extern int flush_writes(struct file_entry *file_entry);
+extern void free_write_buffer(struct file_entry *file_entry);
+extern off_t pending_size(dev_t dev, ino_t ino);
+extern int flush_pending(dev_t dev, ino_t ino, int *flushed);
+extern int clip_pending(dev_t dev, ino_t ino, off_t size);
+extern void log_lost_writes(const struct file_entry *file_entry, const char *what, int err_no);
+
+#endif
@@ -17,10 +17,40 @@
 #include <dirent.h>
 #include <arpa/inet.h>
 #include "logs.h"
+#include "cache.h"
+#include "writeback.h"
+#include "io.h"
+#include "hash.h"
+#include "scrub.h"
+#include "attrs.h"
+#include "lowlevel.h"
+#include "stats.h"
+#include "erasure.h"
+#include "rs.h"
 #include "archivist.h"
 
 void usage() {
-    fprintf(stderr, "Usage: archivist [FUSE options] mount-point root-dir-1 root-dir-2\n");
+    fprintf(stderr, "Usage: archivist [FUSE options] [archivist options] mount-point root-dir-1 root-dir-2 ...\n");
+    fprintf(stderr, "A root-dir is given for each copy of a mirrored layout, or each data root then each parity root\n");
+    fprintf(stderr, "Archivist options:\n");
+    fprintf(stderr, "    --cache-size=BYTES     size of the verified block cache (K, M or G suffix, 0 disables)\n");
+    fprintf(stderr, "    --write-buffer=BYTES   write back buffer per open file (K, M or G suffix, 0 writes through)\n");
+    fprintf(stderr, "    --block-size=BYTES     block size of a new archive, 512 (default) to 64K, a power of two\n");
+    fprintf(stderr, "    --layout=LAYOUT        mirror:COPIES (default mirror:2) or erasure:DATA+PARITY roots\n");
+    fprintf(stderr, "    --fec=on|off           error correction trailer in every full block of a new archive (default off)\n");
+    fprintf(stderr, "    --io-engine=NAME       block I/O engine, uring (default) or pread\n");
+    fprintf(stderr, "    --read-policy=POLICY   all (default) verifies every copy, primary-first only copy 0\n");
+    fprintf(stderr, "    --hash=NAME            hash for blocks written, sha1 (default, version 1) or xxh3 (version 2)\n");
+    fprintf(stderr, "    --readdir=MODE         plus (default) returns and caches attributes with each entry, plain names only\n");
+    fprintf(stderr, "    --attr-timeout=SECONDS how long attributes and missing paths are cached (0 disables)\n");
+    fprintf(stderr, "    --scrub-rate=BYTES     background scrub bytes per second (K, M or G suffix, 0 is off)\n");
+    fprintf(stderr, "    --scrub-state=FILE     where scrub progress is kept (default ./%s)\n", AA_SCRUB_STATE_FILE);
+    fprintf(stderr, "    --log-file=FILE        where the log is written (default ./%s)\n", AA_LOG_DEFAULT_FILE);
+    fprintf(stderr, "    --log-level=LEVEL      error (default), status or info messages and everything more severe\n");
+    fprintf(stderr, "    --log-rotate=BYTES     rotate the log when it reaches this size (default 64M, 0 never)\n");
+    fprintf(stderr, "    --frontend=NAME        FUSE interface, highlevel (default) by path or lowlevel by inode\n");
+    fprintf(stderr, "    --ll-workers=N         lowlevel threads serving reads and fsyncs (default %d, 0 inline)\n", AA_LL_DEFAULT_WORKERS);
+    fprintf(stderr, "    --max-io=BYTES         largest lowlevel read or write requested of the kernel\n");
 }
 
 static void data_file_path(char fpath[PATH_MAX], const char* path, int idx) {
@@ -45,63 +75,303 @@ static void data_file_path(char fpath[PATH_MAX], const char* path, int idx) {
     log_info("", "%s -> %s", path, fpath);
 }
 
+static int primary_identity(const char* path, dev_t *dev, ino_t *ino) {
+    char fpath[PATH_MAX];
+    struct stat statbuf;
+
+    data_file_path(fpath, path, 0);
+    if (lstat(fpath, &statbuf)<0) {
+        return -1;
+    }
+    *dev = statbuf.st_dev;
+    *ino = statbuf.st_ino;
+    return 0;
+}
+
+off_t logical_size(off_t file_size) {
+    if (file_size<=0) {
+        return 0;
+    }
+    return (off_t)((file_size / AA_BLOCK_SIZE) * AA_DATA_SIZE + (file_size % AA_BLOCK_SIZE) - ((file_size % AA_BLOCK_SIZE)!=0?AA_HEAD_SIZE:0));
+}
+
+/*
+  The logical size of a regular file given a descriptor on it in each
+  root and the size of its primary copy. A mirrored file is the size of
+  its largest copy, so a primary cut short does not hide the data left on
+  the mirrors. An erasure coded one is worked out from every root.
+*/
+off_t striped_size(const int fd[], off_t primary_size) {
+    struct stat statbuf;
+    int idx;
+
+    if (!AA_ERASURE_CODED) {
+        for(idx=1; idx<AA_NUM_ROOTS; idx++) {
+            if ((fd[idx]>=0) && (fstat(fd[idx], &statbuf)==0) && (statbuf.st_size>primary_size)) {
+                primary_size = statbuf.st_size;
+            }
+        }
+        return logical_size(primary_size);
+    }
+    return ec_file_size(fd);
+}
+
+/*
+  The logical size of a regular file at path, given the size of its
+  primary copy. Roots missing the file count as empty.
+*/
+static off_t path_size(const char *path, off_t primary_size) {
+    char fpath[PATH_MAX];
+    struct stat statbuf;
+    int fd[AA_MAX_ROOTS];
+    off_t size;
+    int idx;
+
+    if (!AA_ERASURE_CODED) {
+        for(idx=1; idx<AA_NUM_ROOTS; idx++) {
+            data_file_path(fpath, path, idx);
+            if ((lstat(fpath, &statbuf)==0) && (statbuf.st_size>primary_size)) {
+                primary_size = statbuf.st_size;
+            }
+        }
+        return logical_size(primary_size);
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        data_file_path(fpath, path, idx);
+        fd[idx] = open(fpath, O_RDONLY | O_NOFOLLOW);
+    }
+    size = ec_file_size(fd);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (fd[idx]>=0) {
+            close(fd[idx]);
+        }
+    }
+    return size;
+}
+
+/*
+  Forget the cached attributes of a path whose contents or metadata changed.
+*/
+static void invalidate_attrs(const char *path) {
+    attr_invalidate(path);
+}
+
+/*
+  Forget the cached attributes of a path that was created, removed or
+  renamed, and of the directory holding it.
+*/
+static void invalidate_entry(const char *path) {
+    char parent[PATH_MAX];
+    char *slash;
+
+    attr_invalidate(path);
+    strcpy(parent, path);
+    slash = strrchr(parent, '/');
+    if (slash!=NULL) {
+        slash[slash==parent?1:0] = 0;
+        attr_invalidate(parent);
+    }
+}
+
+/*
+  Requests for paths in the statistics tree under /.archivist are answered
+  here from stats.c and never reach the storage locations.
+*/
+static int virtual_getattr(const char *path, struct stat *statbuf) {
+    int node;
+
+    node = stats_node(path);
+    if (node<0) {
+        return log_error("getattr", ENOENT, "%s", path);
+    }
+    stats_attr(node, statbuf);
+    return log_status("getattr", 0, "%s", path);
+}
+
+static int virtual_open(const char *path, struct fuse_file_info *fi) {
+    int node;
+
+    node = stats_node(path);
+    if (node<0) {
+        return log_error("open", ENOENT, "%s", path);
+    }
+    if ((node!=AA_STATS_COUNTERS) && (node!=AA_STATS_LATENCY)) {
+        return log_error("open", EISDIR, "%s", path);
+    }
+    if ((fi->flags & O_ACCMODE)!=O_RDONLY) {
+        return log_error("open", EACCES, "%s", path);
+    }
+    fi->direct_io = 1;
+    fi->fh = 0;
+    return log_status("open", 0, "%s", path);
+}
+
+static int virtual_read(const char *path, char *buf, size_t size, off_t offset) {
+    char *text;
+    size_t len;
+    int err_no;
+
+    err_no = stats_render(stats_node(path), &text, &len);
+    if (err_no!=0) {
+        return log_error("read", err_no, "%s", path);
+    }
+    if (offset>=(off_t)len) {
+        len = 0;
+    } else {
+        len -= (size_t)offset;
+        if (len>size) {
+            len = size;
+        }
+        memcpy(buf, text + offset, len);
+    }
+    free(text);
+    return log_status("read", (int)len, "%s", path);
+}
+
+static int virtual_opendir(const char *path, struct fuse_file_info *fi) {
+    int node;
+
+    node = stats_node(path);
+    if (node<0) {
+        return log_error("opendir", ENOENT, "%s", path);
+    }
+    if ((node!=AA_STATS_TOP) && (node!=AA_STATS_DIR)) {
+        return log_error("opendir", ENOTDIR, "%s", path);
+    }
+    fi->fh = 0;
+    return log_status("opendir", 0, "%s", path);
+}
+
+static int virtual_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+    const char *name;
+    int node;
+    int idx;
+
+    node = stats_node(path);
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for(idx=0; (name = stats_entry(node, idx))!=NULL; idx++) {
+        filler(buf, name, NULL, 0);
+    }
+    return log_status("readdir", 0, "%s", path);
+}
+
 int getattr_call(const char *path, struct stat *statbuf)
 {
     int rc;
     char file_path[PATH_MAX];
+    uint64_t epoch;
+    off_t size;
 
     log_info("getattr","%s", path);
 
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return virtual_getattr(path, statbuf);
+    }
+
+    rc = attr_lookup(path, statbuf);
+    if (rc>0) {
+        return log_status("getattr", 0, "%s (cached)", path);
+    }
+    if (rc<0) {
+        return log_error("getattr", ENOENT, "%s (cached)", path);
+    }
+
+    epoch = attr_epoch(path);
     data_file_path(file_path, path, 0);
     rc = lstat(file_path, statbuf);
     if (rc<0) {
+        if (errno==ENOENT) {
+            attr_insert(path, NULL, epoch);
+        }
         return log_error("getattr", errno, "%s", path);
     }
     if ((statbuf->st_mode & S_IFMT) == S_IFREG) {
-        if (statbuf->st_size>0) {
-            statbuf->st_size = (off_t)((statbuf->st_size / AA_BLOCK_SIZE) * AA_DATA_SIZE + (statbuf->st_size % AA_BLOCK_SIZE) - ((statbuf->st_size % AA_BLOCK_SIZE)!=0?AA_HEAD_SIZE:0));
+        statbuf->st_size = path_size(path, statbuf->st_size);
+        size = pending_size(statbuf->st_dev, statbuf->st_ino);
+        if (size>statbuf->st_size) {
+            statbuf->st_size = size;
         }
     }
+    attr_insert(path, statbuf, epoch);
 
     return log_status("getattr", rc, "%s", path);
 }
 
+static struct file_entry *handle_entry(struct fuse_file_info *fi) {
+    return handle_file_entry(&AA_DATA->handles, fi->fh);
+}
+
+static int flush_entry(const char *path, struct file_entry *file_entry) {
+    int err_no;
+    int dirty;
+
+    pthread_mutex_lock(&file_entry->lock);
+    dirty = file_entry->dirty.count;
+    err_no = flush_writes(file_entry);
+    pthread_mutex_unlock(&file_entry->lock);
+    if (dirty>0) {
+        invalidate_attrs(path);
+    }
+
+    return err_no;
+}
+
+/*
+  Flush what every open handle of the file has buffered, so a read or an
+  open sees the data behind the size getattr reports.
+*/
+static int flush_file(const char *path, const struct file_entry *file_entry) {
+    int err_no;
+    int flushed;
+
+    err_no = flush_pending(file_entry->dev, file_entry->ino, &flushed);
+    if (flushed) {
+        invalidate_attrs(path);
+    }
+
+    return err_no;
+}
+
 int fgetattr_call(const char *path, struct stat *statbuf, struct fuse_file_info *fi) {
     int rc;
+    struct file_entry *file_entry;
+    int fd[AA_MAX_ROOTS];
+    off_t size;
+    int idx;
 
     log_info("fgetattr", "%s", path);
 
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return virtual_getattr(path, statbuf);
+    }
+
     if (!strcmp(path, "/")) {
         return getattr_call(path, statbuf);
     }
 
-    rc = fstat(AA_DATA->entry[fi->fh].file[0].fd, statbuf);
+    file_entry = handle_entry(fi);
+    rc = fstat(file_entry->file[0].fd, statbuf);
     if (rc < 0) {
         return log_error("fgetattr", errno, "fstat failed");
     }
-
-    return log_status("fgetattr", 0, "");
-}
-
-uint64_t find_next_entry() {
-    uint64_t fd;
-    int idx;
-    for(fd=AA_DATA->used_entries; fd<MAX_FUSE_OPEN_FILES; fd++) {
-        for(idx=0; idx<AA_NUM_COPIES; idx++) {
-            if (AA_DATA->entry[fd].file[idx].fd >= 0) {
-                break;
-            }
+    if ((statbuf->st_mode & S_IFMT) == S_IFREG) {
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            fd[idx] = file_entry->file[idx].fd;
         }
-        if (idx==AA_NUM_COPIES) {
-            break;
+        statbuf->st_size = striped_size(fd, statbuf->st_size);
+        size = pending_size(file_entry->dev, file_entry->ino);
+        if (size>statbuf->st_size) {
+            statbuf->st_size = size;
         }
     }
-    return fd;
+
+    return log_status("fgetattr", 0, "");
 }
 
 void close_all(struct file_entry *file_entry) {
     int idx;
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (file_entry->file[idx].fd >= 0) {
             close(file_entry->file[idx].fd);
             log_info("close", "idx=%d fd=%d", idx, file_entry->file[idx].fd);
@@ -112,16 +382,18 @@ void close_all(struct file_entry *file_entry) {
 
 int open_file_entry(const char* path, struct file_entry *file_entry, int flags) {
     int idx;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
+    struct stat statbuf;
 
     clear_list(err_no);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         data_file_path(fpath[idx], path, idx);
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    memset(&file_entry->dirty, 0, sizeof(struct write_buffer));
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         file_entry->file[idx].fd = open(fpath[idx], flags);
         if (file_entry->file[idx].fd<0) {
             err_no[idx] = errno;
@@ -136,6 +408,14 @@ int open_file_entry(const char* path, struct file_entry *file_entry, int flags)
         return first_error(err_no);
     }
 
+    if (fstat(file_entry->file[0].fd, &statbuf)<0) {
+        err_no[0] = errno;
+        close_all(file_entry);
+        return err_no[0];
+    }
+    file_entry->dev = statbuf.st_dev;
+    file_entry->ino = statbuf.st_ino;
+
     return 0;
 }
 
@@ -157,158 +437,309 @@ int open_call(const char* path, struct fuse_file_info *fi) {
 
     log_info("open", "%s : flags = %u", path, flags);
 
-    fd = find_next_entry();
-    if (fd==MAX_FUSE_OPEN_FILES) {
-        return log_error("open", ENFILE, "Too many open files");
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return virtual_open(path, fi);
+    }
+
+    err_no = allocate_handle(&AA_DATA->handles, &fd);
+    if (err_no!=0) {
+        return log_error("open", err_no, "Too many open files");
     }
-    file_entry = &AA_DATA->entry[fd];
+    file_entry = handle_file_entry(&AA_DATA->handles, fd);
 
     err_no = open_file_entry(path, file_entry, flags);
     if (err_no!=0) {
+        release_handle(&AA_DATA->handles, fd);
         return log_error("open", err_no, "%s", path);
     }
-
-    if (fd>=AA_DATA->used_entries) {
-        AA_DATA->used_entries = fd + 1;
+    if (flags & O_TRUNC) {
+        err_no = clip_pending(file_entry->dev, file_entry->ino, 0);
+    } else {
+        err_no = flush_file(path, file_entry);
+    }
+    if (err_no!=0) {
+        close_all(file_entry);
+        release_handle(&AA_DATA->handles, fd);
+        return log_error("open", err_no, "Failed to flush buffered writes for %s", path);
     }
 
     fi->fh = fd;
+    if (flags & O_TRUNC) {
+        invalidate_attrs(path);
+    }
 
     return log_status("open", 0, "");
 }
 
 int release_call(const char* path, struct fuse_file_info *fi) {
     struct file_entry *file_entry;
+    struct stat statbuf;
+    int err_no;
 
     log_info("release", "%s", path);
 
-    file_entry = &AA_DATA->entry[fi->fh];
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_status("release", 0, "%s", path);
+    }
 
-    close_all(file_entry);
+    file_entry = handle_entry(fi);
+
+    pthread_mutex_lock(&file_entry->lock);
+    err_no = flush_writes(file_entry);
+    if (err_no!=0) {
+        err_no = flush_writes(file_entry);
+    }
+    if (err_no!=0) {
+        log_lost_writes(file_entry, "release", err_no);
+    }
+    free_write_buffer(file_entry);
+    pthread_mutex_unlock(&file_entry->lock);
+    invalidate_attrs(path);
+
+    if ((fstat(file_entry->file[0].fd, &statbuf)==0) && (statbuf.st_nlink==0)) {
+        cache_invalidate(file_entry->dev, file_entry->ino, 0);
+    }
 
-    if (fi->fh<AA_DATA->used_entries) {
-        AA_DATA->used_entries = fi->fh;
+    close_all(file_entry);
+    release_handle(&AA_DATA->handles, fi->fh);
+    if (err_no!=0) {
+        return log_error("release", err_no, "Failed to flush buffered writes for %s", path);
     }
 
     return log_status("release", 0, "");
 }
 
-int read_call(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+int flush_call(const char* path, struct fuse_file_info *fi) {
+    int err_no;
+
+    log_info("flush", "%s", path);
+
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_status("flush", 0, "%s", path);
+    }
+
+    err_no = flush_entry(path, handle_entry(fi));
+    if (err_no!=0) {
+        return log_error("flush", err_no, "%s", path);
+    }
+
+    return log_status("flush", 0, "%s", path);
+}
+
+int fsync_call(const char* path, int datasync, struct fuse_file_info *fi) {
+    struct file_entry *file_entry;
+    int err_no;
+    int idx;
+    int rc;
+
+    log_info("fsync", "%s", path);
+
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_status("fsync", 0, "%s", path);
+    }
+
+    file_entry = handle_entry(fi);
+
+    err_no = flush_entry(path, file_entry);
+    if (err_no!=0) {
+        return log_error("fsync", err_no, "%s", path);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        rc = datasync ? fdatasync(file_entry->file[idx].fd) : fsync(file_entry->file[idx].fd);
+        if (rc<0) {
+            return log_error("fsync", errno, "idx=%d %s", idx, path);
+        }
+    }
+
+    return log_status("fsync", 0, "%s", path);
+}
+
+/*
+  Read up to size bytes of logical data at offset from an open file entry
+  into buf. Returns the number of bytes read or a negative errno.
+*/
+ssize_t read_data(struct file_entry *file_entry, char *buf, size_t size, off_t offset) {
     size_t total_size;
     off_t file_block_ofs;
     int block_ofs;
-    struct file_entry *file_entry;
+    struct data_block *blocks;
+    int count;
+    int blocks_read;
+    int blk;
     int err_no;
     int block_size;
     char *ptr;
 
-    log_info("read", "%s , size = %lu , offset = %lu", path, size, offset);
-
     total_size = 0;
-    ptr = (char *) buf;
+    ptr = buf;
 
-    while (size > 0) {
+    file_block_ofs = (offset / AA_DATA_SIZE) * AA_BLOCK_SIZE;
+    block_ofs = (int)(offset % AA_DATA_SIZE);
+    count = (int)((block_ofs + size + AA_DATA_SIZE - 1) / AA_DATA_SIZE);
 
-        file_block_ofs = (offset / AA_DATA_SIZE) * AA_BLOCK_SIZE;
-        block_ofs = (int)(offset % AA_DATA_SIZE);
-
-        file_entry = &AA_DATA->entry[fi->fh];
+    blocks = malloc((size_t)count * AA_BLOCK_SIZE);
+    if (blocks==NULL) {
+        return -ENOMEM;
+    }
 
-        err_no = read_block(file_entry, file_block_ofs);
-        if (err_no != 0) {
-            return log_error("read", err_no, "%s", path);
-        }
+    err_no = read_blocks(file_entry, file_block_ofs, blocks, count, &blocks_read);
+    if (err_no != 0) {
+        free(blocks);
+        return -err_no;
+    }
 
-        block_size = NTOH(file_entry->file[0].block.header.length) - block_ofs;
+    for(blk=0; blk<blocks_read && size>0; blk++) {
+        block_size = NTOH(block_at(blocks, blk)->header.length) - block_ofs;
         if (block_size<=0) {
             break;
         }
-        if (block_size<size) {
-            memcpy(ptr, &file_entry->file[0].block.data[block_ofs], block_size);
-            total_size += block_size;
-            ptr += block_size;
-            size -= block_size;
-            offset += block_size;
-            log_info("read", "Read %d bytes", block_size);
-        } else {
-            memcpy(ptr, &file_entry->file[0].block.data[block_ofs], size);
-            total_size += size;
-            log_info("read", "Read %d bytes", size);
-            break;
+        if (block_size>size) {
+            block_size = (int)size;
         }
+        memcpy(ptr, &block_at(blocks, blk)->data[block_ofs], block_size);
+        total_size += block_size;
+        ptr += block_size;
+        size -= block_size;
+        block_ofs = 0;
     }
-    return log_status("read", (int)total_size, "Composite read");
+
+    free(blocks);
+    log_info("read", "Read %lu bytes from %d blocks", total_size, blocks_read);
+    return (ssize_t)total_size;
 }
 
-int write_call(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    off_t file_block_ofs;
-    int block_ofs;
-    int idx;
+int read_call(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
     struct file_entry *file_entry;
+    ssize_t total_size;
     int err_no;
-    int block_size;
-    int write_bytes;
-    int written_bytes;
-    char* ptr;
 
-    log_info("write", "%s , size = %lu , offset = %lu", path, size, offset);
+    log_info("read", "%s , size = %lu , offset = %lu", path, size, offset);
+
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return virtual_read(path, buf, size, offset);
+    }
+    scrub_foreground();
 
     if (size<1) {
-        return log_status("write", 0, "");
+        return log_status("read", 0, "");
     }
 
-    written_bytes = 0;
-    ptr = (char*)buf;
+    file_entry = handle_entry(fi);
 
-    while (size > 0) {
+    err_no = flush_file(path, file_entry);
+    if (err_no != 0) {
+        return log_error("read", err_no, "Failed to flush buffered writes for %s", path);
+    }
 
-        file_block_ofs = (offset / AA_DATA_SIZE) * AA_BLOCK_SIZE;
-        block_ofs = (int)(offset % AA_DATA_SIZE);
+    total_size = read_data(file_entry, buf, size, offset);
+    if (total_size < 0) {
+        return log_error("read", (int)-total_size, "%s", path);
+    }
 
-        file_entry = &AA_DATA->entry[fi->fh];
+    return log_status("read", (int)total_size, "Composite read");
+}
 
-        err_no = read_block(file_entry, file_block_ofs);
-        if (err_no != 0) {
-            return log_error("write", err_no, "Error reading block");
-        }
+/*
+  Read and check the blocks behind a read as read_data does, but leave
+  the data where it is in the block buffer and describe it, without the
+  block headers, as one segment per block of a fuse_bufvec. The low level
+  frontend replies with the segments directly, saving the copy read_data
+  makes. The caller frees *blocks and *bufp once the reply is sent.
+*/
+int read_segments(struct file_entry *file_entry, size_t size, off_t offset, struct data_block **blocks, struct fuse_bufvec **bufp) {
+    struct fuse_bufvec *bufv;
+    off_t file_block_ofs;
+    int block_ofs;
+    int block_size;
+    int blocks_read;
+    int count;
+    int blk;
+    int err_no;
 
-        block_size = AA_DATA_SIZE - block_ofs;
-        write_bytes = (block_size<=size) ? block_size : (int)size;
+    file_block_ofs = (offset / AA_DATA_SIZE) * AA_BLOCK_SIZE;
+    block_ofs = (int)(offset % AA_DATA_SIZE);
+    count = (int)((block_ofs + size + AA_DATA_SIZE - 1) / AA_DATA_SIZE);
 
-        for(idx=0; idx<AA_NUM_COPIES; idx++) {
-            file_entry->file[idx].block.header.version = HTON(1);
-            memcpy(&file_entry->file[idx].block.data[block_ofs], ptr, write_bytes);
-            if ((block_ofs+write_bytes)>NTOH(file_entry->file[idx].block.header.length)) {
-                file_entry->file[idx].block.header.length = HTON(block_ofs + write_bytes);
-            }
-        }
+    *blocks = malloc((size_t)count * AA_BLOCK_SIZE);
+    bufv = malloc(sizeof(struct fuse_bufvec) + (size_t)count * sizeof(struct fuse_buf));
+    if ((*blocks==NULL) || (bufv==NULL)) {
+        free(*blocks);
+        free(bufv);
+        return ENOMEM;
+    }
 
-        err_no = write_block(file_entry, file_block_ofs);
-        if (err_no!=0) {
-            return log_error("write", err_no, "");
+    err_no = read_blocks(file_entry, file_block_ofs, *blocks, count, &blocks_read);
+    if (err_no != 0) {
+        free(*blocks);
+        free(bufv);
+        return err_no;
+    }
+
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+    for(blk=0; blk<blocks_read && size>0; blk++) {
+        block_size = NTOH(block_at(*blocks, blk)->header.length) - block_ofs;
+        if (block_size<=0) {
+            break;
+        }
+        if (block_size>size) {
+            block_size = (int)size;
         }
+        bufv->buf[bufv->count] = bufv->buf[0];
+        bufv->buf[bufv->count].mem = &block_at(*blocks, blk)->data[block_ofs];
+        bufv->buf[bufv->count].size = (size_t)block_size;
+        bufv->count++;
+        size -= block_size;
+        block_ofs = 0;
+    }
+    if (bufv->count==0) {
+        bufv->count = 1;
+    }
+    *bufp = bufv;
+    log_info("read", "Read %zu bytes from %d blocks in %zu segments", fuse_buf_size(bufv), blocks_read, bufv->count);
+    return 0;
+}
 
-        written_bytes += write_bytes;
-        size -= write_bytes;
-        offset += write_bytes;
-        ptr += write_bytes;
+int write_call(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    struct file_entry *file_entry;
+    int err_no;
 
+    log_info("write", "%s , size = %lu , offset = %lu", path, size, offset);
+    scrub_foreground();
+
+    if (size<1) {
+        return log_status("write", 0, "");
     }
 
-    return log_status("write", (int)written_bytes, "");
+    file_entry = handle_entry(fi);
+
+    pthread_mutex_lock(&file_entry->lock);
+    err_no = buffer_write(file_entry, buf, size, offset);
+    pthread_mutex_unlock(&file_entry->lock);
+    invalidate_attrs(path);
+    if (err_no!=0) {
+        return log_error("write", err_no, "%s", path);
+    }
+
+    return log_status("write", (int)size, "");
 
 }
 
 int mknod_call(const char *path, mode_t mode, dev_t dev)
 { 
     int retstat;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
 
     log_info("mknod", "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("mknod", EEXIST, "%s", path);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         err_no[idx] = 0;
         data_file_path(fpath[idx], path, idx);
         if (S_ISREG(mode)) {
@@ -334,7 +765,9 @@ int mknod_call(const char *path, mode_t mode, dev_t dev)
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    invalidate_entry(path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx] != 0) {
             return log_error("mknod", err_no[idx], "%s -> %s", path, fpath[idx]);
         }
@@ -345,14 +778,18 @@ int mknod_call(const char *path, mode_t mode, dev_t dev)
 }
 
 int mkdir_call(const char *path, mode_t mode) {
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
     int rc;
 
     log_info("mkdir", "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("mkdir", EEXIST, "%s", path);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         err_no[idx] = 0;
         data_file_path(fpath[idx], path, idx);
         rc = mkdir(fpath[idx], mode);
@@ -361,7 +798,9 @@ int mkdir_call(const char *path, mode_t mode) {
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    invalidate_entry(path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx] != 0) {
             return log_error("mkdir", err_no[idx], "%s -> %s", path, fpath[idx]);
         }
@@ -377,6 +816,10 @@ int opendir_call(const char *path, struct fuse_file_info *fi)
 
     log_info("opendir", "%s", path);
 
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return virtual_opendir(path, fi);
+    }
+
     data_file_path(fpath, path, 0);
 
     dp = opendir(fpath);
@@ -389,53 +832,126 @@ int opendir_call(const char *path, struct fuse_file_info *fi)
     return log_status("opendir", 0, "");
 }
 
+/*
+  Fill in the attributes of a directory entry as getattr_call would and
+  prime the attribute cache with them, so the getattr that usually follows
+  a listing does not have to go back to the storage location.
+*/
+static int readdir_attrs(const char *path, DIR *dp, const char *entry, const char *name, struct stat *statbuf) {
+    char child[PATH_MAX];
+    uint64_t epoch;
+    int len;
+
+    len = snprintf(child, sizeof(child), "%s%s%s", path, path[strlen(path)-1]=='/'?"":"/", name);
+    if (len<0 || len>=(int)sizeof(child)) {
+        return -1;
+    }
+    epoch = attr_epoch(child);
+    if (fstatat(dirfd(dp), entry, statbuf, AT_SYMLINK_NOFOLLOW)<0) {
+        return -1;
+    }
+    if ((statbuf->st_mode & S_IFMT) == S_IFREG) {
+        statbuf->st_size = path_size(child, statbuf->st_size);
+    }
+    attr_insert(child, statbuf, epoch);
+    return 0;
+}
+
+/*
+  Entries are returned with their telldir position as the offset, so a
+  large directory is streamed over as many calls as the kernel needs.
+*/
 int readdir_call(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
                struct fuse_file_info *fi)
 {
     char name[257];
     DIR *dp;
     struct dirent *de;
+    struct stat statbuf;
+    struct stat *attrs;
+    int plus;
+    int count;
 
-    log_info("readdir", "%s", path);
+    log_info("readdir", "%s , offset = %ld", path, offset);
+
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return virtual_readdir(path, buf, filler);
+    }
 
     dp = (DIR *) (uintptr_t) fi->fh;
+    plus = AA_DATA->readdir_plus && (AA_DATA->attr_timeout > 0);
 
-    de = readdir(dp);
-    if (de == 0) {
-        return log_error("readdir", errno, "%s", path);
+    if (offset==0) {
+        rewinddir(dp);
+    } else {
+        seekdir(dp, offset);
     }
 
-    do {
+    count = 0;
+    for(;;) {
+        errno = 0;
+        de = readdir(dp);
+        if (de == NULL) {
+            if (errno != 0) {
+                return log_error("readdir", errno, "%s", path);
+            }
+            break;
+        }
+        if (!strcmp(path, "/") && !strcmp(de->d_name, AA_GEOMETRY_FILE)) {
+            continue;
+        }
         memset(name, 0, sizeof(name));
         if (de->d_name[strlen(de->d_name)-1] == '@') {
             strncpy(name, de->d_name, strlen(de->d_name)-1);
         } else {
             strncpy(name, de->d_name, strlen(de->d_name));
         }
-        log_info("readdir", "%s", name);
-        if (filler(buf, name, NULL, 0) != 0) {
-            return log_error("readdir", ENOMEM, "%s", path);
+        memset(&statbuf, 0, sizeof(statbuf));
+        statbuf.st_ino = de->d_ino;
+        statbuf.st_mode = DTTOIF(de->d_type);
+        attrs = &statbuf;
+        if (plus && strcmp(name, ".") && strcmp(name, "..") && (readdir_attrs(path, dp, de->d_name, name, &statbuf) != 0)) {
+            attrs = NULL;
+        }
+        if (filler(buf, name, attrs, telldir(dp)) != 0) {
+            break;
         }
-    } while ((de = readdir(dp)) != NULL);
+        count++;
+    }
 
-    return log_status("readdir", 0, "%s", path);
+    return log_status("readdir", 0, "%s , %d entries", path, count);
 }
 
 int releasedir_call(const char *path, struct fuse_file_info *fi) {
   log_info("releasedir", "%s", path);
+
+  if (stats_node(path)!=AA_STATS_NONE) {
+      return log_status("releasedir", 0, "%s", path);
+  }
+
   closedir((DIR *) (uintptr_t) fi->fh);
   return log_status("releasedir", 0, "");
 }
 
 int unlink_call(const char* path) {
     int rc;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    dev_t dev;
+    ino_t ino;
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
 
     log_info("unlink", "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("unlink", EPERM, "%s", path);
+    }
+
+    if (primary_identity(path, &dev, &ino)==0) {
+        cache_invalidate(dev, ino, 0);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         data_file_path(fpath[idx], path, idx);
         err_no[idx] = 0;
         rc = unlink(fpath[idx]);
@@ -444,7 +960,9 @@ int unlink_call(const char* path) {
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    invalidate_entry(path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx] != 0) {
             return log_error("unlink", err_no[idx], "%s", path);
         }
@@ -456,13 +974,17 @@ int unlink_call(const char* path) {
 
 int rmdir_call(const char* path) {
     int rc;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
 
     log_info("rmdir", "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("rmdir", EPERM, "%s", path);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         data_file_path(fpath[idx], path, idx);
         err_no[idx] = 0;
         rc = rmdir(fpath[idx]);
@@ -471,7 +993,9 @@ int rmdir_call(const char* path) {
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    invalidate_entry(path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx] != 0) {
             return log_error("rmdir", err_no[idx], "%s -> %s", path, fpath[idx]);
         }
@@ -483,13 +1007,17 @@ int rmdir_call(const char* path) {
 
 int chmod_call(const char* path, mode_t mode) {
     int rc;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
 
     log_info("chmod", "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("chmod", EPERM, "%s", path);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         data_file_path(fpath[idx], path, idx);
         err_no[idx] = 0;
         rc = chmod(fpath[idx], mode);
@@ -498,7 +1026,9 @@ int chmod_call(const char* path, mode_t mode) {
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    invalidate_attrs(path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx] != 0) {
             return log_error("chmod", err_no[idx], "%s -> %s", path, fpath[idx]);
         }
@@ -510,13 +1040,17 @@ int chmod_call(const char* path, mode_t mode) {
 
 int chown_call(const char* path, uid_t uid, gid_t gid) {
     int rc;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
 
     log_info("chown", "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("chown", EPERM, "%s", path);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         data_file_path(fpath[idx], path, idx);
         err_no[idx] = 0;
         rc = chown(fpath[idx], uid, gid);
@@ -525,7 +1059,9 @@ int chown_call(const char* path, uid_t uid, gid_t gid) {
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    invalidate_attrs(path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx] != 0) {
             return log_error("chown", err_no[idx], "%s -> %s", path, fpath[idx]);
         }
@@ -537,13 +1073,17 @@ int chown_call(const char* path, uid_t uid, gid_t gid) {
 
 int utime_call(const char* path, struct utimbuf *ubuf) {
     int rc;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
 
     log_info("utime", "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("utime", EPERM, "%s", path);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         data_file_path(fpath[idx], path, idx);
         err_no[idx] = 0;
         rc = utime(fpath[idx], ubuf);
@@ -552,7 +1092,9 @@ int utime_call(const char* path, struct utimbuf *ubuf) {
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    invalidate_attrs(path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx] != 0) {
             return log_error("utime", err_no[idx], "%s -> %s", path, fpath[idx]);
         }
@@ -562,89 +1104,124 @@ int utime_call(const char* path, struct utimbuf *ubuf) {
 
 }
 
-int truncate_call(const char* path, off_t new_size) {
+/*
+  Cut an open file entry down (or extend it) to new_size bytes of logical
+  data, rewriting the new last block on every copy. Returns an errno.
+*/
+int truncate_entry(struct file_entry *file_entry, off_t new_size) {
     int rc;
-    char fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    int err_no[AA_MAX_ROOTS];
     int idx;
-    struct file_entry file_entry;
+    struct block_set blocks;
     off_t file_block_ofs;
     int block_length;
-    size_t new_file_size;
-
-    log_info("truncate", "%s", path);
+    off_t new_file_size;
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        data_file_path(fpath[idx], path, idx);
-        err_no[idx] = 0;
+    if (AA_ERASURE_CODED) {
+        return ec_truncate(file_entry, new_size);
     }
 
+    clear_list(err_no);
+
     if (new_size==0) {
-        for(idx=0; idx<AA_NUM_COPIES; idx++) {
-            rc = truncate(fpath[idx], 0);
-            if (rc<0) {
-                err_no[idx] = errno;
-            }
+        file_block_ofs = 0;
+        new_file_size = 0;
+    } else {
+        file_block_ofs = (new_size / AA_DATA_SIZE) * AA_BLOCK_SIZE;
+        block_length = (int)(new_size % AA_DATA_SIZE);
+
+        rc = read_block(file_entry, file_block_ofs, &blocks);
+        if (rc!=0) {
+            return rc;
         }
         for(idx=0; idx<AA_NUM_COPIES; idx++) {
-            if (err_no[idx]!=0) {
-                return log_error("truncate", err_no[idx], "%s", path);
-            }
+            blocks.copy[idx].block.header.length = HTON(block_length);
+            memset(&blocks.copy[idx].block.data[block_length], 0, AA_DATA_SIZE - block_length);
         }
-        return log_status("truncate", 0, "%s", path);
+        rc = write_block(file_entry, file_block_ofs, &blocks);
+        if (rc!=0) {
+            return rc;
+        }
+        new_file_size = file_block_ofs + block_length + AA_HEAD_SIZE;
+        file_block_ofs += AA_BLOCK_SIZE;
     }
 
-    file_block_ofs = (new_size / AA_DATA_SIZE) * AA_BLOCK_SIZE;
-    block_length = (int)(new_size % AA_DATA_SIZE);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        rc = ftruncate(file_entry->file[idx].fd, new_file_size);
+        if (rc<0) {
+            err_no[idx] = errno;
+        }
+    }
+    cache_invalidate(file_entry->dev, file_entry->ino, file_block_ofs);
 
-    rc = open_file_entry(path, &file_entry, O_RDWR);
-    if (rc!=0) {
-        return log_error("truncate", rc, "%s", path);
+    return first_error(err_no);
+}
+
+int truncate_call(const char* path, off_t new_size) {
+    int rc;
+    struct file_entry file_entry;
+
+    log_info("truncate", "%s", path);
+
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("truncate", EPERM, "%s", path);
     }
-    rc = read_block(&file_entry, file_block_ofs);
+
+    rc = open_file_entry(path, &file_entry, O_RDWR);
     if (rc!=0) {
-        close_all(&file_entry);
         return log_error("truncate", rc, "%s", path);
     }
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        file_entry.file[idx].block.header.length = block_length;
+    rc = clip_pending(file_entry.dev, file_entry.ino, new_size);
+    if (rc==0) {
+        rc = truncate_entry(&file_entry, new_size);
     }
-    rc = write_block(&file_entry, file_block_ofs);
+    close_all(&file_entry);
+    invalidate_attrs(path);
     if (rc!=0) {
-        close_all(&file_entry);
         return log_error("truncate", rc, "%s", path);
     }
-    close_all(&file_entry);
 
-    new_file_size = file_block_ofs + block_length + AA_HEAD_SIZE;
+    return log_status("truncate", 0, "%s", path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        rc = truncate(fpath[idx], (off_t)new_file_size);
-        if (rc<0) {
-            err_no[idx] = errno;
-        }
-    }
+}
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        if (err_no[idx]!=0) {
-            return log_error("truncate", err_no[idx], "%s", path);
-        }
+int ftruncate_call(const char* path, off_t new_size, struct fuse_file_info *fi) {
+    int err_no;
+
+    log_info("ftruncate", "%s", path);
+
+    if (stats_node(path)!=AA_STATS_NONE) {
+        return log_error("ftruncate", EPERM, "%s", path);
     }
 
-    return log_status("truncate", 0, "%s", path);
+    err_no = flush_entry(path, handle_entry(fi));
+    if (err_no!=0) {
+        return log_error("ftruncate", err_no, "%s", path);
+    }
 
+    return truncate_call(path, new_size);
 }
 
 int rename_call(const char* old_path, const char* new_path) {
     int rc;
-    char old_fpath[AA_NUM_COPIES][PATH_MAX];
-    char new_fpath[AA_NUM_COPIES][PATH_MAX];
-    int err_no[AA_NUM_COPIES];
+    dev_t dev;
+    ino_t ino;
+    char old_fpath[AA_MAX_ROOTS][PATH_MAX];
+    char new_fpath[AA_MAX_ROOTS][PATH_MAX];
+    int err_no[AA_MAX_ROOTS];
     int idx;
 
     log_info("rename", "%s -> %s", old_path, new_path);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    if ((stats_node(old_path)!=AA_STATS_NONE) || (stats_node(new_path)!=AA_STATS_NONE)) {
+        return log_error("rename", EPERM, "%s -> %s", old_path, new_path);
+    }
+
+    if (primary_identity(new_path, &dev, &ino)==0) {
+        cache_invalidate(dev, ino, 0);
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         data_file_path(old_fpath[idx], old_path, idx);
         data_file_path(new_fpath[idx], new_path, idx);
         err_no[idx] = 0;
@@ -654,42 +1231,446 @@ int rename_call(const char* old_path, const char* new_path) {
         }
     }
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    attr_invalidate_tree(old_path);
+    attr_invalidate_tree(new_path);
+    invalidate_entry(old_path);
+    invalidate_entry(new_path);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx]!=0) {
-            return log_error("rename", err_no[idx], "%s -> %s", old_path[idx], new_path[idx]);
+            return log_error("rename", err_no[idx], "%s -> %s", old_fpath[idx], new_fpath[idx]);
         }
     }
 
     return log_status("rename", 0, "%s -> %s", old_path, new_path);
 }
 
+/*
+  Format the counters published as user.archivist.* attributes of the
+  mount point. Returns the length of the text or -ENOTSUP.
+*/
+int stats_xattr(const char *name, char *text, size_t size) {
+    struct cache_stats stats;
+    struct attr_stats attrs;
+    struct scrub_stats scrub;
+
+    if (strcmp(name, "user.archivist.cache")==0) {
+        cache_get_stats(&stats);
+        return snprintf(text, size, "capacity=%zu used=%zu hits=%lu misses=%lu inserts=%lu evictions=%lu invalidations=%lu",
+                        stats.capacity, stats.used, stats.hits, stats.misses, stats.inserts, stats.evictions, stats.invalidations);
+    }
+    if (strcmp(name, "user.archivist.attrs")==0) {
+        attr_get_stats(&attrs);
+        return snprintf(text, size, "capacity=%zu used=%zu hits=%lu negative_hits=%lu misses=%lu inserts=%lu evictions=%lu invalidations=%lu",
+                        attrs.capacity, attrs.used, attrs.hits, attrs.negative_hits, attrs.misses, attrs.inserts, attrs.evictions, attrs.invalidations);
+    }
+    if (strcmp(name, "user.archivist.scrub")==0) {
+        scrub_get_stats(&scrub);
+        return snprintf(text, size, "passes=%lu files=%lu scanned=%lu repaired=%lu unrecoverable=%lu unreadable=%lu",
+                        scrub.passes, scrub.files, scrub.blocks_scanned, scrub.blocks_repaired, scrub.blocks_unrecoverable, scrub.files_unreadable);
+    }
+    return -ENOTSUP;
+}
+
+int getxattr_call(const char* path, const char* name, char* value, size_t size) {
+    char text[256];
+    int len;
+
+    log_info("getxattr", "%s : %s", path, name);
+
+    if (strcmp(path, "/")!=0) {
+        return -ENOTSUP;
+    }
+
+    len = stats_xattr(name, text, sizeof(text));
+    if (len<0) {
+        return len;
+    }
+    if (size==0) {
+        return len;
+    }
+    if (size<(size_t)len) {
+        return log_error("getxattr", ERANGE, "%s", name);
+    }
+    memcpy(value, text, len);
+    return log_status("getxattr", len, "%s", name);
+}
+
+void *init_call(struct fuse_conn_info *conn) {
+    struct archivist_state *aa_state;
+
+    aa_state = AA_DATA;
+    start_logging();
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+    start_scrubber(aa_state->root_dir, aa_state->scrub_rate, aa_state->scrub_state);
+    return aa_state;
+}
+
+void destroy_call(void *private_data) {
+    struct cache_stats stats;
+    struct scrub_stats scrub;
+
+    stop_scrubber();
+    cache_get_stats(&stats);
+    log_status("destroy", 0, "cache capacity=%zu used=%zu hits=%lu misses=%lu evictions=%lu invalidations=%lu",
+               stats.capacity, stats.used, stats.hits, stats.misses, stats.evictions, stats.invalidations);
+    scrub_get_stats(&scrub);
+    log_status("destroy", 0, "scrub passes=%lu files=%lu scanned=%lu repaired=%lu unrecoverable=%lu unreadable=%lu",
+               scrub.passes, scrub.files, scrub.blocks_scanned, scrub.blocks_repaired, scrub.blocks_unrecoverable, scrub.files_unreadable);
+}
+
+/*
+  Every callback is timed for the latency histograms in stats.c.
+*/
+#define TIMED_CALL(name, op, params, args) \
+    static int timed_##name params { \
+        uint64_t start = stat_clock(); \
+        int rc = name##_call args; \
+        stat_op(op, start); \
+        return rc; \
+    }
+
+TIMED_CALL(getattr, AA_OP_GETATTR, (const char *path, struct stat *statbuf), (path, statbuf))
+TIMED_CALL(fgetattr, AA_OP_FGETATTR, (const char *path, struct stat *statbuf, struct fuse_file_info *fi), (path, statbuf, fi))
+TIMED_CALL(open, AA_OP_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_CALL(release, AA_OP_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_CALL(read, AA_OP_READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TIMED_CALL(write, AA_OP_WRITE, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TIMED_CALL(mknod, AA_OP_MKNOD, (const char *path, mode_t mode, dev_t dev), (path, mode, dev))
+TIMED_CALL(mkdir, AA_OP_MKDIR, (const char *path, mode_t mode), (path, mode))
+TIMED_CALL(chmod, AA_OP_CHMOD, (const char *path, mode_t mode), (path, mode))
+TIMED_CALL(chown, AA_OP_CHOWN, (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+TIMED_CALL(utime, AA_OP_UTIME, (const char *path, struct utimbuf *ubuf), (path, ubuf))
+TIMED_CALL(opendir, AA_OP_OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_CALL(readdir, AA_OP_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+TIMED_CALL(releasedir, AA_OP_RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_CALL(unlink, AA_OP_UNLINK, (const char *path), (path))
+TIMED_CALL(rmdir, AA_OP_RMDIR, (const char *path), (path))
+TIMED_CALL(truncate, AA_OP_TRUNCATE, (const char *path, off_t new_size), (path, new_size))
+TIMED_CALL(ftruncate, AA_OP_FTRUNCATE, (const char *path, off_t new_size, struct fuse_file_info *fi), (path, new_size, fi))
+TIMED_CALL(flush, AA_OP_FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_CALL(fsync, AA_OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+TIMED_CALL(rename, AA_OP_RENAME, (const char *old_path, const char *new_path), (old_path, new_path))
+TIMED_CALL(getxattr, AA_OP_GETXATTR, (const char *path, const char *name, char *value, size_t size), (path, name, value, size))
+
 static struct fuse_operations operations = {
-    .getattr = getattr_call,
-    .open = open_call,
-    .release = release_call,
-    .read = read_call,
-    .write = write_call,
-    .fgetattr = fgetattr_call,
-    .mknod = mknod_call,
-    .mkdir = mkdir_call,
-    .chmod = chmod_call,
-    .chown = chown_call,
-    .utime = utime_call,
-    .opendir = opendir_call,
-    .readdir = readdir_call,
-    .releasedir = releasedir_call,
-    .unlink = unlink_call,
-    .rmdir = rmdir_call,
-    .truncate = truncate_call,
-    .rename = rename_call,
+    .getattr = timed_getattr,
+    .open = timed_open,
+    .release = timed_release,
+    .read = timed_read,
+    .write = timed_write,
+    .fgetattr = timed_fgetattr,
+    .mknod = timed_mknod,
+    .mkdir = timed_mkdir,
+    .chmod = timed_chmod,
+    .chown = timed_chown,
+    .utime = timed_utime,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .unlink = timed_unlink,
+    .rmdir = timed_rmdir,
+    .truncate = timed_truncate,
+    .ftruncate = timed_ftruncate,
+    .flush = timed_flush,
+    .fsync = timed_fsync,
+    .rename = timed_rename,
+    .getxattr = timed_getxattr,
+    .init = init_call,
+    .destroy = destroy_call,
 };
 
+static int parse_size(const char* value, size_t *size) {
+    char *end;
+    unsigned long long number;
+
+    errno = 0;
+    number = strtoull(value, &end, 10);
+    if (errno!=0 || end==value) {
+        return -1;
+    }
+    switch (*end) {
+        case 'G': case 'g': number *= 1024;
+        /* fall through */
+        case 'M': case 'm': number *= 1024;
+        /* fall through */
+        case 'K': case 'k': number *= 1024; end++;
+        /* fall through */
+        case 0: break;
+        default: return -1;
+    }
+    if (*end!=0) {
+        return -1;
+    }
+    *size = (size_t)number;
+    return 0;
+}
+
+static int parse_seconds(const char* value, double *seconds) {
+    char *end;
+
+    errno = 0;
+    *seconds = strtod(value, &end);
+    if (errno!=0 || end==value || *end!=0 || *seconds<0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  FUSE changes directory to / when it daemonizes, so paths given on the
+  command line are made absolute first.
+*/
+static int absolute_path(char fpath[PATH_MAX], const char *path) {
+    char cwd[PATH_MAX];
+    int len;
+
+    if (path[0]=='/') {
+        len = snprintf(fpath, PATH_MAX, "%s", path);
+    } else if (getcwd(cwd, sizeof(cwd))!=NULL) {
+        len = snprintf(fpath, PATH_MAX, "%s/%s", cwd, path);
+    } else {
+        return -1;
+    }
+    return (len<0 || len>=PATH_MAX) ? -1 : 0;
+}
+
+/*
+  Consume the archivist specific --name=value options leaving the
+  remaining arguments for fuse_main.
+*/
+static int parse_options(int *argc, char* argv[], struct archivist_state *aa_state) {
+    int idx;
+    int out;
+    const char *arg;
+
+    out = 1;
+    for(idx=1; idx<*argc; idx++) {
+        arg = argv[idx];
+        if (!strncmp(arg, "--cache-size=", 13)) {
+            if (parse_size(arg + 13, &aa_state->cache_size)!=0) {
+                fprintf(stderr, "Invalid cache size %s\n", arg + 13);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--write-buffer=", 15)) {
+            if (parse_size(arg + 15, &aa_state->write_buffer_size)!=0) {
+                fprintf(stderr, "Invalid write buffer size %s\n", arg + 15);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--block-size=", 13)) {
+            if (parse_size(arg + 13, &aa_state->block_size)!=0 || !block_size_valid(aa_state->block_size)) {
+                fprintf(stderr, "Invalid block size %s\n", arg + 13);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--layout=", 9)) {
+            if (layout_by_name(arg + 9, &aa_state->layout)!=0) {
+                fprintf(stderr, "Invalid layout %s\n", arg + 9);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--fec=on")) {
+            aa_state->fec = 1;
+        } else if (!strcmp(arg, "--fec=off")) {
+            aa_state->fec = 0;
+        } else if (!strncmp(arg, "--fec=", 6)) {
+            fprintf(stderr, "Invalid error correction setting %s\n", arg + 6);
+            return -1;
+        } else if (!strncmp(arg, "--io-engine=", 12)) {
+            aa_state->io_engine = arg + 12;
+        } else if (!strcmp(arg, "--read-policy=all")) {
+            aa_state->read_policy = AA_READ_ALL;
+        } else if (!strcmp(arg, "--read-policy=primary-first")) {
+            aa_state->read_policy = AA_READ_PRIMARY_FIRST;
+        } else if (!strncmp(arg, "--hash=", 7)) {
+            aa_state->hash_type = hash_type_by_name(arg + 7);
+            if (aa_state->hash_type<0) {
+                fprintf(stderr, "Invalid hash %s\n", arg + 7);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--readdir=plus")) {
+            aa_state->readdir_plus = 1;
+        } else if (!strcmp(arg, "--readdir=plain")) {
+            aa_state->readdir_plus = 0;
+        } else if (!strncmp(arg, "--readdir=", 10)) {
+            fprintf(stderr, "Invalid readdir mode %s\n", arg + 10);
+            return -1;
+        } else if (!strncmp(arg, "--attr-timeout=", 15)) {
+            if (parse_seconds(arg + 15, &aa_state->attr_timeout)!=0) {
+                fprintf(stderr, "Invalid attribute timeout %s\n", arg + 15);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--scrub-rate=", 13)) {
+            if (parse_size(arg + 13, &aa_state->scrub_rate)!=0) {
+                fprintf(stderr, "Invalid scrub rate %s\n", arg + 13);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--scrub-state=", 14)) {
+            if (absolute_path(aa_state->scrub_state, arg + 14)!=0) {
+                fprintf(stderr, "Invalid scrub state file %s\n", arg + 14);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--log-file=", 11)) {
+            if (absolute_path(aa_state->log_file, arg + 11)!=0) {
+                fprintf(stderr, "Invalid log file %s\n", arg + 11);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--log-level=error")) {
+            aa_state->log_level = AA_LOG_ERROR;
+        } else if (!strcmp(arg, "--log-level=status")) {
+            aa_state->log_level = AA_LOG_STATUS;
+        } else if (!strcmp(arg, "--log-level=info")) {
+            aa_state->log_level = AA_LOG_ERROR;
+        } else if (!strncmp(arg, "--log-level=", 12)) {
+            fprintf(stderr, "Invalid log level %s\n", arg + 12);
+            return -1;
+        } else if (!strncmp(arg, "--log-rotate=", 13)) {
+            if (parse_size(arg + 13, &aa_state->log_rotate)!=0) {
+                fprintf(stderr, "Invalid log rotation size %s\n", arg + 13);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--frontend=highlevel")) {
+            aa_state->lowlevel = 0;
+        } else if (!strcmp(arg, "--frontend=lowlevel")) {
+            aa_state->lowlevel = 1;
+        } else if (!strncmp(arg, "--frontend=", 11)) {
+            fprintf(stderr, "Invalid frontend %s\n", arg + 11);
+            return -1;
+        } else if (!strncmp(arg, "--ll-workers=", 13)) {
+            aa_state->ll_workers = atoi(arg + 13);
+            if (aa_state->ll_workers<0 || aa_state->ll_workers>AA_LL_MAX_WORKERS) {
+                fprintf(stderr, "Invalid number of workers %s\n", arg + 13);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--max-io=", 9)) {
+            if (parse_size(arg + 9, &aa_state->max_io)!=0 || aa_state->max_io<4096) {
+                fprintf(stderr, "Invalid maximum I/O size %s\n", arg + 9);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--read-policy=", 14)) {
+            fprintf(stderr, "Invalid read policy %s\n", arg + 14);
+            return -1;
+        } else {
+            argv[out++] = argv[idx];
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+    return 0;
+}
+
+/*
+  Whether a storage location already holds files or directories.
+*/
+static int holds_data(const char *root_dir) {
+    DIR *dp;
+    struct dirent *de;
+    size_t len;
+    int found;
+
+    dp = opendir(root_dir);
+    if (dp==NULL) {
+        return 0;
+    }
+    found = 0;
+    while (!found && (de = readdir(dp))!=NULL) {
+        len = strlen(de->d_name);
+        found = (len>1) && (de->d_name[len-1]=='@');
+    }
+    closedir(dp);
+    return found;
+}
+
+/*
+  Fix the block size, error correction and root layout from the geometry
+  recorded in the storage locations, recording it in any that lack it. Each
+  storage location must be given in the place the archive has it. The
+  requested block size, or zero for none, and error correction, or -1 for
+  none, are used for a new archive and the layout given must be the one the
+  archive has. Storage locations that already hold data but have no record
+  are two mirrored copies with 512 byte blocks and no error correction.
+*/
+static int setup_geometry(char root_dir[AA_MAX_ROOTS][PATH_MAX], int requested, int fec) {
+    struct archive_geometry recorded;
+    struct archive_geometry geometry;
+    char name[2][32];
+    int found;
+    int err_no;
+    int idx;
+
+    found = 0;
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        err_no = load_geometry(root_dir[idx], &geometry);
+        if (err_no==ENOENT) {
+            continue;
+        }
+        if (err_no!=0) {
+            fprintf(stderr, "Cannot read %s in %s: %s\n", AA_GEOMETRY_FILE, root_dir[idx], strerror(err_no));
+            return -1;
+        }
+        if ((geometry.root>=0) && (geometry.root!=idx)) {
+            fprintf(stderr, "Storage location %s is root %d of its archive, not %d\n", root_dir[idx], geometry.root + 1, idx + 1);
+            return -1;
+        }
+        if (found && ((geometry.block_size!=recorded.block_size) || (geometry.fec!=recorded.fec) || !same_layout(&geometry.layout, &recorded.layout))) {
+            fprintf(stderr, "Storage locations %s and %s disagree on the archive geometry\n", root_dir[0], root_dir[idx]);
+            return -1;
+        }
+        recorded = geometry;
+        found = 1;
+    }
+
+    geometry.layout = archive_layout;
+    if (found) {
+        if ((requested!=0) && (requested!=recorded.block_size)) {
+            fprintf(stderr, "Archive has %d byte blocks, not %d\n", recorded.block_size, requested);
+            return -1;
+        }
+        if (!same_layout(&recorded.layout, &archive_layout)) {
+            layout_name(&recorded.layout, name[0], sizeof(name[0]));
+            layout_name(&archive_layout, name[1], sizeof(name[1]));
+            fprintf(stderr, "Archive layout is %s, not %s\n", name[0], name[1]);
+            return -1;
+        }
+        if ((fec>=0) && (fec!=(recorded.fec!=0))) {
+            fprintf(stderr, "Archive has error correction %s\n", recorded.fec ? "on" : "off");
+            return -1;
+        }
+        geometry.block_size = recorded.block_size;
+        geometry.fec = recorded.fec;
+    } else {
+        geometry.block_size = (requested!=0) ? requested : AA_DEFAULT_BLOCK_SIZE;
+        geometry.fec = (fec>0);
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            if (((geometry.block_size!=AA_DEFAULT_BLOCK_SIZE) || geometry.fec || AA_ERASURE_CODED || (AA_NUM_ROOTS!=AA_DEFAULT_COPIES)) && holds_data(root_dir[idx])) {
+                fprintf(stderr, "Archive in %s already has two copies of %d byte blocks\n", root_dir[idx], AA_DEFAULT_BLOCK_SIZE);
+                return -1;
+            }
+        }
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (load_geometry(root_dir[idx], &recorded)==ENOENT) {
+            geometry.root = idx;
+            err_no = save_geometry(root_dir[idx], &geometry);
+            if (err_no!=0) {
+                fprintf(stderr, "Cannot write %s in %s: %s\n", AA_GEOMETRY_FILE, root_dir[idx], strerror(err_no));
+                return -1;
+            }
+        }
+    }
+    set_block_size(geometry.block_size);
+    set_fec(geometry.fec);
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     int fuse_stat;
     struct archivist_state *aa_state;
     int idx;
-    int index;
     char mount_point[PATH_MAX];
+    char timeouts[128];
+    char **fuse_argv;
 
     if ((getuid()==0)||(getgid()==0)) {
         fprintf(stderr, "Running archivist as root has security issues\n");
@@ -698,47 +1679,121 @@ int main(int argc, char* argv[]) {
 
     fprintf(stderr, "Fuse library version %d.%d\n", FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION);
 
-    if (argc<(AA_NUM_COPIES+2)) {
+    aa_state = calloc(sizeof(struct archivist_state),1);
+    if (aa_state==NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    aa_state->cache_size = AA_CACHE_DEFAULT_SIZE;
+    aa_state->write_buffer_size = AA_WRITE_BUFFER_DEFAULT_SIZE;
+    aa_state->io_engine = "uring";
+    aa_state->hash_type = AA_HASH_DEFAULT_TYPE;
+    aa_state->fec = -1;
+    aa_state->layout = archive_layout;
+    aa_state->attr_timeout = AA_ATTR_DEFAULT_TIMEOUT;
+    aa_state->readdir_plus = 1;
+    aa_state->ll_workers = AA_LL_DEFAULT_WORKERS;
+    aa_state->max_io = AA_LL_DEFAULT_MAX_IO;
+    absolute_path(aa_state->scrub_state, AA_SCRUB_STATE_FILE);
+    absolute_path(aa_state->log_file, AA_LOG_DEFAULT_FILE);
+    aa_state->log_level = AA_LOG_INFO;
+    aa_state->log_rotate = AA_LOG_DEFAULT_ROTATE;
+    if (parse_options(&argc, argv, aa_state)!=0) {
         usage();
         exit(1);
     }
-    for(idx=argc-AA_NUM_COPIES-1; idx<argc; idx++) {
+    set_layout(&aa_state->layout);
+
+    if (argc<(AA_NUM_ROOTS+2)) {
+        usage();
+        exit(1);
+    }
+    for(idx=argc-AA_NUM_ROOTS-1; idx<argc; idx++) {
         if (argv[idx][0]=='-') {
             usage();
             exit(1);
         }
     }
 
-    aa_state = calloc(sizeof(struct archivist_state),1);
-    if (aa_state==NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
+    init_write_buffer(aa_state->write_buffer_size);
+    if (init_attr_cache(aa_state->attr_timeout)!=0) {
+        fprintf(stderr, "Failed to allocate the attribute cache\n");
         exit(1);
     }
-
-    for(index=0; index<MAX_FUSE_OPEN_FILES; index++) {
-        for(idx=0; idx<AA_NUM_COPIES; idx++) {
-            aa_state->entry[index].file[idx].fd = -1;
-        }
+    if (init_io_engine(aa_state->io_engine)!=0) {
+        fprintf(stderr, "Unknown I/O engine %s\n", aa_state->io_engine);
+        usage();
+        exit(1);
     }
+    fprintf(stderr, "Using %s block I/O\n", io_engine_name());
+    fprintf(stderr, "Using %s SHA-1\n", hash_engine_name(hash_engine()));
+    fprintf(stderr, "Writing %s hashed blocks\n", hash_type_name(aa_state->hash_type));
+    set_read_policy(aa_state->read_policy);
+    set_hash_type(aa_state->hash_type);
 
-    init_logging();
+    init_logging(aa_state->log_file, aa_state->log_level, aa_state->log_rotate);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        realpath(argv[argc-1], aa_state->root_dir[AA_NUM_COPIES-1-idx]);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        realpath(argv[argc-1], aa_state->root_dir[AA_NUM_ROOTS-1-idx]);
         argv[argc-1] = NULL;
         argc -= 1;
     }
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        if (idx==0) {
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (AA_ERASURE_CODED) {
+            fprintf(stderr, "%s root %d at %s\n", idx<AA_DATA_ROOTS ? "Data" : "Parity", idx<AA_DATA_ROOTS ? idx + 1 : idx - AA_DATA_ROOTS + 1, aa_state->root_dir[idx]);
+        } else if (idx==0) {
             fprintf(stderr, "Primary archive at %s\n", aa_state->root_dir[idx]);
         } else {
             fprintf(stderr, "Secondary archive at %s\n", aa_state->root_dir[idx]);
         }
     }
+    if (setup_geometry(aa_state->root_dir, (int)aa_state->block_size, aa_state->fec)!=0) {
+        exit(1);
+    }
+    fprintf(stderr, "Using %d byte blocks\n", AA_BLOCK_SIZE);
+    if (AA_FEC_SIZE>0) {
+        fprintf(stderr, "Using %d bytes of error correction per block\n", AA_FEC_SIZE);
+    }
+    if (AA_ERASURE_CODED) {
+        if (init_erasure()!=0) {
+            fprintf(stderr, "Cannot set up %d+%d erasure coding\n", AA_DATA_ROOTS, AA_PARITY_ROOTS);
+            exit(1);
+        }
+        fprintf(stderr, "Using %s Reed-Solomon parity\n", rs_engine_name());
+    }
+    if (init_block_cache(aa_state->cache_size)!=0) {
+        fprintf(stderr, "Failed to allocate a block cache of %zu bytes\n", aa_state->cache_size);
+        exit(1);
+    }
 
     realpath(argv[argc-1], mount_point);
+
+    if (aa_state->lowlevel) {
+        fprintf(stderr, "Starting low level Fuse on %s\n", mount_point);
+        fuse_stat = lowlevel_main(argc, argv, aa_state);
+        stop_logging();
+        fprintf(stderr, "Fuse returned %d\n", fuse_stat);
+        return fuse_stat;
+    }
+
+    /* Let the kernel cache attributes and lookups for as long as we do. */
+    snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+             aa_state->attr_timeout, aa_state->attr_timeout, aa_state->attr_timeout);
+    fuse_argv = calloc(argc + 2, sizeof(char *));
+    if (fuse_argv==NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    fuse_argv[0] = argv[0];
+    fuse_argv[1] = timeouts;
+    for(idx=1; idx<argc; idx++) {
+        fuse_argv[idx+1] = argv[idx];
+    }
+
     fprintf(stderr, "Starting Fuse on %s\n", mount_point);
-    fuse_stat = fuse_main(argc, argv, &operations, aa_state);
+    fuse_stat = fuse_main(argc + 1, fuse_argv, &operations, aa_state);
+    stop_logging();
     fprintf(stderr, "Fuse returned %d\n", fuse_stat);
     return fuse_stat;
 
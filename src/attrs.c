@@ -0,0 +1,361 @@
+/*
+  Cache of getattr results keyed by path.
+
+  Each entry holds the stat of a path, with the size already translated
+  to the logical size, or records that the path does not exist. Entries
+  expire after the same timeout that is given to the kernel for its own
+  attribute, entry and negative caches, and are dropped early by every
+  operation that changes a path.
+
+  Like the block cache the entries are split into shards, each with its own
+  lock, slots and CLOCK hand. Each shard has an epoch that advances on every
+  invalidation so a stat taken before a change is never cached after it.
+
+  A rename invalidates everything below a directory without visiting it.
+  Each directory path hashes to a tree epoch, and an entry records the sum
+  of the tree epochs of the directories above it when it is cached. A
+  lookup adds them up again as it hashes the path, and drops the entry if
+  any has advanced since.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "attrs.h"
+
+struct attr_slot {
+    char *path;
+    uint64_t hash;
+    uint64_t tree;
+    int valid;
+    int referenced;
+    int negative;
+    int next;
+    struct timespec expires;
+    struct stat statbuf;
+};
+
+struct attr_shard {
+    pthread_mutex_t lock;
+    uint64_t epoch;
+    int capacity;
+    int used;
+    int hand;
+    int num_buckets;
+    int *bucket;
+    struct attr_slot *slot;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+static struct attr_shard shards[AA_ATTR_SHARDS];
+static int attr_enabled = 0;
+static uint64_t tree_epoch[AA_ATTR_TREES];
+static struct timespec attr_timeout;
+
+static uint64_t attr_hash(const char *path) {
+    uint64_t hash;
+    hash = 0xCBF29CE484222325ULL;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001B3ULL;
+    }
+    hash ^= hash >> 29;
+    return hash;
+}
+
+/*
+  Hash path as attr_hash does, adding up in *tree the tree epochs of every
+  directory above it on the way.
+*/
+static uint64_t attr_hash_tree(const char *path, uint64_t *tree) {
+    const char *pos;
+    uint64_t hash;
+
+    *tree = 0;
+    hash = 0xCBF29CE484222325ULL;
+    for(pos=path; *pos; pos++) {
+        if ((*pos=='/') && (pos>path)) {
+            *tree += __atomic_load_n(&tree_epoch[(hash ^ (hash >> 29)) % AA_ATTR_TREES], __ATOMIC_ACQUIRE);
+        }
+        hash ^= (unsigned char)*pos;
+        hash *= 0x100000001B3ULL;
+    }
+    hash ^= hash >> 29;
+    return hash;
+}
+
+static struct attr_shard *attr_shard_for(uint64_t hash) {
+    return &shards[hash % AA_ATTR_SHARDS];
+}
+
+static int attr_find(struct attr_shard *shard, uint64_t hash, const char *path) {
+    int pos;
+    for(pos=shard->bucket[(hash / AA_ATTR_SHARDS) % shard->num_buckets]; pos>=0; pos=shard->slot[pos].next) {
+        if ((shard->slot[pos].hash==hash) && (strcmp(shard->slot[pos].path, path)==0)) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+static void attr_unlink(struct attr_shard *shard, int pos) {
+    struct attr_slot *slot;
+    int *link;
+
+    slot = &shard->slot[pos];
+    link = &shard->bucket[(slot->hash / AA_ATTR_SHARDS) % shard->num_buckets];
+    while (*link!=pos) {
+        link = &shard->slot[*link].next;
+    }
+    *link = slot->next;
+    free(slot->path);
+    slot->path = NULL;
+    slot->valid = 0;
+    slot->next = -1;
+    shard->used--;
+}
+
+static int attr_victim(struct attr_shard *shard) {
+    int pos;
+    for(;;) {
+        pos = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->capacity;
+        if (!shard->slot[pos].valid) {
+            return pos;
+        }
+        if (shard->slot[pos].referenced) {
+            shard->slot[pos].referenced = 0;
+        } else {
+            attr_unlink(shard, pos);
+            shard->evictions++;
+            return pos;
+        }
+    }
+}
+
+static int expired(const struct timespec *expires, const struct timespec *now) {
+    return (now->tv_sec > expires->tv_sec) || ((now->tv_sec == expires->tv_sec) && (now->tv_nsec >= expires->tv_nsec));
+}
+
+/*
+  Cache attributes for timeout seconds. A timeout of zero disables the cache.
+*/
+int init_attr_cache(double timeout) {
+    int idx;
+    int pos;
+    int per_shard;
+
+    if (timeout<=0) {
+        attr_enabled = 0;
+        return 0;
+    }
+    attr_timeout.tv_sec = (time_t)timeout;
+    attr_timeout.tv_nsec = (long)((timeout - (double)attr_timeout.tv_sec) * 1e9);
+
+    per_shard = AA_ATTR_CACHE_ENTRIES / AA_ATTR_SHARDS;
+    for(idx=0; idx<AA_ATTR_SHARDS; idx++) {
+        shards[idx].capacity = per_shard;
+        shards[idx].num_buckets = per_shard;
+        shards[idx].slot = calloc(per_shard, sizeof(struct attr_slot));
+        shards[idx].bucket = malloc(per_shard * sizeof(int));
+        if ((shards[idx].slot==NULL) || (shards[idx].bucket==NULL)) {
+            return -1;
+        }
+        for(pos=0; pos<per_shard; pos++) {
+            shards[idx].bucket[pos] = -1;
+            shards[idx].slot[pos].next = -1;
+        }
+        if (pthread_mutex_init(&shards[idx].lock, NULL)!=0) {
+            return -1;
+        }
+    }
+
+    attr_enabled = 1;
+    return 0;
+}
+
+/*
+  Returns 1 and fills statbuf when the path is cached, -1 when it is
+  cached as not existing and 0 when it is not cached.
+*/
+int attr_lookup(const char *path, struct stat *statbuf) {
+    uint64_t hash;
+    struct attr_shard *shard;
+    struct timespec now;
+    uint64_t tree;
+    int pos;
+    int found;
+
+    if (!attr_enabled) {
+        return 0;
+    }
+
+    hash = attr_hash_tree(path, &tree);
+    shard = attr_shard_for(hash);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    found = 0;
+    pthread_mutex_lock(&shard->lock);
+    pos = attr_find(shard, hash, path);
+    if ((pos>=0) && ((shard->slot[pos].tree!=tree) || expired(&shard->slot[pos].expires, &now))) {
+        attr_unlink(shard, pos);
+        pos = -1;
+    }
+    if (pos<0) {
+        shard->misses++;
+    } else if (shard->slot[pos].negative) {
+        shard->slot[pos].referenced = 1;
+        shard->negative_hits++;
+        found = -1;
+    } else {
+        shard->slot[pos].referenced = 1;
+        memcpy(statbuf, &shard->slot[pos].statbuf, sizeof(struct stat));
+        shard->hits++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+/*
+  The epoch to pass to attr_insert for path, which advances whenever path
+  or a directory above it is invalidated.
+*/
+uint64_t attr_epoch(const char *path) {
+    uint64_t tree;
+    uint64_t hash;
+
+    if (!attr_enabled) {
+        return 0;
+    }
+    hash = attr_hash_tree(path, &tree);
+    return __atomic_load_n(&attr_shard_for(hash)->epoch, __ATOMIC_ACQUIRE) + tree;
+}
+
+/*
+  Cache the attributes of path, or that it does not exist when statbuf is
+  NULL, unless the path was invalidated since read_epoch was taken.
+*/
+void attr_insert(const char *path, const struct stat *statbuf, uint64_t read_epoch) {
+    uint64_t hash;
+    struct attr_shard *shard;
+    struct attr_slot *slot;
+    uint64_t tree;
+    char *copy;
+    int *head;
+    int pos;
+
+    if (!attr_enabled) {
+        return;
+    }
+
+    hash = attr_hash_tree(path, &tree);
+    shard = attr_shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->epoch + tree!=read_epoch) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    pos = attr_find(shard, hash, path);
+    if (pos<0) {
+        copy = strdup(path);
+        if (copy==NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            return;
+        }
+        pos = attr_victim(shard);
+        slot = &shard->slot[pos];
+        slot->path = copy;
+        slot->hash = hash;
+        slot->valid = 1;
+        head = &shard->bucket[(hash / AA_ATTR_SHARDS) % shard->num_buckets];
+        slot->next = *head;
+        *head = pos;
+        shard->used++;
+    }
+    slot = &shard->slot[pos];
+    slot->tree = tree;
+    slot->referenced = 1;
+    slot->negative = (statbuf==NULL);
+    if (statbuf!=NULL) {
+        memcpy(&slot->statbuf, statbuf, sizeof(struct stat));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &slot->expires);
+    slot->expires.tv_sec += attr_timeout.tv_sec;
+    slot->expires.tv_nsec += attr_timeout.tv_nsec;
+    if (slot->expires.tv_nsec>=1000000000L) {
+        slot->expires.tv_sec++;
+        slot->expires.tv_nsec -= 1000000000L;
+    }
+    shard->inserts++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+  Forget the attributes of a single path.
+*/
+void attr_invalidate(const char *path) {
+    uint64_t hash;
+    struct attr_shard *shard;
+    int pos;
+
+    if (!attr_enabled) {
+        return;
+    }
+
+    hash = attr_hash(path);
+    shard = attr_shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    __atomic_add_fetch(&shard->epoch, 1, __ATOMIC_RELEASE);
+    pos = attr_find(shard, hash, path);
+    if (pos>=0) {
+        attr_unlink(shard, pos);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+  Forget the attributes of path and of everything below it.
+*/
+void attr_invalidate_tree(const char *path) {
+    if (!attr_enabled) {
+        return;
+    }
+
+    __atomic_add_fetch(&tree_epoch[attr_hash(path) % AA_ATTR_TREES], 1, __ATOMIC_RELEASE);
+    attr_invalidate(path);
+}
+
+void attr_get_stats(struct attr_stats *stats) {
+    int idx;
+    struct attr_shard *shard;
+
+    memset(stats, 0, sizeof(struct attr_stats));
+    if (!attr_enabled) {
+        return;
+    }
+
+    for(idx=0; idx<AA_ATTR_SHARDS; idx++) {
+        shard = &shards[idx];
+        pthread_mutex_lock(&shard->lock);
+        stats->capacity += (size_t)shard->capacity;
+        stats->used += (size_t)shard->used;
+        stats->hits += shard->hits;
+        stats->negative_hits += shard->negative_hits;
+        stats->misses += shard->misses;
+        stats->inserts += shard->inserts;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
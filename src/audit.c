@@ -0,0 +1,941 @@
+/*
+  Whole archive verification
+
+  archivist-verify given the storage locations of a mirrored archive walks
+  their backing directories together, merging the listings as the
+  scrubber does, and hands each data file out to a pool of worker threads
+  a chunk at a time. A worker reads its chunk from every copy a megabyte
+  at a time, checks the length and hash of every block, the copies hashed
+  together, and compares the hashes of the copies that are sound, which
+  differ only when the copies hold different data. Each finding is
+  written to a JSON report as it is made, followed by the totals once
+  every file has been checked.
+
+  archivist-repair walks the archive the same way and puts right what it
+  finds by the rules archivist applies to a block it reads: a copy its
+  error correction puts right is written back, a corrupt copy is replaced
+  by the first sound one, and the primary copy wins over sound copies
+  that differ from it or are missing. Missing files and directories are
+  created from the primary, and once everything has been written they
+  are given its permissions and access and modification times. Only the
+  blocks that change are written, in runs of adjacent blocks, and a dry
+  run works everything out but writes nothing.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "audit.h"
+#include "blocks.h"
+#include "hash.h"
+#include "fec.h"
+
+#define AUDIT_ABSENT 0
+#define AUDIT_SOUND 1
+#define AUDIT_CORRUPT 2
+
+#define AUDIT_VERIFY 0
+#define AUDIT_DRY_RUN 1
+#define AUDIT_REPAIR 2
+
+#define AUDIT_MAX_BLOCKS (AA_AUDIT_STEP / AA_MIN_BLOCK_SIZE)
+
+struct audit_job {
+    char rel[PATH_MAX];
+    off_t start;
+    off_t end;
+};
+
+/* A copy created by the repair, to be given the primary's permissions and times. */
+struct audit_stamp {
+    char *rel;
+    int copy;
+    mode_t perm;
+    struct timespec times[2];
+};
+
+struct audit_totals {
+    uint64_t files;
+    uint64_t directories;
+    uint64_t blocks;
+    uint64_t bytes;
+    uint64_t corrupt;
+    uint64_t correctable;
+    uint64_t mismatched;
+    uint64_t missing_tails;
+    uint64_t missing_entries;
+    uint64_t unreadable;
+    uint64_t unwritable;
+    uint64_t repaired_fec;
+    uint64_t repaired_corrupt;
+    uint64_t repaired_mismatched;
+    uint64_t repaired_missing;
+    uint64_t repaired_entries;
+    uint64_t bytes_written;
+    uint64_t unrepaired;
+};
+
+/*
+  What a worker reads a step into and works out about it. A copy is
+  writable when blocks missing from it can be written, which in a dry run
+  includes a copy whose file is yet to be created.
+*/
+struct audit_worker {
+    pthread_t thread;
+    int fd[AA_MAX_COPIES];
+    int writable[AA_MAX_COPIES];
+    int written[AA_MAX_COPIES];
+    unsigned char *buf[AA_MAX_COPIES];
+    int state[AA_MAX_COPIES][AUDIT_MAX_BLOCKS];
+    int dirty[AA_MAX_COPIES][AUDIT_MAX_BLOCKS];
+    const struct data_block *check[AA_MAX_COPIES * AUDIT_MAX_BLOCKS];
+    int *result[AA_MAX_COPIES * AUDIT_MAX_BLOCKS];
+    int valid[AA_MAX_COPIES * AUDIT_MAX_BLOCKS];
+};
+
+static struct auditor {
+    char root_dir[AA_MAX_COPIES][PATH_MAX];
+    int copies;
+    int mode;
+    FILE *report;
+    uint64_t findings;
+    struct audit_job queue[AA_AUDIT_QUEUE];
+    int head;
+    int queued;
+    int walked;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    struct audit_totals totals;
+    struct audit_stamp *stamp;
+    int stamps;
+    int stamp_room;
+} auditor = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER
+};
+
+static void count(uint64_t *counter, uint64_t amount) {
+    __atomic_add_fetch(counter, amount, __ATOMIC_RELAXED);
+}
+
+/*
+  Write a string as JSON. A backing path is written as the path through
+  the mount point, from the root and without the '@' ending each name.
+*/
+static void json_string(FILE *out, const char *text, int backing) {
+    const unsigned char *pos;
+
+    fputc('"', out);
+    if (backing) {
+        fputc('/', out);
+    }
+    for(pos=(const unsigned char *)text; *pos!=0; pos++) {
+        if (backing && (*pos=='@') && ((pos[1]=='/') || (pos[1]==0))) {
+            continue;
+        }
+        if ((*pos=='"') || (*pos=='\\')) {
+            fprintf(out, "\\%c", *pos);
+        } else if (*pos<0x20) {
+            fprintf(out, "\\u%04x", *pos);
+        } else {
+            fputc(*pos, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+  Report a finding of the given type about rel. copy and offset are left
+  out when negative, and more, when given, adds fields of its own. When
+  repairing, the finding also says whether it is put right. A dry run
+  puts nothing right, so it says whether the finding would be and counts
+  every finding as left.
+*/
+static void report_finding(const char *type, const char *rel, int copy, off_t offset, int repaired, const char *more, ...) {
+    va_list args;
+
+    pthread_mutex_lock(&auditor.mutex);
+    fprintf(auditor.report, "%s\n    {\"type\": \"%s\", \"path\": ", (auditor.findings>0) ? "," : "", type);
+    json_string(auditor.report, rel, 1);
+    if (copy>=0) {
+        fprintf(auditor.report, ", \"copy\": %d", copy);
+    }
+    if (offset>=0) {
+        fprintf(auditor.report, ", \"offset\": %lld, \"block\": %lld", (long long)offset, (long long)(offset / AA_BLOCK_SIZE));
+    }
+    if (more!=NULL) {
+        va_start(args, more);
+        vfprintf(auditor.report, more, args);
+        va_end(args);
+    }
+    if (auditor.mode==AUDIT_DRY_RUN) {
+        fprintf(auditor.report, ", \"repaired\": false, \"would_repair\": %s", repaired ? "true" : "false");
+        auditor.totals.unrepaired++;
+    } else if (auditor.mode!=AUDIT_VERIFY) {
+        fprintf(auditor.report, ", \"repaired\": %s", repaired ? "true" : "false");
+        if (!repaired) {
+            auditor.totals.unrepaired++;
+        }
+    }
+    fputc('}', auditor.report);
+    auditor.findings++;
+    pthread_mutex_unlock(&auditor.mutex);
+}
+
+static int backing_path(char fpath[PATH_MAX], int idx, const char *rel) {
+    int len;
+    if (rel[0]==0) {
+        len = snprintf(fpath, PATH_MAX, "%s", auditor.root_dir[idx]);
+    } else {
+        len = snprintf(fpath, PATH_MAX, "%s/%s", auditor.root_dir[idx], rel);
+    }
+    return (len<0 || len>=PATH_MAX) ? ENAMETOOLONG : 0;
+}
+
+static ssize_t pread_fully(int fd, unsigned char *buf, size_t size, off_t ofs) {
+    ssize_t len;
+    size_t done;
+
+    done = 0;
+    while (done<size) {
+        len = pread(fd, buf + done, size - done, ofs + (off_t)done);
+        if ((len<0) && (errno==EINTR)) {
+            continue;
+        }
+        if (len<0) {
+            return -1;
+        }
+        if (len==0) {
+            break;
+        }
+        done += len;
+    }
+    return (ssize_t)done;
+}
+
+static int pwrite_fully(int fd, const unsigned char *buf, size_t size, off_t ofs) {
+    ssize_t len;
+    size_t done;
+
+    done = 0;
+    while (done<size) {
+        len = pwrite(fd, buf + done, size - done, ofs + (off_t)done);
+        if ((len<0) && (errno==EINTR)) {
+            continue;
+        }
+        if (len<=0) {
+            return (len<0) ? errno : EIO;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+/*
+  Mark block blk of copy idx to be written with the block from, counting
+  the repair under counter.
+*/
+static void plan_repair(struct audit_worker *worker, int idx, int blk, const struct data_block *from, uint64_t *counter) {
+    struct data_block *block;
+
+    block = block_at((struct data_block *)worker->buf[idx], blk);
+    if (block!=from) {
+        memcpy(block, from, AA_BLOCK_SIZE);
+    }
+    worker->state[idx][blk] = AUDIT_SOUND;
+    worker->dirty[idx][blk] = 1;
+    count(counter, 1);
+}
+
+/*
+  Check one step of blocks, got[idx] bytes of them read from each copy,
+  and work out the repairs of each block in the order archivist makes
+  them.
+*/
+static void audit_step(struct audit_worker *worker, const char *rel, off_t step_ofs, const ssize_t got[], int blocks) {
+    struct data_block *block;
+    int correctable[AA_MAX_COPIES];
+    off_t block_ofs;
+    ssize_t avail;
+    int repairing;
+    int source;
+    int first;
+    int idx;
+    int blk;
+    int n;
+
+    repairing = (auditor.mode!=AUDIT_VERIFY);
+    n = 0;
+    for(idx=0; idx<auditor.copies; idx++) {
+        for(blk=0; blk<blocks; blk++) {
+            worker->state[idx][blk] = AUDIT_ABSENT;
+            worker->dirty[idx][blk] = 0;
+            avail = got[idx] - (ssize_t)blk * AA_BLOCK_SIZE;
+            if (avail<=0) {
+                continue;
+            }
+            block = block_at((struct data_block *)worker->buf[idx], blk);
+            if (avail<AA_BLOCK_SIZE) {
+                memset((unsigned char *)block + avail, 0, AA_BLOCK_SIZE - avail);
+            } else {
+                avail = AA_BLOCK_SIZE;
+            }
+            worker->state[idx][blk] = AUDIT_CORRUPT;
+            if (avail==block_stored_size(block)) {
+                worker->check[n] = block;
+                worker->result[n] = &worker->state[idx][blk];
+                n++;
+            }
+        }
+    }
+    blocks_hash_valid(worker->check, n, worker->valid);
+    for(idx=0; idx<n; idx++) {
+        *worker->result[idx] = worker->valid[idx] ? AUDIT_SOUND : AUDIT_CORRUPT;
+    }
+
+    for(blk=0; blk<blocks; blk++) {
+        block_ofs = step_ofs + (off_t)blk * AA_BLOCK_SIZE;
+
+        /* Copies their error correction puts right come first. */
+        for(idx=0; idx<auditor.copies; idx++) {
+            block = block_at((struct data_block *)worker->buf[idx], blk);
+            correctable[idx] = 0;
+            if (worker->state[idx][blk]!=AUDIT_ABSENT) {
+                count(&auditor.totals.blocks, 1);
+            }
+            if (worker->state[idx][blk]==AUDIT_CORRUPT) {
+                count(&auditor.totals.corrupt, 1);
+                correctable[idx] = (fec_correct_block(block)>0);
+                if (correctable[idx]) {
+                    count(&auditor.totals.correctable, 1);
+                    report_finding("corrupt", rel, idx, block_ofs, 1, ", \"correctable\": true");
+                    if (repairing) {
+                        plan_repair(worker, idx, blk, block, &auditor.totals.repaired_fec);
+                    }
+                }
+            }
+        }
+
+        /* Then the other corrupt copies from the first sound one. */
+        source = -1;
+        for(idx=0; (idx<auditor.copies) && (source<0); idx++) {
+            if (worker->state[idx][blk]==AUDIT_SOUND) {
+                source = idx;
+            }
+        }
+        for(idx=0; idx<auditor.copies; idx++) {
+            if ((worker->state[idx][blk]==AUDIT_CORRUPT) && !correctable[idx]) {
+                report_finding("corrupt", rel, idx, block_ofs, source>=0, ", \"correctable\": false");
+                if (repairing && (source>=0)) {
+                    plan_repair(worker, idx, blk, block_at((struct data_block *)worker->buf[source], blk), &auditor.totals.repaired_corrupt);
+                }
+            }
+        }
+
+        /* Sound copies that differ from the primary are replaced by it. */
+        first = -1;
+        for(idx=0; idx<auditor.copies; idx++) {
+            block = block_at((struct data_block *)worker->buf[idx], blk);
+            if (worker->state[idx][blk]!=AUDIT_SOUND) {
+                continue;
+            }
+            if (first<0) {
+                first = idx;
+            } else if (memcmp(block->header.hash, block_at((struct data_block *)worker->buf[first], blk)->header.hash, AA_HASH_SIZE)!=0) {
+                count(&auditor.totals.mismatched, 1);
+                report_finding("mismatch", rel, idx, block_ofs, first==0, ", \"differs_from\": %d", first);
+                if (repairing && (first==0)) {
+                    plan_repair(worker, idx, blk, block_at((struct data_block *)worker->buf[0], blk), &auditor.totals.repaired_mismatched);
+                }
+            }
+        }
+
+        /* And copies that end before the primary are extended from it. */
+        if (repairing && (worker->state[0][blk]==AUDIT_SOUND)) {
+            for(idx=1; idx<auditor.copies; idx++) {
+                if ((worker->state[idx][blk]==AUDIT_ABSENT) && worker->writable[idx]) {
+                    plan_repair(worker, idx, blk, block_at((struct data_block *)worker->buf[0], blk), &auditor.totals.repaired_missing);
+                }
+            }
+        }
+    }
+}
+
+/*
+  Write the blocks of a step marked for repair, each run of adjacent
+  blocks with one call. Only the last block of a file is short, so a run
+  ends there.
+*/
+static void write_repairs(struct audit_worker *worker, const char *rel, off_t step_ofs, int blocks) {
+    off_t run_ofs;
+    size_t bytes;
+    int stored;
+    int err_no;
+    int start;
+    int blk;
+    int idx;
+
+    for(idx=0; idx<auditor.copies; idx++) {
+        blk = 0;
+        while (blk<blocks) {
+            if (!worker->dirty[idx][blk]) {
+                blk++;
+                continue;
+            }
+            start = blk;
+            bytes = 0;
+            do {
+                stored = block_stored_size(block_at((struct data_block *)worker->buf[idx], blk));
+                bytes += (size_t)stored;
+                blk++;
+            } while ((blk<blocks) && worker->dirty[idx][blk] && (stored==AA_BLOCK_SIZE));
+            run_ofs = step_ofs + (off_t)start * AA_BLOCK_SIZE;
+            err_no = pwrite_fully(worker->fd[idx], worker->buf[idx] + (size_t)start * AA_BLOCK_SIZE, bytes, run_ofs);
+            if (err_no!=0) {
+                count(&auditor.totals.unwritable, 1);
+                report_finding("unwritable", rel, idx, run_ofs, 0, ", \"error\": \"%s\"", strerror(err_no));
+                continue;
+            }
+            worker->written[idx] = 1;
+            count(&auditor.totals.bytes_written, bytes);
+        }
+    }
+}
+
+static void audit_chunk(struct audit_worker *worker, const struct audit_job *job) {
+    char fpath[PATH_MAX];
+    ssize_t got[AA_MAX_COPIES];
+    size_t step;
+    off_t ofs;
+    int blocks;
+    int idx;
+
+    for(idx=0; idx<auditor.copies; idx++) {
+        worker->fd[idx] = -1;
+        worker->written[idx] = 0;
+        errno = ENAMETOOLONG;
+        if (backing_path(fpath, idx, job->rel)==0) {
+            worker->fd[idx] = open(fpath, (auditor.mode==AUDIT_REPAIR) ? O_RDWR : O_RDONLY);
+        }
+        worker->writable[idx] = (worker->fd[idx]>=0) || ((auditor.mode==AUDIT_DRY_RUN) && (errno==ENOENT));
+        if ((worker->fd[idx]<0) && (errno!=ENOENT)) {
+            count(&auditor.totals.unreadable, 1);
+            report_finding("unreadable", job->rel, idx, job->start, 0, ", \"error\": \"%s\"", strerror(errno));
+        }
+    }
+
+    for(ofs=job->start; ofs<job->end; ofs+=(off_t)step) {
+        step = ((job->end - ofs)<AA_AUDIT_STEP) ? (size_t)(job->end - ofs) : AA_AUDIT_STEP;
+        for(idx=0; idx<auditor.copies; idx++) {
+            got[idx] = 0;
+            if (worker->fd[idx]<0) {
+                continue;
+            }
+            got[idx] = pread_fully(worker->fd[idx], worker->buf[idx], step, ofs);
+            if (got[idx]<0) {
+                count(&auditor.totals.unreadable, 1);
+                report_finding("unreadable", job->rel, idx, ofs, 0, ", \"error\": \"%s\"", strerror(errno));
+                close(worker->fd[idx]);
+                worker->fd[idx] = -1;
+                worker->writable[idx] = 0;
+                got[idx] = 0;
+            }
+            count(&auditor.totals.bytes, (uint64_t)got[idx]);
+        }
+        blocks = (int)((step + AA_BLOCK_SIZE - 1) / AA_BLOCK_SIZE);
+        audit_step(worker, job->rel, ofs, got, blocks);
+        if (auditor.mode==AUDIT_REPAIR) {
+            write_repairs(worker, job->rel, ofs, blocks);
+        }
+    }
+
+    for(idx=0; idx<auditor.copies; idx++) {
+        if (worker->fd[idx]<0) {
+            continue;
+        }
+        if (worker->written[idx] && (fdatasync(worker->fd[idx])!=0)) {
+            count(&auditor.totals.unwritable, 1);
+            report_finding("unwritable", job->rel, idx, job->start, 0, ", \"error\": \"%s\"", strerror(errno));
+        }
+        close(worker->fd[idx]);
+    }
+}
+
+static void *audit_thread(void *arg) {
+    struct audit_worker *worker;
+    struct audit_job job;
+
+    worker = arg;
+    while (1) {
+        pthread_mutex_lock(&auditor.mutex);
+        while ((auditor.queued==0) && !auditor.walked) {
+            pthread_cond_wait(&auditor.changed, &auditor.mutex);
+        }
+        if (auditor.queued==0) {
+            pthread_mutex_unlock(&auditor.mutex);
+            break;
+        }
+        job = auditor.queue[auditor.head];
+        auditor.head = (auditor.head + 1) % AA_AUDIT_QUEUE;
+        auditor.queued--;
+        pthread_cond_broadcast(&auditor.changed);
+        pthread_mutex_unlock(&auditor.mutex);
+        audit_chunk(worker, &job);
+    }
+    return NULL;
+}
+
+static void queue_job(const char *rel, off_t start, off_t end) {
+    struct audit_job *job;
+
+    pthread_mutex_lock(&auditor.mutex);
+    while (auditor.queued==AA_AUDIT_QUEUE) {
+        pthread_cond_wait(&auditor.changed, &auditor.mutex);
+    }
+    job = &auditor.queue[(auditor.head + auditor.queued) % AA_AUDIT_QUEUE];
+    strcpy(job->rel, rel);
+    job->start = start;
+    job->end = end;
+    auditor.queued++;
+    pthread_cond_broadcast(&auditor.changed);
+    pthread_mutex_unlock(&auditor.mutex);
+}
+
+/*
+  Remember to give copy idx of rel the permissions and times of the
+  primary once the repair has written everything, as writing its blocks
+  or creating the entries below it changes the times, and permissions
+  that keep the owner out would stop them being written.
+*/
+static void note_stamp(const char *rel, int idx, mode_t perm, const struct timespec times[2]) {
+    struct audit_stamp *grown;
+
+    if (auditor.stamps==auditor.stamp_room) {
+        grown = realloc(auditor.stamp, (size_t)(auditor.stamp_room + 256) * sizeof(struct audit_stamp));
+        if (grown==NULL) {
+            fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+            return;
+        }
+        auditor.stamp = grown;
+        auditor.stamp_room += 256;
+    }
+    auditor.stamp[auditor.stamps].rel = strdup(rel);
+    if (auditor.stamp[auditor.stamps].rel==NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        return;
+    }
+    auditor.stamp[auditor.stamps].copy = idx;
+    auditor.stamp[auditor.stamps].perm = perm;
+    auditor.stamp[auditor.stamps].times[0] = times[0];
+    auditor.stamp[auditor.stamps].times[1] = times[1];
+    auditor.stamps++;
+}
+
+/*
+  Give every copy the repair created the permissions and times of its
+  primary, the deepest first, and forget them.
+*/
+static void apply_stamps(void) {
+    char fpath[PATH_MAX];
+    int err_no;
+    int idx;
+
+    for(idx=auditor.stamps-1; idx>=0; idx--) {
+        err_no = backing_path(fpath, auditor.stamp[idx].copy, auditor.stamp[idx].rel);
+        if ((err_no==0) && (chmod(fpath, auditor.stamp[idx].perm)!=0)) {
+            err_no = errno;
+        }
+        if ((err_no==0) && (utimensat(AT_FDCWD, fpath, auditor.stamp[idx].times, AT_SYMLINK_NOFOLLOW)!=0)) {
+            err_no = errno;
+        }
+        if (err_no!=0) {
+            count(&auditor.totals.unwritable, 1);
+            report_finding("unwritable", auditor.stamp[idx].rel, auditor.stamp[idx].copy, -1, 0, ", \"error\": \"%s\"", strerror(err_no));
+        }
+        free(auditor.stamp[idx].rel);
+    }
+    free(auditor.stamp);
+    auditor.stamp = NULL;
+    auditor.stamps = 0;
+    auditor.stamp_room = 0;
+}
+
+/*
+  Create copy idx of the file or directory rel, which the primary has
+  with the permissions perm and the access and modification times
+  times. It is created open to its owner, whatever the umask, and given
+  perm at the end. Returns 1 once it is created, or would be in a dry
+  run. Nothing is reported when it fails because its directory is gone
+  as well.
+*/
+static int create_copy(const char *rel, int idx, mode_t kind, mode_t perm, const struct timespec times[2], int gone) {
+    char fpath[PATH_MAX];
+    int err_no;
+    int fd;
+
+    if (auditor.mode==AUDIT_DRY_RUN) {
+        count(&auditor.totals.repaired_entries, 1);
+        return 1;
+    }
+    err_no = backing_path(fpath, idx, rel);
+    if ((err_no==0) && (kind==S_IFDIR) && (mkdir(fpath, perm | S_IRWXU)!=0)) {
+        err_no = errno;
+    } else if ((err_no==0) && (kind==S_IFREG)) {
+        fd = open(fpath, O_CREAT | O_EXCL | O_WRONLY, perm | S_IRUSR | S_IWUSR);
+        if (fd<0) {
+            err_no = errno;
+        } else {
+            close(fd);
+        }
+    }
+    if (err_no!=0) {
+        if (!gone || (err_no!=ENOENT)) {
+            count(&auditor.totals.unwritable, 1);
+            report_finding("unwritable", rel, idx, -1, 0, ", \"error\": \"%s\"", strerror(err_no));
+        }
+        return 0;
+    }
+    note_stamp(rel, idx, perm, times);
+    count(&auditor.totals.repaired_entries, 1);
+    return 1;
+}
+
+/*
+  Report the copies a file is missing from, unless its directory is, and
+  the copies shorter than the longest, then queue its chunks. When
+  repairing, the copies missing from the primary are created first, to
+  be given its times once their blocks are written.
+*/
+static void audit_file(const char *rel, const int present[], const off_t size[], const mode_t perm[], const struct timespec times[2], const int gone[]) {
+    off_t longest;
+    off_t start;
+    int repaired;
+    int idx;
+
+    count(&auditor.totals.files, 1);
+    longest = 0;
+    for(idx=0; idx<auditor.copies; idx++) {
+        if (present[idx] && (size[idx]>longest)) {
+            longest = size[idx];
+        }
+    }
+    for(idx=0; idx<auditor.copies; idx++) {
+        if (!present[idx]) {
+            repaired = (auditor.mode!=AUDIT_VERIFY) && (idx>0) && present[0] && create_copy(rel, idx, S_IFREG, perm[0], times, gone[idx]);
+            if (!gone[idx]) {
+                count(&auditor.totals.missing_entries, 1);
+                report_finding("missing_file", rel, idx, -1, repaired, NULL);
+            }
+        } else if (size[idx]<longest) {
+            count(&auditor.totals.missing_tails, 1);
+            report_finding("missing_tail", rel, idx, size[idx], (idx>0) && present[0] && (size[0]==longest), ", \"bytes\": %lld", (long long)(longest - size[idx]));
+        }
+    }
+    for(start=0; start<longest; start+=AA_AUDIT_CHUNK) {
+        queue_job(rel, start, (longest - start<AA_AUDIT_CHUNK) ? longest : start + AA_AUDIT_CHUNK);
+    }
+}
+
+static int select_data_entry(const struct dirent *entry) {
+    size_t len;
+    len = strlen(entry->d_name);
+    return len>1 && entry->d_name[len-1]=='@';
+}
+
+static int compare_names(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+  Walk everything below the backing directory rel, merging the listings
+  of all copies so an entry missing from some copies is still checked.
+  gone marks the copies rel is already reported missing from.
+*/
+static void audit_dir(const char *rel, const int gone[]) {
+    struct dirent **list[AA_MAX_COPIES];
+    int entries[AA_MAX_COPIES];
+    int next[AA_MAX_COPIES];
+    int present[AA_MAX_COPIES];
+    int absent[AA_MAX_COPIES];
+    off_t size[AA_MAX_COPIES];
+    mode_t perm[AA_MAX_COPIES];
+    struct timespec times[2];
+    char fpath[PATH_MAX];
+    char child[PATH_MAX];
+    char entry[NAME_MAX + 1];
+    const char *name;
+    struct stat statbuf;
+    mode_t kind;
+    int repaired;
+    int idx;
+
+    count(&auditor.totals.directories, 1);
+    for(idx=0; idx<auditor.copies; idx++) {
+        list[idx] = NULL;
+        entries[idx] = 0;
+        next[idx] = 0;
+        if (backing_path(fpath, idx, rel)==0) {
+            entries[idx] = scandir(fpath, &list[idx], select_data_entry, compare_names);
+            if ((entries[idx]<0) && (errno!=ENOENT) && !gone[idx]) {
+                count(&auditor.totals.unreadable, 1);
+                report_finding("unreadable", rel, idx, -1, 0, ", \"error\": \"%s\"", strerror(errno));
+            }
+            if (entries[idx]<0) {
+                entries[idx] = 0;
+            }
+        }
+    }
+
+    while (1) {
+        name = NULL;
+        for(idx=0; idx<auditor.copies; idx++) {
+            if (next[idx]<entries[idx] && (name==NULL || strcmp(list[idx][next[idx]]->d_name, name)<0)) {
+                name = list[idx][next[idx]]->d_name;
+            }
+        }
+        if (name==NULL) {
+            break;
+        }
+        strcpy(entry, name);
+
+        if (snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0]?"/":"", entry)<PATH_MAX) {
+            kind = 0;
+            memset(times, 0, sizeof(times));
+            for(idx=0; idx<auditor.copies; idx++) {
+                present[idx] = 0;
+                size[idx] = 0;
+                perm[idx] = 0;
+                if ((backing_path(fpath, idx, child)==0) && (lstat(fpath, &statbuf)==0)) {
+                    if (kind==0) {
+                        kind = statbuf.st_mode & S_IFMT;
+                    }
+                    present[idx] = ((statbuf.st_mode & S_IFMT)==kind);
+                    size[idx] = statbuf.st_size;
+                    perm[idx] = statbuf.st_mode & 07777;
+                    if (idx==0) {
+                        times[0] = statbuf.st_atim;
+                        times[1] = statbuf.st_mtim;
+                    }
+                }
+            }
+            if (kind==S_IFDIR) {
+                for(idx=0; idx<auditor.copies; idx++) {
+                    repaired = 0;
+                    if (!present[idx] && (auditor.mode!=AUDIT_VERIFY) && (idx>0) && present[0]) {
+                        repaired = create_copy(child, idx, S_IFDIR, perm[0], times, gone[idx]);
+                    }
+                    if (!present[idx] && !gone[idx]) {
+                        count(&auditor.totals.missing_entries, 1);
+                        report_finding("missing_directory", child, idx, -1, repaired, NULL);
+                    }
+                    absent[idx] = !present[idx];
+                }
+                audit_dir(child, absent);
+            } else if (kind==S_IFREG) {
+                audit_file(child, present, size, perm, times, gone);
+            }
+        }
+
+        for(idx=0; idx<auditor.copies; idx++) {
+            if (next[idx]<entries[idx] && strcmp(list[idx][next[idx]]->d_name, entry)==0) {
+                free(list[idx][next[idx]]);
+                next[idx]++;
+            }
+        }
+    }
+
+    for(idx=0; idx<auditor.copies; idx++) {
+        while (next[idx]<entries[idx]) {
+            free(list[idx][next[idx]++]);
+        }
+        free(list[idx]);
+    }
+}
+
+/*
+  Take the geometry from the storage locations, which must agree and be
+  of a mirrored archive with a location for every copy. Locations without
+  a geometry file hold 512 byte blocks in two copies.
+*/
+static int audit_geometry(char *const root_dir[], int roots, struct archive_geometry *geometry) {
+    struct archive_geometry recorded;
+    int err_no;
+    int idx;
+
+    for(idx=0; idx<roots; idx++) {
+        err_no = load_geometry(root_dir[idx], &recorded);
+        if (err_no==ENOENT) {
+            recorded.block_size = AA_DEFAULT_BLOCK_SIZE;
+            recorded.fec = 0;
+            layout_by_name("mirror", &recorded.layout);
+        } else if (err_no!=0) {
+            fprintf(stderr, "Error %d (%s) , Invalid geometry in %s\n", err_no, strerror(err_no), root_dir[idx]);
+            return err_no;
+        }
+        if ((idx>0) && ((recorded.block_size!=geometry->block_size) || (recorded.fec!=geometry->fec) || !same_layout(&recorded.layout, &geometry->layout))) {
+            fprintf(stderr, "Error %d (%s) , Geometry of %s does not match %s\n", EINVAL, strerror(EINVAL), root_dir[idx], root_dir[0]);
+            return EINVAL;
+        }
+        *geometry = recorded;
+    }
+    if (geometry->layout.mode!=AA_LAYOUT_MIRROR) {
+        fprintf(stderr, "Error %d (%s) , Only mirrored archives can be verified or repaired, erasure coded ones are checked by the scrubber\n", EINVAL, strerror(EINVAL));
+        return EINVAL;
+    }
+    if (geometry->layout.roots!=roots) {
+        fprintf(stderr, "Error %d (%s) , The archive has %d copies but %d storage locations were given\n", EINVAL, strerror(EINVAL), geometry->layout.roots, roots);
+        return EINVAL;
+    }
+    return 0;
+}
+
+static double elapsed(const struct timespec *since, const struct timespec *now) {
+    return (double)(now->tv_sec - since->tv_sec) + (double)(now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+  Check every block of every copy of a mirrored archive with threads
+  workers, repairing what is found in the given mode, and write the
+  report to report.
+*/
+static int audit_archive(char *const root_dir[], int roots, int threads, int mode, FILE *report) {
+    struct archive_geometry geometry;
+    struct audit_worker *worker;
+    struct audit_totals *totals;
+    struct timespec started;
+    struct timespec now;
+    int gone[AA_MAX_COPIES];
+    char name[32];
+    double seconds;
+    int idx;
+    int copy;
+
+    if (audit_geometry(root_dir, roots, &geometry)!=0) {
+        return -1;
+    }
+    set_block_size(geometry.block_size);
+    set_fec(geometry.fec);
+    set_layout(&geometry.layout);
+
+    auditor.copies = roots;
+    auditor.mode = mode;
+    auditor.report = report;
+    for(idx=0; idx<roots; idx++) {
+        if (snprintf(auditor.root_dir[idx], PATH_MAX, "%s", root_dir[idx])>=PATH_MAX) {
+            fprintf(stderr, "Error %d (%s) , Path too long %s\n", ENAMETOOLONG, strerror(ENAMETOOLONG), root_dir[idx]);
+            return -1;
+        }
+    }
+
+    worker = calloc((size_t)threads, sizeof(struct audit_worker));
+    if (worker==NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        return -1;
+    }
+    for(idx=0; idx<threads; idx++) {
+        for(copy=0; copy<roots; copy++) {
+            worker[idx].buf[copy] = malloc(AA_AUDIT_STEP);
+            if (worker[idx].buf[copy]==NULL) {
+                fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+                return -1;
+            }
+        }
+    }
+
+    layout_name(&geometry.layout, name, sizeof(name));
+    fprintf(report, "{\n  \"archive\": {\"roots\": [");
+    for(idx=0; idx<roots; idx++) {
+        fprintf(report, "%s", (idx>0) ? ", " : "");
+        json_string(report, root_dir[idx], 0);
+    }
+    fprintf(report, "], \"layout\": \"%s\", \"block_size\": %d, \"fec\": %s", name, AA_BLOCK_SIZE, archive_fec ? "true" : "false");
+    if (mode!=AUDIT_VERIFY) {
+        fprintf(report, ", \"dry_run\": %s", (mode==AUDIT_DRY_RUN) ? "true" : "false");
+    }
+    fprintf(report, "},\n  \"findings\": [");
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for(idx=0; idx<threads; idx++) {
+        if (pthread_create(&worker[idx].thread, NULL, audit_thread, &worker[idx])!=0) {
+            fprintf(stderr, "Error %d (%s) , Failed to start threads\n", errno, strerror(errno));
+            return -1;
+        }
+    }
+    memset(gone, 0, sizeof(gone));
+    audit_dir("", gone);
+    pthread_mutex_lock(&auditor.mutex);
+    auditor.walked = 1;
+    pthread_cond_broadcast(&auditor.changed);
+    pthread_mutex_unlock(&auditor.mutex);
+    for(idx=0; idx<threads; idx++) {
+        pthread_join(worker[idx].thread, NULL);
+    }
+    apply_stamps();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = elapsed(&started, &now);
+
+    totals = &auditor.totals;
+    fprintf(report, "%s],\n  \"summary\": {\"files\": %lu, \"directories\": %lu, \"blocks\": %lu, \"bytes\": %lu, "
+                    "\"corrupt\": %lu, \"correctable\": %lu, \"mismatched\": %lu, \"missing_tails\": %lu, "
+                    "\"missing_entries\": %lu, \"unreadable\": %lu, ",
+            (auditor.findings>0) ? "\n  " : "", totals->files, totals->directories, totals->blocks, totals->bytes,
+            totals->corrupt, totals->correctable, totals->mismatched, totals->missing_tails,
+            totals->missing_entries, totals->unreadable);
+    if (mode!=AUDIT_VERIFY) {
+        fprintf(report, "\"unwritable\": %lu, \"repaired\": {\"fec\": %lu, \"corrupt\": %lu, \"mismatched\": %lu, "
+                        "\"missing\": %lu, \"entries\": %lu}, \"bytes_written\": %lu, \"unrepaired\": %lu, ",
+                totals->unwritable, totals->repaired_fec, totals->repaired_corrupt, totals->repaired_mismatched,
+                totals->repaired_missing, totals->repaired_entries, totals->bytes_written, totals->unrepaired);
+    }
+    fprintf(report, "\"seconds\": %.3f, \"bytes_per_second\": %.0f}\n}\n", seconds, (seconds>0) ? (double)totals->bytes / seconds : 0.0);
+    fflush(report);
+
+    if (mode==AUDIT_VERIFY) {
+        fprintf(stderr, "Verification of %lu blocks in %lu files of %d copies found %lu problems\n",
+                totals->blocks, totals->files, roots, auditor.findings);
+    } else {
+        fprintf(stderr, "Repair of %lu blocks in %lu files of %d copies found %lu problems, %s %lu blocks and %lu entries, %lu left\n",
+                totals->blocks, totals->files, roots, auditor.findings, (mode==AUDIT_DRY_RUN) ? "would repair" : "repaired",
+                totals->repaired_fec + totals->repaired_corrupt + totals->repaired_mismatched + totals->repaired_missing,
+                totals->repaired_entries, totals->unrepaired);
+    }
+    for(idx=0; idx<threads; idx++) {
+        for(copy=0; copy<roots; copy++) {
+            free(worker[idx].buf[copy]);
+        }
+    }
+    free(worker);
+    if (mode==AUDIT_VERIFY) {
+        return (auditor.findings>0) ? 1 : 0;
+    }
+    return (totals->unrepaired>0) ? 1 : 0;
+}
+
+/*
+  Verify every block of every copy of a mirrored archive with threads
+  workers, writing the report to report. Returns 0 when nothing was
+  found, 1 when something was and -1 when the archive could not be
+  verified at all.
+*/
+int verify_archive(char *const root_dir[], int roots, int threads, FILE *report) {
+    return audit_archive(root_dir, roots, threads, AUDIT_VERIFY, report);
+}
+
+/*
+  Verify a mirrored archive as verify_archive does and repair what is
+  found, or only report what would be repaired when dry_run is set. The
+  archive must not be mounted. Returns 0 when everything found is
+  repaired, 1 when something is left, which in a dry run is anything
+  found at all, and -1 when the archive could not be checked at all.
+*/
+int repair_archive(char *const root_dir[], int roots, int threads, int dry_run, FILE *report) {
+    return audit_archive(root_dir, roots, threads, dry_run ? AUDIT_DRY_RUN : AUDIT_REPAIR, report);
+}
@@ -0,0 +1,437 @@
+/*
+  Microbenchmarks of the block engine
+
+  archivist-bench times the hashing kernels, the encode and decode loops
+  of the tools, and read_block, read_blocks and write_block against two
+  copies in a scratch directory, by default on tmpfs so the disks do not
+  hide the cost of the code. The repair cases damage every block of the
+  second copy before each run and time the reads that put it right.
+
+  Each case is run --repeat times and the fastest run is reported, one
+  line per case in fixed columns, as the nanoseconds per block and the
+  rate at which block data is processed in GB/s, so two runs can be
+  compared line by line.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "blocks.h"
+#include "hash.h"
+#include "sha1.h"
+#include "logs.h"
+#include "cache.h"
+#include "io.h"
+
+#define BENCH_DEFAULT_BLOCKS 16384
+#define BENCH_DEFAULT_REPEAT 5
+#define BENCH_BATCH_BYTES (1024 * 1024)
+#define BENCH_READ_SPAN 32
+
+static struct bench {
+    char dir[PATH_MAX];
+    char fpath[AA_MAX_COPIES][PATH_MAX];
+    int blocks;
+    int repeat;
+    unsigned char *data;
+    unsigned char *encoded;
+    unsigned char *variant;
+    struct data_block *span;
+    struct file_entry file_entry;
+} bench;
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void report(const char *name, uint64_t ns) {
+    double per_block;
+    double rate;
+
+    per_block = (double)ns / bench.blocks;
+    rate = (ns>0) ? (double)bench.blocks * AA_DATA_SIZE / (double)ns : 0.0;
+    printf("%-28s %12.1f %10.3f\n", name, per_block, rate);
+    fflush(stdout);
+}
+
+static void fail(int err_no, const char *action) {
+    fprintf(stderr, "Error %d (%s) , %s\n", err_no, strerror(err_no), action);
+    exit(1);
+}
+
+/* Put copy idx back to size bytes of buf before a run. */
+static void restore_copy(int idx, const unsigned char *buf, size_t size) {
+    int fd;
+
+    fd = bench.file_entry.file[idx].fd;
+    if ((ftruncate(fd, 0)!=0) || ((size>0) && (pwrite(fd, buf, size, 0)!=(ssize_t)size))) {
+        fail(errno, "Failed to restore a copy");
+    }
+}
+
+/* SHA-1 of one block at a time, as hash_step sees it, on each kernel. */
+static void bench_sha1(void) {
+    const unsigned char *data[AA_HASH_LANES];
+    unsigned char *md[AA_HASH_LANES];
+    unsigned char digest[AA_HASH_LANES][AA_HASH_SIZE];
+    const int engines[] = { AA_HASH_PORTABLE, AA_HASH_SHANI, AA_HASH_AVX2, AA_HASH_SHANI | AA_HASH_AVX2 };
+    struct data_block *block;
+    char name[64];
+    uint64_t best;
+    uint64_t start;
+    uint64_t ns;
+    int chosen;
+    int engine;
+    int run;
+    int blk;
+    int n;
+
+    chosen = hash_engine();
+    for(engine=0; engine<(int)(sizeof(engines) / sizeof(engines[0])); engine++) {
+        if (hash_select(engines[engine])!=0) {
+            continue;
+        }
+        best = 0;
+        for(run=0; run<bench.repeat; run++) {
+            start = now_ns();
+            for(blk=0; blk<bench.blocks; blk++) {
+                block = block_at((struct data_block *)bench.encoded, blk);
+                SHA1(block->header.seed, AA_HASHED_SIZE, digest[0]);
+            }
+            ns = now_ns() - start;
+            best = ((run==0) || (ns<best)) ? ns : best;
+        }
+        snprintf(name, sizeof(name), "sha1.%s", hash_engine_name(engines[engine]));
+        report(name, best);
+
+        best = 0;
+        for(run=0; run<bench.repeat; run++) {
+            start = now_ns();
+            for(blk=0; blk<bench.blocks; blk+=AA_HASH_LANES) {
+                for(n=0; (n<AA_HASH_LANES) && (blk + n<bench.blocks); n++) {
+                    data[n] = block_at((struct data_block *)bench.encoded, blk + n)->header.seed;
+                    md[n] = digest[n];
+                }
+                SHA1_many(data, AA_HASHED_SIZE, md, n);
+            }
+            ns = now_ns() - start;
+            best = ((run==0) || (ns<best)) ? ns : best;
+        }
+        snprintf(name, sizeof(name), "sha1_many.%s", hash_engine_name(engines[engine]));
+        report(name, best);
+    }
+    hash_select(chosen);
+}
+
+/*
+  The loops of archivist-encode and archivist-decode over batches of a
+  megabyte of blocks, decode checking each batch's hashes together before
+  copying the data out.
+*/
+static void bench_codec(const char *label) {
+    const struct data_block *check[BENCH_BATCH_BYTES / AA_MIN_BLOCK_SIZE];
+    int valid[BENCH_BATCH_BYTES / AA_MIN_BLOCK_SIZE];
+    char name[64];
+    int per_batch;
+    uint64_t best;
+    uint64_t start;
+    uint64_t ns;
+    ssize_t len;
+    size_t count;
+    int run;
+    int blk;
+    int idx;
+
+    per_batch = BENCH_BATCH_BYTES / AA_BLOCK_SIZE;
+    best = 0;
+    for(run=0; run<bench.repeat; run++) {
+        start = now_ns();
+        for(blk=0; blk<bench.blocks; blk+=per_batch) {
+            count = (size_t)((bench.blocks - blk<per_batch) ? bench.blocks - blk : per_batch);
+            len = encode_blocks(bench.data + (size_t)blk * AA_DATA_SIZE, count * AA_DATA_SIZE, block_at((struct data_block *)bench.encoded, blk));
+            if (len<0) {
+                fail(EAGAIN, "Failed to initialise seeds");
+            }
+        }
+        ns = now_ns() - start;
+        best = ((run==0) || (ns<best)) ? ns : best;
+    }
+    snprintf(name, sizeof(name), "encode.%s", label);
+    report(name, best);
+
+    best = 0;
+    for(run=0; run<bench.repeat; run++) {
+        start = now_ns();
+        for(blk=0; blk<bench.blocks; blk+=per_batch) {
+            count = (size_t)((bench.blocks - blk<per_batch) ? bench.blocks - blk : per_batch);
+            for(idx=0; idx<(int)count; idx++) {
+                check[idx] = block_at((struct data_block *)bench.encoded, blk + idx);
+            }
+            blocks_hash_valid(check, (int)count, valid);
+            for(idx=0; idx<(int)count; idx++) {
+                if (!valid[idx]) {
+                    fail(EIO, "Invalid block hash in the decode benchmark");
+                }
+                memcpy(bench.variant + (size_t)(blk + idx) * AA_DATA_SIZE, check[idx]->data, AA_DATA_SIZE);
+            }
+        }
+        ns = now_ns() - start;
+        best = ((run==0) || (ns<best)) ? ns : best;
+    }
+    snprintf(name, sizeof(name), "decode.%s", label);
+    report(name, best);
+}
+
+static void bench_write_block(void) {
+    struct block_set blocks;
+    uint64_t best;
+    uint64_t start;
+    uint64_t ns;
+    int run;
+    int blk;
+    int idx;
+    int rc;
+
+    best = 0;
+    for(run=0; run<bench.repeat; run++) {
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            restore_copy(idx, NULL, 0);
+        }
+        start = now_ns();
+        for(blk=0; blk<bench.blocks; blk++) {
+            for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+                memcpy(&blocks.copy[idx].block, block_at((struct data_block *)bench.encoded, blk), AA_BLOCK_SIZE);
+            }
+            rc = write_block(&bench.file_entry, (off_t)blk * AA_BLOCK_SIZE, &blocks);
+            if (rc!=0) {
+                fail(rc, "write_block failed");
+            }
+        }
+        ns = now_ns() - start;
+        best = ((run==0) || (ns<best)) ? ns : best;
+    }
+    report("write_block", best);
+}
+
+/* Read every block once with read_block, which repairs what it finds. */
+static uint64_t read_all_blocks(void) {
+    struct block_set blocks;
+    uint64_t start;
+    int blk;
+    int rc;
+
+    start = now_ns();
+    for(blk=0; blk<bench.blocks; blk++) {
+        rc = read_block(&bench.file_entry, (off_t)blk * AA_BLOCK_SIZE, &blocks);
+        if (rc!=0) {
+            fail(rc, "read_block failed");
+        }
+    }
+    return now_ns() - start;
+}
+
+static void bench_read_block(void) {
+    uint64_t best;
+    uint64_t start;
+    uint64_t ns;
+    int got;
+    int run;
+    int blk;
+    int rc;
+
+    best = 0;
+    for(run=0; run<bench.repeat; run++) {
+        ns = read_all_blocks();
+        best = ((run==0) || (ns<best)) ? ns : best;
+    }
+    report("read_block", best);
+
+    best = 0;
+    for(run=0; run<bench.repeat; run++) {
+        start = now_ns();
+        for(blk=0; blk<bench.blocks; blk+=BENCH_READ_SPAN) {
+            rc = read_blocks(&bench.file_entry, (off_t)blk * AA_BLOCK_SIZE, bench.span, (bench.blocks - blk<BENCH_READ_SPAN) ? bench.blocks - blk : BENCH_READ_SPAN, &got);
+            if (rc!=0) {
+                fail(rc, "read_blocks failed");
+            }
+        }
+        ns = now_ns() - start;
+        best = ((run==0) || (ns<best)) ? ns : best;
+    }
+    report("read_blocks", best);
+}
+
+/*
+  Time read_block putting right a second copy damaged in every block:
+  corrupted by a flipped data byte, replaced by the same data under other
+  seeds, so its blocks are sound but differ, or missing altogether.
+*/
+static void bench_repair(void) {
+    const char *name[] = { "repair.corrupt", "repair.mismatched", "repair.missing" };
+    size_t size;
+    uint64_t best;
+    uint64_t ns;
+    int kind;
+    int run;
+    int blk;
+
+    size = (size_t)bench.blocks * AA_BLOCK_SIZE;
+    for(kind=0; kind<3; kind++) {
+        if (kind==0) {
+            if (pread(bench.file_entry.file[0].fd, bench.variant, size, 0)!=(ssize_t)size) {
+                fail(EIO, "Failed to read the primary copy");
+            }
+            for(blk=0; blk<bench.blocks; blk++) {
+                block_at((struct data_block *)bench.variant, blk)->data[1] ^= 0x01;
+            }
+        } else if (kind==1) {
+            if (encode_blocks(bench.data, (size_t)bench.blocks * AA_DATA_SIZE, (struct data_block *)bench.variant)<0) {
+                fail(EAGAIN, "Failed to initialise seeds");
+            }
+        }
+        best = 0;
+        for(run=0; run<bench.repeat; run++) {
+            restore_copy(1, bench.variant, (kind==2) ? 0 : size);
+            ns = read_all_blocks();
+            best = ((run==0) || (ns<best)) ? ns : best;
+        }
+        report(name[kind], best);
+    }
+}
+
+static void open_copies(void) {
+    struct stat statbuf;
+    int idx;
+
+    memset(&bench.file_entry, 0, sizeof(bench.file_entry));
+    pthread_mutex_init(&bench.file_entry.lock, NULL);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (snprintf(bench.fpath[idx], PATH_MAX, "%s/archivist-bench.%d.%d", bench.dir, (int)getpid(), idx)>=PATH_MAX) {
+            fail(ENAMETOOLONG, "Path too long");
+        }
+        bench.file_entry.file[idx].fd = open(bench.fpath[idx], O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (bench.file_entry.file[idx].fd<0) {
+            fprintf(stderr, "Error %d (%s) , Failed to open %s\n", errno, strerror(errno), bench.fpath[idx]);
+            exit(1);
+        }
+    }
+    fstat(bench.file_entry.file[0].fd, &statbuf);
+    bench.file_entry.dev = statbuf.st_dev;
+    bench.file_entry.ino = statbuf.st_ino;
+}
+
+static void close_copies(void) {
+    int idx;
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        close(bench.file_entry.file[idx].fd);
+        unlink(bench.fpath[idx]);
+    }
+}
+
+static void *allocate(size_t size) {
+    void *buf;
+
+    if (posix_memalign(&buf, 4096, size)!=0) {
+        fail(ENOMEM, "Memory allocation failed");
+    }
+    return buf;
+}
+
+int main(int argc, char* argv[]) {
+    char fpath_log[PATH_MAX + 32];
+    struct stat statbuf;
+    const char *io_engine;
+    int hash_type;
+    int block_size;
+    size_t idx;
+
+    io_engine = "uring";
+    hash_type = AA_HASH_DEFAULT_TYPE;
+    bench.blocks = BENCH_DEFAULT_BLOCKS;
+    bench.repeat = BENCH_DEFAULT_REPEAT;
+    strcpy(bench.dir, (stat("/dev/shm", &statbuf)==0) ? "/dev/shm" : "/tmp");
+    while ((argc > 1) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--dir=", 6)) {
+            snprintf(bench.dir, sizeof(bench.dir), "%s", argv[1] + 6);
+        } else if (!strncmp(argv[1], "--blocks=", 9)) {
+            bench.blocks = atoi(argv[1] + 9);
+        } else if (!strncmp(argv[1], "--repeat=", 9)) {
+            bench.repeat = atoi(argv[1] + 9);
+        } else if (!strncmp(argv[1], "--block-size=", 13)) {
+            block_size = atoi(argv[1] + 13);
+            if (!block_size_valid(block_size)) {
+                fprintf(stderr, "Error %d (%s) , Invalid block size %s\n", EINVAL, strerror(EINVAL), argv[1] + 13);
+                exit(1);
+            }
+            set_block_size(block_size);
+        } else if (!strcmp(argv[1], "--fec")) {
+            set_fec(1);
+        } else if (!strncmp(argv[1], "--hash=", 7)) {
+            hash_type = hash_type_by_name(argv[1] + 7);
+            if (hash_type<0) {
+                fprintf(stderr, "Error %d (%s) , Unknown hash %s\n", EINVAL, strerror(EINVAL), argv[1] + 7);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--io-engine=", 12)) {
+            io_engine = argv[1] + 12;
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
+    if ((argc!=1) || (bench.blocks<1) || (bench.repeat<1)) {
+        fprintf(stderr, "Error %d (%s) , Invalid arguments\n", EINVAL, strerror(EINVAL));
+        exit(1);
+    }
+
+    snprintf(fpath_log, sizeof(fpath_log), "%s/archivist-bench.log", bench.dir);
+    init_logging(fpath_log, AA_LOG_ERROR, 0);
+    init_block_cache(0);
+    if (init_io_engine(io_engine)!=0) {
+        fprintf(stderr, "Error %d (%s) , Unknown I/O engine %s\n", EINVAL, strerror(EINVAL), io_engine);
+        exit(1);
+    }
+    set_read_policy(AA_READ_ALL);
+
+    bench.data = allocate((size_t)bench.blocks * AA_DATA_SIZE);
+    bench.encoded = allocate((size_t)bench.blocks * AA_BLOCK_SIZE);
+    bench.variant = allocate((size_t)bench.blocks * AA_BLOCK_SIZE);
+    bench.span = allocate((size_t)BENCH_READ_SPAN * AA_BLOCK_SIZE);
+    srand(1);
+    for(idx=0; idx<(size_t)bench.blocks * AA_DATA_SIZE; idx++) {
+        bench.data[idx] = (unsigned char)rand();
+    }
+
+    printf("# archivist-bench block_size=%d fec=%s hash=%s hash_engine=%s io_engine=%s blocks=%d repeat=%d dir=%s\n",
+           AA_BLOCK_SIZE, archive_fec ? "on" : "off", hash_type_name(hash_type), hash_engine_name(hash_engine()),
+           io_engine_name(), bench.blocks, bench.repeat, bench.dir);
+    printf("# %-26s %12s %10s\n", "case", "ns/block", "GB/s");
+
+    set_hash_type(AA_HASH_TYPE_XXH3);
+    bench_codec(hash_type_name(AA_HASH_TYPE_XXH3));
+    set_hash_type(AA_HASH_TYPE_SHA1);
+    bench_codec(hash_type_name(AA_HASH_TYPE_SHA1));
+    bench_sha1();
+
+    set_hash_type(hash_type);
+    if (encode_blocks(bench.data, (size_t)bench.blocks * AA_DATA_SIZE, (struct data_block *)bench.encoded)<0) {
+        fail(EAGAIN, "Failed to initialise seeds");
+    }
+    open_copies();
+    bench_write_block();
+    bench_read_block();
+    bench_repair();
+    close_copies();
+    unlink(fpath_log);
+    return 0;
+}
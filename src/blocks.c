@@ -1,26 +1,102 @@
 /*
   Block reading and writing logic
+
+  All block contents live in per request buffers (struct block_set or the
+  caller's block array) so any number of threads may read the same handle.
+  Verification needs no locks. Repairs and writes of a block are serialised
+  by a striped table of block locks, and every write bumps the generation of
+  its stripe so readers never put a block they read before the write into
+  the block cache.
+
+  A copy that fails its checks is first put right from its own error
+  correction trailer when the archive keeps them, and written back, so
+  the other copies are only needed when that fails.
+
+  In an erasure coded archive there is one copy of each block, spread over
+  the data roots, and the public functions here hand over to erasure.c.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include "blocks.h"
-#include "sha1.h"
+#include "hash.h"
+#include "fec.h"
 #include "logs.h"
 #include "seed.h"
+#include "cache.h"
+#include "io.h"
+#include "stats.h"
+#include "erasure.h"
 #include <sys/random.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+struct block_lock {
+    pthread_mutex_t mutex;
+    uint64_t generation;
+};
+
+static struct block_lock block_lock[AA_BLOCK_LOCKS] = {
+    [0 ... AA_BLOCK_LOCKS-1] = { PTHREAD_MUTEX_INITIALIZER, 0 }
+};
+
+static int read_policy = AA_READ_ALL;
+
+void set_read_policy(int policy) {
+    read_policy = policy;
+}
+
+int block_lock_index(const struct file_entry *file_entry, off_t file_block_ofs) {
+    uint64_t hash;
+    hash = ((uint64_t)file_entry->ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)file_entry->dev;
+    hash ^= (uint64_t)(file_block_ofs / AA_BLOCK_SIZE) * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 31;
+    return (int)(hash % AA_BLOCK_LOCKS);
+}
+
+uint64_t block_generation(int lock) {
+    return __atomic_load_n(&block_lock[lock].generation, __ATOMIC_ACQUIRE);
+}
+
+void lock_block(int lock) {
+    pthread_mutex_lock(&block_lock[lock].mutex);
+}
+
+/*
+  Release a block lock, first bumping its generation when the blocks it
+  covers were written while it was held.
+*/
+void unlock_block(int lock, int written) {
+    if (written) {
+        __atomic_add_fetch(&block_lock[lock].generation, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&block_lock[lock].mutex);
+}
+
+/*
+  Cache a block read without holding its block lock, unless it was written
+  since the read started.
+*/
+void cache_read_block(const struct file_entry *file_entry, off_t file_block_ofs, const struct data_block *block, int lock, uint64_t generation, uint64_t epoch) {
+    pthread_mutex_lock(&block_lock[lock].mutex);
+    if (block_lock[lock].generation==generation) {
+        cache_insert(file_entry->dev, file_entry->ino, file_block_ofs, block, epoch);
+    }
+    pthread_mutex_unlock(&block_lock[lock].mutex);
+}
 
 void clear_list(int list[]) {
-    memset(list, 0, AA_NUM_COPIES * sizeof(int));
+    memset(list, 0, AA_NUM_ROOTS * sizeof(int));
 }
 
 int count_eof(const int eof[]) {
     int idx;
     int total;
     total = 0;
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (eof[idx]!=0) {
             total++;
         }
@@ -30,7 +106,7 @@ int count_eof(const int eof[]) {
 
 int first_error(const int err_no[]) {
     int idx;
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
         if (err_no[idx]!=0) {
             return err_no[idx];
         }
@@ -38,23 +114,39 @@ int first_error(const int err_no[]) {
     return 0;
 }
 
-void repair_corrupt_blocks(struct file_entry *file_entry, off_t file_block_ofs, int err_no[]) {
+/*
+  The first copy that was read and verified, or -1 if there is none.
+*/
+static int good_copy(const int err_no[], const int eof[]) {
+    int idx;
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if ((err_no[idx]==0) && (eof[idx]==0)) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+void repair_corrupt_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, int err_no[], const int eof[]) {
     int idx;
     int idx2;
     uint32_t block_length;
     ssize_t bytes_written;
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        if (file_entry->file[idx].corrupt==1) {
-            for(idx2=0; idx2<AA_NUM_COPIES; idx2++) {
-                if ((err_no[idx2]==0) && (file_entry->file[idx2].corrupt==0)) {
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (blocks->copy[idx].corrupt==1) {
+            for(idx2=0; idx2<AA_NUM_ROOTS; idx2++) {
+                if ((err_no[idx2]==0) && (eof[idx2]==0) && (blocks->copy[idx2].corrupt==0)) {
                     log_info("repair", "Repair idx=%d using idx=%d", idx, idx2);
-                    block_length = NTOH(file_entry->file[idx2].block.header.length) + AA_HEAD_SIZE;
-                    bytes_written = pwrite(file_entry->file[idx].fd, file_entry->file[idx2].block.data, block_length, file_block_ofs);
+                    block_length = block_stored_size(&blocks->copy[idx2].block);
+                    bytes_written = pwrite(file_entry->file[idx].fd, &blocks->copy[idx2].block, block_length, file_block_ofs);
                     if (bytes_written==block_length) {
-                        memcpy(file_entry->file[idx].block.data, file_entry->file[idx2].block.data, AA_BLOCK_SIZE);
-                        file_entry->file[idx].corrupt = 0;
+                        stat_add(AA_STAT_REPAIRS_CORRUPT, 1);
+                        stat_add(AA_STAT_BYTES_WRITTEN(idx), block_length);
+                        memcpy(&blocks->copy[idx].block, &blocks->copy[idx2].block, AA_BLOCK_SIZE);
+                        blocks->copy[idx].corrupt = 0;
                         err_no[idx] = 0;
+                        break;
                     }
                 }
             }
@@ -63,20 +155,47 @@ void repair_corrupt_blocks(struct file_entry *file_entry, off_t file_block_ofs,
 
 }
 
-void repair_mismatched_blocks(struct file_entry *file_entry, off_t file_block_ofs, const int err_no[], const int eof[]) {
+/*
+  Write back the copies that were put right by their error correction.
+  The caller holds the block lock.
+*/
+void repair_corrected_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, const int err_no[]) {
     int idx;
     uint32_t block_length;
     ssize_t bytes_written;
 
-    if ((err_no[0] == 0) && (eof[0] == 0)) {
-        for(idx=1; idx<AA_NUM_COPIES; idx++) {
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if ((err_no[idx]==0) && blocks->copy[idx].corrected) {
+            log_info("repair", "Repair idx=%d from its error correction", idx);
+            block_length = block_stored_size(&blocks->copy[idx].block);
+            bytes_written = pwrite(file_entry->file[idx].fd, &blocks->copy[idx].block, block_length, file_block_ofs);
+            if (bytes_written==block_length) {
+                stat_add(AA_STAT_REPAIRS_FEC, 1);
+                stat_add(AA_STAT_BYTES_WRITTEN(idx), block_length);
+                blocks->copy[idx].corrected = 0;
+            }
+        }
+    }
+}
+
+void repair_mismatched_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, const int err_no[], const int eof[]) {
+    int idx;
+    int good;
+    uint32_t block_length;
+    ssize_t bytes_written;
+
+    good = good_copy(err_no, eof);
+    if (good >= 0) {
+        for(idx=good+1; idx<AA_NUM_ROOTS; idx++) {
             if ((err_no[idx] == 0) && (eof[idx] == 0)) {
-                if (memcmp(file_entry->file[0].block.header.sha1, file_entry->file[idx].block.header.sha1, AA_HASH_SIZE)!=0) {
-                    log_info("repair", "Repair mismatch idx=%d using idx=%d", idx, 0);
-                    block_length = NTOH(file_entry->file[0].block.header.length) + AA_HEAD_SIZE;
-                    bytes_written = pwrite(file_entry->file[idx].fd, file_entry->file[0].block.data, block_length, file_block_ofs);
+                if (memcmp(blocks->copy[good].block.header.hash, blocks->copy[idx].block.header.hash, AA_HASH_SIZE)!=0) {
+                    log_info("repair", "Repair mismatch idx=%d using idx=%d", idx, good);
+                    block_length = block_stored_size(&blocks->copy[good].block);
+                    bytes_written = pwrite(file_entry->file[idx].fd, &blocks->copy[good].block, block_length, file_block_ofs);
                     if (bytes_written==block_length) {
-                        memcpy(file_entry->file[idx].block.data, file_entry->file[0].block.data, AA_BLOCK_SIZE);
+                        stat_add(AA_STAT_REPAIRS_MISMATCHED, 1);
+                        stat_add(AA_STAT_BYTES_WRITTEN(idx), block_length);
+                        memcpy(&blocks->copy[idx].block, &blocks->copy[good].block, AA_BLOCK_SIZE);
                     }
                 }
             }
@@ -85,19 +204,23 @@ void repair_mismatched_blocks(struct file_entry *file_entry, off_t file_block_of
 
 }
 
-void repair_missing_blocks(struct file_entry *file_entry, off_t file_block_ofs, const int err_no[], int eof[]) {
+void repair_missing_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, const int err_no[], int eof[]) {
     int idx;
+    int good;
     uint32_t block_length;
     ssize_t bytes_written;
 
-    if ((err_no[0] == 0) && (eof[0] == 0)) {
-        for(idx=1; idx<AA_NUM_COPIES; idx++) {
+    good = good_copy(err_no, eof);
+    if (good >= 0) {
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
             if ((err_no[idx] == 0) && (eof[idx] == 1)) {
-                log_info("repair", "Repair missing block idx=%d using idx=%d", idx, 0);
-                block_length = NTOH(file_entry->file[0].block.header.length) + AA_HEAD_SIZE;
-                bytes_written = pwrite(file_entry->file[idx].fd, file_entry->file[0].block.data, block_length, file_block_ofs);
+                log_info("repair", "Repair missing block idx=%d using idx=%d", idx, good);
+                block_length = block_stored_size(&blocks->copy[good].block);
+                bytes_written = pwrite(file_entry->file[idx].fd, &blocks->copy[good].block, block_length, file_block_ofs);
                 if (bytes_written==block_length) {
-                    memcpy(file_entry->file[idx].block.data, file_entry->file[0].block.data, AA_BLOCK_SIZE);
+                    stat_add(AA_STAT_REPAIRS_MISSING, 1);
+                    stat_add(AA_STAT_BYTES_WRITTEN(idx), block_length);
+                    memcpy(&blocks->copy[idx].block, &blocks->copy[good].block, AA_BLOCK_SIZE);
                     eof[idx] = 0;
                 }
             }
@@ -105,122 +228,695 @@ void repair_missing_blocks(struct file_entry *file_entry, off_t file_block_ofs,
     }
 }
 
-void initialise_new_block(struct file_entry *file_entry, int err_no[], int eof[]) {
+void initialise_new_block(struct block_set *blocks, int err_no[], int eof[]) {
     int idx;
     int idx2;
     unsigned char seed[AA_SEED_SIZE];
 
-    if (count_eof(eof)==AA_NUM_COPIES) {
+    if (count_eof(eof)==AA_NUM_ROOTS) {
         if (initialise_seed(seed)==0) {
-            for(idx=0; idx<AA_NUM_COPIES; idx++) {
+            for(idx=0; idx<AA_NUM_ROOTS; idx++) {
                 log_info("initialise", "Initialise idx=%d", idx);
-                file_entry->file[idx].block.header.version = HTON(1);
+                blocks->copy[idx].block.header.version = HTON(block_version(AA_VERSION_1));
                 for(idx2=0; idx2<AA_SEED_SIZE; idx2++) {
-                    file_entry->file[idx].block.header.seed[idx2] = seed[idx2];
+                    blocks->copy[idx].block.header.seed[idx2] = seed[idx2];
                 }
             }
         } else {
             log_error("initialise", EAGAIN, "Failed to initialise seed");
-            for(idx=0; idx<AA_NUM_COPIES; idx++) {
+            for(idx=0; idx<AA_NUM_ROOTS; idx++) {
                 err_no[idx] = EAGAIN;
             }
         }
     } else if (count_eof(eof)>0) {
         log_error("initialise", EIO, "Cannot initialise because some are EOF and others are not");
-        for(idx=0; idx<AA_NUM_COPIES; idx++) {
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
             err_no[idx] = EIO;
         }
     }
 }
 
-void verify_block(struct file_entry *file_entry, const int idx, int err_no[]) {
-    SHA1Context cx;
-    unsigned char sha1[AA_HASH_SIZE];
-    hash_init(&cx);
-    hash_step(&cx, file_entry->file[idx].block.header.seed, AA_SEED_SIZE);
-    hash_step(&cx, file_entry->file[idx].block.data, AA_DATA_SIZE);
-    hash_finish(&cx, sha1);
-    if (memcmp(file_entry->file[idx].block.header.sha1, sha1, AA_HASH_SIZE) != 0) {
+void verify_block(struct block_set *blocks, const int idx, int err_no[]) {
+    stat_add(AA_STAT_BLOCKS_VERIFIED, 1);
+    if (!block_hash_valid(&blocks->copy[idx].block)) {
+        stat_add(AA_STAT_HASH_FAILURES, 1);
         err_no[idx] = EIO;
-        file_entry->file[idx].corrupt = 1;
+        blocks->copy[idx].corrupt = 1;
         log_error("verify", EIO, "Hash verification mismatch");
     }
 }
 
-void attempt_block_read(struct file_entry *file_entry, off_t file_block_ofs, const int idx, int err_no[], int eof[]) {
-    ssize_t bytes_read;
+/*
+  Put right a copy that was read but failed its checks from its error
+  correction trailer, marking it to be written back.
+*/
+void correct_block(struct block_set *blocks, const int idx, int err_no[]) {
+    if ((err_no[idx]==EIO) && (fec_correct_block(&blocks->copy[idx].block)>0)) {
+        log_info("verify", "idx=%d put right by its error correction", idx);
+        err_no[idx] = 0;
+        blocks->copy[idx].corrupt = 0;
+        blocks->copy[idx].corrected = 1;
+    }
+}
+
+void finish_block_read(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, const int idx, ssize_t bytes_read, int err_no[], int eof[]) {
     int fd;
     int block_length;
 
     fd = file_entry->file[idx].fd;
-    file_entry->file[idx].corrupt = 0;
-    memset(&file_entry->file[idx].block, 0, AA_BLOCK_SIZE);
-    bytes_read = pread(fd, &file_entry->file[idx].block, AA_BLOCK_SIZE, file_block_ofs);
+    if (bytes_read>0) {
+        stat_add(AA_STAT_BYTES_READ(idx), (uint64_t)bytes_read);
+    }
     if (bytes_read<0) {
-        log_info("readblock", "idx=%d fd=%d offset = %lu , bytes read = %ld , error (%d) %s", idx, fd, file_block_ofs, bytes_read, errno, strerror(errno));
+        log_info("readblock", "idx=%d fd=%d offset = %lu , error (%d) %s", idx, fd, file_block_ofs, (int)-bytes_read, strerror((int)-bytes_read));
     } else {
         log_info("readblock", "idx=%d fd=%d offset = %lu , bytes read = %ld", idx, fd, file_block_ofs, bytes_read);
     }
     if (bytes_read<0) {
-        err_no[idx] = errno;
-        log_error("readblock", errno, "idx=%d fd=%d", idx, fd);
+        err_no[idx] = (int)-bytes_read;
+        log_error("readblock", err_no[idx], "idx=%d fd=%d", idx, fd);
     } else if (bytes_read==0) {
         eof[idx] = 1;
         log_info("readblock", "idx=%d fd=%d EOF encountered", idx, fd);
-    } else if (bytes_read != (AA_HEAD_SIZE + NTOH(file_entry->file[idx].block.header.length))) {
-        block_length = NTOH(file_entry->file[idx].block.header.length);
+    } else if (bytes_read != block_stored_size(&blocks->copy[idx].block)) {
+        block_length = NTOH(blocks->copy[idx].block.header.length);
         err_no[idx] = EIO;
+        blocks->copy[idx].corrupt = 1;
         log_error("readblock", EIO, "idx=%d fd=%d bytes_read=%ld block_length=%d", idx, fd, bytes_read, block_length);
     }
 }
 
-void read_and_verify_blocks(struct file_entry *file_entry, off_t file_block_ofs, int err_no[], int eof[]) {
+/*
+  Read the block from the first copies copies as one batch and verify each
+  copy as its read completes.
+*/
+void read_and_verify_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, int copies, int err_no[], int eof[]) {
     int idx;
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+
+    for(idx=0; idx<copies; idx++) {
+        blocks->copy[idx].corrupt = 0;
+        blocks->copy[idx].corrected = 0;
+        memset(&blocks->copy[idx].block, 0, AA_BLOCK_SIZE);
+        io_prepare(&request[idx], file_entry->file[idx].fd, 0, &blocks->copy[idx].block, AA_BLOCK_SIZE, file_block_ofs);
+    }
+    io_submit(&batch, request, copies);
 
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        attempt_block_read(file_entry, file_block_ofs, idx, err_no, eof);
+    while ((idx = io_complete(&batch)) >= 0) {
+        finish_block_read(file_entry, file_block_ofs, blocks, idx, request[idx].result, err_no, eof);
         if ((err_no[idx] == 0) && (eof[idx] == 0)) {
-            verify_block(file_entry, idx, err_no);
+            verify_block(blocks, idx, err_no);
+        }
+        if (request[idx].result>0) {
+            correct_block(blocks, idx, err_no);
         }
     }
 }
 
-int read_block(struct file_entry *file_entry, off_t file_block_ofs) {
-    int err_no[AA_NUM_COPIES];
-    int eof[AA_NUM_COPIES];
+/*
+  True when no copy needs repairing: every copy read and verified without
+  correction and either all copies hold the same block or all are at end
+  of file.
+*/
+int blocks_consistent(const struct block_set *blocks, const int err_no[], const int eof[]) {
+    int idx;
 
+    if (first_error(err_no)!=0) {
+        return 0;
+    }
+    if (count_eof(eof)==AA_NUM_ROOTS) {
+        return 1;
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if ((eof[idx]!=0) || blocks->copy[idx].corrected) {
+            return 0;
+        }
+        if (memcmp(blocks->copy[0].block.header.hash, blocks->copy[idx].block.header.hash, AA_HASH_SIZE)!=0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+  Re-read every copy under the block lock and repair whatever is still
+  wrong. Returns 1 when a repair was attempted.
+*/
+int repair_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, int err_no[], int eof[]) {
+    int lock;
+    int inconsistent;
+
+    lock = block_lock_index(file_entry, file_block_ofs);
+    pthread_mutex_lock(&block_lock[lock].mutex);
+    clear_list(err_no);
+    clear_list(eof);
+    read_and_verify_blocks(file_entry, file_block_ofs, blocks, AA_NUM_ROOTS, err_no, eof);
+    inconsistent = !blocks_consistent(blocks, err_no, eof);
+    if (inconsistent) {
+        repair_corrected_blocks(file_entry, file_block_ofs, blocks, err_no);
+        repair_corrupt_blocks(file_entry, file_block_ofs, blocks, err_no, eof);
+        repair_mismatched_blocks(file_entry, file_block_ofs, blocks, err_no, eof);
+        repair_missing_blocks(file_entry, file_block_ofs, blocks, err_no, eof);
+    }
+    pthread_mutex_unlock(&block_lock[lock].mutex);
+    return inconsistent;
+}
+
+/*
+  Read and verify copy 0 only. When it is good the other copies are
+  assumed to match and are filled from it, otherwise returns -1 and the
+  caller falls back to reading every copy. A primary at end of file counts
+  as failed, as it may only have been cut short. A copy put
+  right by its error correction is written back, unless the block was
+  written meanwhile.
+*/
+int read_primary_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, int err_no[], int eof[]) {
+    int idx;
+    int lock;
+    uint64_t generation;
+
+    lock = block_lock_index(file_entry, file_block_ofs);
+    generation = block_generation(lock);
+    read_and_verify_blocks(file_entry, file_block_ofs, blocks, 1, err_no, eof);
+    if ((err_no[0]!=0) || (eof[0]!=0)) {
+        log_info("readblock", "offset = %lu , primary failed (%d) or at end of file, reading all copies", file_block_ofs, err_no[0]);
+        clear_list(err_no);
+        clear_list(eof);
+        return -1;
+    }
+    for(idx=1; idx<AA_NUM_ROOTS; idx++) {
+        blocks->copy[idx].corrected = 0;
+    }
+    if (blocks->copy[0].corrected) {
+        lock_block(lock);
+        if (block_generation(lock)==generation) {
+            repair_corrected_blocks(file_entry, file_block_ofs, blocks, err_no);
+        }
+        unlock_block(lock, 0);
+    }
+    for(idx=1; idx<AA_NUM_ROOTS; idx++) {
+        blocks->copy[idx].corrupt = 0;
+        memcpy(&blocks->copy[idx].block, &blocks->copy[0].block, AA_BLOCK_SIZE);
+        eof[idx] = eof[0];
+    }
+    return 0;
+}
+
+/*
+  Copies that are still missing, short or corrupt after any repair are
+  served from a copy that was read and verified, so a damaged primary
+  neither fails the read nor ends it early.
+*/
+static void fill_from_good_copy(struct block_set *blocks, int err_no[], int eof[]) {
+    int idx;
+    int good;
+
+    good = good_copy(err_no, eof);
+    if (good<0) {
+        return;
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if ((err_no[idx]!=0) || (eof[idx]!=0)) {
+            log_info("readblock", "idx=%d served from idx=%d", idx, good);
+            memcpy(&blocks->copy[idx].block, &blocks->copy[good].block, AA_BLOCK_SIZE);
+            blocks->copy[idx].corrupt = 0;
+            err_no[idx] = 0;
+            eof[idx] = 0;
+        }
+    }
+}
+
+/*
+  Read a block under the read policy, repairing copies as needed, without
+  initialising a block past end of file.
+*/
+static void read_copies(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks, int err_no[], int eof[]) {
+    clear_list(err_no);
+    clear_list(eof);
+
+    if ((read_policy==AA_READ_PRIMARY_FIRST) && (read_primary_block(file_entry, file_block_ofs, blocks, err_no, eof)==0)) {
+        return;
+    }
+
+    read_and_verify_blocks(file_entry, file_block_ofs, blocks, AA_NUM_ROOTS, err_no, eof);
+    if (!blocks_consistent(blocks, err_no, eof)) {
+        repair_block(file_entry, file_block_ofs, blocks, err_no, eof);
+    }
+    fill_from_good_copy(blocks, err_no, eof);
+}
+
+int read_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks) {
+    int err_no[AA_MAX_ROOTS];
+    int eof[AA_MAX_ROOTS];
+
+    if (AA_ERASURE_CODED) {
+        return ec_read_block(file_entry, file_block_ofs, blocks);
+    }
+
+    stat_add(AA_STAT_BLOCKS_READ, 1);
+    read_copies(file_entry, file_block_ofs, blocks, err_no, eof);
+    initialise_new_block(blocks, err_no, eof);
+
+    return first_error(err_no);
+}
+
+/*
+  Verify every copy of one block and repair it if needed, as read_block
+  does but regardless of the read policy and without initialising a
+  block past end of file. *repaired is set when any copy was rewritten.
+*/
+int scrub_block(struct file_entry *file_entry, off_t file_block_ofs, int *repaired) {
+    struct block_set blocks;
+    int err_no[AA_MAX_ROOTS];
+    int eof[AA_MAX_ROOTS];
+
+    *repaired = 0;
     clear_list(err_no);
     clear_list(eof);
 
-    read_and_verify_blocks(file_entry, file_block_ofs, err_no, eof);
-    repair_corrupt_blocks(file_entry, file_block_ofs, err_no);
-    repair_mismatched_blocks(file_entry, file_block_ofs, err_no, eof);
-    repair_missing_blocks(file_entry, file_block_ofs, err_no, eof);
-    initialise_new_block(file_entry, err_no, eof);
+    stat_add(AA_STAT_BLOCKS_READ, 1);
+    read_and_verify_blocks(file_entry, file_block_ofs, &blocks, AA_NUM_ROOTS, err_no, eof);
+    if (!blocks_consistent(&blocks, err_no, eof)) {
+        *repaired = repair_block(file_entry, file_block_ofs, &blocks, err_no, eof);
+    }
 
     return first_error(err_no);
 }
 
-int write_block(struct file_entry *file_entry, off_t file_block_ofs) {
+#define SPAN_EOF (-1)
+
+static void verify_span_blocks(struct data_block *span, const int blk[], int count, char status[]) {
+    const struct data_block *block[AA_HASH_LANES];
+    int valid[AA_HASH_LANES];
+    int idx;
+
+    for(idx=0; idx<count; idx++) {
+        block[idx] = block_at(span, blk[idx]);
+    }
+    stat_add(AA_STAT_BLOCKS_VERIFIED, (uint64_t)count);
+    blocks_hash_valid(block, count, valid);
+    for(idx=0; idx<count; idx++) {
+        if (!valid[idx]) {
+            stat_add(AA_STAT_HASH_FAILURES, 1);
+            status[blk[idx]] = EIO;
+        }
+    }
+}
+
+/*
+  Classify each of the count blocks of a span that was read with a single
+  read returning bytes_read bytes, setting status[blk] to 0, EIO or SPAN_EOF.
+  Mirrors the checks in finish_block_read and verify_block, including zero
+  filling a short final block. Hashes are checked a group at a time.
+*/
+static void check_span(struct data_block *span, int count, ssize_t bytes_read, char status[]) {
+    int pending[AA_HASH_LANES];
+    ssize_t avail;
+    int blk;
+    int n;
+
+    n = 0;
+    for(blk=0; blk<count; blk++) {
+        if (bytes_read<0) {
+            status[blk] = EIO;
+            continue;
+        }
+        avail = bytes_read - (ssize_t)blk * AA_BLOCK_SIZE;
+        if (avail<=0) {
+            status[blk] = SPAN_EOF;
+            continue;
+        }
+        if (avail>AA_BLOCK_SIZE) {
+            avail = AA_BLOCK_SIZE;
+        } else {
+            memset((unsigned char *)block_at(span, blk) + avail, 0, AA_BLOCK_SIZE - avail);
+        }
+        if (avail != block_stored_size(block_at(span, blk))) {
+            status[blk] = EIO;
+            continue;
+        }
+        status[blk] = 0;
+        pending[n++] = blk;
+        if (n==AA_HASH_LANES) {
+            verify_span_blocks(span, pending, n, status);
+            n = 0;
+        }
+    }
+    if (n>0) {
+        verify_span_blocks(span, pending, n, status);
+    }
+}
+
+/*
+  Read count consecutive blocks starting at file_block_ofs with one read per
+  copy, all submitted as a single batch. Each copy's blocks are verified as
+  soon as its read completes. Leading blocks already in the block cache are
+  served from it.
+  Blocks that verify cleanly and agree across all copies are returned directly.
+  Under the primary-first policy only copy 0 is read and checked, and a
+  primary that ends early is not taken as the end of the file.
+  Any other block falls back to read_copies so the usual repair logic applies.
+  On return *blocks_read holds the number of blocks before end of file.
+*/
+int read_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct data_block *blocks, int count, int *blocks_read) {
     int idx;
+    int blk;
+    int err_no;
+    int clean;
+    int cached;
+    int copies;
+    int eof[AA_MAX_ROOTS];
+    int copy_err[AA_MAX_ROOTS];
+    ssize_t bytes_read;
+    struct data_block *span[AA_MAX_ROOTS];
+    struct data_block *spare;
+    struct block_set *fallback;
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+    uint64_t *generation;
+    uint64_t epoch;
+    char *status;
+    int lock;
+
+    *blocks_read = 0;
+    for(cached=0; cached<count; cached++) {
+        if (!cache_lookup(file_entry->dev, file_entry->ino, file_block_ofs + (off_t)cached * AA_BLOCK_SIZE, block_at(blocks, cached))) {
+            break;
+        }
+        *blocks_read = cached + 1;
+        if (NTOH(block_at(blocks, cached)->header.length)<AA_DATA_SIZE) {
+            return 0;
+        }
+    }
+    blocks = block_at(blocks, cached);
+    count -= cached;
+    file_block_ofs += (off_t)cached * AA_BLOCK_SIZE;
+
+    if (count<=0) {
+        return 0;
+    }
+    if (AA_ERASURE_CODED) {
+        err_no = ec_read_blocks(file_entry, file_block_ofs, blocks, count, blocks_read);
+        *blocks_read += cached;
+        return err_no;
+    }
+
+    spare = malloc((size_t)(AA_NUM_ROOTS - 1) * count * AA_BLOCK_SIZE + sizeof(struct block_set) + (size_t)count * (sizeof(uint64_t) + AA_NUM_ROOTS));
+    if (spare==NULL) {
+        return log_error("readblocks", ENOMEM, "count=%d", count);
+    }
+    span[0] = blocks;
+    for(idx=1; idx<AA_NUM_ROOTS; idx++) {
+        span[idx] = block_at(spare, (idx - 1) * count);
+    }
+    fallback = (struct block_set *)block_at(spare, (AA_NUM_ROOTS - 1) * count);
+    generation = (uint64_t *)(fallback + 1);
+    status = (char *)(generation + count);
+
+    epoch = cache_epoch(file_entry->dev, file_entry->ino);
+    for(blk=0; blk<count; blk++) {
+        generation[blk] = block_generation(block_lock_index(file_entry, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE));
+    }
+
+    copies = (read_policy==AA_READ_PRIMARY_FIRST ? 1 : AA_NUM_ROOTS);
+    for(idx=0; idx<copies; idx++) {
+        io_prepare(&request[idx], file_entry->file[idx].fd, 0, span[idx], (size_t)count * AA_BLOCK_SIZE, file_block_ofs);
+    }
+    io_submit(&batch, request, copies);
+
+    while ((idx = io_complete(&batch)) >= 0) {
+        bytes_read = request[idx].result;
+        if (bytes_read>0) {
+            stat_add(AA_STAT_BYTES_READ(idx), (uint64_t)bytes_read);
+        }
+        if (bytes_read<0) {
+            log_error("readblocks", (int)-bytes_read, "idx=%d fd=%d offset = %lu , count = %d", idx, file_entry->file[idx].fd, file_block_ofs, count);
+        } else {
+            log_info("readblocks", "idx=%d fd=%d offset = %lu , count = %d , bytes read = %ld", idx, file_entry->file[idx].fd, file_block_ofs, count, bytes_read);
+        }
+        check_span(span[idx], count, bytes_read, &status[idx * count]);
+    }
+
+    err_no = 0;
+    for(blk=0; blk<count; blk++) {
+        clean = 1;
+        clear_list(eof);
+        for(idx=0; idx<copies; idx++) {
+            eof[idx] = (status[idx * count + blk]==SPAN_EOF);
+            if ((status[idx * count + blk]!=0) && (!eof[idx])) {
+                clean = 0;
+            }
+        }
+        if (count_eof(eof)==AA_NUM_ROOTS) {
+            break;
+        }
+        if (count_eof(eof)>0) {
+            clean = 0;
+        }
+        stat_add(AA_STAT_BLOCKS_READ, 1);
+        for(idx=1; idx<copies && clean; idx++) {
+            if ((eof[idx]!=0) || (memcmp(block_at(span[0], blk)->header.hash, block_at(span[idx], blk)->header.hash, AA_HASH_SIZE)!=0)) {
+                clean = 0;
+            }
+        }
+        lock = block_lock_index(file_entry, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE);
+        if (!clean) {
+            generation[blk] = block_generation(lock);
+            read_copies(file_entry, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE, fallback, copy_err, eof);
+            if (count_eof(eof)==AA_NUM_ROOTS) {
+                break;
+            }
+            err_no = first_error(copy_err);
+            if (err_no!=0) {
+                break;
+            }
+            memcpy(block_at(blocks, blk), &fallback->copy[0].block, AA_BLOCK_SIZE);
+        }
+        cache_read_block(file_entry, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE, block_at(blocks, blk), lock, generation[blk], epoch);
+        *blocks_read = cached + blk + 1;
+        if (NTOH(block_at(blocks, blk)->header.length)<AA_DATA_SIZE) {
+            break;
+        }
+    }
+
+    free(spare);
+    return err_no;
+}
+
+/*
+  Scrub count consecutive blocks starting at file_block_ofs, reading every
+  copy of the span in one batch and checking all of their hashes together.
+  Blocks that are not clean on every copy go through scrub_block so they
+  are repaired. err_no[blk] and repaired[blk] report on each block.
+  count may be at most AA_HASH_LANES. Returns the number of blocks before
+  the end of every copy. In an erasure coded archive file_block_ofs is
+  where a stripe is stored and count stripes are scrubbed instead.
+*/
+int scrub_blocks(struct file_entry *file_entry, off_t file_block_ofs, int count, int err_no[], int repaired[]) {
+    int idx;
+    int blk;
+    int clean;
+    int at_eof;
+    int scanned;
+    ssize_t bytes_read;
+    struct data_block *span;
+    char status[AA_MAX_ROOTS * AA_HASH_LANES];
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+
+    if (AA_ERASURE_CODED) {
+        return ec_scrub_blocks(file_entry, file_block_ofs, count, err_no, repaired);
+    }
+    if (count>AA_HASH_LANES) {
+        count = AA_HASH_LANES;
+    }
+    span = malloc((size_t)AA_NUM_ROOTS * count * AA_BLOCK_SIZE);
+    if (span==NULL) {
+        log_error("scrubblocks", ENOMEM, "count=%d", count);
+        return 0;
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        io_prepare(&request[idx], file_entry->file[idx].fd, 0, block_at(span, idx * count), (size_t)count * AA_BLOCK_SIZE, file_block_ofs);
+    }
+    io_submit(&batch, request, AA_NUM_ROOTS);
+
+    while ((idx = io_complete(&batch)) >= 0) {
+        bytes_read = request[idx].result;
+        if (bytes_read>0) {
+            stat_add(AA_STAT_BYTES_READ(idx), (uint64_t)bytes_read);
+        }
+        check_span(block_at(span, idx * count), count, bytes_read, &status[idx * count]);
+    }
+
+    scanned = 0;
+    for(blk=0; blk<count; blk++) {
+        clean = 1;
+        at_eof = 0;
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            if (status[idx * count + blk]==SPAN_EOF) {
+                at_eof++;
+            } else if (status[idx * count + blk]!=0) {
+                clean = 0;
+            }
+        }
+        if (at_eof==AA_NUM_ROOTS) {
+            break;
+        }
+        for(idx=1; idx<AA_NUM_ROOTS && clean; idx++) {
+            if ((at_eof!=0) || (memcmp(block_at(span, blk)->header.hash, block_at(span, idx * count + blk)->header.hash, AA_HASH_SIZE)!=0)) {
+                clean = 0;
+            }
+        }
+        if (clean) {
+            stat_add(AA_STAT_BLOCKS_READ, 1);
+            err_no[blk] = 0;
+            repaired[blk] = 0;
+        } else {
+            err_no[blk] = scrub_block(file_entry, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE, &repaired[blk]);
+        }
+        scanned = blk + 1;
+    }
+
+    free(span);
+    return scanned;
+}
+
+int write_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks) {
+    int idx;
+    int lock;
+    int err_no;
     uint32_t block_length;
     ssize_t bytes_written;
-    SHA1Context cx;
-    int err_no[AA_NUM_COPIES];
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+    struct data_block *block[1];
 
-    clear_list(err_no);
-    for(idx=0; idx<AA_NUM_COPIES; idx++) {
-        block_length = NTOH(file_entry->file[idx].block.header.length) + AA_HEAD_SIZE;
-        hash_init(&cx);
-        hash_step(&cx, file_entry->file[idx].block.header.seed, AA_SEED_SIZE);
-        hash_step(&cx, file_entry->file[idx].block.data, AA_DATA_SIZE);
-        hash_finish(&cx, file_entry->file[idx].block.header.sha1);
-        bytes_written = pwrite(file_entry->file[idx].fd, &file_entry->file[idx].block, block_length, file_block_ofs);
-        if (bytes_written!=block_length) {
-            log_info("write", "Wrote %d bytes", bytes_written);
-            return errno;
+    if (AA_ERASURE_CODED) {
+        block[0] = &blocks->copy[0].block;
+        return ec_write_blocks(file_entry, block, 1, file_block_ofs);
+    }
+
+    lock = block_lock_index(file_entry, file_block_ofs);
+    pthread_mutex_lock(&block_lock[lock].mutex);
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        hash_block(&blocks->copy[idx].block);
+        block_length = block_stored_size(&blocks->copy[idx].block);
+        io_prepare(&request[idx], file_entry->file[idx].fd, 1, &blocks->copy[idx].block, block_length, file_block_ofs);
+    }
+    io_submit(&batch, request, AA_NUM_ROOTS);
+
+    err_no = 0;
+    while ((idx = io_complete(&batch)) >= 0) {
+        bytes_written = request[idx].result;
+        if (bytes_written>0) {
+            stat_add(AA_STAT_BYTES_WRITTEN(idx), (uint64_t)bytes_written);
+        }
+        if (bytes_written!=(ssize_t)request[idx].single.iov_len) {
+            log_info("write", "idx=%d Wrote %ld bytes", idx, bytes_written);
+            if (err_no==0) {
+                err_no = (bytes_written<0?(int)-bytes_written:EIO);
+            }
         }
     }
 
-    return 0;
+    __atomic_add_fetch(&block_lock[lock].generation, 1, __ATOMIC_RELEASE);
+    if (err_no==0) {
+        stat_add(AA_STAT_BLOCKS_WRITTEN, 1);
+        cache_insert(file_entry->dev, file_entry->ino, file_block_ofs, &blocks->copy[0].block, cache_epoch(file_entry->dev, file_entry->ino));
+    } else {
+        cache_invalidate(file_entry->dev, file_entry->ino, file_block_ofs);
+    }
+    pthread_mutex_unlock(&block_lock[lock].mutex);
+
+    return err_no;
+}
+
+/*
+  Write count consecutive blocks starting at file_block_ofs to every copy.
+  Each block is hashed once, the blocks together, and the same bytes are written to all copies
+  with one vectored write per copy, submitted together as one batch.
+  Every block except the last must be full.
+  The block locks are taken in ascending order so writers cannot deadlock.
+*/
+int write_blocks(struct file_entry *file_entry, struct data_block *blocks[], int count, off_t file_block_ofs) {
+    int idx;
+    int blk;
+    int lock;
+    int err_no;
+    ssize_t total;
+    ssize_t bytes_written;
+    struct iovec iov[AA_MAX_WRITE_BLOCKS];
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+    unsigned char held[AA_BLOCK_LOCKS];
+
+    if (count<=0) {
+        return 0;
+    }
+    if (count>AA_MAX_WRITE_BLOCKS) {
+        return EINVAL;
+    }
+    if (AA_ERASURE_CODED) {
+        return ec_write_blocks(file_entry, blocks, count, file_block_ofs);
+    }
+
+    total = 0;
+    hash_blocks(blocks, count);
+    for(blk=0; blk<count; blk++) {
+        iov[blk].iov_base = blocks[blk];
+        iov[blk].iov_len = block_stored_size(blocks[blk]);
+        total += (ssize_t)iov[blk].iov_len;
+    }
+
+    memset(held, 0, sizeof(held));
+    for(blk=0; blk<count; blk++) {
+        held[block_lock_index(file_entry, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE)] = 1;
+    }
+    for(lock=0; lock<AA_BLOCK_LOCKS; lock++) {
+        if (held[lock]) {
+            pthread_mutex_lock(&block_lock[lock].mutex);
+        }
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        io_prepare_vector(&request[idx], file_entry->file[idx].fd, 1, iov, count, file_block_ofs);
+    }
+    io_submit(&batch, request, AA_NUM_ROOTS);
+
+    err_no = 0;
+    while ((idx = io_complete(&batch)) >= 0) {
+        bytes_written = request[idx].result;
+        if (bytes_written>0) {
+            stat_add(AA_STAT_BYTES_WRITTEN(idx), (uint64_t)bytes_written);
+        }
+        if (bytes_written!=total) {
+            if (err_no==0) {
+                err_no = (bytes_written<0?(int)-bytes_written:EIO);
+            }
+            log_error("writeblocks", (bytes_written<0?(int)-bytes_written:EIO), "idx=%d fd=%d offset = %lu , count = %d , bytes written = %ld", idx, file_entry->file[idx].fd, file_block_ofs, count, bytes_written);
+        } else {
+            log_info("writeblocks", "idx=%d fd=%d offset = %lu , count = %d , bytes written = %ld", idx, file_entry->file[idx].fd, file_block_ofs, count, bytes_written);
+        }
+    }
+
+    if (err_no==0) {
+        stat_add(AA_STAT_BLOCKS_WRITTEN, (uint64_t)count);
+    }
+    for(blk=0; blk<count && err_no==0; blk++) {
+        cache_insert(file_entry->dev, file_entry->ino, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE, blocks[blk], cache_epoch(file_entry->dev, file_entry->ino));
+    }
+    if (err_no!=0) {
+        cache_invalidate(file_entry->dev, file_entry->ino, file_block_ofs);
+    }
+
+    for(lock=AA_BLOCK_LOCKS-1; lock>=0; lock--) {
+        if (held[lock]) {
+            __atomic_add_fetch(&block_lock[lock].generation, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&block_lock[lock].mutex);
+        }
+    }
+
+    return err_no;
 }
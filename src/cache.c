@@ -0,0 +1,293 @@
+/*
+  Process wide cache of verified blocks.
+
+  Blocks are keyed by the identity (device and inode) of the primary backing
+  file plus the block offset within it. The cache is split into shards, each
+  with its own lock, fixed set of slots and CLOCK replacement hand, so that
+  concurrent readers of different blocks rarely contend.
+
+  Each shard also chains its slots by file, so invalidating a file visits
+  only the slots holding its blocks rather than every slot of every shard.
+
+  Every invalidation of a file advances its cache epoch. Readers take the
+  epoch before reading a block and the insert is dropped if the file was
+  invalidated in between, so a block read before a truncate or unlink is
+  never cached after. Epochs are kept per file, hashed into a fixed table,
+  so invalidating one file only rarely drops the inserts of another.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cache.h"
+
+struct cache_slot {
+    dev_t dev;
+    ino_t ino;
+    off_t file_block_ofs;
+    int valid;
+    int referenced;
+    int next;
+    int file_next;
+    int file_prev;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    int capacity;
+    int used;
+    int hand;
+    int num_buckets;
+    int *bucket;
+    int *file_bucket;
+    struct cache_slot *slot;
+    struct data_block *data;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+static struct cache_shard shards[AA_CACHE_SHARDS];
+static int cache_enabled = 0;
+static uint64_t epoch[AA_CACHE_EPOCHS];
+
+static uint64_t cache_hash(dev_t dev, ino_t ino, off_t file_block_ofs) {
+    uint64_t hash;
+    hash = (uint64_t)dev * 0x9E3779B97F4A7C15ULL;
+    hash ^= (uint64_t)ino + 0x632BE59BD9B4E019ULL + (hash << 6) + (hash >> 2);
+    hash ^= (uint64_t)(file_block_ofs / AA_BLOCK_SIZE) * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+static uint64_t *cache_file_epoch(dev_t dev, ino_t ino) {
+    return &epoch[cache_hash(dev, ino, 0) % AA_CACHE_EPOCHS];
+}
+
+static int *cache_file_head(struct cache_shard *shard, dev_t dev, ino_t ino) {
+    return &shard->file_bucket[(cache_hash(dev, ino, 0) / AA_CACHE_SHARDS) % shard->num_buckets];
+}
+
+static struct cache_shard *cache_shard_for(uint64_t hash) {
+    return &shards[hash % AA_CACHE_SHARDS];
+}
+
+static int cache_find(struct cache_shard *shard, uint64_t hash, dev_t dev, ino_t ino, off_t file_block_ofs) {
+    int pos;
+    for(pos=shard->bucket[(hash / AA_CACHE_SHARDS) % shard->num_buckets]; pos>=0; pos=shard->slot[pos].next) {
+        if ((shard->slot[pos].file_block_ofs==file_block_ofs) && (shard->slot[pos].ino==ino) && (shard->slot[pos].dev==dev)) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+static void cache_unlink(struct cache_shard *shard, int pos) {
+    struct cache_slot *slot;
+    int *link;
+
+    slot = &shard->slot[pos];
+    link = &shard->bucket[(cache_hash(slot->dev, slot->ino, slot->file_block_ofs) / AA_CACHE_SHARDS) % shard->num_buckets];
+    while (*link!=pos) {
+        link = &shard->slot[*link].next;
+    }
+    *link = slot->next;
+    if (slot->file_prev>=0) {
+        shard->slot[slot->file_prev].file_next = slot->file_next;
+    } else {
+        *cache_file_head(shard, slot->dev, slot->ino) = slot->file_next;
+    }
+    if (slot->file_next>=0) {
+        shard->slot[slot->file_next].file_prev = slot->file_prev;
+    }
+    slot->valid = 0;
+    slot->next = -1;
+    slot->file_next = -1;
+    slot->file_prev = -1;
+    shard->used--;
+}
+
+static int cache_victim(struct cache_shard *shard) {
+    int pos;
+    for(;;) {
+        pos = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->capacity;
+        if (!shard->slot[pos].valid) {
+            return pos;
+        }
+        if (shard->slot[pos].referenced) {
+            shard->slot[pos].referenced = 0;
+        } else {
+            cache_unlink(shard, pos);
+            shard->evictions++;
+            return pos;
+        }
+    }
+}
+
+int init_block_cache(size_t budget) {
+    int idx;
+    int pos;
+    size_t per_shard;
+
+    per_shard = budget / AA_CACHE_SHARDS / (sizeof(struct cache_slot) + AA_BLOCK_SIZE + 3 * sizeof(int));
+    if (per_shard==0) {
+        cache_enabled = 0;
+        return 0;
+    }
+
+    for(idx=0; idx<AA_CACHE_SHARDS; idx++) {
+        shards[idx].capacity = (int)per_shard;
+        shards[idx].num_buckets = (int)per_shard;
+        shards[idx].slot = calloc(per_shard, sizeof(struct cache_slot));
+        shards[idx].data = malloc(per_shard * AA_BLOCK_SIZE);
+        shards[idx].bucket = malloc(per_shard * sizeof(int));
+        shards[idx].file_bucket = malloc(per_shard * sizeof(int));
+        if ((shards[idx].slot==NULL) || (shards[idx].data==NULL) || (shards[idx].bucket==NULL) || (shards[idx].file_bucket==NULL)) {
+            return -1;
+        }
+        for(pos=0; pos<shards[idx].num_buckets; pos++) {
+            shards[idx].bucket[pos] = -1;
+            shards[idx].file_bucket[pos] = -1;
+            shards[idx].slot[pos].next = -1;
+            shards[idx].slot[pos].file_next = -1;
+            shards[idx].slot[pos].file_prev = -1;
+        }
+        if (pthread_mutex_init(&shards[idx].lock, NULL)!=0) {
+            return -1;
+        }
+    }
+
+    cache_enabled = 1;
+    return 0;
+}
+
+int cache_lookup(dev_t dev, ino_t ino, off_t file_block_ofs, struct data_block *block) {
+    uint64_t hash;
+    struct cache_shard *shard;
+    int pos;
+
+    if (!cache_enabled) {
+        return 0;
+    }
+
+    hash = cache_hash(dev, ino, file_block_ofs);
+    shard = cache_shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    pos = cache_find(shard, hash, dev, ino, file_block_ofs);
+    if (pos>=0) {
+        shard->slot[pos].referenced = 1;
+        memcpy(block, block_at(shard->data, pos), AA_BLOCK_SIZE);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return pos>=0;
+}
+
+uint64_t cache_epoch(dev_t dev, ino_t ino) {
+    return __atomic_load_n(cache_file_epoch(dev, ino), __ATOMIC_ACQUIRE);
+}
+
+void cache_insert(dev_t dev, ino_t ino, off_t file_block_ofs, const struct data_block *block, uint64_t read_epoch) {
+    uint64_t hash;
+    struct cache_shard *shard;
+    struct cache_slot *slot;
+    int *head;
+    int pos;
+
+    if (!cache_enabled) {
+        return;
+    }
+
+    hash = cache_hash(dev, ino, file_block_ofs);
+    shard = cache_shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (cache_epoch(dev, ino)!=read_epoch) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    pos = cache_find(shard, hash, dev, ino, file_block_ofs);
+    if (pos<0) {
+        pos = cache_victim(shard);
+        slot = &shard->slot[pos];
+        slot->dev = dev;
+        slot->ino = ino;
+        slot->file_block_ofs = file_block_ofs;
+        slot->valid = 1;
+        head = &shard->bucket[(hash / AA_CACHE_SHARDS) % shard->num_buckets];
+        slot->next = *head;
+        *head = pos;
+        head = cache_file_head(shard, dev, ino);
+        slot->file_next = *head;
+        slot->file_prev = -1;
+        if (*head>=0) {
+            shard->slot[*head].file_prev = pos;
+        }
+        *head = pos;
+        shard->used++;
+    }
+    slot = &shard->slot[pos];
+    slot->referenced = 1;
+    memcpy(block_at(shard->data, pos), block, AA_BLOCK_SIZE);
+    shard->inserts++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+  Drop every cached block of a file at or beyond from_block_ofs.
+  Use an offset of zero to forget the whole file.
+*/
+void cache_invalidate(dev_t dev, ino_t ino, off_t from_block_ofs) {
+    int idx;
+    int pos;
+    int next;
+    struct cache_shard *shard;
+
+    if (!cache_enabled) {
+        return;
+    }
+
+    __atomic_add_fetch(cache_file_epoch(dev, ino), 1, __ATOMIC_RELEASE);
+    for(idx=0; idx<AA_CACHE_SHARDS; idx++) {
+        shard = &shards[idx];
+        pthread_mutex_lock(&shard->lock);
+        for(pos=*cache_file_head(shard, dev, ino); pos>=0; pos=next) {
+            next = shard->slot[pos].file_next;
+            if ((shard->slot[pos].ino==ino) && (shard->slot[pos].dev==dev) && (shard->slot[pos].file_block_ofs>=from_block_ofs)) {
+                cache_unlink(shard, pos);
+                shard->invalidations++;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_get_stats(struct cache_stats *stats) {
+    int idx;
+    struct cache_shard *shard;
+
+    memset(stats, 0, sizeof(struct cache_stats));
+    if (!cache_enabled) {
+        return;
+    }
+
+    for(idx=0; idx<AA_CACHE_SHARDS; idx++) {
+        shard = &shards[idx];
+        pthread_mutex_lock(&shard->lock);
+        stats->capacity += (size_t)shard->capacity * AA_BLOCK_SIZE;
+        stats->used += (size_t)shard->used * AA_BLOCK_SIZE;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->inserts += shard->inserts;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -7,9 +7,90 @@
 #include <stdio.h>
 #include "blocks.h"
 #include <arpa/inet.h>
-#include "sha1.h"
+#include "hash.h"
+#include "fec.h"
+#include "pipeline.h"
 
 #define NTOH ntohs
+#define AA_PIPE_MAX_BLOCKS (AA_PIPE_BATCH_BYTES / AA_MIN_BLOCK_SIZE)
+
+/*
+  The data bytes wanted, from offset up to end, and where the blocks read
+  start. Every block but the last of a file is full, so block n holds the
+  data from n times the data size.
+*/
+struct decode_range {
+    off_t first_block;
+    uint64_t offset;
+    uint64_t end;
+    size_t batch_blocks;
+    const char *fpath;
+};
+
+/*
+  Check a batch of blocks, hashing them together, and gather the wanted
+  part of their data. A block that fails is put right from its error
+  correction if it can be.
+*/
+static int decode_batch(struct pipe_batch *batch, void *arg) {
+    const struct decode_range *range;
+    const struct data_block *check[AA_PIPE_MAX_BLOCKS] = { NULL };
+    int valid[AA_PIPE_MAX_BLOCKS];
+    struct data_block *block;
+    uint64_t pos;
+    uint64_t start;
+    uint64_t stop;
+    int avail;
+    int count;
+    int blk;
+
+    range = arg;
+    batch->out_len = 0;
+    count = (int)((batch->in_len + AA_BLOCK_SIZE - 1) / AA_BLOCK_SIZE);
+    if (count==0) {
+        return 0;
+    }
+    for(blk=0; blk<count; blk++) {
+        block = block_at((struct data_block *)batch->in, blk);
+        avail = (int)(batch->in_len - (size_t)blk * AA_BLOCK_SIZE);
+        if (avail<AA_BLOCK_SIZE) {
+            memset((unsigned char *)block + avail, 0, AA_BLOCK_SIZE - avail);
+        }
+        check[blk] = block;
+    }
+    blocks_hash_valid(check, count, valid);
+
+    for(blk=0; blk<count; blk++) {
+        block = block_at((struct data_block *)batch->in, blk);
+        avail = (int)(batch->in_len - (size_t)blk * AA_BLOCK_SIZE);
+        if (avail>AA_BLOCK_SIZE) {
+            avail = AA_BLOCK_SIZE;
+        }
+        if (((avail != block_stored_size(block)) || !valid[blk]) && (fec_correct_block(block)>0)) {
+            fprintf(stderr, "Corrected a block by its error correction when read from %s\n", range->fpath);
+            valid[blk] = 1;
+        }
+        if (avail != block_stored_size(block)) {
+            snprintf(batch->message, sizeof(batch->message), "Invalid block length (%d) when read from %s", avail, range->fpath);
+            return EIO;
+        }
+        if (!valid[blk]) {
+            snprintf(batch->message, sizeof(batch->message), "Invalid block hash when read from %s", range->fpath);
+            return EIO;
+        }
+        pos = ((uint64_t)range->first_block + batch->seq * range->batch_blocks + blk) * AA_DATA_SIZE;
+        start = (pos>range->offset) ? pos : range->offset;
+        stop = pos + NTOH(block->header.length);
+        if (stop>range->end) {
+            stop = range->end;
+        }
+        if (start<stop) {
+            memcpy(batch->out + batch->out_len, block->data + (start - pos), stop - start);
+            batch->out_len += stop - start;
+        }
+    }
+    return 0;
+}
 
 int main(int argc, char* argv[]) {
     int fd_in;
@@ -17,10 +98,44 @@ int main(int argc, char* argv[]) {
     ssize_t len;
     char fpath_in[PATH_MAX];
     char fpath_out[PATH_MAX];
-    struct data_block block;
-    SHA1Context cx;
-    unsigned char sha1[AA_HASH_SIZE];
+    struct data_block *first;
+    struct decode_range range;
+    struct pipeline pipe;
+    int threads;
+    off_t offset;
+    off_t length;
+    off_t blocks;
+    char *end;
 
+    threads = pipe_threads(NULL);
+    offset = 0;
+    length = -1;
+    while ((argc > 3) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--threads=", 10)) {
+            threads = pipe_threads(argv[1] + 10);
+            if (threads<0) {
+                fprintf(stderr, "Error %d (%s) , Invalid thread count %s\n", EINVAL, strerror(EINVAL), argv[1] + 10);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--offset=", 9)) {
+            offset = strtoll(argv[1] + 9, &end, 10);
+            if ((*end!=0) || (offset<0)) {
+                fprintf(stderr, "Error %d (%s) , Invalid offset %s\n", EINVAL, strerror(EINVAL), argv[1] + 9);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--length=", 9)) {
+            length = strtoll(argv[1] + 9, &end, 10);
+            if ((*end!=0) || (length<0)) {
+                fprintf(stderr, "Error %d (%s) , Invalid length %s\n", EINVAL, strerror(EINVAL), argv[1] + 9);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
     if (argc != 3) {
         fprintf(stderr, "Error %d (%s) , Invalid arguments\n", EINVAL, strerror(EINVAL));
         exit(1);
@@ -41,41 +156,62 @@ int main(int argc, char* argv[]) {
     if (!strcmp(fpath_out, "-")) {
         fd_out = STDOUT_FILENO;
     } else {
-        fd_out = open(fpath_in, O_WRONLY);
+        fd_out = open(fpath_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     }
     if (fd_out == -1) {
         fprintf(stderr, "Error %d (%s) , Failed to open %s\n", errno, strerror(errno), fpath_out);
         exit(1);
     }
 
-    memset(&block, 0, AA_BLOCK_SIZE);
-    len = read(fd_in, &block, AA_BLOCK_SIZE);
-    while (len>0) {
-        if (len != (NTOH(block.header.length) + AA_HEAD_SIZE)) {
-            fprintf(stderr, "Error %d (%s) , Invalid block length (%zd) when read from %s\n", EIO, strerror(EIO), len, fpath_in);
-            exit(1);
-        }
-        hash_init(&cx);
-        hash_step(&cx, block.header.seed, AA_SEED_SIZE);
-        hash_step(&cx, block.data, AA_DATA_SIZE);
-        hash_finish(&cx, sha1);
-        if (memcmp(sha1, block.header.sha1, AA_HASH_SIZE)!=0) {
-            fprintf(stderr, "Error %d (%s) , Invalid block hash when read from %s\n", EIO, strerror(EIO), fpath_in);
-            exit(1);
-        }
-        len = write(fd_out, block.data, NTOH(block.header.length));
-        if (len != NTOH(block.header.length)) {
-            fprintf(stderr, "Error %d (%s) , Failed to write to %s\n", EIO, strerror(EIO), fpath_out);
-            exit(1);
-        }
-        memset(&block, 0, AA_BLOCK_SIZE);
-        len = read(fd_in, &block, AA_BLOCK_SIZE);
+    /* The first block gives the geometry, which sizes everything else. */
+    first = malloc(sizeof(struct data_block));
+    if (first == NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        exit(1);
     }
+    len = read_encoded_block(fd_in, first);
     if (len<0) {
         fprintf(stderr, "Error %d (%s) , Failed to read from %s\n", errno, strerror(errno), fpath_in);
         exit(1);
     }
 
+    memset(&range, 0, sizeof(range));
+    range.first_block = offset / AA_DATA_SIZE;
+    range.offset = (uint64_t)offset;
+    range.end = (length<0) ? UINT64_MAX : (uint64_t)(offset + length);
+    range.batch_blocks = AA_PIPE_BATCH_BYTES / AA_BLOCK_SIZE;
+    range.fpath = fpath_in;
+
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.fd_in = fd_in;
+    pipe.fd_out = fd_out;
+    pipe.in_size = AA_PIPE_BATCH_BYTES;
+    pipe.out_size = range.batch_blocks * AA_DATA_SIZE;
+    pipe.threads = threads;
+    pipe.limit = -1;
+    pipe.work = decode_batch;
+    pipe.arg = &range;
+    if (range.first_block==0) {
+        pipe.prefix = (const unsigned char *)first;
+        pipe.prefix_len = (size_t)len;
+    } else if (len<AA_BLOCK_SIZE) {
+        pipe.limit = 0;
+    } else if (skip_input(fd_in, (range.first_block - 1) * AA_BLOCK_SIZE)!=0) {
+        fprintf(stderr, "Error %d (%s) , Failed to read from %s\n", errno, strerror(errno), fpath_in);
+        exit(1);
+    }
+    if ((length>=0) && (pipe.limit!=0)) {
+        blocks = (length==0) ? 0 : (offset + length - 1) / AA_DATA_SIZE - range.first_block + 1;
+        pipe.limit = blocks * AA_BLOCK_SIZE - (off_t)pipe.prefix_len;
+        if (pipe.limit<0) {
+            pipe.limit = 0;
+        }
+    }
+    if (run_pipeline(&pipe, fpath_in, fpath_out)!=0) {
+        exit(1);
+    }
+
+    free(first);
     close(fd_out);
     close(fd_in);
     return 0;
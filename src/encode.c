@@ -4,22 +4,84 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include "blocks.h"
-#include "sha1.h"
-#include "seed.h"
+#include "hash.h"
+#include "pipeline.h"
 #include <stdio.h>
 
+/*
+  Make a batch of input into blocks, each full but the one holding the end
+  of the input.
+*/
+static int encode_batch(struct pipe_batch *batch, void *arg) {
+    ssize_t len;
+
+    len = encode_blocks(batch->in, batch->in_len, (struct data_block *)batch->out);
+    if (len<0) {
+        snprintf(batch->message, sizeof(batch->message), "Failed to initialise seeds");
+        return EAGAIN;
+    }
+    batch->out_len = (size_t)len;
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     int fd_in;
     int fd_out;
-    ssize_t len;
-    ssize_t ofs;
-    ssize_t size;
-    ssize_t block_length;
     char fpath_in[PATH_MAX];
     char fpath_out[PATH_MAX];
-    struct data_block block;
-    SHA1Context cx;
+    struct pipeline pipe;
+    int hash_type;
+    int block_size;
+    int threads;
+    off_t offset;
+    off_t length;
+    char *end;
 
+    threads = pipe_threads(NULL);
+    offset = 0;
+    length = -1;
+    while ((argc > 3) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--hash=", 7)) {
+            hash_type = hash_type_by_name(argv[1] + 7);
+            if (hash_type<0) {
+                fprintf(stderr, "Error %d (%s) , Unknown hash %s\n", EINVAL, strerror(EINVAL), argv[1] + 7);
+                exit(1);
+            }
+            set_hash_type(hash_type);
+        } else if (!strncmp(argv[1], "--block-size=", 13)) {
+            block_size = atoi(argv[1] + 13);
+            if (!block_size_valid(block_size)) {
+                fprintf(stderr, "Error %d (%s) , Invalid block size %s\n", EINVAL, strerror(EINVAL), argv[1] + 13);
+                exit(1);
+            }
+            set_block_size(block_size);
+        } else if (!strcmp(argv[1], "--fec")) {
+            set_fec(1);
+        } else if (!strncmp(argv[1], "--threads=", 10)) {
+            threads = pipe_threads(argv[1] + 10);
+            if (threads<0) {
+                fprintf(stderr, "Error %d (%s) , Invalid thread count %s\n", EINVAL, strerror(EINVAL), argv[1] + 10);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--offset=", 9)) {
+            offset = strtoll(argv[1] + 9, &end, 10);
+            if ((*end!=0) || (offset<0)) {
+                fprintf(stderr, "Error %d (%s) , Invalid offset %s\n", EINVAL, strerror(EINVAL), argv[1] + 9);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--length=", 9)) {
+            length = strtoll(argv[1] + 9, &end, 10);
+            if ((*end!=0) || (length<0)) {
+                fprintf(stderr, "Error %d (%s) , Invalid length %s\n", EINVAL, strerror(EINVAL), argv[1] + 9);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
     if (argc != 3) {
         fprintf(stderr, "Error %d (%s) , Invalid arguments\n", EINVAL, strerror(EINVAL));
         exit(1);
@@ -40,58 +102,30 @@ int main(int argc, char* argv[]) {
     if (!strcmp(fpath_out, "-")) {
         fd_out = STDOUT_FILENO;
     } else {
-        fd_out = open(fpath_in, O_WRONLY);
+        fd_out = open(fpath_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     }
     if (fd_out == -1) {
         fprintf(stderr, "Error %d (%s) , Failed to open %s\n", errno, strerror(errno), fpath_out);
         exit(1);
     }
 
-    ofs = 0;
-    size = AA_DATA_SIZE;
-    memset(&block, 0, AA_BLOCK_SIZE);
-    len = read(fd_in, &block.data[ofs], size);
-    while (len>0) {
-
-        ofs += len;
-        size -= len;
-        while (len > 0 && size > 0) {
-            len = read(fd_in, &block.data[ofs], size);
-            if (len > 0) {
-                ofs += len;
-                size -= len;
-            }
-        }
-        if (len<0) {
-            fprintf(stderr, "Error %d (%s) , Failed to read from %s\n", errno, strerror(errno), fpath_in);
-            exit(1);
-        }
-
-        block.header.version = HTON(1);
-        block.header.length = HTON(ofs);
-        initialise_seed(block.header.seed);
-        hash_init(&cx);
-        hash_step(&cx, block.header.seed, AA_SEED_SIZE);
-        hash_step(&cx, block.data, AA_DATA_SIZE);
-        hash_finish(&cx, block.header.sha1);
-
-        block_length = ofs + AA_HEAD_SIZE;
-        len = write(fd_out, &block, block_length);
-        if (len != block_length) {
-            fprintf(stderr, "Error %d (%s) , Failed to write to %s\n", EIO, strerror(EIO), fpath_out);
-            exit(1);
-        }
-
-        ofs = 0;
-        size = AA_DATA_SIZE;
-        memset(&block, 0, AA_BLOCK_SIZE);
-        len = read(fd_in, &block.data[ofs], size);
-    }
-    if (len<0) {
+    if (skip_input(fd_in, offset)!=0) {
         fprintf(stderr, "Error %d (%s) , Failed to read from %s\n", errno, strerror(errno), fpath_in);
         exit(1);
     }
 
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.fd_in = fd_in;
+    pipe.fd_out = fd_out;
+    pipe.in_size = (size_t)(AA_PIPE_BATCH_BYTES / AA_BLOCK_SIZE) * AA_DATA_SIZE;
+    pipe.out_size = AA_PIPE_BATCH_BYTES;
+    pipe.threads = threads;
+    pipe.limit = length;
+    pipe.work = encode_batch;
+    if (run_pipeline(&pipe, fpath_in, fpath_out)!=0) {
+        exit(1);
+    }
+
     close(fd_out);
     close(fd_in);
     return 0;
@@ -0,0 +1,1134 @@
+/*
+  Erasure coded block layout
+
+  Block n of a file is kept as an ordinary block on data root n % k, at
+  offset (n / k) * AA_BLOCK_SIZE, so each data root holds every k-th block
+  of the file packed together. The k blocks at the same offset make up a
+  stripe, and parity root j holds parity shard j of every stripe at that
+  offset. Parity is computed over whole blocks, headers included and zero
+  padded, and a block past the end of the file counts as zeros, so every
+  stripe is k blocks wide.
+
+  Blocks are read from their own data root and checked by their hash, as
+  a mirrored copy is. One that is corrupt is first put right from its own
+  error correction trailer when the archive keeps them. One that is still
+  corrupt, or missing, is rebuilt from the rest of its stripe under the
+  stripe's block lock, checked by its hash in turn and written back. Parity carries no hash and is checked by working
+  it out again from sound data, which the scrubber does for every stripe.
+  A write rewrites the parity of each stripe it touches, reading the other
+  blocks of any stripe it only partly covers.
+
+  The end of a file is found from the sizes of its roots, parity
+  included. Blocks lost from the end of a data root would make the file
+  look shorter, so when the sizes leave room for that the last stripe is
+  mended first and the blocks it rebuilds count towards the file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "erasure.h"
+#include "rs.h"
+#include "hash.h"
+#include "fec.h"
+#include "logs.h"
+#include "seed.h"
+#include "cache.h"
+#include "io.h"
+#include "stats.h"
+
+/* A data shard past the end of the file, which reads as zeros. */
+#define SHARD_ABSENT (-1)
+/* A data shard taken to be past the end of the file that may have been lost. */
+#define SHARD_TAIL (-2)
+
+/* A stripe as read, followed by room for the parity worked out from it. */
+#define STRIPE_BYTES ((size_t)(AA_NUM_ROOTS + AA_PARITY_ROOTS) * AA_BLOCK_SIZE)
+
+static struct rs_code code;
+
+int init_erasure() {
+    if (rs_init(&code, AA_DATA_ROOTS, AA_PARITY_ROOTS)!=0) {
+        return EINVAL;
+    }
+    return 0;
+}
+
+static unsigned char *shard_at(unsigned char *buf, int idx) {
+    return buf + (size_t)idx * AA_BLOCK_SIZE;
+}
+
+static off_t stripe_of(off_t block_no) {
+    return block_no / AA_DATA_ROOTS;
+}
+
+static int column_of(off_t block_no) {
+    return (int)(block_no % AA_DATA_ROOTS);
+}
+
+static int stripe_lock(const struct file_entry *file_entry, off_t stripe) {
+    return block_lock_index(file_entry, stripe * AA_DATA_ROOTS * AA_BLOCK_SIZE);
+}
+
+/*
+  The size of the file in each root, parity included. A root without the
+  file counts as empty. Returns an errno.
+*/
+static int root_sizes(const struct file_entry *file_entry, off_t size[]) {
+    struct stat statbuf;
+    int idx;
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        size[idx] = 0;
+        if (file_entry->file[idx].fd<0) {
+            continue;
+        }
+        if (fstat(file_entry->file[idx].fd, &statbuf)<0) {
+            return errno;
+        }
+        size[idx] = statbuf.st_size;
+    }
+    return 0;
+}
+
+/*
+  The number of the last block of the file, -1 when it is empty, from the
+  sizes of its data roots.
+*/
+static off_t sized_last(const off_t size[]) {
+    off_t last;
+    off_t held;
+    int idx;
+
+    last = -1;
+    for(idx=0; idx<AA_DATA_ROOTS; idx++) {
+        held = (size[idx] + AA_BLOCK_SIZE - 1) / AA_BLOCK_SIZE;
+        if ((held>0) && ((held - 1) * AA_DATA_ROOTS + idx > last)) {
+            last = (held - 1) * AA_DATA_ROOTS + idx;
+        }
+    }
+    return last;
+}
+
+/*
+  The number of stripes held by the roots, parity included, which may run
+  past the last block when blocks at the end of the file have been lost.
+*/
+static off_t sized_stripes(const off_t size[]) {
+    off_t stripes;
+    off_t held;
+    int idx;
+
+    stripes = 0;
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        held = (size[idx] + AA_BLOCK_SIZE - 1) / AA_BLOCK_SIZE;
+        if (held>stripes) {
+            stripes = held;
+        }
+    }
+    return stripes;
+}
+
+/*
+  Whether the sizes of the roots leave room for blocks lost from the end
+  of a data root past block last. Only the last block of a file is short,
+  so when it is short and its stripe is the last one stored nothing can
+  follow it. A full last block with room after it in its stripe, or a
+  stripe stored past it, may have lost blocks behind it.
+*/
+static int tail_lost(const off_t size[], off_t last) {
+    off_t stripes;
+
+    stripes = sized_stripes(size);
+    if (stripes==0) {
+        return 0;
+    }
+    if ((last<0) || (last / AA_DATA_ROOTS < stripes - 1)) {
+        return 1;
+    }
+    return (last % AA_DATA_ROOTS<AA_DATA_ROOTS - 1) && (size[last % AA_DATA_ROOTS] % AA_BLOCK_SIZE==0);
+}
+
+/*
+  Check the length of a block of which avail bytes were read, zero filling
+  the rest of it. The hash covers neither the length nor the version but
+  parity covers both, so a version of another block size is corrupt too.
+  Returns 0 when its hash is still to be checked.
+*/
+static int block_status(struct data_block *block, ssize_t avail) {
+    if (avail<=0) {
+        return SHARD_ABSENT;
+    }
+    if (avail>AA_BLOCK_SIZE) {
+        avail = AA_BLOCK_SIZE;
+    } else {
+        memset((unsigned char *)block + avail, 0, AA_BLOCK_SIZE - avail);
+    }
+    if (avail != block_stored_size(block)) {
+        return EIO;
+    }
+    if (version_block_size(NTOH(block->header.version))!=AA_BLOCK_SIZE) {
+        return EIO;
+    }
+    return 0;
+}
+
+/*
+  Check the hashes of count blocks together, setting *status[idx] to EIO
+  for each one that fails.
+*/
+static void verify_blocks(const struct data_block *const block[], int *const status[], int count) {
+    int valid[AA_HASH_LANES];
+    int idx;
+    int n;
+
+    stat_add(AA_STAT_BLOCKS_VERIFIED, (uint64_t)count);
+    for(idx=0; idx<count; idx+=AA_HASH_LANES) {
+        n = (count - idx < AA_HASH_LANES) ? count - idx : AA_HASH_LANES;
+        blocks_hash_valid(&block[idx], n, valid);
+        while (n-->0) {
+            if (!valid[n]) {
+                stat_add(AA_STAT_HASH_FAILURES, 1);
+                *status[idx + n] = EIO;
+            }
+        }
+    }
+}
+
+/*
+  Read every shard of a stripe into buf in one batch. status[idx] is 0
+  for a sound shard. A data shard that is absent is SHARD_ABSENT when it
+  lies past block last and ENOENT when it should be there. A parity shard
+  is SHARD_ABSENT when it is missing and EIO when it is not whole.
+  corrected[idx] is set for a data shard that was put right by its error
+  correction and is sound but still to be written back.
+*/
+static void read_stripe(struct file_entry *file_entry, off_t stripe, off_t last, unsigned char *buf, int status[], int corrected[]) {
+    const struct data_block *block[AA_MAX_ROOTS];
+    int *result[AA_MAX_ROOTS];
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+    ssize_t bytes_read;
+    int idx;
+    int n;
+
+    memset(buf, 0, (size_t)AA_NUM_ROOTS * AA_BLOCK_SIZE);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        io_prepare(&request[idx], file_entry->file[idx].fd, 0, shard_at(buf, idx), AA_BLOCK_SIZE, stripe * AA_BLOCK_SIZE);
+    }
+    io_submit(&batch, request, AA_NUM_ROOTS);
+
+    n = 0;
+    while ((idx = io_complete(&batch)) >= 0) {
+        bytes_read = request[idx].result;
+        if (bytes_read>0) {
+            stat_add(AA_STAT_BYTES_READ(idx), (uint64_t)bytes_read);
+        }
+        if (bytes_read<0) {
+            log_error("readstripe", (int)-bytes_read, "idx=%d fd=%d stripe = %lld", idx, file_entry->file[idx].fd, (long long)stripe);
+            status[idx] = EIO;
+        } else if (idx>=AA_DATA_ROOTS) {
+            status[idx] = (bytes_read==0) ? SHARD_ABSENT : ((bytes_read==AA_BLOCK_SIZE) ? 0 : EIO);
+        } else {
+            status[idx] = block_status((struct data_block *)shard_at(buf, idx), bytes_read);
+            if ((status[idx]==SHARD_ABSENT) && (stripe * AA_DATA_ROOTS + idx <= last)) {
+                status[idx] = ENOENT;
+            }
+            if (status[idx]==0) {
+                block[n] = (const struct data_block *)shard_at(buf, idx);
+                result[n] = &status[idx];
+                n++;
+            }
+        }
+    }
+    verify_blocks(block, result, n);
+
+    for(idx=0; idx<AA_DATA_ROOTS; idx++) {
+        corrected[idx] = (status[idx]==EIO) && (request[idx].result>0) && (fec_correct_block((struct data_block *)shard_at(buf, idx))>0);
+        if (corrected[idx]) {
+            status[idx] = 0;
+        }
+    }
+}
+
+static int zero_shard(const unsigned char *shard) {
+    int idx;
+    for(idx=0; idx<AA_BLOCK_SIZE; idx++) {
+        if (shard[idx]!=0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+  Rebuild the data shards of a stripe that are not sound from the others,
+  keeping the result only when every rebuilt block passes its hash check,
+  or for a SHARD_TAIL shard comes out as zeros. When it does not each
+  sound parity shard is left out in turn, in case it was the one at fault.
+  rebuilt[idx] is set for each block rebuilt.
+*/
+static int rebuild_stripe(unsigned char *buf, const int status[], int rebuilt[]) {
+    unsigned char *shard[AA_MAX_ROOTS];
+    int present[AA_MAX_ROOTS];
+    int skip;
+    int sound;
+    int idx;
+
+    for(skip=-1; skip<AA_NUM_ROOTS; skip++) {
+        if ((skip>=0) && ((skip<AA_DATA_ROOTS) || (status[skip]!=0))) {
+            continue;
+        }
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            shard[idx] = shard_at(buf, idx);
+            present[idx] = (idx!=skip) && ((status[idx]==0) || ((idx<AA_DATA_ROOTS) && (status[idx]==SHARD_ABSENT)));
+        }
+        if (rs_reconstruct(&code, shard, present, AA_BLOCK_SIZE)!=0) {
+            return EIO;
+        }
+        sound = 1;
+        for(idx=0; idx<AA_DATA_ROOTS; idx++) {
+            rebuilt[idx] = !present[idx];
+            if (rebuilt[idx] && (status[idx]==SHARD_TAIL) && zero_shard(shard[idx])) {
+                rebuilt[idx] = 0;
+            } else if (rebuilt[idx] && sound) {
+                stat_add(AA_STAT_BLOCKS_VERIFIED, 1);
+                sound = block_hash_valid((const struct data_block *)shard[idx]);
+            }
+        }
+        if (sound) {
+            return 0;
+        }
+    }
+    memset(rebuilt, 0, AA_DATA_ROOTS * sizeof(int));
+    return EIO;
+}
+
+/*
+  Work out the parity of the data shards into the room after the stripe
+  and mark each stored parity shard that differs from it. Returns the
+  number of stored parity shards that agree.
+*/
+static int check_parity(unsigned char *buf, const int status[], int wrong[]) {
+    const unsigned char *data[AA_MAX_ROOTS];
+    unsigned char *parity[AA_MAX_ROOTS];
+    int agree;
+    int idx;
+
+    for(idx=0; idx<AA_DATA_ROOTS; idx++) {
+        data[idx] = shard_at(buf, idx);
+    }
+    for(idx=0; idx<AA_PARITY_ROOTS; idx++) {
+        parity[idx] = shard_at(buf, AA_NUM_ROOTS + idx);
+    }
+    rs_encode(&code, data, parity, AA_BLOCK_SIZE);
+
+    agree = 0;
+    for(idx=AA_DATA_ROOTS; idx<AA_NUM_ROOTS; idx++) {
+        wrong[idx] = (status[idx]!=0) || (memcmp(shard_at(buf, idx), shard_at(buf, idx + AA_PARITY_ROOTS), AA_BLOCK_SIZE)!=0);
+        if (!wrong[idx]) {
+            agree++;
+        }
+    }
+    return agree;
+}
+
+/*
+  When no stored parity agrees with the data of a stripe, the blocks taken
+  to be past the end of the file may instead have been lost from the end
+  of their data roots. Try each place the file could end, nearest first,
+  and keep the first that rebuilds every block before it. Returns 0 when
+  one does, otherwise the absent blocks are left as zeros.
+*/
+static int rebuild_tail(unsigned char *buf, int status[], int rebuilt[]) {
+    int tail[AA_MAX_ROOTS];
+    int end;
+    int idx;
+
+    for(end=0; end<AA_DATA_ROOTS; end++) {
+        if (status[end]!=SHARD_ABSENT) {
+            continue;
+        }
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            tail[idx] = ((idx<=end) && (status[idx]==SHARD_ABSENT)) ? SHARD_TAIL : status[idx];
+        }
+        if (rebuild_stripe(buf, tail, rebuilt)==0) {
+            memcpy(status, tail, sizeof(tail));
+            return 0;
+        }
+    }
+    for(idx=0; idx<AA_DATA_ROOTS; idx++) {
+        if (status[idx]==SHARD_ABSENT) {
+            memset(shard_at(buf, idx), 0, AA_BLOCK_SIZE);
+        }
+    }
+    return EIO;
+}
+
+/*
+  Write the shards marked in rewrite[] back to their roots: rebuilt or
+  corrected data blocks at their length and parity as worked out by
+  check_parity.
+*/
+static void rewrite_shards(struct file_entry *file_entry, off_t stripe, unsigned char *buf, const int status[], const int rewrite[], const int corrected[]) {
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+    int root[AA_MAX_ROOTS];
+    ssize_t bytes_written;
+    int count;
+    int idx;
+
+    count = 0;
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (!rewrite[idx]) {
+            continue;
+        }
+        if (idx<AA_DATA_ROOTS) {
+            io_prepare(&request[count], file_entry->file[idx].fd, 1, shard_at(buf, idx), block_stored_size((struct data_block *)shard_at(buf, idx)), stripe * AA_BLOCK_SIZE);
+        } else {
+            io_prepare(&request[count], file_entry->file[idx].fd, 1, shard_at(buf, idx + AA_PARITY_ROOTS), AA_BLOCK_SIZE, stripe * AA_BLOCK_SIZE);
+        }
+        root[count++] = idx;
+    }
+    io_submit(&batch, request, count);
+
+    while ((idx = io_complete(&batch)) >= 0) {
+        bytes_written = request[idx].result;
+        if (bytes_written>0) {
+            stat_add(AA_STAT_BYTES_WRITTEN(root[idx]), (uint64_t)bytes_written);
+        }
+        if (bytes_written!=(ssize_t)request[idx].single.iov_len) {
+            log_error("repair", (bytes_written<0?(int)-bytes_written:EIO), "idx=%d stripe = %lld", root[idx], (long long)stripe);
+            continue;
+        }
+        log_info("repair", "Rebuilt idx=%d stripe = %lld", root[idx], (long long)stripe);
+        if ((root[idx]<AA_DATA_ROOTS) && corrected[root[idx]]) {
+            stat_add(AA_STAT_REPAIRS_FEC, 1);
+        } else if ((status[root[idx]]==ENOENT) || (status[root[idx]]==SHARD_ABSENT) || (status[root[idx]]==SHARD_TAIL)) {
+            stat_add(AA_STAT_REPAIRS_MISSING, 1);
+        } else if (status[root[idx]]==0) {
+            stat_add(AA_STAT_REPAIRS_MISMATCHED, 1);
+        } else {
+            stat_add(AA_STAT_REPAIRS_CORRUPT, 1);
+        }
+    }
+}
+
+/*
+  Read a stripe into buf and make its data whole, rebuilding any data
+  shard that is corrupt or missing. *damaged is set when any shard, data
+  or parity, is not as it should be, and with repair set those shards are
+  written back, for which the stripe's block lock must be held. Returns 0
+  when every data shard in buf is sound.
+*/
+static int mend_stripe(struct file_entry *file_entry, off_t stripe, off_t last, unsigned char *buf, int repair, int *damaged) {
+    int status[AA_MAX_ROOTS];
+    int rewrite[AA_MAX_ROOTS];
+    int corrected[AA_MAX_ROOTS];
+    int absent;
+    int stored;
+    int idx;
+
+    *damaged = 0;
+    memset(rewrite, 0, sizeof(rewrite));
+    read_stripe(file_entry, stripe, last, buf, status, corrected);
+
+    absent = 0;
+    stored = 0;
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if ((idx<AA_DATA_ROOTS) && (status[idx]==SHARD_ABSENT)) {
+            absent++;
+        } else if ((idx<AA_DATA_ROOTS) && (status[idx]!=0)) {
+            *damaged = 1;
+        } else if (status[idx]==0) {
+            stored += (idx>=AA_DATA_ROOTS);
+        }
+    }
+    if ((absent==AA_DATA_ROOTS) && (stored==0)) {
+        return 0;
+    }
+    if (*damaged && (rebuild_stripe(buf, status, rewrite)!=0)) {
+        log_error("mendstripe", EIO, "stripe = %lld cannot be rebuilt", (long long)stripe);
+        return EIO;
+    }
+
+    if ((check_parity(buf, status, rewrite)==0) && (stored>0) && (absent>0) && !*damaged) {
+        if (rebuild_tail(buf, status, rewrite)==0) {
+            check_parity(buf, status, rewrite);
+        } else if (absent==AA_DATA_ROOTS) {
+            return 0;
+        }
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if ((idx<AA_DATA_ROOTS) && corrected[idx]) {
+            rewrite[idx] = 1;
+        }
+        if (rewrite[idx]) {
+            *damaged = 1;
+        }
+    }
+    if (repair && *damaged) {
+        rewrite_shards(file_entry, stripe, buf, status, rewrite, corrected);
+    }
+    return 0;
+}
+
+/*
+  The last block of the file, -1 when it is empty, and its length. A data
+  root that has lost blocks from its end makes the file look shorter than
+  it is, so when the sizes of the roots leave room for that the last
+  stripe they hold is mended, as the scrubber would, and its last block
+  that is not zeros taken as the end of the file. Returns an errno, with
+  the end as the sizes give it.
+*/
+static int end_of_file(struct file_entry *file_entry, const off_t size[], off_t *last, int *length) {
+    unsigned char *buf;
+    off_t stripe;
+    off_t held;
+    int damaged;
+    int err_no;
+    int idx;
+
+    *last = sized_last(size);
+    *length = 0;
+    if (*last>=0) {
+        held = size[column_of(*last)] - stripe_of(*last) * AA_BLOCK_SIZE;
+        *length = (held>=AA_BLOCK_SIZE) ? AA_DATA_SIZE : ((held>AA_HEAD_SIZE) ? (int)held - AA_HEAD_SIZE : 0);
+    }
+    if (!tail_lost(size, *last)) {
+        return 0;
+    }
+
+    buf = malloc(STRIPE_BYTES);
+    if (buf==NULL) {
+        return ENOMEM;
+    }
+    stripe = sized_stripes(size) - 1;
+    err_no = mend_stripe(file_entry, stripe, *last, buf, 0, &damaged);
+    for(idx=AA_DATA_ROOTS-1; (err_no==0) && (idx>=0); idx--) {
+        if (zero_shard(shard_at(buf, idx))) {
+            continue;
+        }
+        if (stripe * AA_DATA_ROOTS + idx > *last) {
+            *last = stripe * AA_DATA_ROOTS + idx;
+            *length = NTOH(((struct data_block *)shard_at(buf, idx))->header.length);
+            log_info("lastblock", "block = %lld lost from the end of its data root", (long long)*last);
+        }
+        break;
+    }
+    free(buf);
+    return err_no;
+}
+
+/* The number of the last block of an open file, -1 when it is empty. */
+static int last_block(struct file_entry *file_entry, off_t *last) {
+    off_t size[AA_MAX_ROOTS];
+    int length;
+    int err_no;
+
+    err_no = root_sizes(file_entry, size);
+    if (err_no!=0) {
+        return err_no;
+    }
+    return end_of_file(file_entry, size, last, &length);
+}
+
+/*
+  The logical size of a file given a descriptor on it in each root, -1
+  for a root without it. The descriptors need only be good for fstat, as
+  O_PATH ones are, and the file is opened again to read its end when
+  blocks may have been lost from it. Falls back on the sizes of the data
+  roots when the end cannot be read.
+*/
+off_t ec_file_size(const int fd[]) {
+    struct file_entry file_entry;
+    off_t size[AA_MAX_ROOTS];
+    char fpath[32];
+    off_t last;
+    int length;
+    int reopen;
+    int idx;
+
+    memset(&file_entry, 0, sizeof(file_entry));
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        file_entry.file[idx].fd = fd[idx];
+    }
+    root_sizes(&file_entry, size);
+    reopen = tail_lost(size, sized_last(size));
+    for(idx=0; idx<AA_NUM_ROOTS && reopen; idx++) {
+        if (fd[idx]>=0) {
+            snprintf(fpath, sizeof(fpath), "/proc/self/fd/%d", fd[idx]);
+            file_entry.file[idx].fd = open(fpath, O_RDONLY);
+        }
+    }
+    end_of_file(&file_entry, size, &last, &length);
+    for(idx=0; idx<AA_NUM_ROOTS && reopen; idx++) {
+        if (file_entry.file[idx].fd>=0) {
+            close(file_entry.file[idx].fd);
+        }
+    }
+    return (last<0) ? 0 : last * AA_DATA_SIZE + length;
+}
+
+/*
+  Rebuild one block from its stripe, under the stripe lock, repairing
+  whatever else in the stripe is damaged on the way.
+*/
+static int rebuild_block(struct file_entry *file_entry, off_t block_no, off_t last, struct data_block *block) {
+    unsigned char *buf;
+    int damaged;
+    int err_no;
+    int lock;
+
+    buf = malloc(STRIPE_BYTES);
+    if (buf==NULL) {
+        log_error("rebuild", ENOMEM, "block = %lld", (long long)block_no);
+        return ENOMEM;
+    }
+    lock = stripe_lock(file_entry, stripe_of(block_no));
+    lock_block(lock);
+    err_no = mend_stripe(file_entry, stripe_of(block_no), last, buf, 1, &damaged);
+    unlock_block(lock, 0);
+    if (err_no==0) {
+        memcpy(block, shard_at(buf, column_of(block_no)), AA_BLOCK_SIZE);
+    }
+    free(buf);
+    return err_no;
+}
+
+/*
+  Write back a block put right by its error correction, unless its stripe
+  was written since the block was read.
+*/
+static void rewrite_corrected(struct file_entry *file_entry, off_t block_no, const struct data_block *block, uint64_t generation) {
+    ssize_t bytes_written;
+    int lock;
+    int col;
+
+    col = column_of(block_no);
+    lock = stripe_lock(file_entry, stripe_of(block_no));
+    lock_block(lock);
+    if (block_generation(lock)==generation) {
+        bytes_written = pwrite(file_entry->file[col].fd, block, block_stored_size(block), stripe_of(block_no) * AA_BLOCK_SIZE);
+        if (bytes_written==block_stored_size(block)) {
+            log_info("repair", "Corrected idx=%d block = %lld", col, (long long)block_no);
+            stat_add(AA_STAT_REPAIRS_FEC, 1);
+            stat_add(AA_STAT_BYTES_WRITTEN(col), (uint64_t)bytes_written);
+        } else {
+            log_error("repair", (bytes_written<0?errno:EIO), "idx=%d block = %lld", col, (long long)block_no);
+        }
+    }
+    unlock_block(lock, 0);
+}
+
+/*
+  Read one block from its data root, putting it right from its error
+  correction or rebuilding it when it is not sound. A block past the end
+  of the file is made into a new empty one.
+*/
+static int read_one(struct file_entry *file_entry, off_t block_no, off_t last, struct data_block *block) {
+    const struct data_block *check[1];
+    int *result[1];
+    struct io_request request;
+    struct io_batch batch;
+    uint64_t generation;
+    int status;
+    int col;
+
+    if (block_no>last) {
+        memset(block, 0, AA_BLOCK_SIZE);
+        block->header.version = HTON(block_version(AA_VERSION_1));
+        if (initialise_seed(block->header.seed)!=0) {
+            log_error("initialise", EAGAIN, "Failed to initialise seed");
+            return EAGAIN;
+        }
+        return 0;
+    }
+
+    stat_add(AA_STAT_BLOCKS_READ, 1);
+    col = column_of(block_no);
+    generation = block_generation(stripe_lock(file_entry, stripe_of(block_no)));
+    io_prepare(&request, file_entry->file[col].fd, 0, block, AA_BLOCK_SIZE, stripe_of(block_no) * AA_BLOCK_SIZE);
+    io_submit(&batch, &request, 1);
+    while (io_complete(&batch) >= 0) {
+    }
+    if (request.result>0) {
+        stat_add(AA_STAT_BYTES_READ(col), (uint64_t)request.result);
+    }
+    status = (request.result<0) ? EIO : block_status(block, request.result);
+    if (status==0) {
+        check[0] = block;
+        result[0] = &status;
+        verify_blocks(check, result, 1);
+    }
+    if (status==0) {
+        return 0;
+    }
+    if ((status==EIO) && (request.result>0) && (fec_correct_block(block)>0)) {
+        rewrite_corrected(file_entry, block_no, block, generation);
+        return 0;
+    }
+    log_info("readblock", "idx=%d block = %lld not sound (%d), rebuilding", col, (long long)block_no, status);
+    return rebuild_block(file_entry, block_no, last, block);
+}
+
+int ec_read_block(struct file_entry *file_entry, off_t file_block_ofs, struct block_set *blocks) {
+    off_t last;
+    int err_no;
+
+    err_no = last_block(file_entry, &last);
+    if (err_no!=0) {
+        log_error("readblock", err_no, "fstat failed");
+        return err_no;
+    }
+    blocks->copy[0].corrupt = 0;
+    return read_one(file_entry, file_block_ofs / AA_BLOCK_SIZE, last, &blocks->copy[0].block);
+}
+
+/*
+  Read count blocks from block first, all within the file, with one
+  vectored read per data root that puts each block in its place in
+  blocks. status[blk] is set to 0 for each sound block and an errno for
+  the rest. iov, check and result have room for count entries.
+*/
+static void read_span(struct file_entry *file_entry, off_t first, struct data_block *blocks, int count, int status[], struct iovec iov[], const struct data_block *check[], int *result[]) {
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+    int start[AA_MAX_ROOTS + 1];
+    int lead[AA_MAX_ROOTS];
+    int root[AA_MAX_ROOTS];
+    ssize_t bytes_read;
+    int col;
+    int blk;
+    int pos;
+    int req;
+    int idx;
+    int n;
+
+    pos = 0;
+    req = 0;
+    for(col=0; col<AA_DATA_ROOTS; col++) {
+        start[col] = pos;
+        lead[col] = (int)((col - first % AA_DATA_ROOTS + AA_DATA_ROOTS) % AA_DATA_ROOTS);
+        for(blk=lead[col]; blk<count; blk+=AA_DATA_ROOTS) {
+            iov[pos].iov_base = block_at(blocks, blk);
+            iov[pos].iov_len = AA_BLOCK_SIZE;
+            pos++;
+        }
+        if (pos>start[col]) {
+            io_prepare_vector(&request[req], file_entry->file[col].fd, 0, &iov[start[col]], pos - start[col], stripe_of(first + lead[col]) * AA_BLOCK_SIZE);
+            root[req++] = col;
+        }
+    }
+    start[AA_DATA_ROOTS] = pos;
+    io_submit(&batch, request, req);
+
+    while ((idx = io_complete(&batch)) >= 0) {
+        col = root[idx];
+        bytes_read = request[idx].result;
+        if (bytes_read>0) {
+            stat_add(AA_STAT_BYTES_READ(col), (uint64_t)bytes_read);
+        }
+        if (bytes_read<0) {
+            log_error("readblocks", (int)-bytes_read, "idx=%d fd=%d first = %lld , count = %d", col, file_entry->file[col].fd, (long long)first, count);
+        } else {
+            log_info("readblocks", "idx=%d fd=%d first = %lld , count = %d , bytes read = %ld", col, file_entry->file[col].fd, (long long)first, count, bytes_read);
+        }
+        n = 0;
+        blk = lead[col];
+        for(pos=start[col]; pos<start[col+1]; pos++) {
+            if (bytes_read<0) {
+                status[blk] = EIO;
+            } else {
+                status[blk] = block_status(block_at(blocks, blk), bytes_read - (ssize_t)(pos - start[col]) * AA_BLOCK_SIZE);
+            }
+            if (status[blk]==SHARD_ABSENT) {
+                status[blk] = ENOENT;
+            }
+            if (status[blk]==0) {
+                check[n] = block_at(blocks, blk);
+                result[n] = &status[blk];
+                n++;
+            }
+            blk += AA_DATA_ROOTS;
+        }
+        verify_blocks(check, result, n);
+    }
+}
+
+/*
+  Read count consecutive blocks starting at file_block_ofs, a span of
+  stripes at a time, reading each data root once per span. Blocks that
+  are not sound and cannot be put right from their error correction are
+  rebuilt one at a time. On return *blocks_read holds
+  the number of blocks before end of file.
+*/
+int ec_read_blocks(struct file_entry *file_entry, off_t file_block_ofs, struct data_block *blocks, int count, int *blocks_read) {
+    struct data_block *block;
+    struct iovec *iov;
+    const struct data_block **check;
+    int **result;
+    int *status;
+    uint64_t *generation;
+    uint64_t epoch;
+    off_t first;
+    off_t last;
+    int done;
+    int span;
+    int blk;
+    int lock;
+    int err_no;
+
+    *blocks_read = 0;
+    err_no = last_block(file_entry, &last);
+    if (err_no!=0) {
+        log_error("readblocks", err_no, "fstat failed");
+        return err_no;
+    }
+    first = file_block_ofs / AA_BLOCK_SIZE;
+    if (first + count - 1 > last) {
+        count = (int)(last - first + 1);
+    }
+    if (count<=0) {
+        return 0;
+    }
+
+    span = AA_EC_READ_STRIPES * AA_DATA_ROOTS;
+    if (span>count) {
+        span = count;
+    }
+    iov = malloc((size_t)span * (sizeof(struct iovec) + sizeof(struct data_block *) + sizeof(int *) + sizeof(uint64_t) + sizeof(int)));
+    if (iov==NULL) {
+        log_error("readblocks", ENOMEM, "count=%d", count);
+        return ENOMEM;
+    }
+    check = (const struct data_block **)(iov + span);
+    result = (int **)(check + span);
+    generation = (uint64_t *)(result + span);
+    status = (int *)(generation + span);
+
+    epoch = cache_epoch(file_entry->dev, file_entry->ino);
+    for(done=0; (done<count) && (*blocks_read==done) && (err_no==0); done+=span) {
+        if (span>count - done) {
+            span = count - done;
+        }
+        for(blk=0; blk<span; blk++) {
+            generation[blk] = block_generation(stripe_lock(file_entry, stripe_of(first + done + blk)));
+        }
+        read_span(file_entry, first + done, block_at(blocks, done), span, status, iov, check, result);
+
+        for(blk=0; blk<span; blk++) {
+            block = block_at(blocks, done + blk);
+            lock = stripe_lock(file_entry, stripe_of(first + done + blk));
+            if ((status[blk]==EIO) && (fec_correct_block(block)>0)) {
+                rewrite_corrected(file_entry, first + done + blk, block, generation[blk]);
+                status[blk] = 0;
+            }
+            if (status[blk]!=0) {
+                log_info("readblocks", "block = %lld not sound (%d), rebuilding", (long long)(first + done + blk), status[blk]);
+                generation[blk] = block_generation(lock);
+                err_no = rebuild_block(file_entry, first + done + blk, last, block);
+                if (err_no!=0) {
+                    break;
+                }
+            }
+            stat_add(AA_STAT_BLOCKS_READ, 1);
+            cache_read_block(file_entry, (first + done + blk) * AA_BLOCK_SIZE, block, lock, generation[blk], epoch);
+            *blocks_read = done + blk + 1;
+            if (NTOH(block->header.length)<AA_DATA_SIZE) {
+                break;
+            }
+        }
+    }
+
+    free(iov);
+    return err_no;
+}
+
+/*
+  Write count consecutive blocks starting at file_block_ofs together with
+  the parity of every stripe they touch. Each data root gets one vectored
+  write of its blocks and each parity root one of its shards, all in one
+  batch. The stripe locks are taken in ascending order, as write_blocks
+  takes block locks.
+*/
+int ec_write_blocks(struct file_entry *file_entry, struct data_block *blocks[], int count, off_t file_block_ofs) {
+    struct io_request request[AA_MAX_ROOTS];
+    struct io_batch batch;
+    struct iovec *iov;
+    unsigned char *buf;
+    unsigned char *stripe_buf;
+    unsigned char *data[AA_MAX_ROOTS];
+    unsigned char *parity[AA_MAX_ROOTS];
+    unsigned char held[AA_BLOCK_LOCKS];
+    ssize_t total[AA_MAX_ROOTS];
+    int root[AA_MAX_ROOTS];
+    ssize_t bytes_written;
+    off_t first;
+    off_t last;
+    off_t stripe;
+    int stripes;
+    off_t block_no;
+    int damaged;
+    int partial;
+    int length;
+    int err_no;
+    int lock;
+    int pos;
+    int req;
+    int idx;
+    int blk;
+    int n;
+
+    if (count<=0) {
+        return 0;
+    }
+    if (count>AA_MAX_WRITE_BLOCKS) {
+        return EINVAL;
+    }
+
+    first = file_block_ofs / AA_BLOCK_SIZE;
+    stripes = (int)(stripe_of(first + count - 1) - stripe_of(first) + 1);
+    buf = malloc((size_t)stripes * STRIPE_BYTES + (size_t)(count + stripes * AA_PARITY_ROOTS) * sizeof(struct iovec));
+    if (buf==NULL) {
+        log_error("writeblocks", ENOMEM, "count=%d", count);
+        return ENOMEM;
+    }
+    iov = (struct iovec *)(buf + (size_t)stripes * STRIPE_BYTES);
+
+    hash_blocks(blocks, count);
+
+    memset(held, 0, sizeof(held));
+    for(stripe=0; stripe<stripes; stripe++) {
+        held[stripe_lock(file_entry, stripe_of(first) + stripe)] = 1;
+    }
+    for(lock=0; lock<AA_BLOCK_LOCKS; lock++) {
+        if (held[lock]) {
+            lock_block(lock);
+        }
+    }
+
+    err_no = last_block(file_entry, &last);
+    for(stripe=0; stripe<stripes && err_no==0; stripe++) {
+        stripe_buf = buf + (size_t)stripe * STRIPE_BYTES;
+        partial = 0;
+        for(idx=0; idx<AA_DATA_ROOTS; idx++) {
+            block_no = (stripe_of(first) + stripe) * AA_DATA_ROOTS + idx;
+            if (((block_no<first) || (block_no>=first + count)) && (block_no<=last)) {
+                partial = 1;
+            }
+        }
+        if (partial) {
+            err_no = mend_stripe(file_entry, stripe_of(first) + stripe, last, stripe_buf, 1, &damaged);
+        } else {
+            memset(stripe_buf, 0, (size_t)AA_DATA_ROOTS * AA_BLOCK_SIZE);
+        }
+        for(idx=0; idx<AA_DATA_ROOTS; idx++) {
+            block_no = (stripe_of(first) + stripe) * AA_DATA_ROOTS + idx;
+            if ((block_no>=first) && (block_no<first + count)) {
+                length = block_stored_size(blocks[block_no - first]);
+                memcpy(shard_at(stripe_buf, idx), blocks[block_no - first], length);
+                memset(shard_at(stripe_buf, idx) + length, 0, AA_BLOCK_SIZE - length);
+            }
+            data[idx] = shard_at(stripe_buf, idx);
+        }
+        for(idx=0; idx<AA_PARITY_ROOTS; idx++) {
+            parity[idx] = shard_at(stripe_buf, AA_DATA_ROOTS + idx);
+        }
+        rs_encode(&code, (const unsigned char *const *)data, parity, AA_BLOCK_SIZE);
+    }
+
+    req = 0;
+    pos = 0;
+    for(idx=0; idx<AA_NUM_ROOTS && err_no==0; idx++) {
+        root[req] = idx;
+        total[req] = 0;
+        n = 0;
+        if (idx<AA_DATA_ROOTS) {
+            blk = (int)((idx - first % AA_DATA_ROOTS + AA_DATA_ROOTS) % AA_DATA_ROOTS);
+            stripe = stripe_of(first + blk);
+            for(; blk<count; blk+=AA_DATA_ROOTS) {
+                iov[pos + n].iov_base = blocks[blk];
+                iov[pos + n].iov_len = block_stored_size(blocks[blk]);
+                total[req] += (ssize_t)iov[pos + n].iov_len;
+                n++;
+            }
+        } else {
+            stripe = stripe_of(first);
+            for(; n<stripes; n++) {
+                iov[pos + n].iov_base = shard_at(buf + (size_t)n * STRIPE_BYTES, idx);
+                iov[pos + n].iov_len = AA_BLOCK_SIZE;
+                total[req] += AA_BLOCK_SIZE;
+            }
+        }
+        if (n>0) {
+            io_prepare_vector(&request[req], file_entry->file[idx].fd, 1, &iov[pos], n, stripe * AA_BLOCK_SIZE);
+            pos += n;
+            req++;
+        }
+    }
+
+    if (err_no==0) {
+        io_submit(&batch, request, req);
+        while ((idx = io_complete(&batch)) >= 0) {
+            bytes_written = request[idx].result;
+            if (bytes_written>0) {
+                stat_add(AA_STAT_BYTES_WRITTEN(root[idx]), (uint64_t)bytes_written);
+            }
+            if (bytes_written!=total[idx]) {
+                if (err_no==0) {
+                    err_no = (bytes_written<0?(int)-bytes_written:EIO);
+                }
+                log_error("writeblocks", (bytes_written<0?(int)-bytes_written:EIO), "idx=%d fd=%d offset = %lu , count = %d , bytes written = %ld", root[idx], file_entry->file[root[idx]].fd, file_block_ofs, count, bytes_written);
+            } else {
+                log_info("writeblocks", "idx=%d fd=%d offset = %lu , count = %d , bytes written = %ld", root[idx], file_entry->file[root[idx]].fd, file_block_ofs, count, bytes_written);
+            }
+        }
+    }
+
+    if (err_no==0) {
+        stat_add(AA_STAT_BLOCKS_WRITTEN, (uint64_t)count);
+    }
+    for(blk=0; blk<count && err_no==0; blk++) {
+        cache_insert(file_entry->dev, file_entry->ino, file_block_ofs + (off_t)blk * AA_BLOCK_SIZE, blocks[blk], cache_epoch(file_entry->dev, file_entry->ino));
+    }
+    if (err_no!=0) {
+        cache_invalidate(file_entry->dev, file_entry->ino, file_block_ofs);
+    }
+
+    for(lock=AA_BLOCK_LOCKS-1; lock>=0; lock--) {
+        if (held[lock]) {
+            unlock_block(lock, 1);
+        }
+    }
+
+    free(buf);
+    return err_no;
+}
+
+/*
+  Scrub count stripes starting at the one stored at stripe_ofs, checking
+  the data and parity of each and repairing whatever is damaged under the
+  stripe lock. err_no[idx] and repaired[idx] report on each stripe.
+  Returns the number of stripes before the end of the roots, which can
+  run past the end of the file when its last blocks have been lost.
+*/
+int ec_scrub_blocks(struct file_entry *file_entry, off_t stripe_ofs, int count, int err_no[], int repaired[]) {
+    unsigned char *buf;
+    off_t size[AA_MAX_ROOTS];
+    off_t stripe;
+    off_t stripes;
+    off_t last;
+    int length;
+    int damaged;
+    int lock;
+    int idx;
+
+    if (root_sizes(file_entry, size)!=0) {
+        return 0;
+    }
+    end_of_file(file_entry, size, &last, &length);
+    stripes = sized_stripes(size);
+    if (stripes==0) {
+        return 0;
+    }
+    buf = malloc(STRIPE_BYTES);
+    if (buf==NULL) {
+        log_error("scrubblocks", ENOMEM, "count=%d", count);
+        return 0;
+    }
+
+    stripe = stripe_ofs / AA_BLOCK_SIZE;
+    for(idx=0; idx<count && stripe + idx<stripes; idx++) {
+        repaired[idx] = 0;
+        err_no[idx] = mend_stripe(file_entry, stripe + idx, last, buf, 0, &damaged);
+        if ((err_no[idx]!=0) || damaged) {
+            lock = stripe_lock(file_entry, stripe + idx);
+            lock_block(lock);
+            err_no[idx] = mend_stripe(file_entry, stripe + idx, last, buf, 1, &repaired[idx]);
+            unlock_block(lock, 0);
+        }
+        stat_add(AA_STAT_BLOCKS_READ, 1);
+    }
+
+    free(buf);
+    return idx;
+}
+
+/*
+  Cut every root down to the blocks before block_no, or to nothing when
+  block_no is -1. Block block_no goes as well, and so does the parity of
+  its stripe, ahead of the data, as both are written again. Roots that
+  are already shorter are left alone.
+*/
+static int cut_roots(struct file_entry *file_entry, off_t block_no) {
+    struct stat statbuf;
+    off_t size;
+    int err_no;
+    int idx;
+
+    err_no = 0;
+    for(idx=AA_NUM_ROOTS-1; idx>=0; idx--) {
+        if (fstat(file_entry->file[idx].fd, &statbuf)<0) {
+            if (err_no==0) {
+                err_no = errno;
+            }
+            continue;
+        }
+        if (block_no<0) {
+            size = 0;
+        } else if ((idx>=AA_DATA_ROOTS) || (idx>=column_of(block_no))) {
+            size = stripe_of(block_no) * AA_BLOCK_SIZE;
+        } else {
+            size = (stripe_of(block_no) + 1) * AA_BLOCK_SIZE;
+        }
+        if ((size<statbuf.st_size) && (ftruncate(file_entry->file[idx].fd, size)<0) && (err_no==0)) {
+            err_no = errno;
+        }
+    }
+    return err_no;
+}
+
+/*
+  Cut an open file down (or extend it) to new_size bytes of logical data,
+  as truncate_entry does for mirrored copies: the new last block is read,
+  every root is cut and the block is written back with its new length and
+  the parity of its stripe.
+*/
+int ec_truncate(struct file_entry *file_entry, off_t new_size) {
+    struct data_block *block[1];
+    off_t block_no;
+    off_t last;
+    int length;
+    int err_no;
+
+    block_no = (new_size==0) ? -1 : new_size / AA_DATA_SIZE;
+    length = (int)(new_size % AA_DATA_SIZE);
+
+    block[0] = malloc(AA_BLOCK_SIZE);
+    if (block[0]==NULL) {
+        return ENOMEM;
+    }
+    err_no = last_block(file_entry, &last);
+    if ((err_no==0) && (block_no>=0)) {
+        err_no = read_one(file_entry, block_no, last, block[0]);
+    }
+    if (err_no==0) {
+        err_no = cut_roots(file_entry, block_no);
+    }
+    if ((err_no==0) && (block_no>=0)) {
+        block[0]->header.length = HTON(length);
+        memset(&block[0]->data[length], 0, AA_DATA_SIZE - length);
+        err_no = ec_write_blocks(file_entry, block, 1, block_no * AA_BLOCK_SIZE);
+    }
+    cache_invalidate(file_entry->dev, file_entry->ino, (block_no + 1) * AA_BLOCK_SIZE);
+
+    free(block[0]);
+    return err_no;
+}
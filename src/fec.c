@@ -0,0 +1,62 @@
+/*
+  Block error correction
+
+  An archive made with --fec keeps an error correction trailer in the last
+  1/AA_FEC_RATIO of every full block. The rest of the block, header and
+  data, is dealt out a byte at a time to one short Reed-Solomon codeword
+  per 128 bytes of block, each 126 bytes with 2 check bytes, and the
+  trailer holds the check bytes. One wrong byte in each codeword can be
+  put right, so a burst of flipped bits up to 1/128 of the block long, or
+  a few flips scattered over different codewords, are corrected from the
+  block itself without reading another copy. The hash decides whether a
+  correction worked. Short blocks, at the end of a file, have no trailer.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+#include "hash.h"
+#include "rs.h"
+
+#define FEC_WAYS (AA_FEC_SIZE / 2)
+#define FEC_ROWS ((AA_BLOCK_SIZE - AA_FEC_SIZE) / FEC_WAYS)
+
+static unsigned char *trailer(struct data_block *block) {
+    return (unsigned char *)block + AA_BLOCK_SIZE - AA_FEC_SIZE;
+}
+
+/*
+  Work out the trailer of a full block once its header is complete.
+*/
+void fec_encode_block(struct data_block *block) {
+    if ((AA_FEC_SIZE==0) || (NTOH(block->header.length)!=AA_DATA_SIZE)) {
+        return;
+    }
+    rs_check_interleaved((const unsigned char *)block, FEC_WAYS, FEC_ROWS, trailer(block));
+}
+
+/*
+  Put right a block that failed its checks. Returns the number of bytes
+  changed when it is then a full block that passes its hash check,
+  otherwise 0 with the block as it was.
+*/
+int fec_correct_block(struct data_block *block) {
+    struct data_block *copy;
+    int fixed;
+
+    if (AA_FEC_SIZE==0) {
+        return 0;
+    }
+    copy = malloc(AA_BLOCK_SIZE);
+    if (copy==NULL) {
+        return 0;
+    }
+    memcpy(copy, block, AA_BLOCK_SIZE);
+    fixed = rs_correct_interleaved((unsigned char *)block, FEC_WAYS, FEC_ROWS, trailer(block));
+    if ((fixed<=0) || (NTOH(block->header.length)!=AA_DATA_SIZE) || !block_hash_valid(block)) {
+        memcpy(block, copy, AA_BLOCK_SIZE);
+        fixed = 0;
+    }
+    free(copy);
+    return fixed;
+}
@@ -0,0 +1,251 @@
+/*
+  Archive geometry
+
+  The block size, error correction and root layout of the archive being
+  served or read. Archivist fixes them at mount time from the geometry
+  files of the storage locations. The tools have no storage location to
+  look at and take the block size and error correction from the version
+  of the first block they read instead.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "blocks.h"
+#include "geometry.h"
+
+int archive_block_size = AA_DEFAULT_BLOCK_SIZE;
+int archive_fec = 0;
+static int block_size_fixed = 0;
+
+struct root_layout archive_layout = { AA_LAYOUT_MIRROR, AA_DEFAULT_COPIES, AA_DEFAULT_COPIES, 0 };
+
+int block_size_valid(size_t size) {
+    return (size>=AA_MIN_BLOCK_SIZE) && (size<=AA_MAX_BLOCK_SIZE) && ((size & (size - 1))==0);
+}
+
+void set_block_size(int size) {
+    archive_block_size = size;
+    block_size_fixed = 1;
+}
+
+void set_fec(int fec) {
+    archive_fec = fec;
+}
+
+static int block_shift(int size) {
+    int shift;
+    shift = 0;
+    while ((AA_MIN_BLOCK_SIZE << shift) < size) {
+        shift++;
+    }
+    return shift;
+}
+
+/*
+  The version, in host order, of a block of the given format written with
+  the archive block size and error correction.
+*/
+uint16_t block_version(int format) {
+    return (uint16_t)((archive_fec ? AA_VERSION_FEC : 0) | (block_shift(archive_block_size) << 8) | format);
+}
+
+int version_format(uint16_t version) {
+    return version & 0xff;
+}
+
+/*
+  The block size a version says its block was written with, or -1 when it
+  is out of range or the block's error correction does not match the
+  archive's, as it would then be laid out differently.
+*/
+int version_block_size(uint16_t version) {
+    int shift;
+    if (((version & AA_VERSION_FEC)!=0) != (archive_fec!=0)) {
+        return -1;
+    }
+    shift = (version & ~AA_VERSION_FEC) >> 8;
+    if (shift>block_shift(AA_MAX_BLOCK_SIZE)) {
+        return -1;
+    }
+    return AA_MIN_BLOCK_SIZE << shift;
+}
+
+static int make_layout(struct root_layout *layout, int mode, int data, int parity) {
+    if (mode==AA_LAYOUT_MIRROR) {
+        if ((data<2) || (data>AA_MAX_COPIES) || (parity!=0)) {
+            return -1;
+        }
+    } else if ((mode!=AA_LAYOUT_ERASURE) || (data<2) || (parity<1) || (data + parity>AA_MAX_ROOTS)) {
+        return -1;
+    }
+    layout->mode = mode;
+    layout->roots = data + parity;
+    layout->data = data;
+    layout->parity = parity;
+    return 0;
+}
+
+/*
+  Parse a layout given as mirror, mirror:COPIES or erasure:DATA+PARITY.
+*/
+int layout_by_name(const char *name, struct root_layout *layout) {
+    int data;
+    int parity;
+    char end;
+
+    if (!strcmp(name, "mirror")) {
+        return make_layout(layout, AA_LAYOUT_MIRROR, AA_DEFAULT_COPIES, 0);
+    }
+    if (sscanf(name, "mirror:%d%c", &data, &end)==1) {
+        return make_layout(layout, AA_LAYOUT_MIRROR, data, 0);
+    }
+    if (sscanf(name, "erasure:%d+%d%c", &data, &parity, &end)==2) {
+        return make_layout(layout, AA_LAYOUT_ERASURE, data, parity);
+    }
+    return -1;
+}
+
+void layout_name(const struct root_layout *layout, char *name, size_t size) {
+    if (layout->mode==AA_LAYOUT_ERASURE) {
+        snprintf(name, size, "erasure:%d+%d", layout->data, layout->parity);
+    } else {
+        snprintf(name, size, "mirror:%d", layout->roots);
+    }
+}
+
+void set_layout(const struct root_layout *layout) {
+    archive_layout = *layout;
+}
+
+int same_layout(const struct root_layout *a, const struct root_layout *b) {
+    return (a->mode==b->mode) && (a->data==b->data) && (a->parity==b->parity);
+}
+
+static void geometry_path(char fpath[PATH_MAX], const char *root_dir) {
+    snprintf(fpath, PATH_MAX, "%s/%s", root_dir, AA_GEOMETRY_FILE);
+}
+
+/*
+  Read the geometry recorded for a storage location. Returns ENOENT when
+  none is recorded and EINVAL when the record cannot be understood. Records
+  that give no layout are of mirrored archives with two copies.
+*/
+int load_geometry(const char *root_dir, struct archive_geometry *geometry) {
+    char fpath[PATH_MAX];
+    char line[128];
+    char mode[16];
+    FILE *file;
+    int data;
+    int parity;
+    int err_no;
+
+    geometry_path(fpath, root_dir);
+    file = fopen(fpath, "r");
+    if (file==NULL) {
+        return errno;
+    }
+    geometry->block_size = 0;
+    geometry->fec = 0;
+    make_layout(&geometry->layout, AA_LAYOUT_MIRROR, AA_DEFAULT_COPIES, 0);
+    geometry->root = -1;
+    err_no = 0;
+    while ((err_no==0) && (fgets(line, sizeof(line), file)!=NULL)) {
+        if (sscanf(line, "block_size %d", &geometry->block_size)==1) {
+            continue;
+        }
+        if (sscanf(line, "root %d", &geometry->root)==1) {
+            continue;
+        }
+        if (sscanf(line, "fec %d", &geometry->fec)==1) {
+            continue;
+        }
+        if (sscanf(line, "layout %15s %d %d", mode, &data, &parity)==3) {
+            if (make_layout(&geometry->layout, strcmp(mode, "erasure") ? AA_LAYOUT_MIRROR : AA_LAYOUT_ERASURE, data, parity)!=0) {
+                err_no = EINVAL;
+            }
+            continue;
+        }
+        err_no = EINVAL;
+    }
+    fclose(file);
+    if ((err_no==0) && !block_size_valid((size_t)geometry->block_size)) {
+        err_no = EINVAL;
+    }
+    if ((err_no==0) && (geometry->root>=geometry->layout.roots)) {
+        err_no = EINVAL;
+    }
+    return err_no;
+}
+
+int save_geometry(const char *root_dir, const struct archive_geometry *geometry) {
+    char fpath[PATH_MAX];
+    char ftemp[PATH_MAX + 4];
+    FILE *file;
+
+    geometry_path(fpath, root_dir);
+    snprintf(ftemp, sizeof(ftemp), "%s.new", fpath);
+    file = fopen(ftemp, "w");
+    if (file==NULL) {
+        return errno;
+    }
+    fprintf(file, "block_size %d\n", geometry->block_size);
+    fprintf(file, "fec %d\n", geometry->fec);
+    fprintf(file, "layout %s %d %d\n", geometry->layout.mode==AA_LAYOUT_ERASURE ? "erasure" : "mirror", geometry->layout.data, geometry->layout.parity);
+    fprintf(file, "root %d\n", geometry->root);
+    if ((fclose(file)!=0) || (rename(ftemp, fpath)!=0)) {
+        return errno;
+    }
+    return 0;
+}
+
+static ssize_t read_fully(int fd, unsigned char *buf, size_t size) {
+    ssize_t len;
+    size_t done;
+
+    done = 0;
+    while (done<size) {
+        len = read(fd, buf + done, size - done);
+        if (len<0) {
+            return -1;
+        }
+        if (len==0) {
+            break;
+        }
+        done += len;
+    }
+    return (ssize_t)done;
+}
+
+/*
+  Read the next block of an encoded file, which is short only at the end.
+  Unless the block size has been set, the first block read sets it and
+  the error correction from its version. Returns the number of bytes
+  read, 0 at the end of the file and -1 on error, and zeroes the rest of
+  the block.
+*/
+ssize_t read_encoded_block(int fd, struct data_block *block) {
+    ssize_t head;
+    ssize_t rest;
+    int size;
+
+    memset(block, 0, AA_HEAD_SIZE);
+    head = read_fully(fd, (unsigned char *)block, AA_HEAD_SIZE);
+    if (head<AA_HEAD_SIZE) {
+        return head;
+    }
+    if (!block_size_fixed) {
+        set_fec((NTOH(block->header.version) & AA_VERSION_FEC)!=0);
+        size = version_block_size(NTOH(block->header.version));
+        set_block_size(size>0 ? size : AA_DEFAULT_BLOCK_SIZE);
+    }
+    memset(block->data, 0, AA_BLOCK_SIZE - AA_HEAD_SIZE);
+    rest = read_fully(fd, block->data, AA_BLOCK_SIZE - AA_HEAD_SIZE);
+    if (rest<0) {
+        return -1;
+    }
+    return head + rest;
+}
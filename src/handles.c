@@ -0,0 +1,120 @@
+/*
+  Open file handle table
+
+  Handles live in fixed size chunks that are allocated as the number of open
+  files grows and never move, so a handle number stays valid for as long as
+  the file is open and lookup is a single index. Free handles form a lock free
+  stack threaded through the entries. The head holds the index of the top
+  entry plus one (zero when empty) in its low 32 bits and a counter in its
+  high 32 bits that changes on every update, so a stale head cannot be
+  swapped back in by a thread that slept between reading and updating it.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "handles.h"
+
+#define HEAD_INDEX(head) ((uint32_t)((head) & 0xFFFFFFFFULL))
+#define HEAD_MAKE(head, index) ((((head) >> 32) + 1) << 32 | (uint64_t)(index))
+
+static struct handle *handle_at(struct handle_table *table, uint64_t fh) {
+    struct handle *chunk;
+    chunk = __atomic_load_n(&table->chunk[fh / AA_HANDLE_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    return &chunk[fh % AA_HANDLE_CHUNK_SIZE];
+}
+
+/*
+  Push the chain of free handles starting at first_index (plus one) and
+  ending at last onto the free stack.
+*/
+static void push_free(struct handle_table *table, struct handle *last, uint32_t first_index) {
+    uint64_t head;
+    uint64_t new_head;
+
+    head = __atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE);
+    do {
+        __atomic_store_n(&last->next_free, HEAD_INDEX(head), __ATOMIC_RELAXED);
+        new_head = HEAD_MAKE(head, first_index);
+    } while (!__atomic_compare_exchange_n(&table->free_head, &head, new_head, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+  Add a chunk of handles, keep the first one for the caller and push
+  the rest onto the free stack. The chunk is only claimed once it has
+  been allocated, so a failed allocation leaves the table as it was.
+  Returns EAGAIN when another thread added a chunk first, as there may
+  now be free handles to take instead.
+*/
+static int grow_table(struct handle_table *table, uint64_t *fh) {
+    uint32_t chunk_index;
+    struct handle *chunk;
+    uint64_t base;
+    int pos;
+    int idx;
+
+    chunk_index = __atomic_load_n(&table->num_chunks, __ATOMIC_ACQUIRE);
+    if (chunk_index>=AA_HANDLE_MAX_CHUNKS) {
+        return ENFILE;
+    }
+
+    chunk = calloc(AA_HANDLE_CHUNK_SIZE, sizeof(struct handle));
+    if (chunk==NULL) {
+        return ENOMEM;
+    }
+    base = (uint64_t)chunk_index * AA_HANDLE_CHUNK_SIZE;
+    for(pos=0; pos<AA_HANDLE_CHUNK_SIZE; pos++) {
+        pthread_mutex_init(&chunk[pos].entry.lock, NULL);
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            chunk[pos].entry.file[idx].fd = -1;
+        }
+        chunk[pos].next_free = (uint32_t)(base + pos + 2);
+    }
+    if (!__atomic_compare_exchange_n(&table->num_chunks, &chunk_index, chunk_index + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        for(pos=0; pos<AA_HANDLE_CHUNK_SIZE; pos++) {
+            pthread_mutex_destroy(&chunk[pos].entry.lock);
+        }
+        free(chunk);
+        return EAGAIN;
+    }
+    __atomic_store_n(&table->chunk[chunk_index], chunk, __ATOMIC_RELEASE);
+
+    push_free(table, &chunk[AA_HANDLE_CHUNK_SIZE-1], (uint32_t)(base + 2));
+    *fh = base;
+    return 0;
+}
+
+int allocate_handle(struct handle_table *table, uint64_t *fh) {
+    uint64_t head;
+    uint64_t new_head;
+    uint32_t index;
+    int err_no;
+
+    do {
+        head = __atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE);
+        do {
+            index = HEAD_INDEX(head);
+            if (index==0) {
+                break;
+            }
+            new_head = HEAD_MAKE(head, __atomic_load_n(&handle_at(table, index - 1)->next_free, __ATOMIC_RELAXED));
+        } while (!__atomic_compare_exchange_n(&table->free_head, &head, new_head, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+        if (index!=0) {
+            *fh = index - 1;
+            return 0;
+        }
+        err_no = grow_table(table, fh);
+    } while (err_no==EAGAIN);
+    return err_no;
+}
+
+void release_handle(struct handle_table *table, uint64_t fh) {
+    struct handle *handle;
+    handle = handle_at(table, fh);
+    push_free(table, handle, (uint32_t)(fh + 1));
+}
+
+struct file_entry *handle_file_entry(struct handle_table *table, uint64_t fh) {
+    return &handle_at(table, fh)->entry;
+}
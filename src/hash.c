@@ -0,0 +1,217 @@
+/*
+  Block hashes
+
+  Every block carries a hash of its seed and data. Version 1 blocks use
+  SHA-1. Version 2 blocks record which algorithm they use, so a file can
+  hold blocks of either version and readers check each block by its own
+  header. New blocks are written with the configured algorithm.
+
+  XXH3-128 is the fast version 2 algorithm. It detects bit rot as well as
+  SHA-1 at a fraction of the cost, and resisting a deliberate forger is no
+  part of the job. Its 16 byte digest follows the type byte and the rest
+  of the field is zero.
+
+  The high byte of the version holds the block size, see geometry.h.
+  Hashing a block also works out its error correction trailer, if the
+  archive keeps them, as that covers the header too.
+*/
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <xxhash.h>
+#include "hash.h"
+#include "sha1.h"
+#include "fec.h"
+
+static int write_type = AA_HASH_DEFAULT_TYPE;
+
+void set_hash_type(int type) {
+    write_type = type;
+}
+
+int hash_type_by_name(const char *name) {
+    if (!strcmp(name, "sha1")) {
+        return AA_HASH_TYPE_SHA1;
+    }
+    if (!strcmp(name, "xxh3")) {
+        return AA_HASH_TYPE_XXH3;
+    }
+    return -1;
+}
+
+const char *hash_type_name(int type) {
+    switch (type) {
+        case AA_HASH_TYPE_SHA1:
+            return "sha1";
+        case AA_HASH_TYPE_XXH3:
+            return "xxh3";
+    }
+    return "unknown";
+}
+
+/*
+  The algorithm a block was hashed with, or -1 when its header names a
+  version or algorithm this build does not know, or was written with a
+  different block size from the archive.
+*/
+int block_hash_type(const struct data_block *block) {
+    uint16_t version;
+
+    version = NTOH(block->header.version);
+    if (version_block_size(version)!=AA_BLOCK_SIZE) {
+        return -1;
+    }
+    switch (version_format(version)) {
+        case AA_VERSION_1:
+            return AA_HASH_TYPE_SHA1;
+        case AA_VERSION_2:
+            if (block->header.hash[0]==AA_HASH_TYPE_XXH3) {
+                return AA_HASH_TYPE_XXH3;
+            }
+            break;
+    }
+    return -1;
+}
+
+static void xxh3_field(const struct data_block *block, unsigned char field[AA_HASH_SIZE]) {
+    XXH128_hash_t digest;
+    int idx;
+
+    digest = XXH3_128bits(block->header.seed, AA_HASHED_SIZE);
+    memset(field, 0, AA_HASH_SIZE);
+    field[0] = AA_HASH_TYPE_XXH3;
+    for(idx=0; idx<8; idx++) {
+        field[1 + idx] = (unsigned char)(digest.high64 >> (56 - idx * 8));
+        field[9 + idx] = (unsigned char)(digest.low64 >> (56 - idx * 8));
+    }
+}
+
+void hash_block(struct data_block *block) {
+    hash_blocks(&block, 1);
+}
+
+/*
+  Set the version, hash and error correction trailer of count blocks using
+  the configured algorithm. SHA-1 blocks are hashed together so they can
+  share the multi-buffer lanes.
+*/
+void hash_blocks(struct data_block *const block[], int count) {
+    const unsigned char *data[AA_HASH_LANES];
+    unsigned char *md[AA_HASH_LANES];
+    int first;
+    int idx;
+    int n;
+
+    if (write_type==AA_HASH_TYPE_XXH3) {
+        for(idx=0; idx<count; idx++) {
+            block[idx]->header.version = HTON(block_version(AA_VERSION_2));
+            xxh3_field(block[idx], block[idx]->header.hash);
+            fec_encode_block(block[idx]);
+        }
+        return;
+    }
+    for(first=0; first<count; first+=AA_HASH_LANES) {
+        n = (count - first < AA_HASH_LANES) ? count - first : AA_HASH_LANES;
+        for(idx=0; idx<n; idx++) {
+            block[first + idx]->header.version = HTON(block_version(AA_VERSION_1));
+            data[idx] = block[first + idx]->header.seed;
+            md[idx] = block[first + idx]->header.hash;
+        }
+        SHA1_many(data, AA_HASHED_SIZE, md, n);
+        for(idx=0; idx<n; idx++) {
+            fec_encode_block(block[first + idx]);
+        }
+    }
+}
+
+/*
+  Make length bytes of data into the blocks packed in out, each full but
+  the one holding the end of the data, with fresh seeds and hashes.
+  Returns the bytes the blocks take in a file, or -1 when there are no
+  seeds to be had.
+*/
+ssize_t encode_blocks(const unsigned char *data, size_t length, struct data_block *out) {
+    struct data_block *block[AA_MAX_WRITE_BLOCKS];
+    unsigned char seeds[AA_MAX_WRITE_BLOCKS * AA_SEED_SIZE];
+    size_t total;
+    size_t left;
+    size_t ofs;
+    int count;
+    int blk;
+
+    total = 0;
+    for(ofs=0; ofs<length; ofs+=(size_t)count * AA_DATA_SIZE) {
+        count = (int)((length - ofs + AA_DATA_SIZE - 1) / AA_DATA_SIZE);
+        if (count>AA_MAX_WRITE_BLOCKS) {
+            count = AA_MAX_WRITE_BLOCKS;
+        }
+        if (initialise_seeds(seeds, (size_t)count)!=0) {
+            return -1;
+        }
+        for(blk=0; blk<count; blk++) {
+            block[blk] = block_at(out, (int)(ofs / AA_DATA_SIZE) + blk);
+            left = length - ofs - (size_t)blk * AA_DATA_SIZE;
+            if (left>AA_DATA_SIZE) {
+                left = AA_DATA_SIZE;
+            }
+            memset(block[blk], 0, AA_HEAD_SIZE);
+            memcpy(block[blk]->data, data + ofs + (size_t)blk * AA_DATA_SIZE, left);
+            memset(block[blk]->data + left, 0, AA_BLOCK_SIZE - AA_HEAD_SIZE - left);
+            block[blk]->header.length = HTON(left);
+            memcpy(block[blk]->header.seed, seeds + (size_t)blk * AA_SEED_SIZE, AA_SEED_SIZE);
+        }
+        hash_blocks(block, count);
+        for(blk=0; blk<count; blk++) {
+            total += (size_t)block_stored_size(block[blk]);
+        }
+    }
+    return (ssize_t)total;
+}
+
+int block_hash_valid(const struct data_block *block) {
+    int valid;
+    blocks_hash_valid(&block, 1, &valid);
+    return valid;
+}
+
+/*
+  Check the hashes of count blocks, each by the algorithm its header names.
+  valid[i] is set when block[i] is sound. The SHA-1 blocks are gathered and
+  hashed together.
+*/
+void blocks_hash_valid(const struct data_block *const block[], int count, int valid[]) {
+    const unsigned char *data[AA_HASH_LANES];
+    unsigned char sha1[AA_HASH_LANES][AA_HASH_SIZE];
+    unsigned char *md[AA_HASH_LANES];
+    unsigned char field[AA_HASH_SIZE];
+    int slot[AA_HASH_LANES];
+    int blk;
+    int idx;
+    int n;
+
+    n = 0;
+    for(blk=0; blk<count; blk++) {
+        switch (block_hash_type(block[blk])) {
+            case AA_HASH_TYPE_SHA1:
+                data[n] = block[blk]->header.seed;
+                md[n] = sha1[n];
+                slot[n] = blk;
+                n++;
+                break;
+            case AA_HASH_TYPE_XXH3:
+                xxh3_field(block[blk], field);
+                valid[blk] = (memcmp(block[blk]->header.hash, field, AA_HASH_SIZE)==0);
+                break;
+            default:
+                valid[blk] = 0;
+                break;
+        }
+        if ((n==AA_HASH_LANES) || ((n>0) && (blk==count-1))) {
+            SHA1_many(data, AA_HASHED_SIZE, md, n);
+            for(idx=0; idx<n; idx++) {
+                valid[slot[idx]] = (memcmp(block[slot[idx]]->header.hash, sha1[idx], AA_HASH_SIZE)==0);
+            }
+            n = 0;
+        }
+    }
+}
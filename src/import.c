@@ -0,0 +1,619 @@
+/*
+  Bulk import into a mirrored archive
+
+  archivist-import copies a directory tree into the storage locations of
+  an unmounted mirrored archive without going through FUSE. The calling
+  thread walks the source, making each directory in every copy under the
+  name@ names archivist gives it, and queues the regular files for a pool
+  of workers. A worker reads a file a megabyte of blocks at a time,
+  encodes the blocks once and writes the same buffer to every copy, then
+  gives the copies the permissions, ownership and times of the source.
+  Directories get theirs last, once nothing more is written in them.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "blocks.h"
+#include "hash.h"
+#include "pipeline.h"
+
+#define IMPORT_QUEUE 256
+
+struct import_job {
+    char rel[PATH_MAX];
+    struct stat statbuf;
+};
+
+/* A directory made in the copies, given its metadata at the end. */
+struct import_dir {
+    char *rel;
+    struct stat statbuf;
+};
+
+struct import_worker {
+    pthread_t thread;
+    unsigned char *in;
+    unsigned char *out;
+};
+
+static struct importer {
+    char source_dir[PATH_MAX];
+    char root_dir[AA_MAX_COPIES][PATH_MAX];
+    int copies;
+    size_t in_size;
+    struct import_job queue[IMPORT_QUEUE];
+    int head;
+    int queued;
+    int walked;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    struct import_dir *dirs;
+    size_t dir_count;
+    size_t dir_space;
+    uint64_t files;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t skipped;
+    uint64_t errors;
+} importer = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER
+};
+
+static void count(uint64_t *counter, uint64_t amount) {
+    __atomic_add_fetch(counter, amount, __ATOMIC_RELAXED);
+}
+
+static int source_path(char fpath[PATH_MAX], const char *rel) {
+    int len;
+    len = snprintf(fpath, PATH_MAX, "%s%s%s", importer.source_dir, rel[0] ? "/" : "", rel);
+    return (len<0 || len>=PATH_MAX) ? ENAMETOOLONG : 0;
+}
+
+/*
+  The path of rel in copy idx, with an '@' after each name as archivist's
+  data_file_path makes it.
+*/
+static int archive_path(char fpath[PATH_MAX], int idx, const char *rel) {
+    const char *pos;
+    size_t used;
+    size_t len;
+
+    used = strlen(importer.root_dir[idx]);
+    memcpy(fpath, importer.root_dir[idx], used + 1);
+    pos = rel;
+    while (*pos!=0) {
+        len = strcspn(pos, "/");
+        if (used + len + 3>PATH_MAX) {
+            return ENAMETOOLONG;
+        }
+        fpath[used++] = '/';
+        memcpy(fpath + used, pos, len);
+        used += len;
+        fpath[used++] = '@';
+        fpath[used] = 0;
+        pos += len;
+        while (*pos=='/') {
+            pos++;
+        }
+    }
+    return 0;
+}
+
+static void import_error(int err_no, const char *action, const char *fpath) {
+    fprintf(stderr, "Error %d (%s) , %s %s\n", err_no, strerror(err_no), action, fpath);
+    count(&importer.errors, 1);
+}
+
+/*
+  Give a copy the permissions, ownership and times of its source, through
+  fd when it is open and by fpath otherwise. The owner is kept only when
+  running as root.
+*/
+static int set_metadata(int fd, const char *fpath, const struct stat *statbuf) {
+    struct timespec times[2];
+    int rc;
+
+    times[0] = statbuf->st_atim;
+    times[1] = statbuf->st_mtim;
+    if (geteuid()==0) {
+        rc = (fd>=0) ? fchown(fd, statbuf->st_uid, statbuf->st_gid) : chown(fpath, statbuf->st_uid, statbuf->st_gid);
+        if (rc!=0) {
+            return errno;
+        }
+    }
+    rc = (fd>=0) ? fchmod(fd, statbuf->st_mode & 07777) : chmod(fpath, statbuf->st_mode & 07777);
+    if (rc!=0) {
+        return errno;
+    }
+    rc = (fd>=0) ? futimens(fd, times) : utimensat(AT_FDCWD, fpath, times, 0);
+    if (rc!=0) {
+        return errno;
+    }
+    return 0;
+}
+
+/*
+  Encode a file once into every copy. A copy that could not be written
+  in full is removed, so no copy is left short without a trace.
+*/
+static void import_file(struct import_worker *worker, const struct import_job *job) {
+    char fpath_in[PATH_MAX];
+    char fpath[AA_MAX_COPIES][PATH_MAX];
+    int fd[AA_MAX_COPIES];
+    ssize_t len;
+    ssize_t out_len;
+    int fd_in;
+    int err_no;
+    int idx;
+
+    err_no = source_path(fpath_in, job->rel);
+    if (err_no!=0) {
+        import_error(err_no, "Path too long", job->rel);
+        return;
+    }
+    fd_in = open(fpath_in, O_RDONLY);
+    if (fd_in<0) {
+        import_error(errno, "Failed to open", fpath_in);
+        return;
+    }
+    posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    err_no = 0;
+    for(idx=0; idx<importer.copies; idx++) {
+        fd[idx] = -1;
+        if (err_no!=0) {
+            continue;
+        }
+        err_no = archive_path(fpath[idx], idx, job->rel);
+        if (err_no!=0) {
+            import_error(err_no, "Path too long", job->rel);
+            continue;
+        }
+        fd[idx] = open(fpath[idx], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd[idx]<0) {
+            err_no = errno;
+            import_error(err_no, "Failed to open", fpath[idx]);
+        }
+    }
+
+    while (err_no==0) {
+        len = read_input(fd_in, worker->in, importer.in_size);
+        if (len<0) {
+            err_no = errno;
+            import_error(err_no, "Failed to read from", fpath_in);
+            break;
+        }
+        if (len==0) {
+            break;
+        }
+        out_len = encode_blocks(worker->in, (size_t)len, (struct data_block *)worker->out);
+        if (out_len<0) {
+            err_no = EAGAIN;
+            import_error(err_no, "Failed to initialise seeds for", fpath_in);
+            break;
+        }
+        for(idx=0; (idx<importer.copies) && (err_no==0); idx++) {
+            err_no = write_output(fd[idx], worker->out, (size_t)out_len);
+            if (err_no!=0) {
+                import_error(err_no, "Failed to write to", fpath[idx]);
+            }
+        }
+        count(&importer.bytes_in, (uint64_t)len);
+        count(&importer.bytes_out, (uint64_t)out_len * (uint64_t)importer.copies);
+        if ((size_t)len<importer.in_size) {
+            break;
+        }
+    }
+
+    for(idx=0; idx<importer.copies; idx++) {
+        if (fd[idx]<0) {
+            continue;
+        }
+        if (err_no==0) {
+            err_no = set_metadata(fd[idx], fpath[idx], &job->statbuf);
+            if (err_no!=0) {
+                import_error(err_no, "Failed to set the attributes of", fpath[idx]);
+            }
+        }
+        if ((close(fd[idx])!=0) && (err_no==0)) {
+            err_no = errno;
+            import_error(err_no, "Failed to write to", fpath[idx]);
+        }
+    }
+    if (err_no!=0) {
+        for(idx=0; idx<importer.copies; idx++) {
+            if (fd[idx]>=0) {
+                unlink(fpath[idx]);
+            }
+        }
+    } else {
+        count(&importer.files, 1);
+    }
+    close(fd_in);
+}
+
+static void *import_thread(void *arg) {
+    struct import_worker *worker;
+    struct import_job job;
+
+    worker = arg;
+    while (1) {
+        pthread_mutex_lock(&importer.mutex);
+        while ((importer.queued==0) && !importer.walked) {
+            pthread_cond_wait(&importer.changed, &importer.mutex);
+        }
+        if (importer.queued==0) {
+            pthread_mutex_unlock(&importer.mutex);
+            break;
+        }
+        job = importer.queue[importer.head];
+        importer.head = (importer.head + 1) % IMPORT_QUEUE;
+        importer.queued--;
+        pthread_cond_broadcast(&importer.changed);
+        pthread_mutex_unlock(&importer.mutex);
+        import_file(worker, &job);
+    }
+    return NULL;
+}
+
+static void queue_job(const char *rel, const struct stat *statbuf) {
+    struct import_job *job;
+
+    pthread_mutex_lock(&importer.mutex);
+    while (importer.queued==IMPORT_QUEUE) {
+        pthread_cond_wait(&importer.changed, &importer.mutex);
+    }
+    job = &importer.queue[(importer.head + importer.queued) % IMPORT_QUEUE];
+    strcpy(job->rel, rel);
+    job->statbuf = *statbuf;
+    importer.queued++;
+    pthread_cond_broadcast(&importer.changed);
+    pthread_mutex_unlock(&importer.mutex);
+}
+
+/*
+  Make the directory rel in every copy, or use the one already there,
+  and keep its metadata for the end. Returns 0 when every copy has it.
+*/
+static int make_dir(const char *rel, const struct stat *statbuf) {
+    char fpath[PATH_MAX];
+    struct import_dir *dirs;
+    struct stat existing;
+    int err_no;
+    int idx;
+
+    for(idx=0; idx<importer.copies; idx++) {
+        err_no = archive_path(fpath, idx, rel);
+        if (err_no!=0) {
+            import_error(err_no, "Path too long", rel);
+            return err_no;
+        }
+        if ((mkdir(fpath, S_IRWXU)!=0) && ((errno!=EEXIST) || (stat(fpath, &existing)!=0) || !S_ISDIR(existing.st_mode))) {
+            err_no = (errno==EEXIST) ? ENOTDIR : errno;
+            import_error(err_no, "Failed to create", fpath);
+            return err_no;
+        }
+    }
+    if (importer.dir_count==importer.dir_space) {
+        importer.dir_space = (importer.dir_space==0) ? 64 : importer.dir_space * 2;
+        dirs = realloc(importer.dirs, importer.dir_space * sizeof(struct import_dir));
+        if (dirs==NULL) {
+            fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+            exit(1);
+        }
+        importer.dirs = dirs;
+    }
+    importer.dirs[importer.dir_count].rel = strdup(rel);
+    importer.dirs[importer.dir_count].statbuf = *statbuf;
+    if (importer.dirs[importer.dir_count].rel==NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        exit(1);
+    }
+    importer.dir_count++;
+    return 0;
+}
+
+/*
+  Walk the source directory rel, making its directories and queueing its
+  regular files. Anything else is skipped, as archivist stores neither
+  links nor devices.
+*/
+static void import_dir(const char *rel) {
+    char fpath[PATH_MAX];
+    char child[PATH_MAX];
+    struct stat statbuf;
+    struct dirent *de;
+    DIR *dp;
+
+    if (source_path(fpath, rel)!=0) {
+        import_error(ENAMETOOLONG, "Path too long", rel);
+        return;
+    }
+    dp = opendir(fpath);
+    if (dp==NULL) {
+        import_error(errno, "Failed to open", fpath);
+        return;
+    }
+    while ((de = readdir(dp))!=NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if ((snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", de->d_name)>=PATH_MAX) || (source_path(fpath, child)!=0)) {
+            import_error(ENAMETOOLONG, "Path too long", de->d_name);
+            continue;
+        }
+        if (lstat(fpath, &statbuf)!=0) {
+            import_error(errno, "Failed to stat", fpath);
+            continue;
+        }
+        if (S_ISDIR(statbuf.st_mode)) {
+            if (make_dir(child, &statbuf)==0) {
+                import_dir(child);
+            }
+        } else if (S_ISREG(statbuf.st_mode)) {
+            queue_job(child, &statbuf);
+        } else {
+            fprintf(stderr, "Skipped %s, only directories and regular files are imported\n", fpath);
+            count(&importer.skipped, 1);
+        }
+    }
+    closedir(dp);
+}
+
+/*
+  Give the directories made the metadata of their sources, now that
+  nothing more is written in them.
+*/
+static void finish_dirs(void) {
+    char fpath[PATH_MAX];
+    size_t dir;
+    int err_no;
+    int idx;
+
+    for(dir=0; dir<importer.dir_count; dir++) {
+        for(idx=0; idx<importer.copies; idx++) {
+            archive_path(fpath, idx, importer.dirs[dir].rel);
+            err_no = set_metadata(-1, fpath, &importer.dirs[dir].statbuf);
+            if (err_no!=0) {
+                import_error(err_no, "Failed to set the attributes of", fpath);
+            }
+        }
+        free(importer.dirs[dir].rel);
+    }
+    free(importer.dirs);
+}
+
+/* True when a storage location holds a data file or directory. */
+static int holds_data(const char *root_dir) {
+    struct dirent *de;
+    size_t len;
+    DIR *dp;
+    int found;
+
+    dp = opendir(root_dir);
+    if (dp==NULL) {
+        return 0;
+    }
+    found = 0;
+    while (!found && ((de = readdir(dp))!=NULL)) {
+        len = strlen(de->d_name);
+        found = (len>1) && (de->d_name[len-1]=='@');
+    }
+    closedir(dp);
+    return found;
+}
+
+/*
+  Take the geometry recorded in the storage locations, which must agree
+  and be of a mirrored archive with a location for each copy, in its
+  place. A new archive is given the requested block size, or zero for
+  the default, and error correction, or -1 for none, which an existing
+  one must match. Locations that lack a record are given one, as
+  archivist does when it mounts them.
+*/
+static int import_geometry(char *const root_dir[], int roots, int requested, int fec) {
+    struct archive_geometry recorded;
+    struct archive_geometry geometry;
+    char name[32];
+    int found;
+    int err_no;
+    int idx;
+
+    found = 0;
+    for(idx=0; idx<roots; idx++) {
+        err_no = load_geometry(root_dir[idx], &recorded);
+        if (err_no==ENOENT) {
+            continue;
+        }
+        if (err_no!=0) {
+            fprintf(stderr, "Error %d (%s) , Invalid geometry in %s\n", err_no, strerror(err_no), root_dir[idx]);
+            return err_no;
+        }
+        if ((recorded.root>=0) && (recorded.root!=idx)) {
+            fprintf(stderr, "Error %d (%s) , Storage location %s is root %d of its archive, not %d\n", EINVAL, strerror(EINVAL), root_dir[idx], recorded.root + 1, idx + 1);
+            return EINVAL;
+        }
+        if (found && ((recorded.block_size!=geometry.block_size) || (recorded.fec!=geometry.fec) || !same_layout(&recorded.layout, &geometry.layout))) {
+            fprintf(stderr, "Error %d (%s) , Geometry of %s does not match %s\n", EINVAL, strerror(EINVAL), root_dir[idx], root_dir[0]);
+            return EINVAL;
+        }
+        geometry = recorded;
+        found = 1;
+    }
+    if (!found) {
+        for(idx=0; idx<roots; idx++) {
+            found |= holds_data(root_dir[idx]);
+        }
+        geometry.block_size = found ? AA_DEFAULT_BLOCK_SIZE : ((requested!=0) ? requested : AA_DEFAULT_BLOCK_SIZE);
+        geometry.fec = found ? 0 : (fec>0);
+        snprintf(name, sizeof(name), "mirror:%d", found ? AA_DEFAULT_COPIES : roots);
+        layout_by_name(name, &geometry.layout);
+    }
+
+    if (geometry.layout.mode!=AA_LAYOUT_MIRROR) {
+        fprintf(stderr, "Error %d (%s) , Only mirrored archives can be imported into, erasure coded ones through the mount point\n", EINVAL, strerror(EINVAL));
+        return EINVAL;
+    }
+    if (geometry.layout.roots!=roots) {
+        fprintf(stderr, "Error %d (%s) , The archive has %d copies but %d storage locations were given\n", EINVAL, strerror(EINVAL), geometry.layout.roots, roots);
+        return EINVAL;
+    }
+    if ((requested!=0) && (requested!=geometry.block_size)) {
+        fprintf(stderr, "Error %d (%s) , The archive has %d byte blocks, not %d\n", EINVAL, strerror(EINVAL), geometry.block_size, requested);
+        return EINVAL;
+    }
+    if ((fec>=0) && (fec!=(geometry.fec!=0))) {
+        fprintf(stderr, "Error %d (%s) , The archive has error correction %s\n", EINVAL, strerror(EINVAL), geometry.fec ? "on" : "off");
+        return EINVAL;
+    }
+
+    for(idx=0; idx<roots; idx++) {
+        if (load_geometry(root_dir[idx], &recorded)==ENOENT) {
+            geometry.root = idx;
+            err_no = save_geometry(root_dir[idx], &geometry);
+            if (err_no!=0) {
+                fprintf(stderr, "Error %d (%s) , Failed to write the geometry of %s\n", err_no, strerror(err_no), root_dir[idx]);
+                return err_no;
+            }
+        }
+    }
+    set_block_size(geometry.block_size);
+    set_fec(geometry.fec);
+    set_layout(&geometry.layout);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    struct import_worker *worker;
+    struct stat statbuf;
+    struct timespec started;
+    struct timespec now;
+    double seconds;
+    void *buf;
+    int hash_type;
+    int block_size;
+    int fec;
+    int threads;
+    int roots;
+    int fd;
+    int idx;
+
+    threads = pipe_threads(NULL);
+    block_size = 0;
+    fec = -1;
+    while ((argc > 3) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--hash=", 7)) {
+            hash_type = hash_type_by_name(argv[1] + 7);
+            if (hash_type<0) {
+                fprintf(stderr, "Error %d (%s) , Unknown hash %s\n", EINVAL, strerror(EINVAL), argv[1] + 7);
+                exit(1);
+            }
+            set_hash_type(hash_type);
+        } else if (!strncmp(argv[1], "--block-size=", 13)) {
+            block_size = atoi(argv[1] + 13);
+            if (!block_size_valid(block_size)) {
+                fprintf(stderr, "Error %d (%s) , Invalid block size %s\n", EINVAL, strerror(EINVAL), argv[1] + 13);
+                exit(1);
+            }
+        } else if (!strcmp(argv[1], "--fec")) {
+            fec = 1;
+        } else if (!strncmp(argv[1], "--threads=", 10)) {
+            threads = pipe_threads(argv[1] + 10);
+            if (threads<0) {
+                fprintf(stderr, "Error %d (%s) , Invalid thread count %s\n", EINVAL, strerror(EINVAL), argv[1] + 10);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
+    roots = argc - 2;
+    if ((roots<2) || (roots>AA_MAX_COPIES)) {
+        fprintf(stderr, "Error %d (%s) , Invalid arguments\n", EINVAL, strerror(EINVAL));
+        exit(1);
+    }
+    for(idx=1; idx<argc; idx++) {
+        if ((stat(argv[idx], &statbuf)!=0) || !S_ISDIR(statbuf.st_mode)) {
+            fprintf(stderr, "Error %d (%s) , Not a directory %s\n", ENOTDIR, strerror(ENOTDIR), argv[idx]);
+            exit(1);
+        }
+        if (snprintf((idx==1) ? importer.source_dir : importer.root_dir[idx-2], PATH_MAX, "%s", argv[idx])>=PATH_MAX) {
+            fprintf(stderr, "Error %d (%s) , Path too long %s\n", ENAMETOOLONG, strerror(ENAMETOOLONG), argv[idx]);
+            exit(1);
+        }
+    }
+    if (import_geometry(argv + 2, roots, block_size, fec)!=0) {
+        exit(1);
+    }
+    importer.copies = roots;
+    importer.in_size = (size_t)(AA_PIPE_BATCH_BYTES / AA_BLOCK_SIZE) * AA_DATA_SIZE;
+
+    worker = calloc((size_t)threads, sizeof(struct import_worker));
+    if (worker==NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        exit(1);
+    }
+    for(idx=0; idx<threads; idx++) {
+        if (posix_memalign(&buf, AA_PIPE_ALIGN, importer.in_size)!=0) {
+            fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+            exit(1);
+        }
+        worker[idx].in = buf;
+        if (posix_memalign(&buf, AA_PIPE_ALIGN, AA_PIPE_BATCH_BYTES)!=0) {
+            fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+            exit(1);
+        }
+        worker[idx].out = buf;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for(idx=0; idx<threads; idx++) {
+        if (pthread_create(&worker[idx].thread, NULL, import_thread, &worker[idx])!=0) {
+            fprintf(stderr, "Error %d (%s) , Failed to start threads\n", errno, strerror(errno));
+            exit(1);
+        }
+    }
+    import_dir("");
+    pthread_mutex_lock(&importer.mutex);
+    importer.walked = 1;
+    pthread_cond_broadcast(&importer.changed);
+    pthread_mutex_unlock(&importer.mutex);
+    for(idx=0; idx<threads; idx++) {
+        pthread_join(worker[idx].thread, NULL);
+        free(worker[idx].in);
+        free(worker[idx].out);
+    }
+    free(worker);
+    finish_dirs();
+
+    /* The copies are only an archive once they are on disk. */
+    for(idx=0; idx<roots; idx++) {
+        fd = open(importer.root_dir[idx], O_RDONLY | O_DIRECTORY);
+        if ((fd<0) || (syncfs(fd)!=0)) {
+            import_error(errno, "Failed to sync", importer.root_dir[idx]);
+        }
+        if (fd>=0) {
+            close(fd);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = (double)(now.tv_sec - started.tv_sec) + (double)(now.tv_nsec - started.tv_nsec) / 1e9;
+
+    fprintf(stderr, "Imported %lu files and %zu directories, %lu bytes as %lu bytes of blocks in %d copies, in %.1f seconds, %lu skipped and %lu errors\n",
+            importer.files, importer.dir_count, importer.bytes_in, importer.bytes_out, roots, seconds, importer.skipped, importer.errors);
+    return (importer.errors>0) ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+/*
+  Pluggable block I/O
+
+  Callers describe the reads and writes for a request as a batch, submit it
+  in one go and then take completions one at a time in whatever order the
+  engine finishes them. The pread engine performs each request as it is
+  asked for a completion and is always available. Other engines submit the
+  whole batch up front so the copies on different devices are busy at the
+  same time.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "io.h"
+#include "logs.h"
+
+static const struct io_engine *engine = &pread_engine;
+
+static void pread_submit(struct io_batch *batch) {
+    batch->submitted = batch->count;
+}
+
+static int pread_complete(struct io_batch *batch) {
+    struct io_request *request;
+    int pos;
+
+    for(pos=0; pos<batch->count; pos++) {
+        request = &batch->request[pos];
+        if (request->result==AA_IO_PENDING) {
+            if (request->write) {
+                request->result = pwritev(request->fd, request->iov, request->iovcnt, request->offset);
+            } else {
+                request->result = preadv(request->fd, request->iov, request->iovcnt, request->offset);
+            }
+            if (request->result<0) {
+                request->result = -errno;
+            }
+            batch->completed++;
+            return pos;
+        }
+    }
+    return -1;
+}
+
+static int pread_available() {
+    return 1;
+}
+
+const struct io_engine pread_engine = {
+    .name = "pread",
+    .available = pread_available,
+    .submit = pread_submit,
+    .complete = pread_complete,
+};
+
+int init_io_engine(const char *name) {
+    if (!strcmp(name, uring_engine.name)) {
+        if (uring_engine.available()) {
+            engine = &uring_engine;
+        } else {
+            log_error("io", ENOSYS, "io_uring is not available, using pread");
+            engine = &pread_engine;
+        }
+        return 0;
+    }
+    if (!strcmp(name, pread_engine.name)) {
+        engine = &pread_engine;
+        return 0;
+    }
+    return -1;
+}
+
+const char *io_engine_name() {
+    return engine->name;
+}
+
+void io_prepare(struct io_request *request, int fd, int write, void *buf, size_t len, off_t offset) {
+    request->single.iov_base = buf;
+    request->single.iov_len = len;
+    io_prepare_vector(request, fd, write, &request->single, 1, offset);
+}
+
+void io_prepare_vector(struct io_request *request, int fd, int write, const struct iovec *iov, int iovcnt, off_t offset) {
+    request->fd = fd;
+    request->write = write;
+    request->iov = iov;
+    request->iovcnt = iovcnt;
+    request->offset = offset;
+    request->result = AA_IO_PENDING;
+}
+
+void io_submit(struct io_batch *batch, struct io_request request[], int count) {
+    batch->request = request;
+    batch->count = count;
+    batch->submitted = 0;
+    batch->completed = 0;
+    engine->submit(batch);
+}
+
+/*
+  Index of the next finished request in the batch, or -1 once all have
+  been returned. A negative result holds the errno of a failed request.
+*/
+int io_complete(struct io_batch *batch) {
+    if (batch->completed==batch->count) {
+        return -1;
+    }
+    return engine->complete(batch);
+}
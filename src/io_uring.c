@@ -0,0 +1,345 @@
+/*
+  io_uring block I/O engine
+
+  Each thread gets its own ring the first time it submits a batch, so FUSE
+  worker threads never share a submission queue. A batch is queued as a set
+  of readv/writev operations and submitted with one system call, then
+  completions are returned as they arrive. Threads that cannot set up a
+  ring fall back to performing their requests with preadv/pwritev, as do
+  threads whose ring fails while they wait on it. A thread must finish one
+  batch before it starts another.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "io.h"
+#include "logs.h"
+
+#define AA_URING_ENTRIES 64
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned inflight;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static __thread struct uring *thread_uring;
+static __thread int thread_uring_failed;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void close_uring(struct uring *ring) {
+    if (ring->sqes!=NULL && ring->sqes!=MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring!=NULL && ring->cq_ring!=MAP_FAILED && ring->cq_ring!=ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring!=NULL && ring->sq_ring!=MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd>=0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+static void release_thread_uring(void *ring) {
+    close_uring(ring);
+}
+
+static void create_uring_key() {
+    pthread_key_create(&uring_key, release_thread_uring);
+}
+
+static struct uring *open_uring() {
+    struct io_uring_params params;
+    struct uring *ring;
+    unsigned char *sq;
+    unsigned char *cq;
+
+    ring = calloc(1, sizeof(struct uring));
+    if (ring==NULL) {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(AA_URING_ENTRIES, &params);
+    if (ring->fd<0) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size>ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring==MAP_FAILED) {
+        close_uring(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring==MAP_FAILED) {
+            close_uring(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes==MAP_FAILED) {
+        close_uring(ring);
+        return NULL;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+static struct uring *get_thread_uring() {
+    if ((thread_uring==NULL) && (!thread_uring_failed)) {
+        pthread_once(&uring_once, create_uring_key);
+        thread_uring = open_uring();
+        if (thread_uring==NULL) {
+            thread_uring_failed = 1;
+            log_error("uring", errno, "Failed to set up a ring for this thread, using pread");
+        } else {
+            pthread_setspecific(uring_key, thread_uring);
+        }
+    }
+    return thread_uring;
+}
+
+/*
+  Take back what the batch has queued on the ring but the kernel has not
+  picked up, ask the kernel to cancel what it has, and wait until every
+  request it took has finished with the batch's buffers. The results that
+  turn up here are not kept, so those requests stay pending for pread.
+*/
+static void drain_uring(struct uring *ring, struct io_batch *batch) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct io_request *request;
+    struct timespec pause;
+    unsigned head;
+    unsigned tail;
+    unsigned index;
+    unsigned queued;
+    int pos;
+    int rc;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    ring->inflight -= *ring->sq_tail - head;
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+
+    queued = 0;
+    tail = head;
+    for(pos=0; pos<batch->submitted && queued<ring->entries; pos++) {
+        request = &batch->request[pos];
+        if (request->result!=AA_IO_PENDING) {
+            continue;
+        }
+        index = tail & *ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long long)(uintptr_t)request;
+        sqe->user_data = 0;
+        ring->sq_array[index] = index;
+        tail++;
+        queued++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    if (queued>0) {
+        uring_enter(ring->fd, queued, 0, 0);
+    }
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = 1000000;
+    while (ring->inflight>0) {
+        head = *ring->cq_head;
+        if (head!=__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data!=0) {
+                ring->inflight--;
+            }
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        rc = uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (rc<0 && errno!=EINTR) {
+            /*
+              Completions are still posted to the ring while it cannot be
+              entered, so poll for them instead.
+            */
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+/*
+  Give up on this thread's ring after a hard error, so it and every batch
+  after it are performed with preadv/pwritev.
+*/
+static void drop_thread_uring() {
+    pthread_setspecific(uring_key, NULL);
+    close_uring(thread_uring);
+    thread_uring = NULL;
+    thread_uring_failed = 1;
+}
+
+/*
+  Queue as many of the batch's unsubmitted requests as the ring has room for.
+*/
+static void queue_requests(struct uring *ring, struct io_batch *batch) {
+    struct io_uring_sqe *sqe;
+    struct io_request *request;
+    unsigned tail;
+    unsigned index;
+    unsigned queued;
+    int rc;
+
+    queued = 0;
+    tail = *ring->sq_tail;
+    while ((batch->submitted<batch->count) && (ring->inflight + queued < ring->entries)) {
+        request = &batch->request[batch->submitted++];
+        index = tail & *ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = request->fd;
+        sqe->addr = (unsigned long)request->iov;
+        sqe->len = (unsigned)request->iovcnt;
+        sqe->off = (unsigned long long)request->offset;
+        sqe->user_data = (unsigned long long)(uintptr_t)request;
+        ring->sq_array[index] = index;
+        tail++;
+        queued++;
+    }
+    if (queued==0) {
+        return;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    do {
+        rc = uring_enter(ring->fd, queued, 0, 0);
+    } while (rc<0 && errno==EINTR);
+    ring->inflight += queued;
+}
+
+static void uring_submit(struct io_batch *batch) {
+    struct uring *ring;
+
+    ring = get_thread_uring();
+    if (ring!=NULL) {
+        queue_requests(ring, batch);
+    }
+}
+
+static int uring_complete(struct io_batch *batch) {
+    struct uring *ring;
+    struct io_uring_cqe *cqe;
+    struct io_request *request;
+    unsigned head;
+    int rc;
+
+    ring = get_thread_uring();
+    if (ring==NULL) {
+        return pread_engine.complete(batch);
+    }
+
+    for(;;) {
+        head = *ring->cq_head;
+        if (head!=__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            request = (struct io_request *)(uintptr_t)cqe->user_data;
+            request->result = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            batch->completed++;
+            queue_requests(ring, batch);
+            return (int)(request - batch->request);
+        }
+        queue_requests(ring, batch);
+        rc = uring_enter(ring->fd, *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), 1, IORING_ENTER_GETEVENTS);
+        if (rc<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
+            /*
+              The ring is only closed once nothing is in flight. Requests
+              not yet returned are then done again with pread, which writes
+              the same bytes to the same places.
+            */
+            log_error("uring", errno, "io_uring_enter failed while waiting for %u requests, using pread", ring->inflight);
+            drain_uring(ring, batch);
+            drop_thread_uring();
+            return pread_engine.complete(batch);
+        }
+    }
+}
+
+static int uring_available() {
+    struct uring *ring;
+
+    ring = open_uring();
+    if (ring==NULL) {
+        return 0;
+    }
+    close_uring(ring);
+    return 1;
+}
+
+const struct io_engine uring_engine = {
+    .name = "uring",
+    .available = uring_available,
+    .submit = uring_submit,
+    .complete = uring_complete,
+};
@@ -0,0 +1,627 @@
+/*
+  Load generator for a mounted archive
+
+  archivist-loadgen drives a directory, normally an archivist mount
+  point, with a mix of operations from a number of client threads and
+  reports the throughput and latency percentiles of every kind of
+  operation. Each mix is run for a fixed time at each thread count in
+  turn so the scaling of the file system can be read off the report.
+
+  The files the mixes work on are made before any are timed and removed
+  at the end. Pages the kernel caches from a read are dropped after it,
+  outside the timing, so every read reaches the file system unless
+  --page-cache=keep is given. Every latency is kept, so the percentiles
+  are exact.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define LOAD_MAX_THREADS 256
+#define LOAD_SMALL_FILES 16
+#define LOAD_STATS_PER_LISTING 8
+
+#define OP_READ 0
+#define OP_WRITE 1
+#define OP_CREATE 2
+#define OP_UNLINK 3
+#define OP_READDIR 4
+#define OP_STAT 5
+#define OP_COUNT 6
+
+static const char *op_name[OP_COUNT] = { "read", "write", "create", "unlink", "readdir", "stat" };
+
+/* The latencies of one kind of operation, in nanoseconds. */
+struct samples {
+    uint64_t *ns;
+    size_t count;
+    size_t space;
+    uint64_t bytes;
+};
+
+struct mix;
+
+struct client {
+    pthread_t thread;
+    const struct mix *mix;
+    int id;
+    int fd_own;
+    uint64_t random;
+    off_t position;
+    uint64_t step;
+    uint64_t created;
+    uint64_t removed;
+    unsigned char *buf;
+    struct samples op[OP_COUNT];
+};
+
+struct mix {
+    const char *name;
+    void (*step)(struct client *client);
+    const char *help;
+};
+
+static struct loadgen {
+    char dir[PATH_MAX - 64];
+    int files;
+    int data_files;
+    int fd_data[LOAD_MAX_THREADS];
+    off_t file_size;
+    size_t io_size;
+    size_t seq_size;
+    double seconds;
+    int drop_cache;
+    int stop;
+} load;
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t next_random(struct client *client) {
+    client->random ^= client->random << 13;
+    client->random ^= client->random >> 7;
+    client->random ^= client->random << 17;
+    return client->random;
+}
+
+static void fail(int err_no, const char *action, const char *fpath) {
+    fprintf(stderr, "Error %d (%s) , %s %s\n", err_no, strerror(err_no), action, fpath);
+    exit(1);
+}
+
+static void record(struct client *client, int op, uint64_t start, size_t bytes) {
+    struct samples *samples;
+    uint64_t *ns;
+
+    samples = &client->op[op];
+    if (samples->count==samples->space) {
+        samples->space = (samples->space==0) ? 65536 : samples->space * 2;
+        ns = realloc(samples->ns, samples->space * sizeof(uint64_t));
+        if (ns==NULL) {
+            fail(ENOMEM, "Memory allocation failed", "");
+        }
+        samples->ns = ns;
+    }
+    samples->ns[samples->count++] = now_ns() - start;
+    samples->bytes += bytes;
+}
+
+static void data_path(char fpath[PATH_MAX], int idx) {
+    snprintf(fpath, PATH_MAX, "%s/data.%d", load.dir, idx);
+}
+
+static void timed_read(struct client *client, int fd, size_t size, off_t ofs) {
+    uint64_t start;
+    ssize_t len;
+
+    start = now_ns();
+    len = pread(fd, client->buf, size, ofs);
+    if (len<0) {
+        fail(errno, "Failed to read from", load.dir);
+    }
+    record(client, OP_READ, start, (size_t)len);
+    if (load.drop_cache) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+static void timed_write(struct client *client, int fd, size_t size, off_t ofs) {
+    uint64_t start;
+    ssize_t len;
+
+    client->buf[0] = (unsigned char)next_random(client);
+    start = now_ns();
+    len = pwrite(fd, client->buf, size, ofs);
+    if (len!=(ssize_t)size) {
+        fail((len<0) ? errno : EIO, "Failed to write to", load.dir);
+    }
+    record(client, OP_WRITE, start, size);
+}
+
+static off_t random_offset(struct client *client) {
+    off_t slots;
+    slots = load.file_size / (off_t)load.io_size;
+    return (off_t)(next_random(client) % (uint64_t)((slots>0) ? slots : 1)) * (off_t)load.io_size;
+}
+
+static void step_seqread(struct client *client) {
+    timed_read(client, client->fd_own, load.seq_size, client->position);
+    client->position += (off_t)load.seq_size;
+    if (client->position>=load.file_size) {
+        client->position = 0;
+    }
+}
+
+static void step_seqwrite(struct client *client) {
+    timed_write(client, client->fd_own, load.seq_size, client->position);
+    client->position += (off_t)load.seq_size;
+    if (client->position>=load.file_size) {
+        client->position = 0;
+    }
+}
+
+static void step_randread(struct client *client) {
+    timed_read(client, load.fd_data[next_random(client) % (uint64_t)load.data_files], load.io_size, random_offset(client));
+}
+
+static void step_randwrite(struct client *client) {
+    timed_write(client, client->fd_own, load.io_size, random_offset(client));
+}
+
+/* Seven reads to every three writes, all at random in the shared files. */
+static void step_mixed(struct client *client) {
+    int fd;
+
+    fd = load.fd_data[next_random(client) % (uint64_t)load.data_files];
+    if (next_random(client) % 10<7) {
+        timed_read(client, fd, load.io_size, random_offset(client));
+    } else {
+        timed_write(client, fd, load.io_size, random_offset(client));
+    }
+}
+
+/*
+  Keep LOAD_SMALL_FILES files of io_size bytes per client, creating a new
+  one and removing the oldest in turn.
+*/
+static void step_smallfile(struct client *client) {
+    char fpath[PATH_MAX];
+    uint64_t start;
+    int fd;
+
+    if (client->created - client->removed<LOAD_SMALL_FILES) {
+        snprintf(fpath, PATH_MAX, "%s/small/%d.%lu", load.dir, client->id, client->created);
+        start = now_ns();
+        fd = open(fpath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if ((fd<0) || (write(fd, client->buf, load.io_size)!=(ssize_t)load.io_size) || (close(fd)!=0)) {
+            fail(errno, "Failed to create", fpath);
+        }
+        record(client, OP_CREATE, start, load.io_size);
+        client->created++;
+    } else {
+        snprintf(fpath, PATH_MAX, "%s/small/%d.%lu", load.dir, client->id, client->removed);
+        start = now_ns();
+        if (unlink(fpath)!=0) {
+            fail(errno, "Failed to remove", fpath);
+        }
+        record(client, OP_UNLINK, start, 0);
+        client->removed++;
+    }
+}
+
+/*
+  List the directory of --files entries, then stat some of them at random
+  as ls -l or a backup would.
+*/
+static void step_metadata(struct client *client) {
+    char fpath[PATH_MAX];
+    struct stat statbuf;
+    struct dirent *de;
+    uint64_t start;
+    DIR *dp;
+
+    if (client->step++ % (LOAD_STATS_PER_LISTING + 1)==0) {
+        snprintf(fpath, PATH_MAX, "%s/meta", load.dir);
+        start = now_ns();
+        dp = opendir(fpath);
+        if (dp==NULL) {
+            fail(errno, "Failed to open", fpath);
+        }
+        while ((de = readdir(dp))!=NULL) {
+        }
+        closedir(dp);
+        record(client, OP_READDIR, start, 0);
+    } else {
+        snprintf(fpath, PATH_MAX, "%s/meta/%lu", load.dir, next_random(client) % (uint64_t)load.files);
+        start = now_ns();
+        if (stat(fpath, &statbuf)!=0) {
+            fail(errno, "Failed to stat", fpath);
+        }
+        record(client, OP_STAT, start, 0);
+    }
+}
+
+static const struct mix mixes[] = {
+    { "seqread", step_seqread, "sequential reads of a file per client" },
+    { "seqwrite", step_seqwrite, "sequential overwrites of a file per client" },
+    { "randread", step_randread, "random reads across the files of all clients" },
+    { "randwrite", step_randwrite, "random overwrites of a file per client" },
+    { "smallfile", step_smallfile, "small file creates and unlinks" },
+    { "metadata", step_metadata, "directory listings and stats" },
+    { "mixed", step_mixed, "random reads and writes, 70/30, across all files" },
+};
+
+#define MIX_COUNT ((int)(sizeof(mixes) / sizeof(mixes[0])))
+
+static void *client_thread(void *arg) {
+    struct client *client;
+    const struct mix *mix;
+
+    client = arg;
+    mix = client->mix;
+    while (!__atomic_load_n(&load.stop, __ATOMIC_RELAXED)) {
+        mix->step(client);
+    }
+    return NULL;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x>y) - (x<y);
+}
+
+static double percentile_us(const uint64_t *ns, size_t count, double fraction) {
+    size_t rank;
+
+    rank = (size_t)(fraction * (double)count + 0.999999);
+    if (rank<1) {
+        rank = 1;
+    }
+    return (double)ns[rank - 1] / 1000.0;
+}
+
+/* Merge what the clients recorded and report each kind of operation. */
+static void report(const char *mix, struct client *client, int threads, double seconds) {
+    struct samples all;
+    size_t total;
+    int op;
+    int idx;
+
+    for(op=0; op<OP_COUNT; op++) {
+        total = 0;
+        all.bytes = 0;
+        for(idx=0; idx<threads; idx++) {
+            total += client[idx].op[op].count;
+            all.bytes += client[idx].op[op].bytes;
+        }
+        if (total==0) {
+            continue;
+        }
+        all.ns = malloc(total * sizeof(uint64_t));
+        if (all.ns==NULL) {
+            fail(ENOMEM, "Memory allocation failed", "");
+        }
+        all.count = 0;
+        for(idx=0; idx<threads; idx++) {
+            memcpy(all.ns + all.count, client[idx].op[op].ns, client[idx].op[op].count * sizeof(uint64_t));
+            all.count += client[idx].op[op].count;
+        }
+        qsort(all.ns, all.count, sizeof(uint64_t), compare_ns);
+        printf("%-10s %7d %-8s %10zu %12.1f %10.2f %10.1f %10.1f %10.1f\n", mix, threads, op_name[op], all.count,
+               (double)all.count / seconds, (double)all.bytes / seconds / 1e6,
+               percentile_us(all.ns, all.count, 0.50), percentile_us(all.ns, all.count, 0.99), percentile_us(all.ns, all.count, 0.999));
+        fflush(stdout);
+        free(all.ns);
+    }
+}
+
+static void run_mix(const struct mix *mix, int threads) {
+    char fpath[PATH_MAX];
+    struct client *client;
+    struct timespec pause;
+    uint64_t started;
+    double seconds;
+    int idx;
+    int op;
+
+    client = calloc((size_t)threads, sizeof(struct client));
+    if (client==NULL) {
+        fail(ENOMEM, "Memory allocation failed", "");
+    }
+    for(idx=0; idx<threads; idx++) {
+        client[idx].id = idx;
+        client[idx].random = 0x9e3779b97f4a7c15ULL * (uint64_t)(idx + 1);
+        client[idx].mix = mix;
+        if (posix_memalign((void **)&client[idx].buf, 4096, (load.io_size>load.seq_size) ? load.io_size : load.seq_size)!=0) {
+            fail(ENOMEM, "Memory allocation failed", "");
+        }
+        memset(client[idx].buf, 0x5a, (load.io_size>load.seq_size) ? load.io_size : load.seq_size);
+        data_path(fpath, idx);
+        client[idx].fd_own = open(fpath, O_RDWR);
+        if (client[idx].fd_own<0) {
+            fail(errno, "Failed to open", fpath);
+        }
+    }
+
+    __atomic_store_n(&load.stop, 0, __ATOMIC_RELAXED);
+    started = now_ns();
+    for(idx=0; idx<threads; idx++) {
+        if (pthread_create(&client[idx].thread, NULL, client_thread, &client[idx])!=0) {
+            fail(errno, "Failed to start threads", "");
+        }
+    }
+    pause.tv_sec = (time_t)load.seconds;
+    pause.tv_nsec = (long)((load.seconds - (double)pause.tv_sec) * 1e9);
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&load.stop, 1, __ATOMIC_RELAXED);
+    for(idx=0; idx<threads; idx++) {
+        pthread_join(client[idx].thread, NULL);
+    }
+    seconds = (double)(now_ns() - started) / 1e9;
+    report(mix->name, client, threads, seconds);
+
+    for(idx=0; idx<threads; idx++) {
+        while (client[idx].removed<client[idx].created) {
+            snprintf(fpath, PATH_MAX, "%s/small/%d.%lu", load.dir, idx, client[idx].removed++);
+            unlink(fpath);
+        }
+        close(client[idx].fd_own);
+        free(client[idx].buf);
+        for(op=0; op<OP_COUNT; op++) {
+            free(client[idx].op[op].ns);
+        }
+    }
+    free(client);
+}
+
+/* Make the files every mix works on, data files for the most clients. */
+static void prepare(int most) {
+    char fpath[PATH_MAX];
+    unsigned char *buf;
+    off_t ofs;
+    size_t len;
+    int fd;
+    int idx;
+
+    snprintf(fpath, PATH_MAX, "%s/small", load.dir);
+    if (mkdir(fpath, 0755)!=0) {
+        fail(errno, "Failed to create", fpath);
+    }
+    snprintf(fpath, PATH_MAX, "%s/meta", load.dir);
+    if (mkdir(fpath, 0755)!=0) {
+        fail(errno, "Failed to create", fpath);
+    }
+    for(idx=0; idx<load.files; idx++) {
+        snprintf(fpath, PATH_MAX, "%s/meta/%d", load.dir, idx);
+        fd = open(fpath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if ((fd<0) || (close(fd)!=0)) {
+            fail(errno, "Failed to create", fpath);
+        }
+    }
+
+    buf = malloc(1024 * 1024);
+    if (buf==NULL) {
+        fail(ENOMEM, "Memory allocation failed", "");
+    }
+    for(len=0; len<1024 * 1024; len++) {
+        buf[len] = (unsigned char)(len * 131 + 7);
+    }
+    load.data_files = most;
+    for(idx=0; idx<most; idx++) {
+        data_path(fpath, idx);
+        fd = open(fpath, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd<0) {
+            fail(errno, "Failed to create", fpath);
+        }
+        for(ofs=0; ofs<load.file_size; ofs+=(off_t)len) {
+            len = (load.file_size - ofs<1024 * 1024) ? (size_t)(load.file_size - ofs) : 1024 * 1024;
+            if (pwrite(fd, buf, len, ofs)!=(ssize_t)len) {
+                fail(errno, "Failed to write to", fpath);
+            }
+        }
+        if (load.drop_cache) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        load.fd_data[idx] = fd;
+    }
+    free(buf);
+}
+
+static void clean_up(void) {
+    char fpath[PATH_MAX];
+    int idx;
+
+    for(idx=0; idx<load.data_files; idx++) {
+        close(load.fd_data[idx]);
+        data_path(fpath, idx);
+        unlink(fpath);
+    }
+    for(idx=0; idx<load.files; idx++) {
+        snprintf(fpath, PATH_MAX, "%s/meta/%d", load.dir, idx);
+        unlink(fpath);
+    }
+    snprintf(fpath, PATH_MAX, "%s/meta", load.dir);
+    rmdir(fpath);
+    snprintf(fpath, PATH_MAX, "%s/small", load.dir);
+    rmdir(fpath);
+    rmdir(load.dir);
+}
+
+static off_t parse_size(const char *value) {
+    char *end;
+    off_t size;
+
+    size = strtoll(value, &end, 10);
+    if ((*end=='K') || (*end=='k')) {
+        size *= 1024;
+        end++;
+    } else if ((*end=='M') || (*end=='m')) {
+        size *= 1024 * 1024;
+        end++;
+    } else if ((*end=='G') || (*end=='g')) {
+        size *= 1024 * 1024 * 1024;
+        end++;
+    }
+    return (*end==0) ? size : -1;
+}
+
+/*
+  The thread counts given by --threads, a list such as 1,2,8 or a single
+  N for the powers of two up to N and N itself.
+*/
+static int parse_threads(const char *value, int counts[]) {
+    char *end;
+    long threads;
+    int n;
+
+    n = 0;
+    if (strchr(value, ',')==NULL) {
+        threads = strtol(value, &end, 10);
+        if ((*end!=0) || (threads<1) || (threads>LOAD_MAX_THREADS)) {
+            return -1;
+        }
+        for(n=0; (1L<<n)<threads; n++) {
+            counts[n] = 1 << n;
+        }
+        counts[n++] = (int)threads;
+        return n;
+    }
+    while (*value!=0) {
+        threads = strtol(value, &end, 10);
+        if ((end==value) || ((*end!=',') && (*end!=0)) || (threads<1) || (threads>LOAD_MAX_THREADS) || (n==LOAD_MAX_THREADS)) {
+            return -1;
+        }
+        counts[n++] = (int)threads;
+        value = (*end==',') ? end + 1 : end;
+    }
+    return n;
+}
+
+static void usage(void) {
+    int idx;
+
+    fprintf(stderr, "usage: archivist-loadgen [options] <directory>\n");
+    fprintf(stderr, "    --mix=NAME[,NAME]  mixes to run (default all)\n");
+    for(idx=0; idx<MIX_COUNT; idx++) {
+        fprintf(stderr, "        %-10s %s\n", mixes[idx].name, mixes[idx].help);
+    }
+    fprintf(stderr, "    --threads=N|LIST   client threads, 1, 2, 4 ... up to N or a list such as 1,3,8 (default 8)\n");
+    fprintf(stderr, "    --seconds=S        how long each mix runs at each thread count (default 10)\n");
+    fprintf(stderr, "    --file-size=BYTES  size of each client's data file (default 16M)\n");
+    fprintf(stderr, "    --io-size=BYTES    size of random reads and writes and of small files (default 4K)\n");
+    fprintf(stderr, "    --seq-size=BYTES   size of sequential reads and writes (default 128K)\n");
+    fprintf(stderr, "    --files=N          entries in the directory listed by the metadata mix (default 1000)\n");
+    fprintf(stderr, "    --page-cache=MODE  drop (default) pages cached by each read, or keep them\n");
+}
+
+int main(int argc, char* argv[]) {
+    int counts[LOAD_MAX_THREADS];
+    int selected[MIX_COUNT];
+    const char *mix_names;
+    const char *name;
+    size_t len;
+    int nthreads;
+    int most;
+    int idx;
+    int run;
+
+    load.seconds = 10;
+    load.file_size = 16 * 1024 * 1024;
+    load.io_size = 4096;
+    load.seq_size = 128 * 1024;
+    load.files = 1000;
+    load.drop_cache = 1;
+    mix_names = NULL;
+    nthreads = parse_threads("8", counts);
+    while ((argc > 2) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--mix=", 6)) {
+            mix_names = argv[1] + 6;
+        } else if (!strncmp(argv[1], "--threads=", 10)) {
+            nthreads = parse_threads(argv[1] + 10, counts);
+            if (nthreads<0) {
+                fprintf(stderr, "Error %d (%s) , Invalid thread counts %s\n", EINVAL, strerror(EINVAL), argv[1] + 10);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--seconds=", 10)) {
+            load.seconds = atof(argv[1] + 10);
+        } else if (!strncmp(argv[1], "--file-size=", 12)) {
+            load.file_size = parse_size(argv[1] + 12);
+        } else if (!strncmp(argv[1], "--io-size=", 10)) {
+            load.io_size = (size_t)parse_size(argv[1] + 10);
+        } else if (!strncmp(argv[1], "--seq-size=", 11)) {
+            load.seq_size = (size_t)parse_size(argv[1] + 11);
+        } else if (!strncmp(argv[1], "--files=", 8)) {
+            load.files = atoi(argv[1] + 8);
+        } else if (!strncmp(argv[1], "--page-cache=", 13)) {
+            load.drop_cache = strcmp(argv[1] + 13, "keep")!=0;
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            usage();
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
+    if ((argc!=2) || (load.seconds<=0) || (load.file_size<=0) || ((ssize_t)load.io_size<=0) || ((ssize_t)load.seq_size<=0)
+        || (load.io_size>(size_t)load.file_size) || (load.seq_size>(size_t)load.file_size) || (load.files<1)) {
+        usage();
+        exit(1);
+    }
+
+    for(idx=0; idx<MIX_COUNT; idx++) {
+        selected[idx] = (mix_names==NULL);
+    }
+    for(name=mix_names; (name!=NULL) && (*name!=0); name+=len + (name[len]==',')) {
+        len = strcspn(name, ",");
+        for(idx=0; idx<MIX_COUNT; idx++) {
+            if ((strlen(mixes[idx].name)==len) && !strncmp(mixes[idx].name, name, len)) {
+                selected[idx] = 1;
+                break;
+            }
+        }
+        if (idx==MIX_COUNT) {
+            fprintf(stderr, "Error %d (%s) , Unknown mix %.*s\n", EINVAL, strerror(EINVAL), (int)len, name);
+            exit(1);
+        }
+    }
+
+    if (snprintf(load.dir, sizeof(load.dir), "%s/loadgen.%d", argv[1], (int)getpid())>=(int)sizeof(load.dir)) {
+        fail(ENAMETOOLONG, "Path too long", argv[1]);
+    }
+    if (mkdir(load.dir, 0755)!=0) {
+        fail(errno, "Failed to create", load.dir);
+    }
+    most = 1;
+    for(run=0; run<nthreads; run++) {
+        most = (counts[run]>most) ? counts[run] : most;
+    }
+    prepare(most);
+
+    printf("# archivist-loadgen dir=%s seconds=%.1f file_size=%lld io_size=%zu seq_size=%zu files=%d page_cache=%s\n",
+           argv[1], load.seconds, (long long)load.file_size, load.io_size, load.seq_size, load.files, load.drop_cache ? "drop" : "keep");
+    printf("# %-8s %7s %-8s %10s %12s %10s %10s %10s %10s\n", "mix", "threads", "op", "ops", "ops/s", "MB/s", "p50_us", "p99_us", "p999_us");
+    for(idx=0; idx<MIX_COUNT; idx++) {
+        if (!selected[idx]) {
+            continue;
+        }
+        for(run=0; run<nthreads; run++) {
+            run_mix(&mixes[idx], counts[run]);
+        }
+    }
+    clean_up();
+    return 0;
+}
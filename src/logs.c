@@ -1,93 +1,324 @@
+/*
+  Logging
+
+  Every thread formats its messages into a ring of records of its own, so
+  logging takes no locks and makes no system calls on the calling thread.
+  A single writer thread drains the rings into the log file, stamps each
+  line, and rotates the file when it grows past its limit. A ring that
+  fills up before the writer empties it drops records and the writer notes
+  how many were lost.
+
+  The clock is read by the writer and cached for the other threads, so
+  times are accurate to about AA_LOG_IDLE_MS.
+*/
 
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include "logs.h"
 
-FILE* log_fh;
-pthread_mutex_t log_mutex;
+struct log_record {
+    time_t when;
+    int level;
+    int rc;
+    char context[AA_LOG_CONTEXT_SIZE];
+    char text[AA_LOG_TEXT_SIZE];
+};
+
+struct log_ring {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    int orphaned;
+    struct log_ring *next;
+    struct log_record record[AA_LOG_RING_RECORDS];
+};
+
+int log_level = AA_LOG_ERROR;
+
+static FILE* log_fh;
+static char log_path[PATH_MAX];
+static size_t log_rotate_size;
+static size_t log_file_size;
+static time_t log_clock;
+
+static struct log_ring *log_rings;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_ring_key;
+static __thread struct log_ring *thread_ring;
+
+static pthread_t log_writer;
+static int log_running;
+static int log_stop;
+
+static void orphan_ring(void *arg) {
+    struct log_ring *ring = arg;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+void init_logging(const char *path, int level, size_t rotate_size) {
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    log_level = level;
+    log_rotate_size = rotate_size;
+    log_clock = time(NULL);
 
-void init_logging() {
-    log_fh = fopen("archivist.log", "w");
+    log_fh = fopen(log_path, "w");
     if (log_fh==NULL) {
-        fprintf(stderr, "Failed to open log file archivist.log\n");
+        fprintf(stderr, "Failed to open log file %s\n", log_path);
         exit(1);
     }
 
-    if (pthread_mutex_init(&log_mutex, NULL)!=0) {
-        fprintf(stderr, "Failed to create a mutex for the log file\n");
+    if (pthread_key_create(&log_ring_key, orphan_ring)!=0) {
+        fprintf(stderr, "Failed to create a key for the log buffers\n");
         exit(1);
     }
+}
+
+static struct log_ring *get_ring() {
+    struct log_ring *ring;
 
-    setvbuf(log_fh, NULL, _IOLBF, 0);
+    if (thread_ring!=NULL) {
+        return thread_ring;
+    }
+    ring = calloc(1, sizeof(struct log_ring));
+    if (ring==NULL) {
+        return NULL;
+    }
+    pthread_setspecific(log_ring_key, ring);
+    pthread_mutex_lock(&log_rings_lock);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_rings_lock);
+    thread_ring = ring;
+    return ring;
 }
 
-int log_status(const char* context, int rc, const char* format, ...) {
-    va_list ap;
-    time_t now;
-    struct tm local;
+/*
+  Reserve the next record in this thread's ring, or return NULL when the
+  ring is full. Errors are never dropped while the writer is running, they
+  wait for it to make room instead.
+*/
+static struct log_record *begin_record(int level, const char *context, int rc) {
+    struct log_ring *ring;
+    struct log_record *record;
+    uint64_t head;
 
-    time(&now);
-    localtime_r(&now, &local);
+    ring = get_ring();
+    if (ring==NULL) {
+        return NULL;
+    }
+    head = ring->head;
+    while ((level==AA_LOG_ERROR) && __atomic_load_n(&log_running, __ATOMIC_ACQUIRE) &&
+           (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= AA_LOG_RING_RECORDS)) {
+        sched_yield();
+    }
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= AA_LOG_RING_RECORDS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    record = &ring->record[head % AA_LOG_RING_RECORDS];
+    record->when = __atomic_load_n(&log_clock, __ATOMIC_RELAXED);
+    record->level = level;
+    record->rc = rc;
+    snprintf(record->context, sizeof(record->context), "%s", context);
+    return record;
+}
 
-    pthread_mutex_lock(&log_mutex);
+static void end_record() {
+    __atomic_store_n(&thread_ring->head, thread_ring->head + 1, __ATOMIC_RELEASE);
+}
 
-    fprintf(log_fh, "%02d:%02d:%02d : %-6s : %-10s : (%-5d) : ", local.tm_hour, local.tm_min, local.tm_sec, "STATUS", context, rc);
+static void rotate_log() {
+    char from[PATH_MAX + 16];
+    char to[PATH_MAX + 16];
+    int keep;
 
-    va_start(ap, format);
-    vfprintf(log_fh, format, ap);
-    va_end(ap);
+    fclose(log_fh);
+    for(keep=AA_LOG_KEEP-1; keep>0; keep--) {
+        snprintf(from, sizeof(from), "%s.%d", log_path, keep);
+        snprintf(to, sizeof(to), "%s.%d", log_path, keep + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log_path);
+    rename(log_path, to);
 
-    fprintf(log_fh, "\n");
+    log_fh = fopen(log_path, "w");
+    log_file_size = 0;
+}
 
-    pthread_mutex_unlock(&log_mutex);
+static void write_record(const struct log_record *record) {
+    static time_t stamp_time = -1;
+    static struct tm stamp;
+    int len;
 
-    return rc;
+    if (log_fh==NULL) {
+        return;
+    }
+    if (record->when!=stamp_time) {
+        stamp_time = record->when;
+        localtime_r(&stamp_time, &stamp);
+    }
+    switch (record->level) {
+        case AA_LOG_ERROR:
+            len = fprintf(log_fh, "%02d:%02d:%02d : %-6s : %-10s : (%-5d) : %-20s : %s\n", stamp.tm_hour, stamp.tm_min, stamp.tm_sec,
+                          "ERROR", record->context, record->rc, (record->rc!=0?strerror(record->rc):""), record->text);
+            break;
+        case AA_LOG_STATUS:
+            len = fprintf(log_fh, "%02d:%02d:%02d : %-6s : %-10s : (%-5d) : %s\n", stamp.tm_hour, stamp.tm_min, stamp.tm_sec,
+                          "STATUS", record->context, record->rc, record->text);
+            break;
+        default:
+            len = fprintf(log_fh, "%02d:%02d:%02d : %-6s : %-10s : %s\n", stamp.tm_hour, stamp.tm_min, stamp.tm_sec,
+                          "INFO", record->context, record->text);
+            break;
+    }
+    if (len>0) {
+        log_file_size += (size_t)len;
+    }
+    if ((log_rotate_size>0) && (log_file_size>=log_rotate_size)) {
+        rotate_log();
+    }
 }
 
-void log_info(const char* context, const char* format, ...) {
-    va_list ap;
-    time_t now;
-    struct tm local;
+/*
+  Write out everything queued so far. Returns the number of records written.
+*/
+static int drain_rings() {
+    struct log_ring **link;
+    struct log_ring *ring;
+    struct log_record note;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    int written;
 
-    time(&now);
-    localtime_r(&now, &local);
+    written = 0;
+    pthread_mutex_lock(&log_rings_lock);
+    link = &log_rings;
+    while ((ring = *link)!=NULL) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for(tail=ring->tail; tail!=head; tail++) {
+            write_record(&ring->record[tail % AA_LOG_RING_RECORDS]);
+            written++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 
-    pthread_mutex_lock(&log_mutex);
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped>0) {
+            memset(&note, 0, sizeof(note));
+            note.when = log_clock;
+            note.level = AA_LOG_STATUS;
+            snprintf(note.context, sizeof(note.context), "log");
+            snprintf(note.text, sizeof(note.text), "%lu records dropped", dropped);
+            write_record(&note);
+        }
 
-    fprintf(log_fh, "%02d:%02d:%02d : %-6s : %-10s : ", local.tm_hour, local.tm_min, local.tm_sec, "INFO", context);
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) && (ring->head==tail)) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&log_rings_lock);
 
-    va_start(ap, format);
-    vfprintf(log_fh, format, ap);
-    va_end(ap);
+    if ((written>0) && (log_fh!=NULL)) {
+        fflush(log_fh);
+    }
+    return written;
+}
 
-    fprintf(log_fh, "\n");
+static void *writer_thread(void *arg) {
+    struct timespec idle = { 0, AA_LOG_IDLE_MS * 1000000L };
 
-    pthread_mutex_unlock(&log_mutex);
+    while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&log_clock, time(NULL), __ATOMIC_RELAXED);
+        if (drain_rings()==0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    drain_rings();
+    return NULL;
 }
 
-int log_error(const char* context, int err_no, const char* format, ...) {
+/*
+  Start the writer thread. This is done once FUSE has daemonized, as threads
+  do not survive the fork. Messages logged before then wait in the rings.
+*/
+void start_logging() {
+    if (log_running) {
+        return;
+    }
+    __atomic_store_n(&log_stop, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&log_writer, NULL, writer_thread, NULL)!=0) {
+        fprintf(stderr, "Failed to start the log writer\n");
+        return;
+    }
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+}
+
+void stop_logging() {
+    if (log_running) {
+        __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(log_writer, NULL);
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    } else {
+        drain_rings();
+    }
+}
+
+int log_status_write(const char* context, int rc, const char* format, ...) {
     va_list ap;
-    time_t now;
-    struct tm local;
+    struct log_record *record;
 
-    time(&now);
-    localtime_r(&now, &local);
+    record = begin_record(AA_LOG_STATUS, context, rc);
+    if (record==NULL) {
+        return rc;
+    }
 
-    pthread_mutex_lock(&log_mutex);
+    va_start(ap, format);
+    vsnprintf(record->text, sizeof(record->text), format, ap);
+    va_end(ap);
+
+    end_record();
+    return rc;
+}
 
-    fprintf(log_fh, "%02d:%02d:%02d : %-6s : %-10s : (%-5d) : %-20s : ", local.tm_hour, local.tm_min, local.tm_sec, "ERROR", context, err_no , (err_no!=0?strerror(err_no):""));
+void log_info_write(const char* context, const char* format, ...) {
+    va_list ap;
+    struct log_record *record;
+
+    record = begin_record(AA_LOG_INFO, context, 0);
+    if (record==NULL) {
+        return;
+    }
 
     va_start(ap, format);
-    vfprintf(log_fh, format, ap);
+    vsnprintf(record->text, sizeof(record->text), format, ap);
     va_end(ap);
 
-    fprintf(log_fh, "\n");
+    end_record();
+}
 
-    pthread_mutex_unlock(&log_mutex);
+int log_error(const char* context, int err_no, const char* format, ...) {
+    va_list ap;
+    struct log_record *record;
+
+    record = begin_record(AA_LOG_ERROR, context, err_no);
+    if (record==NULL) {
+        return -err_no;
+    }
+
+    va_start(ap, format);
+    vsnprintf(record->text, sizeof(record->text), format, ap);
+    va_end(ap);
 
+    end_record();
     return -err_no;
 }
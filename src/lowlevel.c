@@ -0,0 +1,1153 @@
+/*
+  Low level FUSE frontend
+
+  The kernel refers to files by inode number instead of by path. Each inode
+  the kernel knows about holds an O_PATH descriptor on every copy, opened
+  once by lookup and kept until the kernel forgets it, so operations work
+  relative to those descriptors and never rebuild or resolve a backing path.
+  Inodes are found again by the device and inode number of the primary copy
+  so hard links and repeated lookups share one entry.
+
+  Reads and fsyncs are handed to a small pool of worker threads which send
+  the reply themselves, leaving the FUSE threads free to take the next
+  request while the block I/O is in progress.
+*/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 30
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse_lowlevel.h>
+#include "logs.h"
+#include "cache.h"
+#include "writeback.h"
+#include "scrub.h"
+#include "stats.h"
+#include "lowlevel.h"
+
+struct ll_inode {
+    int fd[AA_MAX_ROOTS];
+    dev_t dev;
+    ino_t ino;
+    int node;
+    uint64_t nlookup;
+    struct ll_inode *next;
+};
+
+#define LL_READ 0
+#define LL_FSYNC 1
+
+struct ll_job {
+    int op;
+    fuse_req_t req;
+    uint64_t fh;
+    size_t size;
+    off_t offset;
+    int datasync;
+    uint64_t start;
+    struct ll_job *next;
+};
+
+struct ll_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct ll_job *head;
+    struct ll_job *tail;
+    int stop;
+    int workers;
+    pthread_t thread[AA_LL_MAX_WORKERS];
+};
+
+static struct archivist_state *ll_state;
+static struct ll_inode root_inode;
+static struct ll_inode stats_inode[AA_STATS_NODES];
+static struct ll_inode *inode_bucket[AA_LL_INODE_BUCKETS];
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ll_queue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER
+};
+
+static struct ll_inode *ll_inode(fuse_ino_t ino) {
+    if (ino==FUSE_ROOT_ID) {
+        return &root_inode;
+    }
+    return (struct ll_inode *)(uintptr_t)ino;
+}
+
+static struct file_entry *ll_entry(struct fuse_file_info *fi) {
+    return handle_file_entry(&ll_state->handles, fi->fh);
+}
+
+static int inode_bucket_index(dev_t dev, ino_t ino) {
+    uint64_t hash;
+    hash = ((uint64_t)ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)dev;
+    hash ^= hash >> 31;
+    return (int)(hash % AA_LL_INODE_BUCKETS);
+}
+
+static void proc_path(char fpath[32], int fd) {
+    snprintf(fpath, 32, "/proc/self/fd/%d", fd);
+}
+
+static int backing_name(char bname[NAME_MAX + 2], const char *name) {
+    size_t len;
+    len = strlen(name);
+    if (len>=NAME_MAX) {
+        return ENAMETOOLONG;
+    }
+    memcpy(bname, name, len);
+    bname[len] = '@';
+    bname[len+1] = 0;
+    return 0;
+}
+
+static int ll_stat(struct ll_inode *inode, struct stat *statbuf) {
+    if (fstatat(inode->fd[0], "", statbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)<0) {
+        return errno;
+    }
+    if ((statbuf->st_mode & S_IFMT) == S_IFREG) {
+        statbuf->st_size = striped_size(inode->fd, statbuf->st_size);
+    }
+    return 0;
+}
+
+static void close_inode(struct ll_inode *inode) {
+    int idx;
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (inode->fd[idx]>=0) {
+            close(inode->fd[idx]);
+            inode->fd[idx] = -1;
+        }
+    }
+}
+
+/*
+  Look up name in parent on every copy and take a reference on its inode.
+*/
+static int ll_do_lookup(struct ll_inode *parent, const char *name, struct fuse_entry_param *entry) {
+    char bname[NAME_MAX + 2];
+    struct ll_inode found;
+    struct ll_inode *inode;
+    int bucket;
+    int idx;
+    int err_no;
+
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    entry->attr_timeout = ll_state->attr_timeout;
+    entry->entry_timeout = ll_state->attr_timeout;
+
+    err_no = backing_name(bname, name);
+    if (err_no!=0) {
+        return err_no;
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        found.fd[idx] = -1;
+        if (parent->fd[idx]>=0) {
+            found.fd[idx] = openat(parent->fd[idx], bname, O_PATH | O_NOFOLLOW);
+        }
+        if (found.fd[idx]<0) {
+            err_no = (parent->fd[idx]>=0 ? errno : EIO);
+            if (idx==0) {
+                return err_no;
+            }
+            log_error("lookup", err_no, "idx=%d %s", idx, name);
+        }
+    }
+    err_no = ll_stat(&found, &entry->attr);
+    if (err_no!=0) {
+        close_inode(&found);
+        return err_no;
+    }
+    found.dev = entry->attr.st_dev;
+    found.ino = entry->attr.st_ino;
+    found.node = AA_STATS_NONE;
+
+    bucket = inode_bucket_index(found.dev, found.ino);
+    pthread_mutex_lock(&inode_lock);
+    for(inode=inode_bucket[bucket]; inode!=NULL; inode=inode->next) {
+        if ((inode->ino==found.ino) && (inode->dev==found.dev)) {
+            break;
+        }
+    }
+    if (inode==NULL) {
+        inode = malloc(sizeof(struct ll_inode));
+        if (inode==NULL) {
+            pthread_mutex_unlock(&inode_lock);
+            close_inode(&found);
+            return ENOMEM;
+        }
+        memcpy(inode, &found, sizeof(struct ll_inode));
+        inode->nlookup = 0;
+        inode->next = inode_bucket[bucket];
+        inode_bucket[bucket] = inode;
+    } else {
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            if (inode->fd[idx]<0) {
+                inode->fd[idx] = found.fd[idx];
+                found.fd[idx] = -1;
+            }
+        }
+        close_inode(&found);
+    }
+    inode->nlookup++;
+    pthread_mutex_unlock(&inode_lock);
+
+    entry->ino = (fuse_ino_t)(uintptr_t)inode;
+    return 0;
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup) {
+    struct ll_inode *inode;
+    struct ll_inode **link;
+
+    inode = ll_inode(ino);
+    if ((inode==&root_inode) || (inode->node!=AA_STATS_NONE)) {
+        return;
+    }
+    pthread_mutex_lock(&inode_lock);
+    inode->nlookup -= nlookup;
+    if (inode->nlookup==0) {
+        link = &inode_bucket[inode_bucket_index(inode->dev, inode->ino)];
+        while (*link!=inode) {
+            link = &(*link)->next;
+        }
+        *link = inode->next;
+        close_inode(inode);
+        free(inode);
+    }
+    pthread_mutex_unlock(&inode_lock);
+}
+
+/*
+  Open every copy of an inode for reading and writing blocks.
+*/
+static int open_inode_entry(struct ll_inode *inode, struct file_entry *file_entry, int flags) {
+    char fpath[32];
+    int err_no[AA_MAX_ROOTS];
+    int idx;
+
+    clear_list(err_no);
+    memset(&file_entry->dirty, 0, sizeof(struct write_buffer));
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        file_entry->file[idx].fd = -1;
+        if (inode->fd[idx]<0) {
+            err_no[idx] = EIO;
+            continue;
+        }
+        proc_path(fpath, inode->fd[idx]);
+        file_entry->file[idx].fd = open(fpath, flags & ~(O_CREAT | O_EXCL | O_NOCTTY));
+        if (file_entry->file[idx].fd<0) {
+            err_no[idx] = errno;
+        }
+    }
+    if (first_error(err_no)!=0) {
+        close_all(file_entry);
+        return first_error(err_no);
+    }
+    file_entry->dev = inode->dev;
+    file_entry->ino = inode->ino;
+    return 0;
+}
+
+static int flush_ll_entry(struct file_entry *file_entry) {
+    int err_no;
+
+    pthread_mutex_lock(&file_entry->lock);
+    err_no = flush_writes(file_entry);
+    pthread_mutex_unlock(&file_entry->lock);
+
+    return err_no;
+}
+
+static void serve_job(struct ll_job *job) {
+    struct file_entry *file_entry;
+    struct fuse_bufvec *bufv;
+    struct data_block *blocks;
+    int flushed;
+    int err_no;
+    int idx;
+    int rc;
+
+    file_entry = handle_file_entry(&ll_state->handles, job->fh);
+    if (job->op==LL_READ) {
+        err_no = flush_pending(file_entry->dev, file_entry->ino, &flushed);
+    } else {
+        err_no = flush_ll_entry(file_entry);
+    }
+    if (err_no!=0) {
+        fuse_reply_err(job->req, log_error(job->op==LL_READ?"read":"fsync", err_no, "Failed to flush buffered writes"));
+        return;
+    }
+
+    if (job->op==LL_READ) {
+        err_no = read_segments(file_entry, job->size, job->offset, &blocks, &bufv);
+        if (err_no!=0) {
+            fuse_reply_err(job->req, log_error("read", err_no, "offset = %lu", job->offset));
+            return;
+        }
+        fuse_reply_data(job->req, bufv, FUSE_BUF_SPLICE_MOVE);
+        free(blocks);
+        free(bufv);
+        return;
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        rc = job->datasync ? fdatasync(file_entry->file[idx].fd) : fsync(file_entry->file[idx].fd);
+        if (rc<0) {
+            fuse_reply_err(job->req, log_error("fsync", errno, "idx=%d", idx));
+            return;
+        }
+    }
+    fuse_reply_err(job->req, 0);
+}
+
+static void run_job(struct ll_job *job) {
+    serve_job(job);
+    stat_op(job->op==LL_READ ? AA_OP_READ : AA_OP_FSYNC, job->start);
+}
+
+static void *worker_thread(void *arg) {
+    struct ll_job *job;
+
+    for(;;) {
+        pthread_mutex_lock(&queue.lock);
+        while ((queue.head==NULL) && !queue.stop) {
+            pthread_cond_wait(&queue.ready, &queue.lock);
+        }
+        job = queue.head;
+        if (job==NULL) {
+            pthread_mutex_unlock(&queue.lock);
+            return NULL;
+        }
+        queue.head = job->next;
+        if (queue.head==NULL) {
+            queue.tail = NULL;
+        }
+        pthread_mutex_unlock(&queue.lock);
+
+        run_job(job);
+        free(job);
+    }
+}
+
+/*
+  Hand a job to the worker threads, or run it here if there are none.
+*/
+static void defer(int op, fuse_req_t req, struct fuse_file_info *fi, size_t size, off_t offset, int datasync) {
+    struct ll_job *job;
+
+    job = malloc(sizeof(struct ll_job));
+    if (job==NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    job->op = op;
+    job->req = req;
+    job->fh = fi->fh;
+    job->size = size;
+    job->offset = offset;
+    job->datasync = datasync;
+    job->start = stat_clock();
+    job->next = NULL;
+
+    if (queue.workers==0) {
+        run_job(job);
+        free(job);
+        return;
+    }
+    pthread_mutex_lock(&queue.lock);
+    if (queue.tail==NULL) {
+        queue.head = job;
+    } else {
+        queue.tail->next = job;
+    }
+    queue.tail = job;
+    pthread_cond_signal(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+  The statistics tree under /.archivist is made of static inodes that never
+  touch the storage locations.
+*/
+static int virtual_name(struct ll_inode *dir, const char *name) {
+    return (dir->node!=AA_STATS_NONE) || ((dir==&root_inode) && !strcmp(name, AA_STATS_TOP_NAME));
+}
+
+static int virtual_lookup(struct ll_inode *parent, const char *name, struct fuse_entry_param *entry) {
+    int node;
+
+    node = stats_child(parent==&root_inode ? AA_STATS_NONE : parent->node, name);
+    if (node==AA_STATS_NONE) {
+        return ENOENT;
+    }
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    entry->ino = (fuse_ino_t)(uintptr_t)&stats_inode[node];
+    entry->entry_timeout = ll_state->attr_timeout;
+    stats_attr(node, &entry->attr);
+    return 0;
+}
+
+static void virtual_open(fuse_req_t req, struct ll_inode *inode, struct fuse_file_info *fi) {
+    if ((inode->node!=AA_STATS_COUNTERS) && (inode->node!=AA_STATS_LATENCY)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    if ((fi->flags & O_ACCMODE)!=O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    fi->direct_io = 1;
+    fi->fh = 0;
+    fuse_reply_open(req, fi);
+}
+
+static void virtual_read(fuse_req_t req, struct ll_inode *inode, size_t size, off_t offset) {
+    char *text;
+    size_t len;
+    int err_no;
+
+    err_no = stats_render(inode->node, &text, &len);
+    if (err_no!=0) {
+        fuse_reply_err(req, err_no);
+        return;
+    }
+    if (offset>=(off_t)len) {
+        fuse_reply_buf(req, NULL, 0);
+    } else {
+        len -= (size_t)offset;
+        fuse_reply_buf(req, text + offset, len<size ? len : size);
+    }
+    free(text);
+}
+
+static void virtual_readdir(fuse_req_t req, struct ll_inode *inode, size_t size, off_t offset) {
+    struct stat statbuf;
+    const char *name;
+    char *buf;
+    size_t used;
+    size_t entsize;
+    int idx;
+
+    buf = malloc(size);
+    if (buf==NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    used = 0;
+    memset(&statbuf, 0, sizeof(statbuf));
+    for(idx=(int)offset; ; idx++) {
+        name = (idx==0) ? "." : (idx==1) ? ".." : stats_entry(inode->node, idx - 2);
+        if (name==NULL) {
+            break;
+        }
+        statbuf.st_mode = (idx<2) ? S_IFDIR : 0;
+        entsize = fuse_add_direntry(req, buf + used, size - used, name, &statbuf, idx + 1);
+        if (entsize>size - used) {
+            break;
+        }
+        used += entsize;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+    int idx;
+
+    start_logging();
+    if (conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+    conn->max_write = (unsigned)ll_state->max_io;
+    conn->max_readahead = (unsigned)ll_state->max_io;
+
+    queue.stop = 0;
+    queue.workers = 0;
+    for(idx=0; idx<ll_state->ll_workers && idx<AA_LL_MAX_WORKERS; idx++) {
+        if (pthread_create(&queue.thread[idx], NULL, worker_thread, NULL)!=0) {
+            log_error("init", errno, "Started only %d worker threads", idx);
+            break;
+        }
+        queue.workers++;
+    }
+
+    start_scrubber(ll_state->root_dir, ll_state->scrub_rate, ll_state->scrub_state);
+}
+
+static void ll_destroy(void *userdata) {
+    int idx;
+
+    pthread_mutex_lock(&queue.lock);
+    queue.stop = 1;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+    for(idx=0; idx<queue.workers; idx++) {
+        pthread_join(queue.thread[idx], NULL);
+    }
+    queue.workers = 0;
+
+    destroy_call(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param entry;
+    struct ll_inode *dir;
+    int err_no;
+
+    memset(&entry, 0, sizeof(entry));
+    dir = ll_inode(parent);
+    if (virtual_name(dir, name)) {
+        err_no = virtual_lookup(dir, name, &entry);
+    } else {
+        err_no = ll_do_lookup(dir, name, &entry);
+    }
+    if (err_no==ENOENT) {
+        entry.ino = 0;
+        fuse_reply_entry(req, &entry);
+    } else if (err_no!=0) {
+        fuse_reply_err(req, err_no);
+    } else if (fuse_reply_entry(req, &entry)!=0) {
+        ll_forget_one(entry.ino, 1);
+    }
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    ll_forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat statbuf;
+    off_t size;
+    int err_no;
+
+    if (ll_inode(ino)->node!=AA_STATS_NONE) {
+        stats_attr(ll_inode(ino)->node, &statbuf);
+        fuse_reply_attr(req, &statbuf, 0);
+        return;
+    }
+    err_no = ll_stat(ll_inode(ino), &statbuf);
+    if (err_no!=0) {
+        fuse_reply_err(req, err_no);
+        return;
+    }
+    if ((statbuf.st_mode & S_IFMT) == S_IFREG) {
+        size = pending_size(statbuf.st_dev, statbuf.st_ino);
+        if (size>statbuf.st_size) {
+            statbuf.st_size = size;
+        }
+    }
+    fuse_reply_attr(req, &statbuf, ll_state->attr_timeout);
+}
+
+static int ll_truncate(struct ll_inode *inode, off_t size, struct fuse_file_info *fi) {
+    struct file_entry file_entry;
+    struct file_entry *open_entry;
+    int err_no;
+
+    err_no = clip_pending(inode->dev, inode->ino, size);
+    if (err_no!=0) {
+        return err_no;
+    }
+    if (fi!=NULL) {
+        open_entry = ll_entry(fi);
+        pthread_mutex_lock(&open_entry->lock);
+        err_no = flush_writes(open_entry);
+        if (err_no==0) {
+            err_no = truncate_entry(open_entry, size);
+        }
+        pthread_mutex_unlock(&open_entry->lock);
+        return err_no;
+    }
+    err_no = open_inode_entry(inode, &file_entry, O_RDWR);
+    if (err_no!=0) {
+        return err_no;
+    }
+    err_no = truncate_entry(&file_entry, size);
+    close_all(&file_entry);
+    return err_no;
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct ll_inode *inode;
+    struct timespec times[2];
+    char fpath[32];
+    int err_no;
+    int idx;
+
+    inode = ll_inode(ino);
+    if (inode->node!=AA_STATS_NONE) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    err_no = 0;
+    for(idx=0; idx<AA_NUM_ROOTS && err_no==0; idx++) {
+        if (inode->fd[idx]<0) {
+            err_no = EIO;
+            break;
+        }
+        proc_path(fpath, inode->fd[idx]);
+        if ((to_set & FUSE_SET_ATTR_MODE) && (chmod(fpath, attr->st_mode)<0)) {
+            err_no = errno;
+        }
+        if ((err_no==0) && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+            if (fchownat(inode->fd[idx], "", (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1,
+                         (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)<0) {
+                err_no = errno;
+            }
+        }
+        if ((err_no==0) && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+            times[0].tv_sec = 0;
+            times[0].tv_nsec = UTIME_OMIT;
+            times[1].tv_sec = 0;
+            times[1].tv_nsec = UTIME_OMIT;
+            if (to_set & FUSE_SET_ATTR_ATIME) {
+                times[0] = attr->st_atim;
+                if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+                    times[0].tv_nsec = UTIME_NOW;
+                }
+            }
+            if (to_set & FUSE_SET_ATTR_MTIME) {
+                times[1] = attr->st_mtim;
+                if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+                    times[1].tv_nsec = UTIME_NOW;
+                }
+            }
+            if (utimensat(AT_FDCWD, fpath, times, 0)<0) {
+                err_no = errno;
+            }
+        }
+    }
+    if ((err_no==0) && (to_set & FUSE_SET_ATTR_SIZE)) {
+        err_no = ll_truncate(inode, attr->st_size, fi);
+    }
+    if (err_no!=0) {
+        fuse_reply_err(req, log_error("setattr", err_no, "to_set=%x", to_set));
+        return;
+    }
+    ll_getattr(req, ino, fi);
+}
+
+/*
+  Reply to a successful create with a lookup of the new name, otherwise
+  with the first error.
+*/
+static void reply_created(fuse_req_t req, struct ll_inode *parent, const char *name, const char *context, const int err_no[]) {
+    struct fuse_entry_param entry;
+    int rc;
+
+    rc = first_error(err_no);
+    if (rc==0) {
+        rc = ll_do_lookup(parent, name, &entry);
+    }
+    if (rc!=0) {
+        fuse_reply_err(req, log_error(context, rc, "%s", name));
+    } else if (fuse_reply_entry(req, &entry)!=0) {
+        ll_forget_one(entry.ino, 1);
+    }
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    struct ll_inode *dir;
+    char bname[NAME_MAX + 2];
+    int err_no[AA_MAX_ROOTS];
+    int idx;
+    int fd;
+
+    dir = ll_inode(parent);
+    if (virtual_name(dir, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    clear_list(err_no);
+    err_no[0] = backing_name(bname, name);
+    for(idx=0; idx<AA_NUM_ROOTS && err_no[0]==0; idx++) {
+        if (S_ISREG(mode)) {
+            fd = openat(dir->fd[idx], bname, O_CREAT | O_EXCL | O_WRONLY, mode);
+            if ((fd<0) || (close(fd)<0)) {
+                err_no[idx] = errno;
+            }
+        } else if (S_ISFIFO(mode)) {
+            if (mkfifoat(dir->fd[idx], bname, mode)<0) {
+                err_no[idx] = errno;
+            }
+        } else if (mknodat(dir->fd[idx], bname, mode, rdev)<0) {
+            err_no[idx] = errno;
+        }
+    }
+    reply_created(req, dir, name, "mknod", err_no);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct ll_inode *dir;
+    char bname[NAME_MAX + 2];
+    int err_no[AA_MAX_ROOTS];
+    int idx;
+
+    dir = ll_inode(parent);
+    if (virtual_name(dir, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    clear_list(err_no);
+    err_no[0] = backing_name(bname, name);
+    for(idx=0; idx<AA_NUM_ROOTS && err_no[0]==0; idx++) {
+        if (mkdirat(dir->fd[idx], bname, mode)<0) {
+            err_no[idx] = errno;
+        }
+    }
+    reply_created(req, dir, name, "mkdir", err_no);
+}
+
+static void remove_entry(fuse_req_t req, fuse_ino_t parent, const char *name, int flags, const char *context) {
+    struct ll_inode *dir;
+    char bname[NAME_MAX + 2];
+    struct stat statbuf;
+    int err_no[AA_MAX_ROOTS];
+    int idx;
+
+    dir = ll_inode(parent);
+    if (virtual_name(dir, name)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    clear_list(err_no);
+    err_no[0] = backing_name(bname, name);
+    if ((err_no[0]==0) && (fstatat(dir->fd[0], bname, &statbuf, AT_SYMLINK_NOFOLLOW)==0)) {
+        cache_invalidate(statbuf.st_dev, statbuf.st_ino, 0);
+    }
+    for(idx=0; idx<AA_NUM_ROOTS && err_no[0]==0; idx++) {
+        if (unlinkat(dir->fd[idx], bname, flags)<0) {
+            err_no[idx] = errno;
+        }
+    }
+    if (first_error(err_no)!=0) {
+        fuse_reply_err(req, log_error(context, first_error(err_no), "%s", name));
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    remove_entry(req, parent, name, 0, "unlink");
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    remove_entry(req, parent, name, AT_REMOVEDIR, "rmdir");
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    struct ll_inode *old_dir;
+    struct ll_inode *new_dir;
+    char old_bname[NAME_MAX + 2];
+    char new_bname[NAME_MAX + 2];
+    struct stat statbuf;
+    int err_no[AA_MAX_ROOTS];
+    int idx;
+
+    old_dir = ll_inode(parent);
+    new_dir = ll_inode(newparent);
+    if (virtual_name(old_dir, name) || virtual_name(new_dir, newname)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    clear_list(err_no);
+    err_no[0] = backing_name(old_bname, name);
+    if (err_no[0]==0) {
+        err_no[0] = backing_name(new_bname, newname);
+    }
+    if ((err_no[0]==0) && (fstatat(new_dir->fd[0], new_bname, &statbuf, AT_SYMLINK_NOFOLLOW)==0)) {
+        cache_invalidate(statbuf.st_dev, statbuf.st_ino, 0);
+    }
+    for(idx=0; idx<AA_NUM_ROOTS && err_no[0]==0; idx++) {
+        if (renameat(old_dir->fd[idx], old_bname, new_dir->fd[idx], new_bname)<0) {
+            err_no[idx] = errno;
+        }
+    }
+    if (first_error(err_no)!=0) {
+        fuse_reply_err(req, log_error("rename", first_error(err_no), "%s -> %s", name, newname));
+        return;
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct ll_inode *inode;
+    struct file_entry *file_entry;
+    uint64_t fh;
+    int flushed;
+    int flags;
+    int err_no;
+
+    inode = ll_inode(ino);
+    if (inode->node!=AA_STATS_NONE) {
+        virtual_open(req, inode, fi);
+        return;
+    }
+    flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+
+    err_no = allocate_handle(&ll_state->handles, &fh);
+    if (err_no!=0) {
+        fuse_reply_err(req, log_error("open", err_no, "Too many open files"));
+        return;
+    }
+    file_entry = handle_file_entry(&ll_state->handles, fh);
+    err_no = open_inode_entry(inode, file_entry, flags);
+    if (err_no!=0) {
+        release_handle(&ll_state->handles, fh);
+        fuse_reply_err(req, log_error("open", err_no, ""));
+        return;
+    }
+    if (flags & O_TRUNC) {
+        cache_invalidate(file_entry->dev, file_entry->ino, 0);
+        err_no = clip_pending(file_entry->dev, file_entry->ino, 0);
+    } else {
+        err_no = flush_pending(file_entry->dev, file_entry->ino, &flushed);
+    }
+    if (err_no!=0) {
+        close_all(file_entry);
+        release_handle(&ll_state->handles, fh);
+        fuse_reply_err(req, log_error("open", err_no, "Failed to flush buffered writes"));
+        return;
+    }
+
+    fi->fh = fh;
+    if (fuse_reply_open(req, fi)!=0) {
+        close_all(file_entry);
+        release_handle(&ll_state->handles, fh);
+    }
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (ll_inode(ino)->node!=AA_STATS_NONE) {
+        virtual_read(req, ll_inode(ino), size, offset);
+        return;
+    }
+    scrub_foreground();
+    if (size<1) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    defer(LL_READ, req, fi, size, offset, 0);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct file_entry *file_entry;
+    int err_no;
+
+    scrub_foreground();
+    file_entry = ll_entry(fi);
+    pthread_mutex_lock(&file_entry->lock);
+    err_no = buffer_write(file_entry, buf, size, offset);
+    pthread_mutex_unlock(&file_entry->lock);
+    if (err_no!=0) {
+        fuse_reply_err(req, log_error("write", err_no, "offset = %lu", offset));
+        return;
+    }
+    fuse_reply_write(req, size);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int err_no;
+
+    if (ll_inode(ino)->node!=AA_STATS_NONE) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    err_no = flush_ll_entry(ll_entry(fi));
+    if (err_no!=0) {
+        log_error("flush", err_no, "");
+    }
+    fuse_reply_err(req, err_no);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct file_entry *file_entry;
+    struct stat statbuf;
+    int err_no;
+
+    if (ll_inode(ino)->node!=AA_STATS_NONE) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    file_entry = ll_entry(fi);
+
+    pthread_mutex_lock(&file_entry->lock);
+    err_no = flush_writes(file_entry);
+    if (err_no!=0) {
+        err_no = flush_writes(file_entry);
+    }
+    if (err_no!=0) {
+        log_lost_writes(file_entry, "release", err_no);
+    }
+    free_write_buffer(file_entry);
+    pthread_mutex_unlock(&file_entry->lock);
+
+    if ((fstat(file_entry->file[0].fd, &statbuf)==0) && (statbuf.st_nlink==0)) {
+        cache_invalidate(file_entry->dev, file_entry->ino, 0);
+    }
+
+    close_all(file_entry);
+    release_handle(&ll_state->handles, fi->fh);
+    if (err_no!=0) {
+        log_error("release", err_no, "Failed to flush buffered writes");
+    }
+    fuse_reply_err(req, err_no);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    if (ll_inode(ino)->node!=AA_STATS_NONE) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+    defer(LL_FSYNC, req, fi, 0, 0, datasync);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    DIR *dp;
+    int fd;
+
+    if (ll_inode(ino)->node!=AA_STATS_NONE) {
+        if ((ll_inode(ino)->node!=AA_STATS_TOP) && (ll_inode(ino)->node!=AA_STATS_DIR)) {
+            fuse_reply_err(req, ENOTDIR);
+            return;
+        }
+        fi->fh = 0;
+        fuse_reply_open(req, fi);
+        return;
+    }
+    fd = openat(ll_inode(ino)->fd[0], ".", O_RDONLY | O_DIRECTORY);
+    if (fd<0) {
+        fuse_reply_err(req, log_error("opendir", errno, ""));
+        return;
+    }
+    dp = fdopendir(fd);
+    if (dp==NULL) {
+        close(fd);
+        fuse_reply_err(req, log_error("opendir", errno, ""));
+        return;
+    }
+    fi->fh = (uintptr_t)dp;
+    if (fuse_reply_open(req, fi)!=0) {
+        closedir(dp);
+    }
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    DIR *dp;
+    struct dirent *de;
+    struct stat statbuf;
+    char name[NAME_MAX + 1];
+    char *buf;
+    size_t used;
+    size_t entsize;
+    size_t len;
+
+    if (ll_inode(ino)->node!=AA_STATS_NONE) {
+        virtual_readdir(req, ll_inode(ino), size, offset);
+        return;
+    }
+    dp = (DIR *)(uintptr_t)fi->fh;
+    buf = malloc(size);
+    if (buf==NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if (offset==0) {
+        rewinddir(dp);
+    } else {
+        seekdir(dp, offset);
+    }
+
+    used = 0;
+    for(;;) {
+        errno = 0;
+        de = readdir(dp);
+        if (de==NULL) {
+            if (errno!=0) {
+                free(buf);
+                fuse_reply_err(req, log_error("readdir", errno, ""));
+                return;
+            }
+            break;
+        }
+        if ((ino==FUSE_ROOT_ID) && !strcmp(de->d_name, AA_GEOMETRY_FILE)) {
+            continue;
+        }
+        len = strlen(de->d_name);
+        if ((len>1) && (de->d_name[len-1]=='@')) {
+            len--;
+        }
+        memcpy(name, de->d_name, len);
+        name[len] = 0;
+        memset(&statbuf, 0, sizeof(statbuf));
+        statbuf.st_ino = de->d_ino;
+        statbuf.st_mode = DTTOIF(de->d_type);
+        entsize = fuse_add_direntry(req, buf + used, size - used, name, &statbuf, telldir(dp));
+        if (entsize>size - used) {
+            break;
+        }
+        used += entsize;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ll_inode(ino)->node==AA_STATS_NONE) {
+        closedir((DIR *)(uintptr_t)fi->fh);
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    char text[256];
+    int len;
+
+    if (ino!=FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
+    len = stats_xattr(name, text, sizeof(text));
+    if (len<0) {
+        fuse_reply_err(req, -len);
+    } else if (size==0) {
+        fuse_reply_xattr(req, (size_t)len);
+    } else if (size<(size_t)len) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, text, (size_t)len);
+    }
+}
+
+/*
+  Requests answered on the FUSE thread are timed here, reads and fsyncs
+  when their worker replies.
+*/
+#define TIMED_LL(name, op, params, args) \
+    static void timed_##name params { \
+        uint64_t start = stat_clock(); \
+        ll_##name args; \
+        stat_op(op, start); \
+    }
+
+TIMED_LL(lookup, AA_OP_LOOKUP, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TIMED_LL(forget, AA_OP_FORGET, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup))
+TIMED_LL(getattr, AA_OP_GETATTR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL(setattr, AA_OP_SETATTR, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi), (req, ino, attr, to_set, fi))
+TIMED_LL(mknod, AA_OP_MKNOD, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev), (req, parent, name, mode, rdev))
+TIMED_LL(mkdir, AA_OP_MKDIR, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode), (req, parent, name, mode))
+TIMED_LL(unlink, AA_OP_UNLINK, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TIMED_LL(rmdir, AA_OP_RMDIR, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TIMED_LL(rename, AA_OP_RENAME, (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname), (req, parent, name, newparent, newname))
+TIMED_LL(open, AA_OP_OPEN, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL(write, AA_OP_WRITE, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, buf, size, offset, fi))
+TIMED_LL(flush, AA_OP_FLUSH, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL(release, AA_OP_RELEASE, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL(opendir, AA_OP_OPENDIR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL(readdir, AA_OP_READDIR, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi))
+TIMED_LL(releasedir, AA_OP_RELEASEDIR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TIMED_LL(getxattr, AA_OP_GETXATTR, (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size), (req, ino, name, size))
+
+static struct fuse_lowlevel_ops ll_operations = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = timed_lookup,
+    .forget = timed_forget,
+    .getattr = timed_getattr,
+    .setattr = timed_setattr,
+    .mknod = timed_mknod,
+    .mkdir = timed_mkdir,
+    .unlink = timed_unlink,
+    .rmdir = timed_rmdir,
+    .rename = timed_rename,
+    .open = timed_open,
+    .read = ll_read,
+    .write = timed_write,
+    .flush = timed_flush,
+    .release = timed_release,
+    .fsync = ll_fsync,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .getxattr = timed_getxattr,
+};
+
+/*
+  Mount and serve the file system with the low level API. argv holds the
+  FUSE options and the mount point.
+*/
+int lowlevel_main(int argc, char* argv[], struct archivist_state *aa_state) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan *channel;
+    struct fuse_session *session;
+    struct stat statbuf;
+    char *mount_point;
+    int multithreaded;
+    int foreground;
+    int idx;
+    int rc;
+
+    ll_state = aa_state;
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        root_inode.fd[idx] = open(aa_state->root_dir[idx], O_PATH | O_DIRECTORY);
+        if (root_inode.fd[idx]<0) {
+            fprintf(stderr, "Cannot open %s\n", aa_state->root_dir[idx]);
+            return 1;
+        }
+    }
+    if (fstat(root_inode.fd[0], &statbuf)<0) {
+        return 1;
+    }
+    root_inode.dev = statbuf.st_dev;
+    root_inode.ino = statbuf.st_ino;
+    root_inode.nlookup = 1;
+    for(idx=0; idx<AA_STATS_NODES; idx++) {
+        memset(&stats_inode[idx], -1, sizeof(stats_inode[idx].fd));
+        stats_inode[idx].node = idx;
+        stats_inode[idx].ino = (ino_t)idx;
+    }
+
+    if (fuse_parse_cmdline(&args, &mount_point, &multithreaded, &foreground)!=0) {
+        return 1;
+    }
+    fuse_opt_add_arg(&args, "-obig_writes");
+
+    rc = 1;
+    channel = fuse_mount(mount_point, &args);
+    if (channel!=NULL) {
+        session = fuse_lowlevel_new(&args, &ll_operations, sizeof(ll_operations), aa_state);
+        if (session!=NULL) {
+            if (fuse_set_signal_handlers(session)==0) {
+                fuse_session_add_chan(session, channel);
+                fuse_daemonize(foreground);
+                rc = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(channel);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mount_point, channel);
+    }
+    fuse_opt_free_args(&args);
+    close_inode(&root_inode);
+
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,333 @@
+/*
+  Block pipeline for the encode and decode tools
+
+  A reader thread fills batches of input with large reads, a pool of
+  workers turns each batch into output in parallel, and the calling thread
+  writes the batches out strictly in the order they were read. The batches
+  form a ring twice as deep as there are workers, so the reader and writer
+  keep the disks busy while every worker has a batch in hand. Buffers are
+  aligned to a page and never resized, so each batch is read and written
+  with one system call whatever the block size.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pipeline.h"
+
+#define PIPE_FREE 0
+#define PIPE_READY 1
+#define PIPE_WORKING 2
+#define PIPE_DONE 3
+
+struct pipe_state {
+    const struct pipeline *pipe;
+    const char *fpath_in;
+    struct pipe_batch *batch;
+    int depth;
+    int drained;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    pthread_t reader;
+    pthread_t worker[AA_PIPE_MAX_THREADS];
+};
+
+/*
+  The number of workers given by a --threads value, or one per processor
+  when value is NULL. Returns -1 for a value that is out of range.
+*/
+int pipe_threads(const char *value) {
+    long threads;
+    char *end;
+
+    if (value==NULL) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads<1) {
+            threads = 1;
+        }
+        return (threads>AA_PIPE_MAX_THREADS) ? AA_PIPE_MAX_THREADS : (int)threads;
+    }
+    threads = strtol(value, &end, 10);
+    if ((*end!=0) || (threads<1) || (threads>AA_PIPE_MAX_THREADS)) {
+        return -1;
+    }
+    return (int)threads;
+}
+
+/*
+  Move past bytes of input, by seeking when it is a file and by reading
+  and dropping them when it is a pipe. Running out of input is not an
+  error, the pipeline then reads nothing.
+*/
+int skip_input(int fd, off_t bytes) {
+    char buf[65536];
+    ssize_t len;
+
+    if ((bytes<=0) || (lseek(fd, bytes, SEEK_CUR)>=0)) {
+        return 0;
+    }
+    if (errno!=ESPIPE) {
+        return errno;
+    }
+    while (bytes>0) {
+        len = read(fd, buf, (bytes<(off_t)sizeof(buf)) ? (size_t)bytes : sizeof(buf));
+        if ((len<0) && (errno==EINTR)) {
+            continue;
+        }
+        if (len<0) {
+            return errno;
+        }
+        if (len==0) {
+            break;
+        }
+        bytes -= len;
+    }
+    return 0;
+}
+
+/*
+  Read until size bytes or the end of input, retrying interrupted reads.
+  Returns the bytes read or -1 on failure.
+*/
+ssize_t read_input(int fd, unsigned char *buf, size_t size) {
+    ssize_t len;
+    size_t done;
+
+    done = 0;
+    while (done<size) {
+        len = read(fd, buf + done, size - done);
+        if ((len<0) && (errno==EINTR)) {
+            continue;
+        }
+        if (len<0) {
+            return -1;
+        }
+        if (len==0) {
+            break;
+        }
+        done += len;
+    }
+    return (ssize_t)done;
+}
+
+/* Write all size bytes. Returns 0 or the error. */
+int write_output(int fd, const unsigned char *buf, size_t size) {
+    ssize_t len;
+    size_t done;
+
+    done = 0;
+    while (done<size) {
+        len = write(fd, buf + done, size - done);
+        if ((len<0) && (errno==EINTR)) {
+            continue;
+        }
+        if (len<=0) {
+            return (len<0) ? errno : EIO;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+static void set_state(struct pipe_state *state, struct pipe_batch *batch, int value) {
+    pthread_mutex_lock(&state->mutex);
+    batch->state = value;
+    pthread_cond_broadcast(&state->changed);
+    pthread_mutex_unlock(&state->mutex);
+}
+
+static void *reader_thread(void *arg) {
+    struct pipe_state *state;
+    const struct pipeline *pipe;
+    struct pipe_batch *batch;
+    uint64_t seq;
+    off_t left;
+    size_t want;
+    ssize_t len;
+    int stop;
+
+    state = arg;
+    pipe = state->pipe;
+    left = pipe->limit;
+    for(seq=0; ; seq++) {
+        batch = &state->batch[seq % state->depth];
+        pthread_mutex_lock(&state->mutex);
+        while ((batch->state!=PIPE_FREE) && !state->stop) {
+            pthread_cond_wait(&state->changed, &state->mutex);
+        }
+        stop = state->stop;
+        pthread_mutex_unlock(&state->mutex);
+        if (stop) {
+            break;
+        }
+
+        batch->seq = seq;
+        batch->in_len = 0;
+        batch->out_len = 0;
+        batch->err_no = 0;
+        if ((seq==0) && (pipe->prefix_len>0)) {
+            memcpy(batch->in, pipe->prefix, pipe->prefix_len);
+            batch->in_len = pipe->prefix_len;
+        }
+        want = pipe->in_size - batch->in_len;
+        if ((left>=0) && ((off_t)want>left)) {
+            want = (size_t)left;
+        }
+        len = read_input(pipe->fd_in, batch->in + batch->in_len, want);
+        if (len<0) {
+            batch->err_no = errno;
+            snprintf(batch->message, sizeof(batch->message), "Failed to read from %s", state->fpath_in);
+            len = 0;
+        }
+        batch->in_len += len;
+        if (left>=0) {
+            left -= len;
+        }
+        batch->last = (batch->err_no!=0) || ((size_t)len<want) || (left==0);
+        set_state(state, batch, PIPE_READY);
+        if (batch->last) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+  Take the oldest batch waiting for work, or NULL once the last batch has
+  been taken or the pipeline is stopping.
+*/
+static struct pipe_batch *take_batch(struct pipe_state *state) {
+    struct pipe_batch *batch;
+    int idx;
+
+    pthread_mutex_lock(&state->mutex);
+    batch = NULL;
+    while ((batch==NULL) && !state->drained && !state->stop) {
+        for(idx=0; idx<state->depth; idx++) {
+            if ((state->batch[idx].state==PIPE_READY) && ((batch==NULL) || (state->batch[idx].seq<batch->seq))) {
+                batch = &state->batch[idx];
+            }
+        }
+        if (batch==NULL) {
+            pthread_cond_wait(&state->changed, &state->mutex);
+        }
+    }
+    if (batch!=NULL) {
+        batch->state = PIPE_WORKING;
+        if (batch->last) {
+            state->drained = 1;
+            pthread_cond_broadcast(&state->changed);
+        }
+    }
+    pthread_mutex_unlock(&state->mutex);
+    return batch;
+}
+
+static void *worker_thread(void *arg) {
+    struct pipe_state *state;
+    struct pipe_batch *batch;
+
+    state = arg;
+    while ((batch = take_batch(state))!=NULL) {
+        if (batch->err_no==0) {
+            batch->err_no = state->pipe->work(batch, state->pipe->arg);
+        }
+        set_state(state, batch, PIPE_DONE);
+    }
+    return NULL;
+}
+
+/*
+  Run a pipeline to the end of its input. Returns 0 once everything is
+  written. Otherwise the output is written up to the first failure, which
+  is reported, and 1 is returned with the threads left running for the
+  caller to exit, as the reader may be waiting on a pipe.
+*/
+int run_pipeline(const struct pipeline *pipe, const char *fpath_in, const char *fpath_out) {
+    struct pipe_state *state;
+    struct pipe_batch *batch;
+    uint64_t seq;
+    void *buf;
+    int started;
+    int err_no;
+    int idx;
+
+    state = calloc(1, sizeof(struct pipe_state));
+    if (state==NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        return 1;
+    }
+    state->pipe = pipe;
+    state->fpath_in = fpath_in;
+    state->depth = 2 * pipe->threads + 2;
+    pthread_mutex_init(&state->mutex, NULL);
+    pthread_cond_init(&state->changed, NULL);
+    state->batch = calloc((size_t)state->depth, sizeof(struct pipe_batch));
+    if (state->batch==NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        return 1;
+    }
+    for(idx=0; idx<state->depth; idx++) {
+        if (posix_memalign(&buf, AA_PIPE_ALIGN, pipe->in_size)!=0) {
+            fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+            return 1;
+        }
+        state->batch[idx].in = buf;
+        if (posix_memalign(&buf, AA_PIPE_ALIGN, pipe->out_size)!=0) {
+            fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+            return 1;
+        }
+        state->batch[idx].out = buf;
+    }
+
+    err_no = pthread_create(&state->reader, NULL, reader_thread, state);
+    for(started=0; (err_no==0) && (started<pipe->threads); started++) {
+        err_no = pthread_create(&state->worker[started], NULL, worker_thread, state);
+    }
+    if (err_no!=0) {
+        fprintf(stderr, "Error %d (%s) , Failed to start threads\n", err_no, strerror(err_no));
+        return 1;
+    }
+
+    for(seq=0; ; seq++) {
+        batch = &state->batch[seq % state->depth];
+        pthread_mutex_lock(&state->mutex);
+        while (batch->state!=PIPE_DONE) {
+            pthread_cond_wait(&state->changed, &state->mutex);
+        }
+        pthread_mutex_unlock(&state->mutex);
+        err_no = write_output(pipe->fd_out, batch->out, batch->out_len);
+        if ((err_no!=0) && (batch->err_no==0)) {
+            batch->err_no = err_no;
+            snprintf(batch->message, sizeof(batch->message), "Failed to write to %s", fpath_out);
+        }
+        if (batch->err_no!=0) {
+            fprintf(stderr, "Error %d (%s) , %s\n", batch->err_no, strerror(batch->err_no), batch->message);
+            pthread_mutex_lock(&state->mutex);
+            state->stop = 1;
+            pthread_cond_broadcast(&state->changed);
+            pthread_mutex_unlock(&state->mutex);
+            return 1;
+        }
+        if (batch->last) {
+            break;
+        }
+        set_state(state, batch, PIPE_FREE);
+    }
+
+    pthread_join(state->reader, NULL);
+    for(idx=0; idx<pipe->threads; idx++) {
+        pthread_join(state->worker[idx], NULL);
+    }
+    for(idx=0; idx<state->depth; idx++) {
+        free(state->batch[idx].in);
+        free(state->batch[idx].out);
+    }
+    free(state->batch);
+    free(state);
+    return 0;
+}
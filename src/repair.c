@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "blocks.h"
+#include "audit.h"
+#include "pipeline.h"
+#include <sys/stat.h>
+
+/*
+  Repair the copies of an unmounted mirrored archive against each other,
+  given its storage locations, writing the report to stdout or the file
+  named by --report.
+*/
+int main(int argc, char* argv[]) {
+    FILE *report;
+    struct stat statbuf;
+    const char *fpath_report;
+    int dry_run;
+    int threads;
+    int idx;
+    int rc;
+
+    /* Reading is what takes the time, so twice as many workers as processors. */
+    threads = 2 * pipe_threads(NULL);
+    if (threads>AA_PIPE_MAX_THREADS) {
+        threads = AA_PIPE_MAX_THREADS;
+    }
+    fpath_report = NULL;
+    dry_run = 0;
+    while ((argc > 2) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--threads=", 10)) {
+            threads = pipe_threads(argv[1] + 10);
+            if (threads<0) {
+                fprintf(stderr, "Error %d (%s) , Invalid thread count %s\n", EINVAL, strerror(EINVAL), argv[1] + 10);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--report=", 9)) {
+            fpath_report = argv[1] + 9;
+        } else if (!strcmp(argv[1], "--dry-run")) {
+            dry_run = 1;
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
+    if ((argc < 3) || ((argc - 1)>AA_MAX_COPIES)) {
+        fprintf(stderr, "Error %d (%s) , Invalid arguments\n", EINVAL, strerror(EINVAL));
+        exit(1);
+    }
+    for(idx=1; idx<argc; idx++) {
+        if ((stat(argv[idx], &statbuf)!=0) || !S_ISDIR(statbuf.st_mode)) {
+            fprintf(stderr, "Error %d (%s) , Invalid storage location %s\n", ENOTDIR, strerror(ENOTDIR), argv[idx]);
+            exit(1);
+        }
+    }
+
+    if (fpath_report==NULL) {
+        report = stdout;
+    } else {
+        report = fopen(fpath_report, "w");
+    }
+    if (report == NULL) {
+        fprintf(stderr, "Error %d (%s) , Failed to open %s\n", errno, strerror(errno), fpath_report);
+        exit(1);
+    }
+    rc = repair_archive(argv + 1, argc - 1, threads, dry_run, report);
+    if ((report!=stdout) && (fclose(report)!=0)) {
+        fprintf(stderr, "Error %d (%s) , Failed to write to %s\n", errno, strerror(errno), fpath_report);
+        exit(1);
+    }
+    return (rc==0) ? 0 : 1;
+}
@@ -0,0 +1,373 @@
+/*
+  Reed-Solomon erasure code
+
+  Arithmetic is in GF(2^8) with the polynomial x^8+x^4+x^3+x^2+1. The code
+  is systematic: the data shards are stored as they are and parity shard j
+  is the sum over the data shards i of c[j][i] times shard i, where c is
+  the Cauchy matrix 1/(x_j + y_i) with x_j = data + j and y_i = i. Every
+  square submatrix of a Cauchy matrix is invertible, so any data-many rows
+  of the identity stacked on c can be inverted to recover the data.
+
+  The same field gives the short error correcting codes kept in each block,
+  see rs_check_interleaved.
+
+  The inner loop multiplies a shard by a constant and adds it to another.
+  With AVX2 it looks the low and high nibbles of 32 bytes at a time up in
+  two 16 entry product tables, otherwise it uses a 256 entry product table
+  a byte at a time.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "rs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AA_RS_X86 1
+#endif
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned char gf_mul_table[256][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void (*mul_add)(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len);
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    if ((a==0) || (b==0)) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static unsigned char gf_inv(unsigned char a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void portable_mul_add(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len) {
+    const unsigned char *row;
+    size_t idx;
+
+    row = gf_mul_table[c];
+    for(idx=0; idx<len; idx++) {
+        dst[idx] ^= row[src[idx]];
+    }
+}
+
+#ifdef AA_RS_X86
+
+__attribute__((target("avx2")))
+static void avx2_mul_add(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len) {
+    unsigned char lo[16];
+    unsigned char hi[16];
+    __m256i lo_table;
+    __m256i hi_table;
+    __m256i mask;
+    __m256i in;
+    __m256i out;
+    size_t idx;
+    int nibble;
+
+    for(nibble=0; nibble<16; nibble++) {
+        lo[nibble] = gf_mul_table[c][nibble];
+        hi[nibble] = gf_mul_table[c][nibble << 4];
+    }
+    lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    mask = _mm256_set1_epi8(0x0f);
+    for(idx=0; idx+32<=len; idx+=32) {
+        in = _mm256_loadu_si256((const __m256i *)(src + idx));
+        out = _mm256_xor_si256(_mm256_shuffle_epi8(lo_table, _mm256_and_si256(in, mask)),
+                               _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi64(in, 4), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + idx), _mm256_xor_si256(out, _mm256_loadu_si256((const __m256i *)(dst + idx))));
+    }
+    portable_mul_add(dst + idx, src + idx, c, len - idx);
+}
+
+#endif
+
+static void build_tables() {
+    unsigned int value;
+    int a;
+    int b;
+
+    value = 1;
+    for(a=0; a<255; a++) {
+        gf_exp[a] = (unsigned char)value;
+        gf_log[value] = (unsigned char)a;
+        value <<= 1;
+        if (value & 0x100) {
+            value ^= 0x11d;
+        }
+    }
+    for(a=255; a<512; a++) {
+        gf_exp[a] = gf_exp[a - 255];
+    }
+    for(a=0; a<256; a++) {
+        for(b=0; b<256; b++) {
+            gf_mul_table[a][b] = gf_mul((unsigned char)a, (unsigned char)b);
+        }
+    }
+    mul_add = portable_mul_add;
+#ifdef AA_RS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mul_add = avx2_mul_add;
+    }
+#endif
+}
+
+/*
+  The tables are built on first use, which may be from several threads at
+  once when blocks are corrected in parallel.
+*/
+static void init_tables() {
+    pthread_once(&tables_once, build_tables);
+}
+
+/*
+  Set up a code of data data shards and parity parity shards. Called before
+  any other threads use the code. Returns -1 when there are too many shards.
+*/
+int rs_init(struct rs_code *code, int data, int parity) {
+    int row;
+    int col;
+
+    if ((data<1) || (parity<0) || (data + parity>AA_MAX_ROOTS)) {
+        return -1;
+    }
+    init_tables();
+    code->data = data;
+    code->parity = parity;
+    for(row=0; row<parity; row++) {
+        for(col=0; col<data; col++) {
+            code->matrix[row][col] = gf_inv((unsigned char)((data + row) ^ col));
+        }
+    }
+    return 0;
+}
+
+const char *rs_engine_name() {
+    init_tables();
+#ifdef AA_RS_X86
+    if (mul_add==avx2_mul_add) {
+        return "avx2";
+    }
+#endif
+    return "portable";
+}
+
+void rs_encode(const struct rs_code *code, const unsigned char *const data[], unsigned char *const parity[], size_t len) {
+    int row;
+    int col;
+
+    for(row=0; row<code->parity; row++) {
+        memset(parity[row], 0, len);
+        for(col=0; col<code->data; col++) {
+            mul_add(parity[row], data[col], code->matrix[row][col], len);
+        }
+    }
+}
+
+/*
+  Invert the n by n matrix a in place, returning -1 if it is singular.
+*/
+static int invert(unsigned char a[AA_MAX_ROOTS][AA_MAX_ROOTS], int n) {
+    unsigned char inv[AA_MAX_ROOTS][AA_MAX_ROOTS];
+    unsigned char tmp;
+    unsigned char scale;
+    int row;
+    int col;
+    int pivot;
+
+    memset(inv, 0, sizeof(inv));
+    for(row=0; row<n; row++) {
+        inv[row][row] = 1;
+    }
+    for(col=0; col<n; col++) {
+        for(pivot=col; pivot<n && a[pivot][col]==0; pivot++) {
+        }
+        if (pivot==n) {
+            return -1;
+        }
+        for(row=0; row<n; row++) {
+            tmp = a[col][row]; a[col][row] = a[pivot][row]; a[pivot][row] = tmp;
+            tmp = inv[col][row]; inv[col][row] = inv[pivot][row]; inv[pivot][row] = tmp;
+        }
+        scale = gf_inv(a[col][col]);
+        for(row=0; row<n; row++) {
+            a[col][row] = gf_mul(a[col][row], scale);
+            inv[col][row] = gf_mul(inv[col][row], scale);
+        }
+        for(row=0; row<n; row++) {
+            if ((row!=col) && (a[row][col]!=0)) {
+                scale = a[row][col];
+                for(pivot=0; pivot<n; pivot++) {
+                    a[row][pivot] ^= gf_mul(scale, a[col][pivot]);
+                    inv[row][pivot] ^= gf_mul(scale, inv[col][pivot]);
+                }
+            }
+        }
+    }
+    memcpy(a, inv, sizeof(inv));
+    return 0;
+}
+
+/*
+  Rebuild the data shards that are not present from the first data-many
+  shards that are, data or parity. Parity shards that are not present are
+  left alone, rs_encode makes them again. Returns -1 when fewer than
+  data-many shards are present.
+*/
+int rs_reconstruct(const struct rs_code *code, unsigned char *const shard[], const int present[], size_t len) {
+    unsigned char a[AA_MAX_ROOTS][AA_MAX_ROOTS];
+    int chosen[AA_MAX_ROOTS];
+    int missing;
+    int n;
+    int idx;
+    int col;
+
+    missing = 0;
+    for(idx=0; idx<code->data; idx++) {
+        if (!present[idx]) {
+            missing++;
+        }
+    }
+    if (missing==0) {
+        return 0;
+    }
+
+    n = 0;
+    for(idx=0; idx<code->data + code->parity && n<code->data; idx++) {
+        if (present[idx]) {
+            chosen[n++] = idx;
+        }
+    }
+    if (n<code->data) {
+        return -1;
+    }
+
+    memset(a, 0, sizeof(a));
+    for(idx=0; idx<n; idx++) {
+        if (chosen[idx]<code->data) {
+            a[idx][chosen[idx]] = 1;
+        } else {
+            for(col=0; col<code->data; col++) {
+                a[idx][col] = code->matrix[chosen[idx] - code->data][col];
+            }
+        }
+    }
+    if (invert(a, n)!=0) {
+        return -1;
+    }
+
+    for(idx=0; idx<code->data; idx++) {
+        if (present[idx]) {
+            continue;
+        }
+        memset(shard[idx], 0, len);
+        for(col=0; col<n; col++) {
+            mul_add(shard[idx], shard[chosen[col]], a[idx][col], len);
+        }
+    }
+    return 0;
+}
+
+/*
+  Interleaved single error correcting codes. Byte r * ways + j of data is
+  symbol r + 2 of codeword j, and the two check symbols of codeword j, at
+  positions 0 and 1, are check[j] and check[ways + j]. They are chosen so
+  that every codeword c has c(1) = c(alpha) = 0, which lets one wrong
+  symbol anywhere in a codeword be found and put right. A burst of up to
+  ways bytes touches each codeword once. rows + 2 may be at most 255.
+*/
+
+static unsigned char mul_alpha(unsigned char a) {
+    return (unsigned char)((a << 1) ^ ((a & 0x80) ? 0x1d : 0));
+}
+
+/*
+  Sum the rows of data into sum[j] and evaluate them at alpha into
+  eval[j], both a codeword at a time across each row.
+*/
+static void evaluate_rows(const unsigned char *data, int ways, int rows, unsigned char *sum, unsigned char *eval) {
+    const unsigned char *row;
+    int r;
+    int j;
+
+    memset(sum, 0, (size_t)ways);
+    memset(eval, 0, (size_t)ways);
+    for(r=rows-1; r>=0; r--) {
+        row = data + (size_t)r * ways;
+        for(j=0; j<ways; j++) {
+            sum[j] ^= row[j];
+            eval[j] = mul_alpha(eval[j]) ^ row[j];
+        }
+    }
+}
+
+void rs_check_interleaved(const unsigned char *data, int ways, int rows, unsigned char *check) {
+    unsigned char sum[AA_RS_MAX_WAYS];
+    unsigned char eval[AA_RS_MAX_WAYS];
+    unsigned char inv_1_alpha;
+    unsigned char p1;
+    int j;
+
+    init_tables();
+    evaluate_rows(data, ways, rows, sum, eval);
+    inv_1_alpha = gf_inv(1 ^ gf_exp[1]);
+    for(j=0; j<ways; j++) {
+        p1 = gf_mul(sum[j] ^ gf_mul(eval[j], gf_exp[2]), inv_1_alpha);
+        check[j] = sum[j] ^ p1;
+        check[ways + j] = p1;
+    }
+}
+
+/*
+  Put right the codewords of data and check that have a single wrong
+  symbol. Returns the number of symbols changed, or -1 when a codeword
+  has more wrong than can be put right, in which case nothing is changed.
+*/
+int rs_correct_interleaved(unsigned char *data, int ways, int rows, unsigned char *check) {
+    unsigned char sum[AA_RS_MAX_WAYS];
+    unsigned char eval[AA_RS_MAX_WAYS];
+    unsigned char s0;
+    unsigned char s1;
+    int where[AA_RS_MAX_WAYS];
+    int fixed;
+    int pos;
+    int j;
+
+    init_tables();
+    evaluate_rows(data, ways, rows, sum, eval);
+    fixed = 0;
+    for(j=0; j<ways; j++) {
+        s0 = sum[j] ^ check[j] ^ check[ways + j];
+        s1 = gf_mul(eval[j], gf_exp[2]) ^ check[j] ^ gf_mul(check[ways + j], gf_exp[1]);
+        where[j] = -1;
+        if ((s0==0) && (s1==0)) {
+            continue;
+        }
+        if ((s0==0) || (s1==0)) {
+            return -1;
+        }
+        pos = (gf_log[s1] + 255 - gf_log[s0]) % 255;
+        if (pos>=rows + 2) {
+            return -1;
+        }
+        where[j] = pos;
+        sum[j] = s0;
+        fixed++;
+    }
+    for(j=0; j<ways && fixed>0; j++) {
+        if (where[j]==0) {
+            check[j] ^= sum[j];
+        } else if (where[j]==1) {
+            check[ways + j] ^= sum[j];
+        } else if (where[j]>1) {
+            data[(size_t)(where[j] - 2) * ways + j] ^= sum[j];
+        }
+    }
+    return fixed;
+}
@@ -0,0 +1,461 @@
+/*
+  Background scrubber
+
+  A single thread walks the backing directories of every copy in name order
+  and checks each data file a few blocks at a time with scrub_blocks, which
+  hashes the blocks together and repairs bad copies exactly as a client read
+  would. The file being scrubbed and the next block are saved to a state
+  file every few seconds and on shutdown, so a remount carries on where the
+  last mount stopped. Reads are limited to a configured number of bytes per
+  second, and the scrubber pauses whenever FUSE requests have arrived since
+  it last looked.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "scrub.h"
+#include "logs.h"
+
+struct scrubber {
+    pthread_t thread;
+    int running;
+    int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    char root_dir[AA_MAX_ROOTS][PATH_MAX];
+    char state_file[PATH_MAX];
+    char state_temp[PATH_MAX + 8];
+    size_t rate;
+    double tokens;
+    struct timespec refilled;
+    struct timespec saved;
+    uint64_t seen_activity;
+    char resume[PATH_MAX];
+    off_t resume_ofs;
+    char current[PATH_MAX];
+    off_t current_ofs;
+};
+
+static struct scrubber scrubber = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER
+};
+
+static uint64_t foreground_activity;
+static struct scrub_stats scrub_stats;
+
+static void count(uint64_t *counter, uint64_t amount) {
+    __atomic_add_fetch(counter, amount, __ATOMIC_RELAXED);
+}
+
+static double elapsed(const struct timespec *since, const struct timespec *now) {
+    return (double)(now->tv_sec - since->tv_sec) + (double)(now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+  Note that a FUSE request has arrived so the scrubber backs off.
+*/
+void scrub_foreground() {
+    __atomic_add_fetch(&foreground_activity, 1, __ATOMIC_RELAXED);
+}
+
+void scrub_get_stats(struct scrub_stats *stats) {
+    stats->passes = __atomic_load_n(&scrub_stats.passes, __ATOMIC_RELAXED);
+    stats->files = __atomic_load_n(&scrub_stats.files, __ATOMIC_RELAXED);
+    stats->blocks_scanned = __atomic_load_n(&scrub_stats.blocks_scanned, __ATOMIC_RELAXED);
+    stats->blocks_repaired = __atomic_load_n(&scrub_stats.blocks_repaired, __ATOMIC_RELAXED);
+    stats->blocks_unrecoverable = __atomic_load_n(&scrub_stats.blocks_unrecoverable, __ATOMIC_RELAXED);
+    stats->files_unreadable = __atomic_load_n(&scrub_stats.files_unreadable, __ATOMIC_RELAXED);
+}
+
+/*
+  Sleep for ms milliseconds or until asked to stop. Returns non zero
+  when the scrubber should stop.
+*/
+static int scrub_sleep(long ms) {
+    struct timespec until;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    if (until.tv_nsec>=1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&scrubber.mutex);
+    while (!scrubber.stop) {
+        if (pthread_cond_timedwait(&scrubber.wake, &scrubber.mutex, &until)==ETIMEDOUT) {
+            break;
+        }
+    }
+    stop = scrubber.stop;
+    pthread_mutex_unlock(&scrubber.mutex);
+    return stop;
+}
+
+static int scrub_stopping() {
+    return __atomic_load_n(&scrubber.stop, __ATOMIC_RELAXED);
+}
+
+/*
+  Wait until FUSE has been quiet for AA_SCRUB_IDLE_MS and enough of the
+  rate allowance has built up to read bytes. Returns non zero when the
+  scrubber should stop.
+*/
+static int scrub_throttle(size_t bytes) {
+    uint64_t activity;
+    struct timespec now;
+    double burst;
+
+    activity = __atomic_load_n(&foreground_activity, __ATOMIC_RELAXED);
+    while (activity!=scrubber.seen_activity) {
+        scrubber.seen_activity = activity;
+        if (scrub_sleep(AA_SCRUB_IDLE_MS)) {
+            return -1;
+        }
+        activity = __atomic_load_n(&foreground_activity, __ATOMIC_RELAXED);
+    }
+
+    /* A second's worth is banked, or one request's worth at very low rates. */
+    burst = (double)(scrubber.rate>bytes ? scrubber.rate : bytes);
+    for(;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        scrubber.tokens += elapsed(&scrubber.refilled, &now) * (double)scrubber.rate;
+        if (scrubber.tokens>burst) {
+            scrubber.tokens = burst;
+        }
+        scrubber.refilled = now;
+        if (scrubber.tokens>=(double)bytes) {
+            break;
+        }
+        if (scrub_sleep((long)(((double)bytes - scrubber.tokens) * 1000.0 / (double)scrubber.rate) + 1)) {
+            return -1;
+        }
+    }
+    scrubber.tokens -= (double)bytes;
+    return scrub_stopping();
+}
+
+static void save_progress() {
+    FILE *file;
+
+    clock_gettime(CLOCK_MONOTONIC, &scrubber.saved);
+    file = fopen(scrubber.state_temp, "w");
+    if (file==NULL) {
+        log_error("scrub", errno, "Cannot save progress to %s", scrubber.state_temp);
+        return;
+    }
+    fprintf(file, "%s\n%lld\n", scrubber.current, (long long)scrubber.current_ofs);
+    if (fclose(file)!=0 || rename(scrubber.state_temp, scrubber.state_file)!=0) {
+        log_error("scrub", errno, "Cannot save progress to %s", scrubber.state_file);
+    }
+}
+
+static void load_progress() {
+    FILE *file;
+    long long ofs;
+    size_t len;
+
+    scrubber.resume[0] = 0;
+    scrubber.resume_ofs = 0;
+    file = fopen(scrubber.state_file, "r");
+    if (file==NULL) {
+        return;
+    }
+    if (fgets(scrubber.resume, PATH_MAX, file)!=NULL && fscanf(file, "%lld", &ofs)==1) {
+        len = strlen(scrubber.resume);
+        if (len>0 && scrubber.resume[len-1]=='\n') {
+            scrubber.resume[len-1] = 0;
+        }
+        scrubber.resume_ofs = (off_t)ofs;
+        log_info("scrub", "Resuming at %s block offset %lld", scrubber.resume, ofs);
+    } else {
+        scrubber.resume[0] = 0;
+    }
+    fclose(file);
+}
+
+/*
+  Backing names of data files and directories end with '@'.
+*/
+static int select_data_entry(const struct dirent *entry) {
+    size_t len;
+    len = strlen(entry->d_name);
+    return len>1 && entry->d_name[len-1]=='@';
+}
+
+static int compare_names(const struct dirent **a, const struct dirent **b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int backing_path(char fpath[PATH_MAX], int idx, const char *rel) {
+    int len;
+    if (rel[0]==0) {
+        len = snprintf(fpath, PATH_MAX, "%s", scrubber.root_dir[idx]);
+    } else {
+        len = snprintf(fpath, PATH_MAX, "%s/%s", scrubber.root_dir[idx], rel);
+    }
+    return (len<0 || len>=PATH_MAX) ? ENAMETOOLONG : 0;
+}
+
+static int scrub_file(const char *rel, off_t start_ofs) {
+    struct file_entry file_entry;
+    char fpath[PATH_MAX];
+    struct stat statbuf;
+    off_t file_size;
+    off_t file_block_ofs;
+    off_t block_ofs;
+    int idx;
+    int blk;
+    int scanned;
+    int err_no;
+    int span_err_no[AA_SCRUB_SPAN];
+    int repaired[AA_SCRUB_SPAN];
+    int rc;
+    struct timespec now;
+
+    memset(&file_entry, 0, sizeof(file_entry));
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        file_entry.file[idx].fd = -1;
+    }
+
+    err_no = 0;
+    file_size = 0;
+    for(idx=0; idx<AA_NUM_ROOTS && err_no==0; idx++) {
+        err_no = backing_path(fpath, idx, rel);
+        if (err_no!=0) {
+            break;
+        }
+        file_entry.file[idx].fd = open(fpath, O_RDWR);
+        if (file_entry.file[idx].fd<0 || fstat(file_entry.file[idx].fd, &statbuf)<0) {
+            err_no = errno;
+            break;
+        }
+        if (idx==0) {
+            file_entry.dev = statbuf.st_dev;
+            file_entry.ino = statbuf.st_ino;
+        }
+        if (statbuf.st_size>file_size) {
+            file_size = statbuf.st_size;
+        }
+    }
+
+    rc = 0;
+    if (err_no!=0) {
+        log_error("scrub", err_no, "Cannot open idx=%d of %s", idx, rel);
+        count(&scrub_stats.files_unreadable, 1);
+    } else {
+        strcpy(scrubber.current, rel);
+        for(file_block_ofs=start_ofs - (start_ofs % AA_BLOCK_SIZE); file_block_ofs<file_size; file_block_ofs+=(off_t)AA_SCRUB_SPAN * AA_BLOCK_SIZE) {
+            scrubber.current_ofs = file_block_ofs;
+            if (scrub_throttle(AA_NUM_ROOTS * AA_SCRUB_SPAN * AA_BLOCK_SIZE)!=0) {
+                rc = -1;
+                break;
+            }
+            scanned = scrub_blocks(&file_entry, file_block_ofs, AA_SCRUB_SPAN, span_err_no, repaired);
+            count(&scrub_stats.blocks_scanned, (uint64_t)scanned);
+            for(blk=0; blk<scanned; blk++) {
+                block_ofs = file_block_ofs + (off_t)blk * AA_BLOCK_SIZE;
+                if (span_err_no[blk]!=0) {
+                    log_error("scrub", span_err_no[blk], "Unrecoverable block at offset %lld of %s", (long long)block_ofs, rel);
+                    count(&scrub_stats.blocks_unrecoverable, 1);
+                } else if (repaired[blk]) {
+                    log_info("scrub", "Repaired block at offset %lld of %s", (long long)block_ofs, rel);
+                    count(&scrub_stats.blocks_repaired, 1);
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (elapsed(&scrubber.saved, &now)>=AA_SCRUB_SAVE_SECONDS) {
+                scrubber.current_ofs = file_block_ofs + (off_t)AA_SCRUB_SPAN * AA_BLOCK_SIZE;
+                save_progress();
+            }
+        }
+        if (rc==0) {
+            scrubber.current_ofs = file_size;
+            count(&scrub_stats.files, 1);
+        }
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (file_entry.file[idx].fd>=0) {
+            close(file_entry.file[idx].fd);
+        }
+    }
+    return rc;
+}
+
+/*
+  Scrub everything below the backing directory rel, merging the listings
+  of all copies so entries missing from some copies are still visited.
+  resume, when not NULL, is the path below rel of the file to start from.
+*/
+static int scrub_dir(const char *rel, const char *resume) {
+    struct dirent **list[AA_MAX_ROOTS];
+    int entries[AA_MAX_ROOTS];
+    int next[AA_MAX_ROOTS];
+    char fpath[PATH_MAX];
+    char child[PATH_MAX];
+    char entry[NAME_MAX + 1];
+    const char *name;
+    const char *child_resume;
+    size_t resume_len;
+    struct stat statbuf;
+    int idx;
+    int cmp;
+    int rc;
+    int found;
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        list[idx] = NULL;
+        entries[idx] = 0;
+        next[idx] = 0;
+        if (backing_path(fpath, idx, rel)==0) {
+            entries[idx] = scandir(fpath, &list[idx], select_data_entry, compare_names);
+            if (entries[idx]<0) {
+                log_error("scrub", errno, "Cannot list idx=%d of %s", idx, rel[0]?rel:"/");
+                entries[idx] = 0;
+            }
+        }
+    }
+
+    rc = 0;
+    while (rc==0) {
+        name = NULL;
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            if (next[idx]<entries[idx] && (name==NULL || strcmp(list[idx][next[idx]]->d_name, name)<0)) {
+                name = list[idx][next[idx]]->d_name;
+            }
+        }
+        if (name==NULL) {
+            break;
+        }
+        strcpy(entry, name);
+        name = entry;
+
+        child_resume = NULL;
+        if (resume!=NULL) {
+            resume_len = strcspn(resume, "/");
+            cmp = strncmp(name, resume, resume_len);
+            if (cmp==0 && name[resume_len]!=0) {
+                cmp = 1;
+            }
+            if (cmp==0) {
+                child_resume = resume + resume_len;
+                if (child_resume[0]=='/') {
+                    child_resume++;
+                }
+            }
+            if (cmp>=0) {
+                resume = NULL;
+            }
+        }
+
+        if ((resume==NULL) && (snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0]?"/":"", name)<PATH_MAX)) {
+            found = 0;
+            for(idx=0; idx<AA_NUM_ROOTS && !found; idx++) {
+                if (backing_path(fpath, idx, child)==0 && lstat(fpath, &statbuf)==0) {
+                    found = 1;
+                }
+            }
+            if (found && S_ISDIR(statbuf.st_mode)) {
+                rc = scrub_dir(child, (child_resume!=NULL && child_resume[0]!=0) ? child_resume : NULL);
+            } else if (found && S_ISREG(statbuf.st_mode)) {
+                rc = scrub_file(child, (child_resume!=NULL) ? scrubber.resume_ofs : 0);
+            }
+        }
+
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            if (next[idx]<entries[idx] && strcmp(list[idx][next[idx]]->d_name, entry)==0) {
+                free(list[idx][next[idx]]);
+                next[idx]++;
+            }
+        }
+    }
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        while (next[idx]<entries[idx]) {
+            free(list[idx][next[idx]++]);
+        }
+        free(list[idx]);
+    }
+    return rc;
+}
+
+static void *scrub_thread(void *arg) {
+    struct scrub_stats stats;
+
+    load_progress();
+    clock_gettime(CLOCK_MONOTONIC, &scrubber.refilled);
+    scrubber.saved = scrubber.refilled;
+    while (!scrub_stopping()) {
+        if (scrub_dir("", scrubber.resume[0]!=0 ? scrubber.resume : NULL)!=0) {
+            break;
+        }
+        count(&scrub_stats.passes, 1);
+        scrub_get_stats(&stats);
+        log_status("scrub", 0, "Pass complete files=%lu scanned=%lu repaired=%lu unrecoverable=%lu unreadable=%lu",
+                   stats.files, stats.blocks_scanned, stats.blocks_repaired, stats.blocks_unrecoverable, stats.files_unreadable);
+        scrubber.resume[0] = 0;
+        scrubber.current[0] = 0;
+        scrubber.current_ofs = 0;
+        unlink(scrubber.state_file);
+        if (scrub_sleep(1000)) {
+            break;
+        }
+    }
+    if (scrubber.current[0]!=0) {
+        save_progress();
+    }
+    return NULL;
+}
+
+/*
+  Start scrubbing the backing trees at no more than rate bytes per second,
+  keeping progress in state_file. A rate of 0 leaves the scrubber off.
+*/
+int start_scrubber(char root_dir[AA_MAX_ROOTS][PATH_MAX], size_t rate, const char *state_file) {
+    int idx;
+    int err_no;
+
+    if (rate==0 || scrubber.running) {
+        return 0;
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        strcpy(scrubber.root_dir[idx], root_dir[idx]);
+    }
+    strcpy(scrubber.state_file, state_file);
+    snprintf(scrubber.state_temp, sizeof(scrubber.state_temp), "%s.tmp", state_file);
+    scrubber.rate = rate;
+    scrubber.tokens = 0;
+    scrubber.stop = 0;
+    scrubber.current[0] = 0;
+
+    err_no = pthread_create(&scrubber.thread, NULL, scrub_thread, NULL);
+    if (err_no!=0) {
+        return log_error("scrub", err_no, "Cannot start scrubber");
+    }
+    scrubber.running = 1;
+    log_info("scrub", "Scrubbing at %zu bytes per second", rate);
+    return 0;
+}
+
+void stop_scrubber() {
+    if (!scrubber.running) {
+        return;
+    }
+    pthread_mutex_lock(&scrubber.mutex);
+    __atomic_store_n(&scrubber.stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&scrubber.wake);
+    pthread_mutex_unlock(&scrubber.mutex);
+    pthread_join(scrubber.thread, NULL);
+    scrubber.running = 0;
+}
@@ -16,4 +16,25 @@ int initialise_seed(unsigned char seed[]) {
         return 0;
     }
     return -1;
-}
\ No newline at end of file
+}
+/*
+  Fill count seeds, one after another, from as few getrandom calls as the
+  kernel allows.
+*/
+int initialise_seeds(unsigned char seeds[], size_t count) {
+    ssize_t size;
+    size_t done;
+
+    done = 0;
+    while (done<count * AA_SEED_SIZE) {
+        size = getrandom(seeds + done, count * AA_SEED_SIZE - done, 0);
+        if ((size<0) && (errno==EINTR)) {
+            continue;
+        }
+        if (size<=0) {
+            return -1;
+        }
+        done += size;
+    }
+    return 0;
+}
@@ -0,0 +1,1175 @@
+/*
+  Regression checks of the block engine
+
+  archivist-selftest runs the named checks against files in a scratch
+  directory, by default on tmpfs, driving the block engine directly as
+  the daemon does without a FUSE mount. Each check damages the copies or
+  roots of a file the way a failing disk would and checks that what is
+  read back is the data that was written, or that the failure is
+  reported. Others drive one part, such as the hash kernels or the block
+  cache, on its own. It prints nothing and exits 0 when every check
+  passes, and reports the first that fails on stderr and exits 1.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "blocks.h"
+#include "hash.h"
+#include "logs.h"
+#include "cache.h"
+#include "io.h"
+#include "erasure.h"
+#include "writeback.h"
+#include "handles.h"
+#include "attrs.h"
+
+#define TEST_READ_SPAN 64
+#define TEST_HASH_LANES 19
+#define TEST_LOG_THREADS 8
+#define TEST_LOG_RECORDS 1000
+
+static struct selftest {
+    char dir[PATH_MAX];
+    char log[PATH_MAX + 32];
+    char fpath[AA_MAX_ROOTS][PATH_MAX];
+    struct file_entry file_entry;
+} test;
+
+static void fail(int err_no, const char *check, const char *action) {
+    fprintf(stderr, "Error %d (%s) , %s: %s\n", err_no, strerror(err_no), check, action);
+    exit(1);
+}
+
+static void *allocate(size_t size) {
+    void *buf;
+
+    if (posix_memalign(&buf, 4096, (size>0) ? size : 1)!=0) {
+        fail(ENOMEM, "selftest", "Memory allocation failed");
+    }
+    return buf;
+}
+
+/* Set the geometry of the archive a check runs against. */
+static void use_geometry(const char *check, const char *layout_name, int block_size, int fec) {
+    struct root_layout layout;
+
+    if (layout_by_name(layout_name, &layout)!=0) {
+        fail(EINVAL, check, layout_name);
+    }
+    set_layout(&layout);
+    set_block_size(block_size);
+    set_fec(fec);
+    if (AA_ERASURE_CODED && (init_erasure()!=0)) {
+        fail(EINVAL, check, "Cannot set up erasure coding");
+    }
+}
+
+static void open_roots(const char *check) {
+    struct stat statbuf;
+    int idx;
+
+    memset(&test.file_entry, 0, sizeof(test.file_entry));
+    pthread_mutex_init(&test.file_entry.lock, NULL);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (snprintf(test.fpath[idx], PATH_MAX, "%s/archivist-selftest.%d.%d", test.dir, (int)getpid(), idx)>=PATH_MAX) {
+            fail(ENAMETOOLONG, check, "Path too long");
+        }
+        test.file_entry.file[idx].fd = open(test.fpath[idx], O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (test.file_entry.file[idx].fd<0) {
+            fail(errno, check, test.fpath[idx]);
+        }
+    }
+    fstat(test.file_entry.file[0].fd, &statbuf);
+    test.file_entry.dev = statbuf.st_dev;
+    test.file_entry.ino = statbuf.st_ino;
+}
+
+static void close_roots(void) {
+    int idx;
+
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        close(test.file_entry.file[idx].fd);
+        unlink(test.fpath[idx]);
+    }
+}
+
+static off_t root_size(int idx) {
+    struct stat statbuf;
+
+    if (fstat(test.file_entry.file[idx].fd, &statbuf)!=0) {
+        return -1;
+    }
+    return statbuf.st_size;
+}
+
+static unsigned char *make_data(size_t size, unsigned int seed) {
+    unsigned char *data;
+    size_t idx;
+
+    data = allocate(size);
+    srand(seed);
+    for(idx=0; idx<size; idx++) {
+        data[idx] = (unsigned char)rand();
+    }
+    return data;
+}
+
+/* Write size bytes of data as a new file through write_blocks. */
+static void write_file(const char *check, const unsigned char *data, size_t size) {
+    struct data_block *encoded;
+    struct data_block *block[AA_MAX_WRITE_BLOCKS];
+    int count;
+    int done;
+    int blk;
+    int rc;
+
+    count = (int)((size + AA_DATA_SIZE - 1) / AA_DATA_SIZE);
+    encoded = allocate((size_t)count * AA_BLOCK_SIZE);
+    if (encode_blocks(data, size, encoded)<0) {
+        fail(EAGAIN, check, "Failed to initialise seeds");
+    }
+    for(done=0; done<count; done+=AA_MAX_WRITE_BLOCKS) {
+        for(blk=0; (blk<AA_MAX_WRITE_BLOCKS) && (done + blk<count); blk++) {
+            block[blk] = block_at(encoded, done + blk);
+        }
+        rc = write_blocks(&test.file_entry, block, blk, (off_t)done * AA_BLOCK_SIZE);
+        if (rc!=0) {
+            fail(rc, check, "write_blocks failed");
+        }
+    }
+    free(encoded);
+}
+
+/*
+  Read the whole file back through read_blocks, as read_data does, into
+  buf with room for size bytes. Returns the number of bytes read, or a
+  negative errno.
+*/
+static ssize_t read_file(unsigned char *buf, size_t size) {
+    struct data_block *span;
+    size_t total;
+    int blocks_read;
+    int length;
+    int blk;
+    int rc;
+
+    span = allocate((size_t)TEST_READ_SPAN * AA_BLOCK_SIZE);
+    total = 0;
+    for(;;) {
+        rc = read_blocks(&test.file_entry, (off_t)(total / AA_DATA_SIZE) * AA_BLOCK_SIZE, span, TEST_READ_SPAN, &blocks_read);
+        if (rc!=0) {
+            free(span);
+            return -rc;
+        }
+        for(blk=0; blk<blocks_read; blk++) {
+            length = NTOH(block_at(span, blk)->header.length);
+            if (total + (size_t)length>size) {
+                free(span);
+                return -EFBIG;
+            }
+            memcpy(buf + total, block_at(span, blk)->data, (size_t)length);
+            total += (size_t)length;
+            if (length<AA_DATA_SIZE) {
+                break;
+            }
+        }
+        if ((blocks_read<TEST_READ_SPAN) || (blk<blocks_read)) {
+            break;
+        }
+    }
+    free(span);
+    return (ssize_t)total;
+}
+
+/* Read the file back and check it holds size bytes of data. */
+static void expect_file(const char *check, const unsigned char *data, size_t size) {
+    unsigned char *buf;
+    ssize_t len;
+
+    buf = allocate(size + AA_MAX_BLOCK_SIZE);
+    len = read_file(buf, size + AA_MAX_BLOCK_SIZE);
+    if (len<0) {
+        fail((int)-len, check, "read_blocks failed");
+    }
+    if ((size_t)len!=size) {
+        fprintf(stderr, "Error %d (%s) , %s: read %zd of %zu bytes\n", EIO, strerror(EIO), check, len, size);
+        exit(1);
+    }
+    if (memcmp(buf, data, size)!=0) {
+        fail(EIO, check, "data read back differs from data written");
+    }
+    free(buf);
+}
+
+/*
+  Erasure coded reads of a file whose last block has been lost with its
+  data root: the root emptied, two roots emptied, or the root cut short
+  by its last block. The size and the data must come back whole, rebuilt
+  from parity, and the lost roots written back as they were.
+*/
+static void check_erasure(void) {
+    static const struct {
+        const char *layout;
+        int block_size;
+        int fec;
+        size_t size;
+        int lose;
+    } cases[] = {
+        { "erasure:3+2", 512, 0, 25457, 1 },
+        { "erasure:2+1", 512, 0, 25457, 1 },
+        { "erasure:4+2", 4096, 1, 25457, 1 },
+        { "erasure:4+2", 512, 0, 212017, 2 },
+        { "erasure:3+2", 512, 0, 25457, 0 },
+        { "erasure:3+2", 512, 0, 24960, 1 },
+    };
+    off_t before[AA_MAX_ROOTS];
+    int fd[AA_MAX_ROOTS];
+    char check[64];
+    unsigned char *data;
+    off_t last;
+    int col;
+    int idx;
+    int n;
+
+    for(n=0; n<(int)(sizeof(cases) / sizeof(cases[0])); n++) {
+        snprintf(check, sizeof(check), "erasure %s/%d%s size %zu", cases[n].layout, cases[n].block_size, cases[n].fec ? "/fec" : "", cases[n].size);
+        use_geometry(check, cases[n].layout, cases[n].block_size, cases[n].fec);
+        open_roots(check);
+        data = make_data(cases[n].size, (unsigned int)n + 1);
+        write_file(check, data, cases[n].size);
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            before[idx] = root_size(idx);
+            fd[idx] = test.file_entry.file[idx].fd;
+        }
+
+        last = (off_t)((cases[n].size + AA_DATA_SIZE - 1) / AA_DATA_SIZE) - 1;
+        col = (int)(last % AA_DATA_ROOTS);
+        if (cases[n].lose==0) {
+            if (ftruncate(fd[col], (last / AA_DATA_ROOTS) * AA_BLOCK_SIZE)!=0) {
+                fail(errno, check, "Failed to cut a root short");
+            }
+        }
+        for(idx=0; idx<cases[n].lose; idx++) {
+            if (ftruncate(fd[(col + AA_DATA_ROOTS - idx) % AA_DATA_ROOTS], 0)!=0) {
+                fail(errno, check, "Failed to empty a root");
+            }
+        }
+
+        if (ec_file_size(fd)!=(off_t)cases[n].size) {
+            fprintf(stderr, "Error %d (%s) , %s: size %lld\n", EIO, strerror(EIO), check, (long long)ec_file_size(fd));
+            exit(1);
+        }
+        expect_file(check, data, cases[n].size);
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            if (root_size(idx)!=before[idx]) {
+                fail(EIO, check, "lost root not written back");
+            }
+        }
+        expect_file(check, data, cases[n].size);
+        close_roots();
+        free(data);
+    }
+}
+
+/*
+  Open a second handle on the file of the first.
+*/
+static void open_other(const char *check, struct file_entry *other) {
+    int idx;
+
+    memset(other, 0, sizeof(struct file_entry));
+    pthread_mutex_init(&other->lock, NULL);
+    other->dev = test.file_entry.dev;
+    other->ino = test.file_entry.ino;
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        other->file[idx].fd = dup(test.file_entry.file[idx].fd);
+        if (other->file[idx].fd<0) {
+            fail(errno, check, "Failed to open a second handle");
+        }
+    }
+}
+
+static void close_other(struct file_entry *other) {
+    int idx;
+
+    free_write_buffer(other);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        close(other->file[idx].fd);
+    }
+}
+
+/*
+  Writes buffered on one handle of a file, as seen from another: a read
+  there flushes them first, and a truncate drops what lies past the new
+  end, so a later flush cannot bring it back.
+*/
+static void check_shared_writeback(void) {
+    const char *check = "writeback shared";
+    const size_t size = 2000;
+    const size_t end = 9000;
+    const off_t from = 1500;
+    const off_t cut = 3000;
+    struct file_entry other;
+    unsigned char *data;
+    unsigned char *patch;
+    int flushed;
+    int rc;
+
+    use_geometry(check, "mirror:2", 512, 0);
+    open_roots(check);
+    open_other(check, &other);
+    data = make_data(end, 3);
+    patch = make_data(end, 4);
+    write_file(check, data, size);
+
+    memcpy(data + from, patch + from, end - from);
+    pthread_mutex_lock(&other.lock);
+    rc = buffer_write(&other, (const char *)patch + from, end - from, from);
+    pthread_mutex_unlock(&other.lock);
+    if (rc!=0) {
+        fail(rc, check, "buffer_write failed");
+    }
+    rc = flush_pending(test.file_entry.dev, test.file_entry.ino, &flushed);
+    if ((rc!=0) || !flushed || (other.dirty.count!=0)) {
+        fail((rc!=0) ? rc : EIO, check, "writes on another handle not flushed before a read");
+    }
+    expect_file(check, data, end);
+
+    close_other(&other);
+    close_roots();
+    open_roots(check);
+    open_other(check, &other);
+    write_file(check, data, size);
+    pthread_mutex_lock(&other.lock);
+    rc = buffer_write(&other, (const char *)patch + from, end - from, from);
+    pthread_mutex_unlock(&other.lock);
+    if (rc!=0) {
+        fail(rc, check, "buffer_write failed");
+    }
+    if (clip_pending(test.file_entry.dev, test.file_entry.ino, cut)!=0) {
+        fail(ENOMEM, check, "clip_pending failed");
+    }
+    if (pending_size(test.file_entry.dev, test.file_entry.ino)!=cut) {
+        fail(EIO, check, "pending size not clipped by a truncate");
+    }
+    pthread_mutex_lock(&other.lock);
+    rc = flush_writes(&other);
+    pthread_mutex_unlock(&other.lock);
+    if (rc!=0) {
+        fail(rc, check, "flush_writes failed");
+    }
+    expect_file(check, data, (size_t)cut);
+
+    close_other(&other);
+    close_roots();
+    free(data);
+    free(patch);
+}
+
+/*
+  A write back buffer that fails to flush, here because a copy can only be
+  read, keeps its blocks and its pending size, reports the error, and
+  writes them all once the copy can be written again.
+*/
+static void check_writeback(void) {
+    const char *check = "writeback";
+    const size_t size = 5000;
+    const size_t extra = 1000;
+    unsigned char *data;
+    unsigned char *patch;
+    int fd;
+    int rc;
+
+    use_geometry(check, "mirror:2", 512, 0);
+    open_roots(check);
+    data = make_data(size + extra, 1);
+    patch = make_data(size + extra, 2);
+    write_file(check, data, size);
+
+    memcpy(data + 700, patch + 700, 3000);
+    memcpy(data + size, patch + size, extra);
+    pthread_mutex_lock(&test.file_entry.lock);
+    if ((buffer_write(&test.file_entry, (const char *)patch + 700, 3000, 700)!=0) ||
+        (buffer_write(&test.file_entry, (const char *)patch + size, extra, (off_t)size)!=0)) {
+        fail(EIO, check, "buffer_write failed");
+    }
+    if (pending_size(test.file_entry.dev, test.file_entry.ino)!=(off_t)(size + extra)) {
+        fail(EIO, check, "pending size does not include buffered writes");
+    }
+
+    fd = open(test.fpath[1], O_RDONLY);
+    if ((fd<0) || (dup2(fd, test.file_entry.file[1].fd)<0)) {
+        fail(errno, check, "Failed to make a copy read only");
+    }
+    close(fd);
+    rc = flush_writes(&test.file_entry);
+    if (rc==0) {
+        fail(EIO, check, "flush to a read only copy succeeded");
+    }
+    if ((test.file_entry.dirty.count==0) || (pending_size(test.file_entry.dev, test.file_entry.ino)!=(off_t)(size + extra))) {
+        fail(rc, check, "buffered writes dropped after a failed flush");
+    }
+
+    fd = open(test.fpath[1], O_RDWR);
+    if ((fd<0) || (dup2(fd, test.file_entry.file[1].fd)<0)) {
+        fail(errno, check, "Failed to make a copy writable");
+    }
+    close(fd);
+    rc = flush_writes(&test.file_entry);
+    if (rc!=0) {
+        fail(rc, check, "flush_writes failed");
+    }
+    if ((test.file_entry.dirty.count!=0) || (pending_size(test.file_entry.dev, test.file_entry.ino)!=0)) {
+        fail(EIO, check, "buffer not emptied by a flush");
+    }
+    pthread_mutex_unlock(&test.file_entry.lock);
+    free_write_buffer(&test.file_entry);
+
+    expect_file(check, data, size + extra);
+    close_roots();
+    free(data);
+    free(patch);
+    check_shared_writeback();
+}
+
+/*
+  Mirrored reads of a file whose primary copy has been cut short in the
+  middle of a block, emptied, or cut short and made read only, under both
+  read policies. The data must be read whole from the mirror, the primary
+  put right where it can be written, and a partial write into the lost
+  part merged with the mirror's data.
+*/
+static void check_fallback(void) {
+    static const struct {
+        int policy;
+        off_t cut;
+        int read_only;
+    } cases[] = {
+        { AA_READ_ALL, 3, 0 },
+        { AA_READ_ALL, 0, 0 },
+        { AA_READ_ALL, 3, 1 },
+        { AA_READ_PRIMARY_FIRST, 3, 0 },
+        { AA_READ_PRIMARY_FIRST, 0, 0 },
+        { AA_READ_PRIMARY_FIRST, 3, 1 },
+    };
+    const size_t size = 9000;
+    const off_t patch_ofs = 6000;
+    const size_t patch_size = 100;
+    char check[64];
+    unsigned char *data;
+    unsigned char *patch;
+    off_t cut;
+    int fd;
+    int rc;
+    int n;
+
+    for(n=0; n<(int)(sizeof(cases) / sizeof(cases[0])); n++) {
+        snprintf(check, sizeof(check), "fallback %s cut %lld%s", (cases[n].policy==AA_READ_ALL) ? "all" : "primary", (long long)cases[n].cut, cases[n].read_only ? " read only" : "");
+        use_geometry(check, "mirror:2", 512, 0);
+        set_read_policy(cases[n].policy);
+        open_roots(check);
+        data = make_data(size, (unsigned int)n + 1);
+        patch = make_data(patch_size, (unsigned int)n + 101);
+        write_file(check, data, size);
+
+        cut = (cases[n].cut==0) ? 0 : cases[n].cut * AA_BLOCK_SIZE + 100;
+        if (ftruncate(test.file_entry.file[0].fd, cut)!=0) {
+            fail(errno, check, "Failed to cut the primary short");
+        }
+        if (cases[n].read_only) {
+            fd = open(test.fpath[0], O_RDONLY);
+            if ((fd<0) || (dup2(fd, test.file_entry.file[0].fd)<0)) {
+                fail(errno, check, "Failed to make the primary read only");
+            }
+            close(fd);
+        }
+        expect_file(check, data, size);
+        if (cases[n].read_only) {
+            close_roots();
+            free(data);
+            free(patch);
+            continue;
+        }
+        if (root_size(0)!=root_size(1)) {
+            fail(EIO, check, "primary not written back");
+        }
+
+        if (ftruncate(test.file_entry.file[0].fd, cut)!=0) {
+            fail(errno, check, "Failed to cut the primary short");
+        }
+        memcpy(data + patch_ofs, patch, patch_size);
+        pthread_mutex_lock(&test.file_entry.lock);
+        rc = buffer_write(&test.file_entry, (const char *)patch, patch_size, patch_ofs);
+        if (rc==0) {
+            rc = flush_writes(&test.file_entry);
+        }
+        pthread_mutex_unlock(&test.file_entry.lock);
+        free_write_buffer(&test.file_entry);
+        if (rc!=0) {
+            fail(rc, check, "partial write failed");
+        }
+        expect_file(check, data, size);
+        close_roots();
+        free(data);
+        free(patch);
+    }
+    set_read_policy(AA_READ_ALL);
+}
+
+/* The whole of root idx, its size in *size. */
+static unsigned char *read_root(const char *check, int idx, off_t *size) {
+    unsigned char *buf;
+
+    *size = root_size(idx);
+    buf = allocate((size_t)*size);
+    if (pread(test.file_entry.file[idx].fd, buf, (size_t)*size, 0)!=*size) {
+        fail(EIO, check, "Failed to read a root");
+    }
+    return buf;
+}
+
+/*
+  Blocks with a burst of flipped bytes short enough for their error
+  correction trailer, on every copy of a mirrored block under both read
+  policies and in a data root of an erasure coded file. The data must
+  read back whole and the damaged roots that were read be written back
+  as they were, which under the primary-first policy is the primary.
+*/
+static void check_fec(void) {
+    static const struct {
+        const char *layout;
+        int policy;
+        int roots;
+        int restored;
+    } cases[] = {
+        { "mirror:2", AA_READ_ALL, 2, 2 },
+        { "mirror:2", AA_READ_PRIMARY_FIRST, 2, 1 },
+        { "erasure:4+2", AA_READ_ALL, 1, 1 },
+    };
+    const size_t size = 100000;
+    const int burst = 16;
+    unsigned char *before[AA_MAX_ROOTS];
+    unsigned char *after;
+    unsigned char flip[16];
+    off_t length[AA_MAX_ROOTS];
+    off_t now;
+    char check[64];
+    unsigned char *data;
+    int idx;
+    int n;
+
+    for(n=0; n<(int)(sizeof(cases) / sizeof(cases[0])); n++) {
+        snprintf(check, sizeof(check), "fec %s %s", cases[n].layout, (cases[n].policy==AA_READ_ALL) ? "all" : "primary");
+        use_geometry(check, cases[n].layout, 4096, 1);
+        set_read_policy(cases[n].policy);
+        open_roots(check);
+        data = make_data(size, (unsigned int)n + 1);
+        write_file(check, data, size);
+
+        for(idx=0; idx<cases[n].roots; idx++) {
+            before[idx] = read_root(check, idx, &length[idx]);
+            memcpy(flip, before[idx] + AA_BLOCK_SIZE + 1000, (size_t)burst);
+            for(now=0; now<burst; now++) {
+                flip[now] ^= 0xFF;
+            }
+            if (pwrite(test.file_entry.file[idx].fd, flip, (size_t)burst, AA_BLOCK_SIZE + 1000)!=burst) {
+                fail(errno, check, "Failed to damage a block");
+            }
+        }
+        expect_file(check, data, size);
+        for(idx=0; idx<cases[n].roots; idx++) {
+            after = read_root(check, idx, &now);
+            if ((idx<cases[n].restored) && ((now!=length[idx]) || (memcmp(after, before[idx], (size_t)now)!=0))) {
+                fail(EIO, check, "corrected block not written back");
+            }
+            free(after);
+            free(before[idx]);
+        }
+        close_roots();
+        free(data);
+    }
+    set_read_policy(AA_READ_ALL);
+}
+
+/*
+  The block cache, enabled for this check alone with room for a handful
+  of blocks per shard. A run of inserts larger than the cache must evict
+  without losing the newest block or returning the wrong one, an insert made with an epoch taken before the file was
+  invalidated must be dropped, and an invalidation from an offset must
+  drop the blocks at and past it and keep the rest.
+*/
+static void check_cache(void) {
+    const char *check = "cache";
+    const int blocks = 1000;
+    const ino_t ino = 1000;
+    struct cache_stats stats;
+    struct data_block *block;
+    struct data_block *found;
+    uint64_t read_epoch;
+    uint64_t other_epoch;
+    ino_t other;
+    int hits;
+    int hit;
+    int blk;
+
+    use_geometry(check, "mirror:2", 512, 0);
+    if (init_block_cache((size_t)AA_CACHE_SHARDS * 8 * 1024)!=0) {
+        fail(ENOMEM, check, "Cannot set up the block cache");
+    }
+    block = allocate(AA_BLOCK_SIZE);
+    found = allocate(AA_BLOCK_SIZE);
+    memset(block, 0, AA_BLOCK_SIZE);
+
+    for(blk=0; blk<blocks; blk++) {
+        block->header.length = (uint32_t)blk;
+        cache_insert(1, ino, (off_t)blk * AA_BLOCK_SIZE, block, cache_epoch(1, ino));
+    }
+    cache_get_stats(&stats);
+    if ((stats.evictions==0) || (stats.used>stats.capacity)) {
+        fail(EIO, check, "Inserts past the capacity did not evict");
+    }
+    hits = 0;
+    for(blk=blocks-1; blk>=0; blk--) {
+        hit = cache_lookup(1, ino, (off_t)blk * AA_BLOCK_SIZE, found);
+        if (hit && (found->header.length!=(uint32_t)blk)) {
+            fail(EIO, check, "Lookup returned another block");
+        }
+        hits += hit;
+    }
+    if ((hits==0) || ((size_t)hits * AA_BLOCK_SIZE>stats.capacity)) {
+        fail(EIO, check, "Cache holds more blocks than its capacity");
+    }
+    if (cache_lookup(1, ino, (off_t)(blocks - 1) * AA_BLOCK_SIZE, found)!=1) {
+        fail(EIO, check, "Newest block was evicted");
+    }
+
+    /* An insert that raced an invalidation of its file is dropped. */
+    other = ino;
+    do {
+        other++;
+        other_epoch = cache_epoch(1, other);
+        read_epoch = cache_epoch(1, ino);
+        cache_invalidate(1, ino, 0);
+    } while (cache_epoch(1, other)!=other_epoch);
+    cache_insert(1, ino, 0, block, read_epoch);
+    if (cache_lookup(1, ino, 0, found)) {
+        fail(EIO, check, "Block read before an invalidation was cached");
+    }
+    cache_insert(1, other, 0, block, other_epoch);
+    if (!cache_lookup(1, other, 0, found)) {
+        fail(EIO, check, "Invalidating one file dropped the insert of another");
+    }
+
+    /* Invalidation from an offset keeps the blocks before it. */
+    for(blk=0; blk<4; blk++) {
+        block->header.length = (uint32_t)blk;
+        cache_insert(1, ino, (off_t)blk * AA_BLOCK_SIZE, block, cache_epoch(1, ino));
+    }
+    cache_invalidate(1, ino, 2 * AA_BLOCK_SIZE);
+    for(blk=0; blk<4; blk++) {
+        if (cache_lookup(1, ino, (off_t)blk * AA_BLOCK_SIZE, found)!=(blk<2)) {
+            fail(EIO, check, (blk<2) ? "Block before the invalidated range was dropped" : "Block past the invalidated range was kept");
+        }
+    }
+
+    cache_invalidate(1, ino, 0);
+    cache_invalidate(1, other, 0);
+    cache_get_stats(&stats);
+    if (stats.used!=0) {
+        fail(EIO, check, "Invalidated blocks still take up the cache");
+    }
+    init_block_cache(0);
+    free(found);
+    free(block);
+}
+
+/*
+  The open file handle table. Handles taken past the end of the first
+  chunk must be distinct and keep their entries, handles released on
+  both sides of the chunk boundary must be the ones handed out again,
+  and the table must only grow when every handle is in use.
+*/
+static void check_handles(void) {
+    const char *check = "handles";
+    const int count = 2 * AA_HANDLE_CHUNK_SIZE;
+    const int released[] = { 0, AA_HANDLE_CHUNK_SIZE - 1, AA_HANDLE_CHUNK_SIZE, count - 1 };
+    const int num_released = (int)(sizeof(released) / sizeof(released[0]));
+    struct handle_table *table;
+    struct file_entry *file_entry;
+    unsigned char *seen;
+    uint64_t *fh;
+    uint64_t again;
+    int idx;
+    int n;
+
+    table = allocate(sizeof(struct handle_table));
+    memset(table, 0, sizeof(struct handle_table));
+    fh = allocate((size_t)(count + 1) * sizeof(uint64_t));
+    seen = allocate((size_t)count);
+    memset(seen, 0, (size_t)count);
+    for(n=0; n<count; n++) {
+        if (allocate_handle(table, &fh[n])!=0) {
+            fail(ENFILE, check, "Cannot allocate a handle");
+        }
+        if ((fh[n]>=(uint64_t)count) || seen[fh[n]]) {
+            fail(EINVAL, check, "Handle allocated twice or out of range");
+        }
+        seen[fh[n]] = 1;
+        file_entry = handle_file_entry(table, fh[n]);
+        for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+            if (file_entry->file[idx].fd!=-1) {
+                fail(EINVAL, check, "New handle has an open file");
+            }
+        }
+        file_entry->ino = (ino_t)fh[n] + 1;
+    }
+    if (table->num_chunks!=2) {
+        fail(EINVAL, check, "Table grew with free handles left");
+    }
+
+    for(n=0; n<num_released; n++) {
+        release_handle(table, (uint64_t)released[n]);
+    }
+    for(n=0; n<num_released; n++) {
+        if (allocate_handle(table, &again)!=0) {
+            fail(ENFILE, check, "Cannot reuse a handle");
+        }
+        if (again!=(uint64_t)released[num_released - 1 - n]) {
+            fail(EINVAL, check, "Released handle not handed out again");
+        }
+    }
+    for(n=0; n<count; n++) {
+        if (handle_file_entry(table, fh[n])->ino!=(ino_t)fh[n] + 1) {
+            fail(EINVAL, check, "Handle entry moved");
+        }
+    }
+    if (table->num_chunks!=2) {
+        fail(EINVAL, check, "Table grew while released handles were free");
+    }
+
+    if ((allocate_handle(table, &fh[count])!=0) || (fh[count]!=(uint64_t)count) || (table->num_chunks!=3)) {
+        fail(EINVAL, check, "Table did not grow once every handle was in use");
+    }
+    for(n=0; n<=count; n++) {
+        release_handle(table, fh[n]);
+    }
+    for(n=0; n<(int)table->num_chunks; n++) {
+        free(table->chunk[n]);
+    }
+    free(table);
+    free(seen);
+    free(fh);
+}
+
+/*
+  The attribute cache. A path cached as missing must be reported so
+  until it is invalidated, and a negative entry based on a lookup made
+  before an invalidation must not be cached. Renaming a directory over
+  another, as rename_call does, must drop what is cached below either
+  name and any stat taken before the rename, and keep paths that only
+  share a prefix with them.
+*/
+static void check_attrs(void) {
+    static const struct {
+        const char *path;
+        int negative;
+        int after_rename;
+    } cases[] = {
+        { "/d", 0, 0 },
+        { "/d/x", 0, 0 },
+        { "/d/e/y", 0, 0 },
+        { "/dd/x", 0, 1 },
+        { "/e/z", 0, 1 },
+        { "/e/missing", 1, -1 },
+        { "/f/x", 1, 0 },
+    };
+    const char *check = "attrs";
+    struct stat statbuf;
+    struct stat found;
+    uint64_t epoch;
+    int expected;
+    int n;
+
+    if (init_attr_cache(60)!=0) {
+        fail(ENOMEM, check, "Cannot set up the attribute cache");
+    }
+    memset(&statbuf, 0, sizeof(statbuf));
+    statbuf.st_mode = S_IFREG | 0644;
+    statbuf.st_size = 525;
+
+    for(n=0; n<(int)(sizeof(cases) / sizeof(cases[0])); n++) {
+        attr_insert(cases[n].path, cases[n].negative ? NULL : &statbuf, attr_epoch(cases[n].path));
+    }
+    for(n=0; n<(int)(sizeof(cases) / sizeof(cases[0])); n++) {
+        expected = cases[n].negative ? -1 : 1;
+        if (attr_lookup(cases[n].path, &found)!=expected) {
+            fail(EINVAL, check, cases[n].path);
+        }
+        if ((expected==1) && (found.st_size!=statbuf.st_size)) {
+            fail(EINVAL, check, "Cached stat differs");
+        }
+    }
+
+    epoch = attr_epoch("/e/gone");
+    attr_invalidate("/e/gone");
+    attr_insert("/e/gone", NULL, epoch);
+    if (attr_lookup("/e/gone", &found)!=0) {
+        fail(EINVAL, check, "Negative entry from before an invalidation was cached");
+    }
+
+    epoch = attr_epoch("/d/e/q");
+    attr_invalidate_tree("/d");
+    attr_invalidate_tree("/f");
+    attr_insert("/d/e/q", &statbuf, epoch);
+    if (attr_lookup("/d/e/q", &found)!=0) {
+        fail(EINVAL, check, "Stat from before a rename was cached");
+    }
+    for(n=0; n<(int)(sizeof(cases) / sizeof(cases[0])); n++) {
+        if (attr_lookup(cases[n].path, &found)!=cases[n].after_rename) {
+            fail(EINVAL, check, (cases[n].after_rename==0) ? "Entry below a renamed directory was kept" : "Entry outside the renamed directories was dropped");
+        }
+    }
+    attr_insert("/d/x", &statbuf, attr_epoch("/d/x"));
+    if (attr_lookup("/d/x", &found)!=1) {
+        fail(EINVAL, check, "Entry cached after a rename was dropped");
+    }
+
+    attr_invalidate("/e/missing");
+    if (attr_lookup("/e/missing", &found)!=0) {
+        fail(EINVAL, check, "Invalidated negative entry was kept");
+    }
+    init_attr_cache(0);
+}
+
+static pthread_barrier_t log_logged;
+static pthread_barrier_t log_stopped;
+
+/*
+  Log the records of one thread of the logs check. Odd threads exit
+  straight after, leaving their rings to the writer, even ones wait
+  until logging has stopped.
+*/
+static void *log_thread(void *arg) {
+    int thread;
+    int record;
+
+    thread = (int)(intptr_t)arg;
+    for(record=0; record<TEST_LOG_RECORDS; record++) {
+        if (record % 100==99) {
+            log_error("selftest", EIO, "thread %d record %d", thread, record);
+        } else {
+            log_info("selftest", "thread %d record %d", thread, record);
+        }
+    }
+    if (thread % 2==0) {
+        pthread_barrier_wait(&log_logged);
+        pthread_barrier_wait(&log_stopped);
+    }
+    return NULL;
+}
+
+/*
+  The log writer. Records logged by threads that have exited and by
+  threads that are still running must all be in the log file once
+  stop_logging returns, each exactly once.
+*/
+static void check_logs(void) {
+    const char *check = "logs";
+    pthread_t thread[TEST_LOG_THREADS];
+    struct stat statbuf;
+    unsigned char *seen;
+    char line[512];
+    char *text;
+    FILE *fh;
+    int record;
+    int idx;
+    int n;
+
+    seen = allocate(TEST_LOG_THREADS * TEST_LOG_RECORDS);
+    memset(seen, 0, TEST_LOG_THREADS * TEST_LOG_RECORDS);
+    pthread_barrier_init(&log_logged, NULL, TEST_LOG_THREADS / 2 + 1);
+    pthread_barrier_init(&log_stopped, NULL, TEST_LOG_THREADS / 2 + 1);
+    if (stat(test.log, &statbuf)!=0) {
+        fail(errno, check, test.log);
+    }
+    log_level = AA_LOG_INFO;
+    start_logging();
+    for(idx=0; idx<TEST_LOG_THREADS; idx++) {
+        if (pthread_create(&thread[idx], NULL, log_thread, (void *)(intptr_t)idx)!=0) {
+            fail(EAGAIN, check, "Cannot start a logging thread");
+        }
+    }
+    for(idx=1; idx<TEST_LOG_THREADS; idx+=2) {
+        pthread_join(thread[idx], NULL);
+    }
+    pthread_barrier_wait(&log_logged);
+    stop_logging();
+    pthread_barrier_wait(&log_stopped);
+    for(idx=0; idx<TEST_LOG_THREADS; idx+=2) {
+        pthread_join(thread[idx], NULL);
+    }
+    log_level = AA_LOG_ERROR;
+    pthread_barrier_destroy(&log_logged);
+    pthread_barrier_destroy(&log_stopped);
+
+    fh = fopen(test.log, "r");
+    if (fh==NULL) {
+        fail(errno, check, test.log);
+    }
+    fseek(fh, statbuf.st_size, SEEK_SET);
+    while (fgets(line, sizeof(line), fh)!=NULL) {
+        text = strstr(line, " : selftest ");
+        text = (text!=NULL) ? strstr(text, "thread ") : NULL;
+        if ((text==NULL) || (sscanf(text, "thread %d record %d", &idx, &record)!=2)) {
+            continue;
+        }
+        if ((idx<0) || (idx>=TEST_LOG_THREADS) || (record<0) || (record>=TEST_LOG_RECORDS) || seen[idx * TEST_LOG_RECORDS + record]) {
+            fail(EINVAL, check, "Record written twice or garbled");
+        }
+        seen[idx * TEST_LOG_RECORDS + record] = 1;
+    }
+    fclose(fh);
+    for(n=0; n<TEST_LOG_THREADS * TEST_LOG_RECORDS; n++) {
+        if (!seen[n]) {
+            fail(EIO, check, "Record logged before stop_logging is missing from the log");
+        }
+    }
+    free(seen);
+}
+
+/*
+  Version 2 blocks hashed with XXH3-128. A file written with them, with
+  error correction on, must read back whole once SHA-1 is the write
+  algorithm again, as readers go by each block's header. A version 2
+  block relabelled version 1, a version 1 block relabelled version 2
+  and a version 2 block naming an unknown algorithm must all fail their
+  check, and a file whose copies all hold such a block must fail to read
+  rather than return its data.
+*/
+static void check_hash_v2(void) {
+    const char *check = "hash-v2";
+    const size_t size = 20000;
+    struct data_block *encoded;
+    struct data_block *block;
+    unsigned char *buf;
+    unsigned char *data;
+    uint16_t version;
+    off_t length;
+    ssize_t len;
+    int idx;
+
+    use_geometry(check, "mirror:2", 4096, 1);
+    set_hash_type(AA_HASH_TYPE_XXH3);
+    open_roots(check);
+    data = make_data(size, 16);
+    write_file(check, data, size);
+    set_hash_type(AA_HASH_TYPE_SHA1);
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        buf = read_root(check, idx, &length);
+        block = (struct data_block *)buf;
+        if ((version_format(NTOH(block->header.version))!=AA_VERSION_2) || (block_hash_type(block)!=AA_HASH_TYPE_XXH3)) {
+            fail(EINVAL, check, "Block not written as version 2 with XXH3");
+        }
+        free(buf);
+    }
+    expect_file(check, data, size);
+    close_roots();
+
+    use_geometry(check, "mirror:2", 512, 0);
+    encoded = allocate((size_t)2 * AA_BLOCK_SIZE);
+    set_hash_type(AA_HASH_TYPE_XXH3);
+    encode_blocks(data, AA_DATA_SIZE, encoded);
+    set_hash_type(AA_HASH_TYPE_SHA1);
+    encode_blocks(data, AA_DATA_SIZE, block_at(encoded, 1));
+    block = block_at(encoded, 0);
+    if (!block_hash_valid(block) || !block_hash_valid(block_at(encoded, 1))) {
+        fail(EINVAL, check, "Freshly hashed block fails its check");
+    }
+    version = block->header.version;
+    block->header.version = HTON(block_version(AA_VERSION_1));
+    if (block_hash_valid(block)) {
+        fail(EINVAL, check, "Version 2 block passes as version 1");
+    }
+    block->header.version = version;
+    block->header.hash[0] = AA_HASH_TYPE_XXH3 + 1;
+    if (block_hash_valid(block)) {
+        fail(EINVAL, check, "Block with an unknown algorithm passes");
+    }
+    block->header.hash[0] = AA_HASH_TYPE_XXH3;
+    block = block_at(encoded, 1);
+    block->header.version = HTON(block_version(AA_VERSION_2));
+    block->header.hash[0] = AA_HASH_TYPE_XXH3;
+    if (block_hash_valid(block)) {
+        fail(EINVAL, check, "Version 1 block passes as version 2");
+    }
+
+    /* Every copy of the first block of an XXH3 file relabelled version 1. */
+    set_hash_type(AA_HASH_TYPE_XXH3);
+    open_roots(check);
+    write_file(check, data, size);
+    set_hash_type(AA_HASH_TYPE_SHA1);
+    version = HTON(block_version(AA_VERSION_1));
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        if (pwrite(test.file_entry.file[idx].fd, &version, sizeof(version), offsetof(struct data_header, version))!=sizeof(version)) {
+            fail(errno, check, "Failed to relabel a block");
+        }
+    }
+    buf = allocate(size + AA_MAX_BLOCK_SIZE);
+    len = read_file(buf, size + AA_MAX_BLOCK_SIZE);
+    if (len>=0) {
+        fail(EINVAL, check, "File with a relabelled block read back");
+    }
+    close_roots();
+    free(buf);
+    free(encoded);
+    free(data);
+}
+
+/*
+  The SHA-1 kernels this processor can run, selected one at a time, must
+  give the digests the portable kernel gives, for every message length up
+  to a page, which covers the padding edges at 55, 56 and 64 bytes, and
+  through SHA1_many for every number of messages up to 19, which leaves
+  groups of lanes partly filled.
+*/
+static void check_hash(void) {
+    static const int engines[] = { AA_HASH_SHANI, AA_HASH_AVX2, AA_HASH_SHANI | AA_HASH_AVX2 };
+    static const size_t many_sizes[] = { 0, 55, 56, 64, 4096 };
+    static const unsigned char abc[20] = {
+        0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+        0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+    };
+    const size_t max_size = 4096;
+    const unsigned char *message[TEST_HASH_LANES];
+    unsigned char many_expected[5][TEST_HASH_LANES][20];
+    unsigned char *md[TEST_HASH_LANES];
+    unsigned char digest[TEST_HASH_LANES][20];
+    unsigned char *expected;
+    unsigned char *data;
+    char check[64];
+    size_t size;
+    int saved;
+    int lanes;
+    int lane;
+    int idx;
+    int n;
+
+    saved = hash_engine();
+    data = make_data(max_size + TEST_HASH_LANES, 1);
+    expected = allocate((max_size + 1) * 20);
+    for(lane=0; lane<TEST_HASH_LANES; lane++) {
+        message[lane] = data + lane;
+        md[lane] = digest[lane];
+    }
+
+    hash_select(AA_HASH_PORTABLE);
+    SHA1((const unsigned char *)"abc", 3, digest[0]);
+    if (memcmp(digest[0], abc, 20)!=0) {
+        fail(EIO, "hash portable", "Wrong SHA-1 of abc");
+    }
+    for(size=0; size<=max_size; size++) {
+        SHA1(data, size, &expected[size * 20]);
+    }
+    for(idx=0; idx<5; idx++) {
+        for(lane=0; lane<TEST_HASH_LANES; lane++) {
+            SHA1(message[lane], many_sizes[idx], many_expected[idx][lane]);
+        }
+    }
+
+    for(n=0; n<(int)(sizeof(engines) / sizeof(engines[0])); n++) {
+        if (hash_select(engines[n])!=0) {
+            continue;
+        }
+        snprintf(check, sizeof(check), "hash %s", hash_engine_name(engines[n]));
+        for(size=0; size<=max_size; size++) {
+            SHA1(data, size, digest[0]);
+            if (memcmp(digest[0], &expected[size * 20], 20)!=0) {
+                fail(EIO, check, "SHA1 differs from the portable kernel");
+            }
+        }
+        for(idx=0; idx<5; idx++) {
+            for(lanes=1; lanes<=TEST_HASH_LANES; lanes++) {
+                memset(digest, 0, sizeof(digest));
+                SHA1_many(message, many_sizes[idx], md, lanes);
+                for(lane=0; lane<TEST_HASH_LANES; lane++) {
+                    if ((lane<lanes) ? (memcmp(digest[lane], many_expected[idx][lane], 20)!=0) : (digest[lane][0]!=0 || memcmp(digest[lane], digest[lane] + 1, 19)!=0)) {
+                        fail(EIO, check, "SHA1_many differs from the portable kernel");
+                    }
+                }
+            }
+        }
+    }
+
+    hash_select(saved);
+    free(expected);
+    free(data);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} checks[] = {
+    { "erasure", check_erasure },
+    { "writeback", check_writeback },
+    { "fallback", check_fallback },
+    { "fec", check_fec },
+    { "hash", check_hash },
+    { "cache", check_cache },
+    { "handles", check_handles },
+    { "attrs", check_attrs },
+    { "logs", check_logs },
+    { "hash-v2", check_hash_v2 },
+};
+
+#define CHECK_COUNT ((int)(sizeof(checks) / sizeof(checks[0])))
+
+int main(int argc, char* argv[]) {
+    struct stat statbuf;
+    int ran;
+    int arg;
+    int idx;
+
+    strcpy(test.dir, (stat("/dev/shm", &statbuf)==0) ? "/dev/shm" : "/tmp");
+    while ((argc > 1) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--dir=", 6)) {
+            snprintf(test.dir, sizeof(test.dir), "%s", argv[1] + 6);
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
+
+    snprintf(test.log, sizeof(test.log), "%s/archivist-selftest.%d.log", test.dir, (int)getpid());
+    init_logging(test.log, AA_LOG_ERROR, 0);
+    init_block_cache(0);
+    if (init_io_engine("pread")!=0) {
+        fprintf(stderr, "Error %d (%s) , Unknown I/O engine pread\n", EINVAL, strerror(EINVAL));
+        exit(1);
+    }
+    set_read_policy(AA_READ_ALL);
+
+    for(arg=1; arg<argc || (argc==1 && arg==1); arg++) {
+        ran = 0;
+        for(idx=0; idx<CHECK_COUNT; idx++) {
+            if ((argc==1) || !strcmp(argv[arg], checks[idx].name)) {
+                checks[idx].run();
+                ran = 1;
+            }
+        }
+        if (!ran) {
+            fprintf(stderr, "Error %d (%s) , Unknown check %s\n", EINVAL, strerror(EINVAL), argv[arg]);
+            exit(1);
+        }
+    }
+    unlink(test.log);
+    return 0;
+}
@@ -4,9 +4,16 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include "sha1.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AA_HASH_X86 1
+#endif
+
 #define SHA_ROT(x,l,r) ((x) << (l) | (x) >> (r))
 #define rol(x,k) SHA_ROT(x,k,32-(k))
 #define ror(x,k) SHA_ROT(x,32-(k),k)
@@ -105,6 +112,431 @@ static void SHA1Transform(unsigned int state[5], const unsigned char buffer[64])
 }
 
 
+/*
+ * Everything below the portable transform picks a faster kernel at run time.
+ * SHA-NI runs the rounds in hardware one chunk at a time. The AVX2 kernel
+ * runs the portable rounds on eight independent messages at once, one per
+ * 32 bit lane, which pays when many blocks are hashed together.
+ */
+static void portable_transform(unsigned int state[5], const unsigned char *data, size_t chunks) {
+    while (chunks-->0) {
+        SHA1Transform(state, data);
+        data += 64;
+    }
+}
+
+#ifdef AA_HASH_X86
+
+__attribute__((target("sha,sse4.1")))
+static void shani_transform(unsigned int state[5], const unsigned char *data, size_t chunks) {
+    __m128i abcd;
+    __m128i abcd_save;
+    __m128i e0;
+    __m128i e0_save;
+    __m128i e1;
+    __m128i msg0;
+    __m128i msg1;
+    __m128i msg2;
+    __m128i msg3;
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    while (chunks-->0) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        /* Rounds 0-3 */
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), mask);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        /* Rounds 4-7 */
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        /* Rounds 8-11 */
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        /* Rounds 12-15 */
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        /* Rounds 16-19 */
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        /* Rounds 20-23 */
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        /* Rounds 24-27 */
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        /* Rounds 28-31 */
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        /* Rounds 32-35 */
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        /* Rounds 36-39 */
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        /* Rounds 40-43 */
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        /* Rounds 44-47 */
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        /* Rounds 48-51 */
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        /* Rounds 52-55 */
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        /* Rounds 56-59 */
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        /* Rounds 60-63 */
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        /* Rounds 64-67 */
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        /* Rounds 68-71 */
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        /* Rounds 72-75 */
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        /* Rounds 76-79 */
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (unsigned int)_mm_extract_epi32(e0, 3);
+}
+
+#define ROL8(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+#define ROUND8(f, k) \
+    tmp = _mm256_add_epi32(_mm256_add_epi32(ROL8(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15])); \
+    e = d; d = c; c = ROL8(b, 30); b = a; a = tmp;
+
+#define EXPAND8(t) \
+    if ((t)>=16) { \
+        w[(t) & 15] = _mm256_xor_si256(_mm256_xor_si256(w[((t) - 3) & 15], w[((t) - 8) & 15]), \
+                                       _mm256_xor_si256(w[((t) - 14) & 15], w[(t) & 15])); \
+        w[(t) & 15] = ROL8(w[(t) & 15], 1); \
+    }
+
+/*
+ * Load words base to base+7 of a chunk from each of the eight messages,
+ * transposed so that w[i] holds word base+i of every message.
+ */
+__attribute__((target("avx2")))
+static void load_words8(__m256i w[8], const unsigned char *const data[AA_HASH_LANES], size_t ofs) {
+    __m256i r[8];
+    __m256i t[8];
+    __m256i u[8];
+    int idx;
+    const __m256i swap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                         12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    for(idx=0; idx<8; idx++) {
+        r[idx] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(data[idx] + ofs)), swap);
+    }
+    for(idx=0; idx<8; idx+=2) {
+        t[idx] = _mm256_unpacklo_epi32(r[idx], r[idx + 1]);
+        t[idx + 1] = _mm256_unpackhi_epi32(r[idx], r[idx + 1]);
+    }
+    for(idx=0; idx<8; idx+=4) {
+        u[idx] = _mm256_unpacklo_epi64(t[idx], t[idx + 2]);
+        u[idx + 1] = _mm256_unpackhi_epi64(t[idx], t[idx + 2]);
+        u[idx + 2] = _mm256_unpacklo_epi64(t[idx + 1], t[idx + 3]);
+        u[idx + 3] = _mm256_unpackhi_epi64(t[idx + 1], t[idx + 3]);
+    }
+    for(idx=0; idx<4; idx++) {
+        w[idx] = _mm256_permute2x128_si256(u[idx], u[idx + 4], 0x20);
+        w[idx + 4] = _mm256_permute2x128_si256(u[idx], u[idx + 4], 0x31);
+    }
+}
+
+/*
+ * Hash chunks 64 byte chunks from each of eight messages. state[i] holds
+ * word i of the state of every message.
+ */
+__attribute__((target("avx2")))
+static void avx2_transform8(__m256i state[5], const unsigned char *const data[AA_HASH_LANES], size_t chunks) {
+    __m256i w[16];
+    __m256i a, b, c, d, e, f, tmp;
+    const __m256i k0 = _mm256_set1_epi32(0x5A827999);
+    const __m256i k1 = _mm256_set1_epi32(0x6ED9EBA1);
+    const __m256i k2 = _mm256_set1_epi32((int)0x8F1BBCDC);
+    const __m256i k3 = _mm256_set1_epi32((int)0xCA62C1D6);
+    size_t chunk;
+    int t;
+
+    for(chunk=0; chunk<chunks; chunk++) {
+        load_words8(&w[0], data, chunk * 64);
+        load_words8(&w[8], data, chunk * 64 + 32);
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        for(t=0; t<20; t++) {
+            EXPAND8(t);
+            f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+            ROUND8(f, k0);
+        }
+        for(; t<40; t++) {
+            EXPAND8(t);
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            ROUND8(f, k1);
+        }
+        for(; t<60; t++) {
+            EXPAND8(t);
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            ROUND8(f, k2);
+        }
+        for(; t<80; t++) {
+            EXPAND8(t);
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            ROUND8(f, k3);
+        }
+        state[0] = _mm256_add_epi32(state[0], a);
+        state[1] = _mm256_add_epi32(state[1], b);
+        state[2] = _mm256_add_epi32(state[2], c);
+        state[3] = _mm256_add_epi32(state[3], d);
+        state[4] = _mm256_add_epi32(state[4], e);
+    }
+}
+
+/*
+ * Hash eight messages of count bytes each. The whole chunks are read in
+ * place and the padded tail of each message is built on the stack.
+ */
+__attribute__((target("avx2")))
+static void avx2_hash8(const unsigned char *const data[AA_HASH_LANES], size_t count, unsigned char *const md_buf[AA_HASH_LANES]) {
+    __m256i state[5];
+    uint32_t word[5][AA_HASH_LANES];
+    unsigned char pad[AA_HASH_LANES][128];
+    const unsigned char *tail[AA_HASH_LANES];
+    uint64_t bits;
+    size_t whole;
+    size_t rest;
+    size_t pad_len;
+    int lane;
+    int idx;
+
+    state[0] = _mm256_set1_epi32(0x67452301);
+    state[1] = _mm256_set1_epi32((int)0xEFCDAB89);
+    state[2] = _mm256_set1_epi32((int)0x98BADCFE);
+    state[3] = _mm256_set1_epi32(0x10325476);
+    state[4] = _mm256_set1_epi32((int)0xC3D2E1F0);
+
+    whole = count / 64;
+    rest = count % 64;
+    avx2_transform8(state, data, whole);
+
+    pad_len = (rest + 9 <= 64) ? 64 : 128;
+    bits = (uint64_t)count << 3;
+    for(lane=0; lane<AA_HASH_LANES; lane++) {
+        memset(pad[lane], 0, pad_len);
+        memcpy(pad[lane], data[lane] + whole * 64, rest);
+        pad[lane][rest] = 0x80;
+        for(idx=0; idx<8; idx++) {
+            pad[lane][pad_len - 1 - idx] = (unsigned char)(bits >> (idx * 8));
+        }
+        tail[lane] = pad[lane];
+    }
+    avx2_transform8(state, tail, pad_len / 64);
+
+    for(idx=0; idx<5; idx++) {
+        _mm256_storeu_si256((__m256i *)word[idx], state[idx]);
+    }
+    for(lane=0; lane<AA_HASH_LANES; lane++) {
+        if (md_buf[lane]==NULL) {
+            continue;
+        }
+        for(idx=0; idx<20; idx++) {
+            md_buf[lane][idx] = (unsigned char)(word[idx >> 2][lane] >> ((3 - (idx & 3)) * 8));
+        }
+    }
+}
+
+#endif
+
+static int engine = -1;
+static void (*transform)(unsigned int state[5], const unsigned char *data, size_t chunks);
+
+static int engine_supported(int choice) {
+    int supported;
+
+    supported = AA_HASH_PORTABLE;
+#ifdef AA_HASH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        supported |= AA_HASH_SHANI;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        supported |= AA_HASH_AVX2;
+    }
+#endif
+    return (choice & ~supported)==0;
+}
+
+/*
+ * Use the given kernels from now on, AA_HASH_PORTABLE or any of the others
+ * or'ed together. Returns ENOTSUP, leaving the current choice in place,
+ * when this processor or build cannot run one of them.
+ */
+int hash_select(int choice) {
+    if (!engine_supported(choice)) {
+        return ENOTSUP;
+    }
+#ifdef AA_HASH_X86
+    __atomic_store_n(&transform, ((choice & AA_HASH_SHANI) ? shani_transform : portable_transform), __ATOMIC_RELEASE);
+#else
+    __atomic_store_n(&transform, portable_transform, __ATOMIC_RELEASE);
+#endif
+    __atomic_store_n(&engine, choice, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * The kernels in use, choosing every one the processor supports on first
+ * use. SHA-NI hashes every message when present, the AVX2 lanes hash
+ * groups of messages only without it.
+ */
+int hash_engine() {
+    int current;
+
+    current = __atomic_load_n(&engine, __ATOMIC_ACQUIRE);
+    if (current<0) {
+        if (hash_select(AA_HASH_SHANI | AA_HASH_AVX2)!=0 && hash_select(AA_HASH_SHANI)!=0 && hash_select(AA_HASH_AVX2)!=0) {
+            hash_select(AA_HASH_PORTABLE);
+        }
+        current = __atomic_load_n(&engine, __ATOMIC_ACQUIRE);
+    }
+    return current;
+}
+
+const char *hash_engine_name(int choice) {
+    switch (choice) {
+        case AA_HASH_SHANI:
+            return "sha-ni";
+        case AA_HASH_AVX2:
+            return "avx2";
+        case AA_HASH_SHANI | AA_HASH_AVX2:
+            return "sha-ni+avx2";
+    }
+    return "portable";
+}
+
+static void hash_chunks(unsigned int state[5], const unsigned char *data, size_t chunks) {
+    void (*current)(unsigned int state[5], const unsigned char *data, size_t chunks);
+
+    current = __atomic_load_n(&transform, __ATOMIC_ACQUIRE);
+    if (current==NULL) {
+        hash_engine();
+        current = __atomic_load_n(&transform, __ATOMIC_ACQUIRE);
+    }
+    current(state, data, chunks);
+}
+
 /* Initialize a SHA1 context */
 void hash_init(SHA1Context *p){
   /* SHA1 initialization constants */
@@ -131,9 +563,10 @@ void hash_step(
   j = (j >> 3) & 63;
   if( (j + len) > 63 ){
     (void)memcpy(&p->buffer[j], data, (i = 64-j));
-    SHA1Transform(p->state, p->buffer);
-    for(; i + 63 < len; i += 64){
-      SHA1Transform(p->state, &data[i]);
+    hash_chunks(p->state, p->buffer, 1);
+    if( i + 63 < len ){
+      hash_chunks(p->state, &data[i], (len - i) / 64);
+      i += ((len - i) / 64) * 64;
     }
     j = 0;
   }else{
@@ -171,3 +604,43 @@ void SHA1(const unsigned char *data, size_t count, unsigned char* md_buf){
   hash_step(&cx, data, count);
   hash_finish(&cx, md_buf);
 }
+
+/*
+ * Hash n messages that are all count bytes long, putting the digest of
+ * data[i] in md_buf[i]. SHA-NI hashes each message faster than the AVX2
+ * lanes hash eight, so the messages are hashed one after another whenever
+ * SHA-NI is in use. With only the AVX2 kernel they are hashed eight at a
+ * time while enough of them are left.
+ */
+void SHA1_many(const unsigned char *const data[], size_t count, unsigned char *const md_buf[], int n){
+  int done;
+#ifdef AA_HASH_X86
+  const unsigned char *lane_data[AA_HASH_LANES];
+  unsigned char *lane_md[AA_HASH_LANES];
+  int lane;
+#endif
+
+  done = 0;
+#ifdef AA_HASH_X86
+  if( (hash_engine() & (AA_HASH_SHANI | AA_HASH_AVX2))==AA_HASH_AVX2 ){
+    for(; n - done >= AA_HASH_MIN_LANES; done += AA_HASH_LANES){
+      for(lane=0; lane<AA_HASH_LANES; lane++){
+        if( done + lane < n ){
+          lane_data[lane] = data[done + lane];
+          lane_md[lane] = md_buf[done + lane];
+        }else{
+          lane_data[lane] = data[done];
+          lane_md[lane] = NULL;
+        }
+      }
+      avx2_hash8(lane_data, count, lane_md);
+    }
+    if( done > n ){
+      done = n;
+    }
+  }
+#endif
+  for(; done<n; done++){
+    SHA1(data[done], count, md_buf[done]);
+  }
+}
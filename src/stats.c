@@ -0,0 +1,270 @@
+/*
+  Statistics
+
+  Block counters and per operation latency histograms. Threads are spread
+  over a set of cache line aligned shards and add to their shard with
+  relaxed atomics, so updates from different threads rarely touch the same
+  line. The shards are only summed when the statistics are read.
+
+  The statistics are read through a small read only tree under the mount
+  point, /.archivist/stats, holding a counters file and a latency file.
+  The files are rendered afresh whenever they are looked at.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "stats.h"
+
+struct stats_shard {
+    uint64_t counter[AA_STAT_COUNTERS];
+    uint64_t op_count[AA_OPS];
+    uint64_t op_total_ns[AA_OPS];
+    uint64_t latency[AA_OPS][AA_STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct stats_shard shards[AA_STATS_SHARDS];
+static int next_shard;
+static __thread int thread_shard = -1;
+
+static const char *counter_names[AA_STAT_NAMED] = {
+    "blocks_read",
+    "blocks_written",
+    "blocks_verified",
+    "hash_failures",
+    "repairs_corrupt",
+    "repairs_mismatched",
+    "repairs_missing",
+    "repairs_fec"
+};
+
+static const char *op_names[AA_OPS] = {
+    "lookup", "forget", "getattr", "fgetattr", "setattr", "open", "release",
+    "read", "write", "flush", "fsync", "mknod", "mkdir", "unlink", "rmdir",
+    "rename", "chmod", "chown", "utime", "truncate", "ftruncate", "opendir",
+    "readdir", "releasedir", "getxattr"
+};
+
+static struct stats_shard *my_shard() {
+    if (thread_shard<0) {
+        thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % AA_STATS_SHARDS;
+    }
+    return &shards[thread_shard];
+}
+
+void stat_add(int counter, uint64_t n) {
+    __atomic_add_fetch(&my_shard()->counter[counter], n, __ATOMIC_RELAXED);
+}
+
+uint64_t stat_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/*
+  Record an operation that started at start. Bucket n holds operations that
+  took less than 2^(n+1) microseconds.
+*/
+void stat_op(int op, uint64_t start) {
+    struct stats_shard *shard;
+    uint64_t elapsed;
+    uint64_t micros;
+    int bucket;
+
+    elapsed = stat_clock() - start;
+    micros = elapsed / 1000;
+    bucket = 0;
+    while ((micros>1) && (bucket<AA_STATS_BUCKETS-1)) {
+        micros >>= 1;
+        bucket++;
+    }
+
+    shard = my_shard();
+    __atomic_add_fetch(&shard->op_count[op], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shard->op_total_ns[op], elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shard->latency[op][bucket], 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t sum_shards(const uint64_t *first) {
+    uint64_t total;
+    size_t offset;
+    int idx;
+
+    offset = (size_t)((const char *)first - (const char *)&shards[0]);
+    total = 0;
+    for(idx=0; idx<AA_STATS_SHARDS; idx++) {
+        total += __atomic_load_n((const uint64_t *)((const char *)&shards[idx] + offset), __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/*
+  Find the child called name of node, where AA_STATS_NONE stands for the
+  root of the mount. Returns AA_STATS_NONE when it is not part of the tree.
+*/
+int stats_child(int node, const char *name) {
+    switch (node) {
+        case AA_STATS_NONE:
+            return strcmp(name, AA_STATS_TOP_NAME) ? AA_STATS_NONE : AA_STATS_TOP;
+        case AA_STATS_TOP:
+            return strcmp(name, "stats") ? AA_STATS_NONE : AA_STATS_DIR;
+        case AA_STATS_DIR:
+            if (!strcmp(name, "counters")) {
+                return AA_STATS_COUNTERS;
+            }
+            if (!strcmp(name, "latency")) {
+                return AA_STATS_LATENCY;
+            }
+            return AA_STATS_NONE;
+    }
+    return AA_STATS_NONE;
+}
+
+/*
+  The node a path within the mount refers to. Returns AA_STATS_NONE for
+  paths outside the tree and -1 for paths inside it that do not exist.
+*/
+int stats_node(const char *path) {
+    char name[NAME_MAX + 1];
+    const char *end;
+    size_t len;
+    int node;
+
+    if ((path==NULL) || (path[0]!='/') || strncmp(path + 1, AA_STATS_TOP_NAME, strlen(AA_STATS_TOP_NAME))) {
+        return AA_STATS_NONE;
+    }
+    node = AA_STATS_NONE;
+    while (*path=='/') {
+        path++;
+        if (*path==0) {
+            break;
+        }
+        end = strchr(path, '/');
+        len = (end==NULL) ? strlen(path) : (size_t)(end - path);
+        if (len>NAME_MAX) {
+            return -1;
+        }
+        memcpy(name, path, len);
+        name[len] = 0;
+        if (stats_child(node, name)==AA_STATS_NONE) {
+            return (node==AA_STATS_NONE) ? AA_STATS_NONE : -1;
+        }
+        node = stats_child(node, name);
+        path += len;
+    }
+    return node;
+}
+
+const char *stats_entry(int node, int index) {
+    static const char *top[] = { "stats", NULL };
+    static const char *dir[] = { "counters", "latency", NULL };
+
+    if (node==AA_STATS_TOP) {
+        return top[index<1 ? index : 1];
+    }
+    if (node==AA_STATS_DIR) {
+        return dir[index<2 ? index : 2];
+    }
+    return NULL;
+}
+
+void stats_attr(int node, struct stat *statbuf) {
+    char *text;
+    size_t len;
+
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_ino = (ino_t)node;
+    statbuf->st_uid = getuid();
+    statbuf->st_gid = getgid();
+    statbuf->st_mtime = time(NULL);
+    statbuf->st_atime = statbuf->st_mtime;
+    statbuf->st_ctime = statbuf->st_mtime;
+    if ((node==AA_STATS_TOP) || (node==AA_STATS_DIR)) {
+        statbuf->st_mode = S_IFDIR | 0555;
+        statbuf->st_nlink = 2;
+        return;
+    }
+    statbuf->st_mode = S_IFREG | 0444;
+    statbuf->st_nlink = 1;
+    if (stats_render(node, &text, &len)==0) {
+        statbuf->st_size = (off_t)len;
+        free(text);
+    }
+}
+
+static void render_counters(FILE *out) {
+    int idx;
+
+    for(idx=0; idx<AA_STAT_NAMED; idx++) {
+        fprintf(out, "%s %lu\n", counter_names[idx], sum_shards(&shards[0].counter[idx]));
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        fprintf(out, "bytes_read_copy%d %lu\n", idx, sum_shards(&shards[0].counter[AA_STAT_BYTES_READ(idx)]));
+    }
+    for(idx=0; idx<AA_NUM_ROOTS; idx++) {
+        fprintf(out, "bytes_written_copy%d %lu\n", idx, sum_shards(&shards[0].counter[AA_STAT_BYTES_WRITTEN(idx)]));
+    }
+}
+
+static void render_latency(FILE *out) {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t bucket[AA_STATS_BUCKETS];
+    int first;
+    int last;
+    int op;
+    int idx;
+
+    for(op=0; op<AA_OPS; op++) {
+        count = sum_shards(&shards[0].op_count[op]);
+        if (count==0) {
+            continue;
+        }
+        total_ns = sum_shards(&shards[0].op_total_ns[op]);
+        first = -1;
+        last = 0;
+        for(idx=0; idx<AA_STATS_BUCKETS; idx++) {
+            bucket[idx] = sum_shards(&shards[0].latency[op][idx]);
+            if (bucket[idx]!=0) {
+                if (first<0) {
+                    first = idx;
+                }
+                last = idx;
+            }
+        }
+        fprintf(out, "%s count=%lu mean_us=%.1f\n", op_names[op], count, (double)total_ns / count / 1000.0);
+        for(idx=(first<0 ? 0 : first); idx<=last; idx++) {
+            fprintf(out, "    <%lu us %lu\n", 2UL << idx, bucket[idx]);
+        }
+    }
+}
+
+/*
+  Render the contents of a file node into a newly allocated buffer.
+*/
+int stats_render(int node, char **text, size_t *len) {
+    FILE *out;
+
+    *text = NULL;
+    *len = 0;
+    out = open_memstream(text, len);
+    if (out==NULL) {
+        return ENOMEM;
+    }
+    if (node==AA_STATS_COUNTERS) {
+        render_counters(out);
+    } else if (node==AA_STATS_LATENCY) {
+        render_latency(out);
+    }
+    if (fclose(out)!=0) {
+        free(*text);
+        *text = NULL;
+        return ENOMEM;
+    }
+    return 0;
+}
@@ -7,21 +7,107 @@
 #include <stdio.h>
 #include "blocks.h"
 #include <arpa/inet.h>
-#include "sha1.h"
+#include "hash.h"
+#include "fec.h"
+#include "audit.h"
+#include "pipeline.h"
+#include <sys/stat.h>
 
 #define NTOH ntohs
 
+/*
+  Check the hashes of the count blocks read so far, all hashed together,
+  where the first of them is block number first of the file. A block that
+  fails is reported and passes when its error correction puts it right.
+*/
+static void verify_pending(struct data_block *block, int count, size_t first, const char *fpath) {
+    const struct data_block *pending[AA_HASH_LANES] = { NULL };
+    int valid[AA_HASH_LANES];
+    int idx;
+
+    for(idx=0; idx<count; idx++) {
+        pending[idx] = block_at(block, idx);
+    }
+    blocks_hash_valid(pending, count, valid);
+    for(idx=0; idx<count; idx++) {
+        if (!valid[idx] && (fec_correct_block(block_at(block, idx))>0)) {
+            fprintf(stderr, "Correctable block hash when read block (%zu) from %s\n", first + idx, fpath);
+            valid[idx] = 1;
+        }
+        if (!valid[idx]) {
+            fprintf(stderr, "Error %d (%s) , Invalid block hash when read block (%zu) from %s\n", EIO, strerror(EIO), first + idx, fpath);
+            exit(1);
+        }
+    }
+}
+
+/*
+  Verify a whole mirrored archive given its storage locations, writing
+  the report to stdout or the file named by --report.
+*/
+static int verify_locations(int argc, char* argv[], int threads, const char *fpath_report) {
+    FILE *report;
+    int rc;
+
+    if ((argc - 1)>AA_MAX_COPIES) {
+        fprintf(stderr, "Error %d (%s) , Too many storage locations\n", EINVAL, strerror(EINVAL));
+        exit(1);
+    }
+    if (fpath_report==NULL) {
+        report = stdout;
+    } else {
+        report = fopen(fpath_report, "w");
+    }
+    if (report == NULL) {
+        fprintf(stderr, "Error %d (%s) , Failed to open %s\n", errno, strerror(errno), fpath_report);
+        exit(1);
+    }
+    rc = verify_archive(argv + 1, argc - 1, threads, report);
+    if ((report!=stdout) && (fclose(report)!=0)) {
+        fprintf(stderr, "Error %d (%s) , Failed to write to %s\n", errno, strerror(errno), fpath_report);
+        exit(1);
+    }
+    return (rc==0) ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
     int fd_in;
     ssize_t len;
     char fpath_in[PATH_MAX];
-    struct data_block block;
-    SHA1Context cx;
-    unsigned char sha1[AA_HASH_SIZE];
+    struct data_block *block;
+    int pending;
     size_t count_blocks;
     size_t file_bytes;
     size_t data_bytes;
+    struct stat statbuf;
+    const char *fpath_report;
+    int threads;
 
+    /* Reading is what takes the time, so twice as many workers as processors. */
+    threads = 2 * pipe_threads(NULL);
+    if (threads>AA_PIPE_MAX_THREADS) {
+        threads = AA_PIPE_MAX_THREADS;
+    }
+    fpath_report = NULL;
+    while ((argc > 2) && (!strncmp(argv[1], "--", 2))) {
+        if (!strncmp(argv[1], "--threads=", 10)) {
+            threads = pipe_threads(argv[1] + 10);
+            if (threads<0) {
+                fprintf(stderr, "Error %d (%s) , Invalid thread count %s\n", EINVAL, strerror(EINVAL), argv[1] + 10);
+                exit(1);
+            }
+        } else if (!strncmp(argv[1], "--report=", 9)) {
+            fpath_report = argv[1] + 9;
+        } else {
+            fprintf(stderr, "Error %d (%s) , Unknown option %s\n", EINVAL, strerror(EINVAL), argv[1]);
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
+    if ((argc >= 2) && (stat(argv[1], &statbuf)==0) && S_ISDIR(statbuf.st_mode)) {
+        return verify_locations(argc, argv, threads, fpath_report);
+    }
     if (argc != 2) {
         fprintf(stderr, "Error %d (%s) , Invalid arguments\n", EINVAL, strerror(EINVAL));
         exit(1);
@@ -38,35 +124,44 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    /* Room for a group of the largest blocks, they are packed by the actual size. */
+    block = malloc(AA_HASH_LANES * sizeof(struct data_block));
+    if (block == NULL) {
+        fprintf(stderr, "Error %d (%s) , Memory allocation failed\n", ENOMEM, strerror(ENOMEM));
+        exit(1);
+    }
+
     count_blocks = 0;
     file_bytes = 0;
     data_bytes = 0;
-    memset(&block, 0, AA_BLOCK_SIZE);
-    len = read(fd_in, &block, AA_BLOCK_SIZE);
+    pending = 0;
+    len = read_encoded_block(fd_in, block);
     while (len>0) {
-        if (len != (NTOH(block.header.length) + AA_HEAD_SIZE)) {
-            fprintf(stderr, "Error %d (%s) , Invalid block length (%zd) when read block (%zu) from %s\n", EIO, strerror(EIO), len, count_blocks, fpath_in);
-            exit(1);
+        if ((len != block_stored_size(block_at(block, pending))) && (fec_correct_block(block_at(block, pending))>0)) {
+            fprintf(stderr, "Correctable block length when read block (%zu) from %s\n", count_blocks, fpath_in);
         }
-        hash_init(&cx);
-        hash_step(&cx, block.header.seed, AA_SEED_SIZE);
-        hash_step(&cx, block.data, AA_DATA_SIZE);
-        hash_finish(&cx, sha1);
-        if (memcmp(sha1, block.header.sha1, AA_HASH_SIZE)!=0) {
-            fprintf(stderr, "Error %d (%s) , Invalid block hash when read block (%zu) from %s\n", EIO, strerror(EIO), count_blocks, fpath_in);
+        if (len != block_stored_size(block_at(block, pending))) {
+            verify_pending(block, pending, count_blocks - pending, fpath_in);
+            fprintf(stderr, "Error %d (%s) , Invalid block length (%zd) when read block (%zu) from %s\n", EIO, strerror(EIO), len, count_blocks, fpath_in);
             exit(1);
         }
         count_blocks++;
         file_bytes += len;
-        data_bytes += NTOH(block.header.length);
-        memset(&block, 0, AA_BLOCK_SIZE);
-        len = read(fd_in, &block, AA_BLOCK_SIZE);
+        data_bytes += NTOH(block_at(block, pending)->header.length);
+        pending++;
+        if (pending==AA_HASH_LANES) {
+            verify_pending(block, pending, count_blocks - pending, fpath_in);
+            pending = 0;
+        }
+        len = read_encoded_block(fd_in, block_at(block, pending));
     }
+    verify_pending(block, pending, count_blocks - pending, fpath_in);
     if (len<0) {
         fprintf(stderr, "Error %d (%s) , Failed to read from %s\n", errno, strerror(errno), fpath_in);
         exit(1);
     }
 
+    free(block);
     close(fd_in);
     fprintf(stderr, "Verification of %ld blocks containing %ld data bytes in a file of %ld bytes successful for %s\n", count_blocks, data_bytes, file_bytes, fpath_in);
     return 0;
@@ -0,0 +1,536 @@
+/*
+  Per handle write back buffer
+
+  Writes are staged as dirty blocks and merged with later writes to the same
+  block. A block that ends up completely overwritten is never read back from
+  the copies. Partially written blocks are merged with their current contents
+  when flushed. Buffers are flushed on release, flush and fsync, before a read
+  on the same handle and whenever they grow past the configured limit.
+  Callers hold the file entry lock around every function here.
+
+  A buffer that fails to flush keeps its blocks, so the error reaches the
+  caller and a later flush can try again. Each non-empty buffer is also
+  listed by device and inode with the end of the data written to it, so
+  getattr on the path or on another handle sees the size the file will
+  have once it is flushed. Reads and opens flush every buffer of the file
+  first, so what they see matches that size, and a truncate drops what
+  every buffer holds past the new end. flush_pending and clip_pending
+  take the file entry locks themselves, so their callers hold none.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "writeback.h"
+#include "logs.h"
+#include "seed.h"
+
+#define AA_PENDING_BUCKETS 256
+
+static size_t write_buffer_limit = AA_WRITE_BUFFER_DEFAULT_SIZE;
+
+static struct pending_bucket {
+    pthread_mutex_t lock;
+    struct file_entry *head;
+} pending[AA_PENDING_BUCKETS] = { [0 ... AA_PENDING_BUCKETS-1] = { PTHREAD_MUTEX_INITIALIZER, NULL } };
+
+void init_write_buffer(size_t limit) {
+    write_buffer_limit = limit;
+}
+
+static struct pending_bucket *pending_bucket(dev_t dev, ino_t ino) {
+    return &pending[((uint64_t)ino ^ ((uint64_t)dev * 31)) % AA_PENDING_BUCKETS];
+}
+
+/*
+  Record that the buffer holds data written up to end.
+*/
+static void note_pending(struct file_entry *file_entry, off_t end) {
+    struct pending_bucket *bucket;
+
+    bucket = pending_bucket(file_entry->dev, file_entry->ino);
+    pthread_mutex_lock(&bucket->lock);
+    if (!file_entry->dirty.pending) {
+        file_entry->dirty.next_pending = bucket->head;
+        bucket->head = file_entry;
+        file_entry->dirty.pending = 1;
+    }
+    if (end>file_entry->dirty.end) {
+        file_entry->dirty.end = end;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+static void clear_pending(struct file_entry *file_entry) {
+    struct pending_bucket *bucket;
+    struct file_entry **link;
+
+    if (!file_entry->dirty.pending) {
+        return;
+    }
+    bucket = pending_bucket(file_entry->dev, file_entry->ino);
+    pthread_mutex_lock(&bucket->lock);
+    for(link=&bucket->head; *link!=NULL; link=&(*link)->dirty.next_pending) {
+        if (*link==file_entry) {
+            *link = file_entry->dirty.next_pending;
+            break;
+        }
+    }
+    file_entry->dirty.next_pending = NULL;
+    file_entry->dirty.pending = 0;
+    file_entry->dirty.end = 0;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+  Lower the end recorded for a buffer that has been clipped to size.
+*/
+static void lower_pending(struct file_entry *file_entry, off_t size) {
+    struct pending_bucket *bucket;
+
+    bucket = pending_bucket(file_entry->dev, file_entry->ino);
+    pthread_mutex_lock(&bucket->lock);
+    if (file_entry->dirty.end>size) {
+        file_entry->dirty.end = size;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+  The entries with writes buffered for a file, in an array the caller
+  frees. Returns how many there are, or -1 when out of memory.
+*/
+static int pending_entries(dev_t dev, ino_t ino, struct file_entry ***found) {
+    struct pending_bucket *bucket;
+    struct file_entry *file_entry;
+    int count;
+
+    bucket = pending_bucket(dev, ino);
+    pthread_mutex_lock(&bucket->lock);
+    count = 0;
+    for(file_entry=bucket->head; file_entry!=NULL; file_entry=file_entry->dirty.next_pending) {
+        count += ((file_entry->dev==dev) && (file_entry->ino==ino));
+    }
+    *found = malloc((size_t)(count + 1) * sizeof(struct file_entry *));
+    if (*found==NULL) {
+        pthread_mutex_unlock(&bucket->lock);
+        return -1;
+    }
+    count = 0;
+    for(file_entry=bucket->head; file_entry!=NULL; file_entry=file_entry->dirty.next_pending) {
+        if ((file_entry->dev==dev) && (file_entry->ino==ino)) {
+            (*found)[count++] = file_entry;
+        }
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return count;
+}
+
+/*
+  True while the entry, locked by the caller, still buffers writes for the
+  file. It may have been flushed, released or reused since it was found.
+*/
+static int still_pending(const struct file_entry *file_entry, dev_t dev, ino_t ino) {
+    return file_entry->dirty.pending && (file_entry->dev==dev) && (file_entry->ino==ino);
+}
+
+static int compare_dirty_blocks(const void *a, const void *b) {
+    const struct dirty_block *block_a = a;
+    const struct dirty_block *block_b = b;
+    if (block_a->file_block_ofs < block_b->file_block_ofs) {
+        return -1;
+    }
+    return block_a->file_block_ofs > block_b->file_block_ofs;
+}
+
+static int complete_block(const struct dirty_block *dirty) {
+    return dirty->loaded || ((dirty->lo==0) && (dirty->hi==AA_DATA_SIZE));
+}
+
+static struct dirty_block *find_dirty_block(struct write_buffer *buffer, off_t file_block_ofs) {
+    int pos;
+    for(pos=buffer->count-1; pos>=0; pos--) {
+        if (buffer->block[pos].file_block_ofs==file_block_ofs) {
+            return &buffer->block[pos];
+        }
+    }
+    return NULL;
+}
+
+static struct data_block *dirty_data(const struct write_buffer *buffer, const struct dirty_block *dirty) {
+    return block_at(buffer->data, dirty->slot);
+}
+
+/*
+  Forget the dirty block at pos, moving the block in the last slot of the
+  data pool into the one it frees.
+*/
+static void remove_dirty_block(struct write_buffer *buffer, int pos) {
+    int slot;
+    int last;
+    int idx;
+
+    slot = buffer->block[pos].slot;
+    last = buffer->count - 1;
+    buffer->block[pos] = buffer->block[last];
+    buffer->count = last;
+    if (slot==last) {
+        return;
+    }
+    for(idx=0; idx<buffer->count; idx++) {
+        if (buffer->block[idx].slot==last) {
+            memcpy(block_at(buffer->data, slot), block_at(buffer->data, last), AA_BLOCK_SIZE);
+            buffer->block[idx].slot = slot;
+            break;
+        }
+    }
+}
+
+/*
+  Dirty blocks are sorted when flushed, so each keeps the slot of the data
+  pool its block is held in. Slots 0 to count-1 are always the ones in use.
+*/
+static struct dirty_block *add_dirty_block(struct write_buffer *buffer, off_t file_block_ofs) {
+    struct dirty_block *dirty;
+    struct data_block *data;
+    int capacity;
+
+    if (buffer->count==buffer->capacity) {
+        capacity = (buffer->capacity==0) ? 16 : buffer->capacity * 2;
+        dirty = realloc(buffer->block, (size_t)capacity * sizeof(struct dirty_block));
+        if (dirty==NULL) {
+            return NULL;
+        }
+        buffer->block = dirty;
+        data = realloc(buffer->data, (size_t)capacity * AA_BLOCK_SIZE);
+        if (data==NULL) {
+            return NULL;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    dirty = &buffer->block[buffer->count];
+    memset(dirty, 0, sizeof(struct dirty_block));
+    dirty->file_block_ofs = file_block_ofs;
+    dirty->slot = buffer->count++;
+    memset(dirty_data(buffer, dirty), 0, AA_BLOCK_SIZE);
+    return dirty;
+}
+
+/*
+  Merge a partially written block with its current contents from the copies.
+*/
+static int load_dirty_block(struct file_entry *file_entry, struct dirty_block *dirty) {
+    struct block_set blocks;
+    struct data_block *block;
+    int err_no;
+    int length;
+
+    err_no = read_block(file_entry, dirty->file_block_ofs, &blocks);
+    if (err_no!=0) {
+        return err_no;
+    }
+    block = dirty_data(&file_entry->dirty, dirty);
+    length = NTOH(blocks.copy[0].block.header.length);
+    memcpy(&blocks.copy[0].block.data[dirty->lo], &block->data[dirty->lo], dirty->hi - dirty->lo);
+    memcpy(block, &blocks.copy[0].block, AA_BLOCK_SIZE);
+    if (dirty->hi>length) {
+        block->header.length = HTON(dirty->hi);
+    }
+    dirty->loaded = 1;
+    return 0;
+}
+
+/*
+  Give a completely overwritten block its header without reading it.
+*/
+static int fill_dirty_block(struct write_buffer *buffer, struct dirty_block *dirty) {
+    struct data_block *block;
+
+    block = dirty_data(buffer, dirty);
+    if (initialise_seed(block->header.seed)!=0) {
+        return EAGAIN;
+    }
+    block->header.length = HTON(AA_DATA_SIZE);
+    dirty->loaded = 1;
+    return 0;
+}
+
+int flush_writes(struct file_entry *file_entry) {
+    struct write_buffer *buffer;
+    struct data_block *run[AA_MAX_WRITE_BLOCKS];
+    struct dirty_block *dirty;
+    off_t run_ofs;
+    int count;
+    int pos;
+    int err_no;
+
+    buffer = &file_entry->dirty;
+    if (buffer->count==0) {
+        return 0;
+    }
+
+    qsort(buffer->block, buffer->count, sizeof(struct dirty_block), compare_dirty_blocks);
+
+    err_no = 0;
+    count = 0;
+    run_ofs = 0;
+    for(pos=0; pos<buffer->count && err_no==0; pos++) {
+        dirty = &buffer->block[pos];
+        if (dirty->loaded) {
+            err_no = 0;
+        } else if (complete_block(dirty)) {
+            err_no = fill_dirty_block(buffer, dirty);
+        } else {
+            err_no = load_dirty_block(file_entry, dirty);
+        }
+        if (err_no!=0) {
+            break;
+        }
+        if ((count>0) && ((run_ofs + (off_t)count * AA_BLOCK_SIZE != dirty->file_block_ofs) || (count==AA_MAX_WRITE_BLOCKS))) {
+            err_no = write_blocks(file_entry, run, count, run_ofs);
+            count = 0;
+        }
+        if (count==0) {
+            run_ofs = dirty->file_block_ofs;
+        }
+        run[count++] = dirty_data(buffer, dirty);
+        if (NTOH(run[count-1]->header.length)<AA_DATA_SIZE) {
+            err_no = write_blocks(file_entry, run, count, run_ofs);
+            count = 0;
+        }
+    }
+    if ((err_no==0) && (count>0)) {
+        err_no = write_blocks(file_entry, run, count, run_ofs);
+    }
+
+    if (err_no!=0) {
+        log_error("flush", err_no, "Kept %d blocks buffered", buffer->count);
+        return err_no;
+    }
+    log_info("flush", "Flushed %d blocks", buffer->count);
+    buffer->count = 0;
+    clear_pending(file_entry);
+    return 0;
+}
+
+int buffer_write(struct file_entry *file_entry, const char *buf, size_t size, off_t offset) {
+    struct write_buffer *buffer;
+    struct dirty_block *dirty;
+    struct data_block *block;
+    off_t file_block_ofs;
+    int block_ofs;
+    int write_bytes;
+    int length;
+    int err_no;
+
+    buffer = &file_entry->dirty;
+
+    while (size > 0) {
+        file_block_ofs = (offset / AA_DATA_SIZE) * AA_BLOCK_SIZE;
+        block_ofs = (int)(offset % AA_DATA_SIZE);
+        write_bytes = (AA_DATA_SIZE - block_ofs <= size) ? AA_DATA_SIZE - block_ofs : (int)size;
+
+        dirty = find_dirty_block(buffer, file_block_ofs);
+        if (dirty==NULL) {
+            dirty = add_dirty_block(buffer, file_block_ofs);
+            if (dirty==NULL) {
+                return ENOMEM;
+            }
+            dirty->lo = block_ofs;
+            dirty->hi = block_ofs;
+        } else if (!dirty->loaded && ((block_ofs > dirty->hi) || (block_ofs + write_bytes < dirty->lo))) {
+            err_no = load_dirty_block(file_entry, dirty);
+            if (err_no!=0) {
+                return err_no;
+            }
+        }
+
+        block = dirty_data(buffer, dirty);
+        memcpy(&block->data[block_ofs], buf, write_bytes);
+        if (dirty->loaded) {
+            length = NTOH(block->header.length);
+            if (block_ofs + write_bytes > length) {
+                block->header.length = HTON(block_ofs + write_bytes);
+            }
+        } else {
+            if (block_ofs < dirty->lo) {
+                dirty->lo = block_ofs;
+            }
+            if (block_ofs + write_bytes > dirty->hi) {
+                dirty->hi = block_ofs + write_bytes;
+            }
+        }
+
+        size -= write_bytes;
+        offset += write_bytes;
+        buf += write_bytes;
+    }
+    if (buffer->count>0) {
+        note_pending(file_entry, offset);
+    }
+
+    if ((size_t)buffer->count * AA_BLOCK_SIZE >= write_buffer_limit) {
+        return flush_writes(file_entry);
+    }
+    return 0;
+}
+
+/*
+  Logical end of file implied by the data buffered on every open handle of
+  a file, or zero if none.
+*/
+off_t pending_size(dev_t dev, ino_t ino) {
+    struct pending_bucket *bucket;
+    struct file_entry *file_entry;
+    off_t size;
+
+    size = 0;
+    bucket = pending_bucket(dev, ino);
+    pthread_mutex_lock(&bucket->lock);
+    for(file_entry=bucket->head; file_entry!=NULL; file_entry=file_entry->dirty.next_pending) {
+        if ((file_entry->dev==dev) && (file_entry->ino==ino) && (file_entry->dirty.end>size)) {
+            size = file_entry->dirty.end;
+        }
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return size;
+}
+
+/*
+  Flush the writes buffered on every open handle of a file. Returns the
+  first error, and sets *flushed when anything was written.
+*/
+int flush_pending(dev_t dev, ino_t ino, int *flushed) {
+    struct file_entry **found;
+    int count;
+    int err_no;
+    int rc;
+    int idx;
+
+    *flushed = 0;
+    count = pending_entries(dev, ino, &found);
+    if (count<0) {
+        return ENOMEM;
+    }
+    err_no = 0;
+    for(idx=0; idx<count; idx++) {
+        pthread_mutex_lock(&found[idx]->lock);
+        if (still_pending(found[idx], dev, ino)) {
+            rc = flush_writes(found[idx]);
+            *flushed = 1;
+            if (err_no==0) {
+                err_no = rc;
+            }
+        }
+        pthread_mutex_unlock(&found[idx]->lock);
+    }
+    free(found);
+    return err_no;
+}
+
+/*
+  Drop whatever one buffer holds at or past size. The caller holds the
+  file entry lock.
+*/
+static void clip_writes(struct file_entry *file_entry, off_t size) {
+    struct write_buffer *buffer;
+    struct dirty_block *dirty;
+    struct data_block *block;
+    off_t last_ofs;
+    int keep;
+    int pos;
+
+    buffer = &file_entry->dirty;
+    last_ofs = (size / AA_DATA_SIZE) * AA_BLOCK_SIZE;
+    keep = (int)(size % AA_DATA_SIZE);
+    pos = 0;
+    while (pos<buffer->count) {
+        dirty = &buffer->block[pos];
+        if ((dirty->file_block_ofs>last_ofs) || ((dirty->file_block_ofs==last_ofs) && (keep==0))) {
+            remove_dirty_block(buffer, pos);
+            continue;
+        }
+        if (dirty->file_block_ofs==last_ofs) {
+            block = dirty_data(buffer, dirty);
+            if (dirty->loaded) {
+                if ((int)NTOH(block->header.length)>keep) {
+                    block->header.length = HTON(keep);
+                    memset(&block->data[keep], 0, AA_DATA_SIZE - keep);
+                }
+            } else {
+                if (dirty->hi>keep) {
+                    dirty->hi = keep;
+                }
+                if (dirty->lo>=dirty->hi) {
+                    remove_dirty_block(buffer, pos);
+                    continue;
+                }
+            }
+        }
+        pos++;
+    }
+    if (buffer->count==0) {
+        clear_pending(file_entry);
+    } else {
+        lower_pending(file_entry, size);
+    }
+}
+
+/*
+  Drop what every open handle of a file has buffered at or past size,
+  before the file is truncated to it, so a later flush cannot bring the
+  truncated data back.
+*/
+int clip_pending(dev_t dev, ino_t ino, off_t size) {
+    struct file_entry **found;
+    int count;
+    int idx;
+
+    count = pending_entries(dev, ino, &found);
+    if (count<0) {
+        return ENOMEM;
+    }
+    for(idx=0; idx<count; idx++) {
+        pthread_mutex_lock(&found[idx]->lock);
+        if (still_pending(found[idx], dev, ino)) {
+            clip_writes(found[idx], size);
+        }
+        pthread_mutex_unlock(&found[idx]->lock);
+    }
+    free(found);
+    return 0;
+}
+
+/*
+  Log the writes a buffer still holds, with the range of bytes they
+  cover, before they are thrown away.
+*/
+void log_lost_writes(const struct file_entry *file_entry, const char *what, int err_no) {
+    const struct dirty_block *dirty;
+    off_t from;
+    off_t start;
+    int pos;
+
+    if (file_entry->dirty.count==0) {
+        return;
+    }
+    from = file_entry->dirty.end;
+    for(pos=0; pos<file_entry->dirty.count; pos++) {
+        dirty = &file_entry->dirty.block[pos];
+        start = (dirty->file_block_ofs / AA_BLOCK_SIZE) * AA_DATA_SIZE + (dirty->loaded ? 0 : dirty->lo);
+        if (start<from) {
+            from = start;
+        }
+    }
+    log_error(what, err_no, "Lost %d buffered blocks , bytes %lld to %lld", file_entry->dirty.count, (long long)from, (long long)file_entry->dirty.end);
+}
+
+void free_write_buffer(struct file_entry *file_entry) {
+    clear_pending(file_entry);
+    free(file_entry->dirty.block);
+    free(file_entry->dirty.data);
+    memset(&file_entry->dirty, 0, sizeof(struct write_buffer));
+}